@@ -0,0 +1,1116 @@
+/**
+* @file     bench.c
+* @brief    TBI benchmark suite. Measures the hot paths of the library, and writes
+*           the results to stdout as JSON for comparing releases, see
+*           utils/bench_compare.py. Run utils/compose.py on utils/example.json
+*           before compiling
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ftw.h>
+
+#include "tbi.h"
+#include "messagespec.h"
+#include "buf.h"
+#include "dcb.h"
+#include "crc16.h"
+#include "crc32c.h"
+#include "bitpack.h"
+#include "protocol.h"
+#include "serializer.h"
+#include "store.h"
+#include "query.h"
+#include "utils.h"
+
+/** @brief Time to spend measuring each result, and with -q */
+#define BENCH_TARGET_NS         (300 * 1000 * 1000ULL)
+#define BENCH_TARGET_NS_QUICK   (30 * 1000 * 1000ULL)
+
+/** @brief Number of measurements of each result, the fastest one is reported */
+#define BENCH_ROUNDS 3
+
+/** @brief Samples in each synthetic DCB signal */
+#define BENCH_DCB_SAMPLES (16 * TBI_DCB_MAX_SAMPLES)
+
+/** @brief Messages sent over loopback, and with -q */
+#define BENCH_LOOPBACK_MSGS         200000
+#define BENCH_LOOPBACK_MSGS_QUICK   20000
+
+/** @brief Messages scheduled between loopback flushes */
+#define BENCH_LOOPBACK_BATCH 32
+
+/** @brief Max time to wait for the loopback messages to arrive */
+#define BENCH_LOOPBACK_TIMEOUT_MS 10000
+
+/** @brief Acceleration rows stored for the query benchmark, a day and with -q an hour at 100 Hz */
+#define BENCH_QUERY_ROWS        (24 * 3600 * 100)
+#define BENCH_QUERY_ROWS_QUICK  (3600 * 100)
+
+/** @brief Rows appended to the store at once, as from a column callback */
+#define BENCH_QUERY_APPEND 1024
+
+/** @brief Bucket length of the query benchmark aggregation */
+#define BENCH_QUERY_BUCKET_MS 60000
+
+/** @brief Runs iters operations of a benchmark */
+typedef void (*bench_fn)(void *arg, long iters);
+
+/** @brief Struct member mix of the serializer benchmarks */
+typedef struct {
+    const char *name;
+    int format_len;
+    uint8_t format[8];
+} bench_mix_t;
+
+static const bench_mix_t bench_mixes[] = {
+    { "u8x8",  8, { TBI_UINT8, TBI_UINT8, TBI_UINT8, TBI_UINT8, TBI_UINT8, TBI_UINT8, TBI_UINT8, TBI_UINT8 } },
+    { "u16x8", 8, { TBI_UINT16, TBI_INT16, TBI_UINT16, TBI_INT16, TBI_UINT16, TBI_INT16, TBI_UINT16, TBI_INT16 } },
+    { "u32x8", 8, { TBI_UINT32, TBI_INT32, TBI_UINT32, TBI_INT32, TBI_UINT32, TBI_INT32, TBI_UINT32, TBI_INT32 } },
+    { "mixed", 8, { TBI_TIMEDIFF_MS, TBI_INT32, TBI_INT16, TBI_INT8, TBI_UINT32, TBI_UINT16, TBI_UINT8, TBI_TIMEDIFF_S } },
+};
+
+/** @brief Benchmark settings, from the command line */
+typedef struct {
+    bool quick;
+    const char *recorded;
+    FILE *out;
+    int results;
+} bench_t;
+
+static bench_t bench;
+
+/** @brief Keeps the compiler from optimizing the measured work away */
+static volatile uint64_t bench_sink;
+
+/**
+ * @brief Measure the time of a single operation of a benchmark. The number of
+ * iterations is doubled until a round takes long enough to measure, and the
+ * fastest of @ref BENCH_ROUNDS rounds is reported
+ *
+ * @param[in] fn        Benchmark
+ * @param[in] arg       Passed to fn
+ *
+ * @return time per operation in ns
+*/
+static double bench_measure(bench_fn fn, void *arg)
+{
+    uint64_t target = (bench.quick ? BENCH_TARGET_NS_QUICK : BENCH_TARGET_NS) / BENCH_ROUNDS;
+    uint64_t start_ns, elapsed;
+    double best = 0;
+    long iters = 1;
+    int round;
+
+    /* Warm up, and find an iteration count that runs long enough */
+    while(1) {
+        start_ns = get_monotonic_time_ns();
+        fn(arg, iters);
+        elapsed = get_monotonic_time_ns() - start_ns;
+        if(elapsed >= target / 4)
+            break;
+        iters *= 2;
+    }
+    iters = (long)((double)iters * target / (elapsed ? elapsed : 1)) + 1;
+
+    for(round = 0; round < BENCH_ROUNDS; round++) {
+        start_ns = get_monotonic_time_ns();
+        fn(arg, iters);
+        elapsed = get_monotonic_time_ns() - start_ns;
+        if(round == 0 || (double)elapsed / iters < best)
+            best = (double)elapsed / iters;
+    }
+    return best;
+}
+
+/**
+ * @brief Write a single result as a JSON object. Metrics ending with "_per_s"
+ * are better when higher, all others when lower
+ *
+ * @param[in] group     Benchmark group, e.g. "serialize"
+ * @param[in] name      Benchmark within the group
+ * @param[in] metric    Metric and its unit, e.g. "ns_per_msg"
+ * @param[in] value     Measured value
+*/
+static void bench_report(const char *group, const char *name, const char *metric, double value)
+{
+    fprintf(bench.out, "%s\n    {\"group\": \"%s\", \"name\": \"%s\", \"metric\": \"%s\", \"value\": %.6g}",
+        bench.results++ ? "," : "", group, name, metric, value);
+    fprintf(stderr, "%-10s %-28s %-14s %12.3f\n", group, name, metric, value);
+}
+
+/**
+ * @brief Register the message spec into a context with a private copy of the
+ * message type contexts, so that a client and a server can run in one process
+ *
+ * @return TBI context, or NULL on failure
+*/
+static tbi_ctx_t *bench_tbi_init(void)
+{
+    tbi_msg_ctx_t *ctxs;
+    tbi_ctx_t *tbi;
+
+    if(!(tbi = tbi_init()))
+        return NULL;
+    if(tbi_register_msgspec(tbi) != 0 || !(ctxs = malloc(tbi->msg_ctxs_len * sizeof(tbi_msg_ctx_t)))) {
+        tbi_close(tbi);
+        return NULL;
+    }
+    memcpy(ctxs, tbi->msg_ctxs, tbi->msg_ctxs_len * sizeof(tbi_msg_ctx_t));
+    tbi->msg_ctxs = ctxs;
+    return tbi;
+}
+
+/** @brief Close a context from @ref bench_tbi_init() */
+static void bench_tbi_close(tbi_ctx_t *tbi)
+{
+    tbi_msg_ctx_t *ctxs = tbi->msg_ctxs;
+
+    tbi_close(tbi);
+    free(ctxs);
+}
+
+/* ---------------------------------------------------------------------------
+ * Serializer
+ * ------------------------------------------------------------------------- */
+
+/** @brief Serializer benchmark state */
+typedef struct {
+    const uint8_t *format;
+    int format_len;
+    tbi_msg_ctx_t *ctx;
+    uint8_t native[64];
+    uint8_t wire[64];
+    int wire_len;
+} bench_serialize_t;
+
+static void bench_serialize_interpreted(void *arg, long iters)
+{
+    bench_serialize_t *b = (bench_serialize_t*)arg;
+    long i;
+
+    for(i = 0; i < iters; i++) {
+        b->native[0] = (uint8_t)i;
+        bench_sink += tbi_serialize_rtm_into(b->format, 1, b->format_len, b->native, sizeof(b->native),
+            b->wire, sizeof(b->wire));
+    }
+}
+
+static void bench_deserialize_interpreted(void *arg, long iters)
+{
+    bench_serialize_t *b = (bench_serialize_t*)arg;
+    long i;
+
+    for(i = 0; i < iters; i++) {
+        b->wire[1] = (uint8_t)i;
+        bench_sink += tbi_deserialize_rtm_into(b->format, b->format_len, b->wire, b->wire_len,
+            b->native, sizeof(b->native));
+    }
+}
+
+static void bench_serialize_generated(void *arg, long iters)
+{
+    bench_serialize_t *b = (bench_serialize_t*)arg;
+    long i;
+
+    for(i = 0; i < iters; i++) {
+        b->native[0] = (uint8_t)i;
+        bench_sink += b->ctx->encode(b->native, b->wire, sizeof(b->wire));
+    }
+}
+
+static void bench_deserialize_generated(void *arg, long iters)
+{
+    bench_serialize_t *b = (bench_serialize_t*)arg;
+    long i;
+
+    for(i = 0; i < iters; i++) {
+        b->wire[1] = (uint8_t)i;
+        bench_sink += b->ctx->decode(b->wire, b->wire_len, b->native);
+    }
+}
+
+/** @brief Report serialize and deserialize cost and throughput of a format */
+static void bench_serialize_report(const char *name, bench_serialize_t *b, bench_fn ser, bench_fn deser)
+{
+    double ns;
+
+    ns = bench_measure(ser, b);
+    bench_report("serialize", name, "ns_per_msg", ns);
+    bench_report("serialize", name, "mb_per_s", b->wire_len / ns * 1e3);
+
+    ns = bench_measure(deser, b);
+    bench_report("deserialize", name, "ns_per_msg", ns);
+    bench_report("deserialize", name, "mb_per_s", b->wire_len / ns * 1e3);
+}
+
+/** @brief Serializer throughput for each struct member mix, interpreted from
+ * the format, and with the serializers generated for the example message spec */
+static void bench_serialize(tbi_ctx_t *tbi)
+{
+    bench_serialize_t b;
+    char name[64];
+    int i;
+
+    for(i = 0; i < (int)(sizeof(bench_mixes) / sizeof(bench_mixes[0])); i++) {
+        memset(&b, 0, sizeof(b));
+        b.format = bench_mixes[i].format;
+        b.format_len = bench_mixes[i].format_len;
+        b.wire_len = tbi_serialize_rtm_into(b.format, 1, b.format_len, b.native, sizeof(b.native),
+            b.wire, sizeof(b.wire));
+        snprintf(name, sizeof(name), "%s/interpreted", bench_mixes[i].name);
+        bench_serialize_report(name, &b, bench_serialize_interpreted, bench_deserialize_interpreted);
+    }
+
+    for(i = 0; i < tbi->msg_ctxs_len; i++) {
+        memset(&b, 0, sizeof(b));
+        b.ctx = &tbi->msg_ctxs[i];
+        b.format = b.ctx->format;
+        b.format_len = b.ctx->format_len;
+        b.wire_len = tbi_serialize_rtm_into(b.format, b.ctx->msgtype, b.format_len, b.native, sizeof(b.native),
+            b.wire, sizeof(b.wire));
+
+        snprintf(name, sizeof(name), "type%u/interpreted", b.ctx->msgtype);
+        bench_serialize_report(name, &b, bench_serialize_interpreted, bench_deserialize_interpreted);
+        if(b.ctx->encode && b.ctx->decode) {
+            snprintf(name, sizeof(name), "type%u/generated", b.ctx->msgtype);
+            bench_serialize_report(name, &b, bench_serialize_generated, bench_deserialize_generated);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Message buffer
+ * ------------------------------------------------------------------------- */
+
+static void bench_buffer_push_pop(void *arg, long iters)
+{
+    tbi_msg_ctx_t *ctx = (tbi_msg_ctx_t*)arg;
+    msgspec_acceleration_t msg = {0};
+    uint64_t pos;
+    void *slot;
+    long i;
+
+    for(i = 0; i < iters; i++) {
+        msg.acc_x = (int32_t)i;
+        tbi_buf_push_back(ctx, &msg, sizeof(msg));
+        if((slot = tbi_buf_pop_front(ctx, &pos)) != NULL) {
+            bench_sink += ((msgspec_acceleration_t*)slot)->acc_x;
+            tbi_buf_release(ctx, pos);
+        }
+    }
+}
+
+/** @brief Cost of a push and a pop at various queue depths */
+static void bench_buffer(tbi_ctx_t *tbi)
+{
+    static const int depths[] = { 0, 64, 1024, 4000 };
+    msgspec_acceleration_t msg = {0};
+    tbi_msg_ctx_t ctx;
+    char name[64];
+    int i, j;
+
+    memcpy(&ctx, tbi_msg_ctx(tbi, ACCELERATION), sizeof(ctx));
+    ctx.ring = NULL;
+    ctx.capacity = 4096;
+    ctx.overflow = TBI_OVERFLOW_DROP_NEWEST;
+
+    for(i = 0; i < (int)(sizeof(depths) / sizeof(depths[0])); i++) {
+        if(tbi_buf_init(&ctx, NULL, 0) != 0)
+            return;
+        for(j = 0; j < depths[i]; j++)
+            tbi_buf_push_back(&ctx, &msg, sizeof(msg));
+
+        snprintf(name, sizeof(name), "depth%d", depths[i]);
+        bench_report("buffer", name, "ns_per_push_pop", bench_measure(bench_buffer_push_pop, &ctx));
+        tbi_buf_free(&ctx);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Checksums
+ * ------------------------------------------------------------------------- */
+
+/** @brief Checksum benchmark state */
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+} bench_crc_t;
+
+static void bench_crc32c(void *arg, long iters)
+{
+    bench_crc_t *b = (bench_crc_t*)arg;
+    long i;
+
+    for(i = 0; i < iters; i++)
+        bench_sink += crc32c(0, b->buf, b->len);
+}
+
+static void bench_crc32c_sw(void *arg, long iters)
+{
+    bench_crc_t *b = (bench_crc_t*)arg;
+    long i;
+
+    for(i = 0; i < iters; i++)
+        bench_sink += crc32c_sw(0, b->buf, b->len);
+}
+
+static void bench_crc16(void *arg, long iters)
+{
+    bench_crc_t *b = (bench_crc_t*)arg;
+    uint16_t crc;
+    size_t j;
+    long i;
+
+    for(i = 0; i < iters; i++) {
+        crc = crc16_begin();
+        for(j = 0; j < b->len; j++)
+            crc = crc16(crc, b->buf[j]);
+        bench_sink += crc;
+    }
+}
+
+/** @brief Frame checksum cost at typical frame sizes, in hardware and software */
+static void bench_crc(void)
+{
+    static const size_t sizes[] = { 16, 64, 1500, 65536 };
+    bench_crc_t b;
+    char name[64];
+    double ns;
+    int i;
+
+    if(!(b.buf = malloc(sizes[3])))
+        return;
+    for(i = 0; i < (int)sizes[3]; i++)
+        b.buf[i] = (uint8_t)(i * 131 + 7);
+
+    for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        b.len = sizes[i];
+        snprintf(name, sizeof(name), "crc32c_%s/%zu", crc32c_impl_name(), sizes[i]);
+        ns = bench_measure(bench_crc32c, &b);
+        bench_report("crc", name, "ns_per_op", ns);
+        bench_report("crc", name, "mb_per_s", b.len / ns * 1e3);
+
+        snprintf(name, sizeof(name), "crc32c_slice8/%zu", sizes[i]);
+        ns = bench_measure(bench_crc32c_sw, &b);
+        bench_report("crc", name, "ns_per_op", ns);
+        bench_report("crc", name, "mb_per_s", b.len / ns * 1e3);
+    }
+
+    /* Schema checksum of the handshake */
+    b.len = 64;
+    bench_report("crc", "crc16/64", "ns_per_op", bench_measure(bench_crc16, &b));
+    free(b.buf);
+}
+
+/* ---------------------------------------------------------------------------
+ * Bit packing
+ * ------------------------------------------------------------------------- */
+
+/** @brief Values of a bit packing benchmark, as many as a DCB frame column holds */
+#define BENCH_BITPACK_COUNT 4096
+
+/** @brief Bit packing benchmark state, a contiguous stream of values of one width */
+typedef struct {
+    uint32_t *values;
+    uint32_t *out;
+    uint8_t *packed;
+    int packed_len;
+    int width;
+} bench_bitpack_t;
+
+static void bench_bitpack_pack(void *arg, long iters)
+{
+    bench_bitpack_t *b = (bench_bitpack_t*)arg;
+    long i;
+
+    /* Values are ORed into the stream, packing them again stores the same bits */
+    for(i = 0; i < iters; i++) {
+        tbi_bitpack_pack(b->packed, b->packed_len, 0, b->width, b->width, BENCH_BITPACK_COUNT, b->values);
+        bench_sink += b->packed[0];
+    }
+}
+
+static void bench_bitpack_unpack(void *arg, long iters)
+{
+    bench_bitpack_t *b = (bench_bitpack_t*)arg;
+    long i;
+
+    for(i = 0; i < iters; i++) {
+        tbi_bitpack_unpack(b->packed, b->packed_len, 0, b->width, b->width, BENCH_BITPACK_COUNT, b->out);
+        bench_sink += b->out[BENCH_BITPACK_COUNT - 1];
+    }
+}
+
+static void bench_zigzag_encode(void *arg, long iters)
+{
+    bench_bitpack_t *b = (bench_bitpack_t*)arg;
+    long i;
+
+    for(i = 0; i < iters; i++) {
+        tbi_zigzag_delta_encode(b->values, BENCH_BITPACK_COUNT, 0, b->out);
+        bench_sink += b->out[BENCH_BITPACK_COUNT - 1];
+    }
+}
+
+static void bench_zigzag_decode(void *arg, long iters)
+{
+    bench_bitpack_t *b = (bench_bitpack_t*)arg;
+    long i;
+
+    /* Decoding in place, each pass integrates the previous one, which costs the same */
+    for(i = 0; i < iters; i++)
+        bench_sink += tbi_zigzag_delta_decode(b->out, BENCH_BITPACK_COUNT, 0);
+}
+
+/** @brief Bit packing and zigzag delta coding of the DCB codec, for every width
+ * and every instruction set the CPU supports. Packing has only a scalar kernel,
+ * so it is reported once. Throughput is of the unpacked 32-bit values */
+static void bench_bitpack(void)
+{
+    const double bytes = BENCH_BITPACK_COUNT * sizeof(uint32_t);
+    tbi_bitpack_isa_t isa, isa_default = tbi_bitpack_get_isa();
+    bench_bitpack_t b;
+    char name[64];
+    uint32_t state = 1;
+    int i;
+
+    b.packed_len = BENCH_BITPACK_COUNT * sizeof(uint32_t);
+    b.values = malloc(BENCH_BITPACK_COUNT * sizeof(uint32_t));
+    b.out = malloc(BENCH_BITPACK_COUNT * sizeof(uint32_t));
+    b.packed = malloc(b.packed_len);
+    if(!b.values || !b.out || !b.packed)
+        goto exit;
+
+    for(isa = TBI_BITPACK_SCALAR; isa <= TBI_BITPACK_AVX2; isa++) {
+        if(tbi_bitpack_set_isa(isa) != 0)
+            continue;
+
+        for(b.width = 1; b.width <= 32; b.width++) {
+            for(i = 0; i < BENCH_BITPACK_COUNT; i++) {
+                state = state * 1103515245 + 12345;
+                b.values[i] = b.width < 32 ? state & ((1u << b.width) - 1) : state;
+            }
+            memset(b.packed, 0, b.packed_len);
+            tbi_bitpack_pack(b.packed, b.packed_len, 0, b.width, b.width, BENCH_BITPACK_COUNT, b.values);
+
+            if(isa == TBI_BITPACK_SCALAR) {
+                snprintf(name, sizeof(name), "%s/pack/%d", tbi_bitpack_isa_name(isa), b.width);
+                bench_report("bitpack", name, "gb_per_s", bytes / bench_measure(bench_bitpack_pack, &b));
+            }
+            snprintf(name, sizeof(name), "%s/unpack/%d", tbi_bitpack_isa_name(isa), b.width);
+            bench_report("bitpack", name, "gb_per_s", bytes / bench_measure(bench_bitpack_unpack, &b));
+        }
+
+        /* Slowly varying signal, as recorded samples are */
+        for(i = 0; i < BENCH_BITPACK_COUNT; i++) {
+            state = state * 1103515245 + 12345;
+            b.values[i] = (i ? b.values[i - 1] : 0) + (state >> 28) - 8;
+        }
+        snprintf(name, sizeof(name), "%s/zigzag_encode", tbi_bitpack_isa_name(isa));
+        bench_report("bitpack", name, "gb_per_s", bytes / bench_measure(bench_zigzag_encode, &b));
+        snprintf(name, sizeof(name), "%s/zigzag_decode", tbi_bitpack_isa_name(isa));
+        bench_report("bitpack", name, "gb_per_s", bytes / bench_measure(bench_zigzag_decode, &b));
+    }
+
+exit:
+    tbi_bitpack_set_isa(isa_default);
+    free(b.values);
+    free(b.out);
+    free(b.packed);
+}
+
+/* ---------------------------------------------------------------------------
+ * DCB
+ * ------------------------------------------------------------------------- */
+
+/** @brief DCB benchmark state, a signal and its encoded frames */
+typedef struct {
+    tbi_msg_ctx_t *ctx;
+    tbi_dcb_enc_t *enc;
+    tbi_dcb_dec_t *dec;
+    msgspec_acceleration_t *samples;
+    int samples_len;
+    uint8_t *frames;
+    int frames_size;
+    int frames_len;
+    int *frame_ends;
+    msgspec_acceleration_t msg;
+    void *cols[4];              /** @brief Columns of a frame: timestamps, acc_x, acc_y and acc_z */
+} bench_dcb_t;
+
+/** @brief Encode the signal into frames of @ref TBI_DCB_MAX_SAMPLES samples */
+static int bench_dcb_encode_all(bench_dcb_t *b)
+{
+    int i, frame = 0, len;
+
+    b->frames_len = 0;
+    for(i = 0; i < b->samples_len; i++) {
+        if(tbi_dcb_enc_add(b->enc, b->ctx, &b->samples[i]) < 0)
+            return -1;
+        if(b->enc->len == TBI_DCB_MAX_SAMPLES || i == b->samples_len - 1) {
+            len = tbi_dcb_enc_finish(b->enc, b->ctx, b->frames + b->frames_len, b->frames_size - b->frames_len);
+            if(len < 0)
+                return -1;
+            b->frames_len += len;
+            b->frame_ends[frame++] = b->frames_len;
+        }
+    }
+    return frame;
+}
+
+static void bench_dcb_encode(void *arg, long iters)
+{
+    bench_dcb_t *b = (bench_dcb_t*)arg;
+    long i;
+
+    for(i = 0; i < iters; i++)
+        bench_sink += bench_dcb_encode_all(b);
+}
+
+static int bench_dcb_emit(void *userdata, const void *msg)
+{
+    bench_sink += ((const msgspec_acceleration_t*)msg)->acc_x;
+    return 0;
+}
+
+static void bench_dcb_decode(void *arg, long iters)
+{
+    bench_dcb_t *b = (bench_dcb_t*)arg;
+    int off, frame, frames = (b->samples_len + TBI_DCB_MAX_SAMPLES - 1) / TBI_DCB_MAX_SAMPLES;
+    long i;
+
+    for(i = 0; i < iters; i++) {
+        for(off = 0, frame = 0; frame < frames; off = b->frame_ends[frame++]) {
+            bench_sink += tbi_dcb_decode(b->dec, b->ctx, b->frames + off, b->frame_ends[frame] - off,
+                &b->msg, sizeof(b->msg), bench_dcb_emit, NULL);
+        }
+    }
+}
+
+static void bench_dcb_decode_columns(void *arg, long iters)
+{
+    bench_dcb_t *b = (bench_dcb_t*)arg;
+    int off, frame, frames = (b->samples_len + TBI_DCB_MAX_SAMPLES - 1) / TBI_DCB_MAX_SAMPLES;
+    long i;
+
+    for(i = 0; i < iters; i++) {
+        for(off = 0, frame = 0; frame < frames; off = b->frame_ends[frame++]) {
+            bench_sink += tbi_dcb_decode_columns(b->dec, b->ctx, b->frames + off, b->frame_ends[frame] - off,
+                b->cols, 0, 0);
+            bench_sink += ((int32_t*)b->cols[1])[0];
+        }
+    }
+}
+
+/** @brief Fill one sample of a synthetic signal */
+static void bench_dcb_signal(const char *signal, int i, uint32_t *rand_state, msgspec_acceleration_t *out)
+{
+    uint32_t x = *rand_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *rand_state = x;
+
+    /* Sampled at 100 Hz */
+    out->time.seconds = (i * 10) / 1000;
+    out->time.ms = (i * 10) % 1000;
+
+    if(!strcmp(signal, "constant")) {
+        out->acc_x = 1000;
+        out->acc_y = -500;
+        out->acc_z = 9810;
+    }
+    else if(!strcmp(signal, "ramp")) {
+        out->acc_x = 1000 + (i % 7);
+        out->acc_y = -500 - (i / 10);
+        out->acc_z = 9810;
+    }
+    else if(!strcmp(signal, "noisy")) {
+        out->acc_x = (int32_t)(2000 * sin(i * 0.01)) + (int32_t)(x % 17) - 8;
+        out->acc_y = (int32_t)(2000 * cos(i * 0.013)) + (int32_t)((x >> 8) % 17) - 8;
+        out->acc_z = 9810 + (int32_t)((x >> 16) % 17) - 8;
+    }
+    else {
+        out->acc_x = (int32_t)x;
+        out->acc_y = (int32_t)(x * 2654435761U);
+        out->acc_z = (int32_t)(x ^ 0x9e3779b9U);
+    }
+}
+
+/**
+ * @brief Read a recorded acceleration signal: one sample per line, with the time
+ * in ms and the three axes as integers, separated by whitespace
+ *
+ * @param[in]  path     File to read
+ * @param[out] out      Samples, must be freed after use
+ *
+ * @return number of samples, or a negative error code on failure
+*/
+static int bench_dcb_read_recorded(const char *path, msgspec_acceleration_t **out)
+{
+    msgspec_acceleration_t *samples = NULL, *grown;
+    long long t;
+    int x, y, z, len = 0, size = 0;
+    FILE *f;
+
+    if(!(f = fopen(path, "r")))
+        return -1;
+    while(fscanf(f, "%lld %d %d %d", &t, &x, &y, &z) == 4) {
+        if(len == size) {
+            size = size ? size * 2 : 1024;
+            if(!(grown = realloc(samples, size * sizeof(*samples)))) {
+                free(samples);
+                fclose(f);
+                return -1;
+            }
+            samples = grown;
+        }
+        memset(&samples[len], 0, sizeof(samples[len]));
+        samples[len].time.seconds = (uint32_t)(t / 1000);
+        samples[len].time.ms = (uint32_t)(t % 1000);
+        samples[len].acc_x = x;
+        samples[len].acc_y = y;
+        samples[len].acc_z = z;
+        len++;
+    }
+    fclose(f);
+    *out = samples;
+    return len;
+}
+
+/** @brief Report DCB encode and decode cost, and compressed size relative to RTM */
+static void bench_dcb_report(const char *name, bench_dcb_t *b)
+{
+    int frames = (b->samples_len + TBI_DCB_MAX_SAMPLES - 1) / TBI_DCB_MAX_SAMPLES;
+    int rtm_len = msg_wire_len(b->ctx->format, b->ctx->format_len);
+
+    b->frames_size = frames * tbi_dcb_frame_max_len(b->ctx, TBI_DCB_MAX_SAMPLES);
+    b->frames = malloc(b->frames_size);
+    b->frame_ends = malloc(frames * sizeof(int));
+    if(!b->frames || !b->frame_ends || bench_dcb_encode_all(b) < 0) {
+        fprintf(stderr, "DCB encoding of %s failed\n", name);
+        goto exit;
+    }
+
+    bench_report("dcb", name, "ratio", (double)b->frames_len / ((double)b->samples_len * rtm_len));
+    bench_report("dcb", name, "bytes_per_sample", (double)b->frames_len / b->samples_len);
+    bench_report("dcb", name, "encode_ns_per_sample", bench_measure(bench_dcb_encode, b) / b->samples_len);
+    bench_report("dcb", name, "decode_ns_per_sample", bench_measure(bench_dcb_decode, b) / b->samples_len);
+    bench_report("dcb", name, "decode_columns_ns_per_sample", bench_measure(bench_dcb_decode_columns, b) / b->samples_len);
+
+exit:
+    free(b->frames);
+    free(b->frame_ends);
+}
+
+/** @brief DCB encode and decode cost, and compression ratio of synthetic signals,
+ * and of a recorded signal if given */
+static void bench_dcb(tbi_ctx_t *tbi)
+{
+    static const char *signals[] = { "constant", "ramp", "noisy", "random" };
+    uint32_t rand_state = 0x12345678;
+    bench_dcb_t b;
+    int i, j, len;
+
+    memset(&b, 0, sizeof(b));
+    b.ctx = tbi_msg_ctx(tbi, ACCELERATION);
+    b.enc = tbi_dcb_enc_create(b.ctx->format_len);
+    b.dec = tbi_dcb_dec_create(b.ctx->format_len);
+    b.samples = calloc(BENCH_DCB_SAMPLES, sizeof(msgspec_acceleration_t));
+    if(!b.enc || !b.dec || !b.samples)
+        goto exit;
+    for(i = 0; i < b.ctx->format_len; i++) {
+        if(!(b.cols[i] = calloc(TBI_DCB_MAX_SAMPLES, sizeof(uint64_t))))
+            goto exit;
+    }
+
+    for(i = 0; i < (int)(sizeof(signals) / sizeof(signals[0])); i++) {
+        for(j = 0; j < BENCH_DCB_SAMPLES; j++)
+            bench_dcb_signal(signals[i], j, &rand_state, &b.samples[j]);
+        b.samples_len = BENCH_DCB_SAMPLES;
+        bench_dcb_report(signals[i], &b);
+    }
+
+    if(bench.recorded) {
+        free(b.samples);
+        b.samples = NULL;
+        if((len = bench_dcb_read_recorded(bench.recorded, &b.samples)) <= 0) {
+            fprintf(stderr, "Unable to read recorded signal %s\n", bench.recorded);
+            goto exit;
+        }
+        b.samples_len = len;
+        bench_dcb_report("recorded", &b);
+    }
+
+exit:
+    tbi_dcb_enc_free(b.enc);
+    tbi_dcb_dec_free(b.dec);
+    for(i = 0; i < b.ctx->format_len; i++)
+        free(b.cols[i]);
+    free(b.samples);
+}
+
+/* ---------------------------------------------------------------------------
+ * Loopback
+ * ------------------------------------------------------------------------- */
+
+/** @brief Loopback benchmark state, shared by the client and the server thread */
+typedef struct {
+    tbi_ctx_t *server;
+    bool stop;
+    int expected;
+    int received;
+    uint64_t last_rx_ns;
+    uint32_t *latency_ns;
+} bench_loopback_t;
+
+/** @brief Server callback, the message carries its sequence number and send time */
+static void bench_loopback_receive(const int msgtype, const void *msg, void *userdata)
+{
+    const msgspec_temp_and_hum_t *th = (const msgspec_temp_and_hum_t*)msg;
+    bench_loopback_t *b = (bench_loopback_t*)userdata;
+    uint64_t now_ns = get_monotonic_time_ns();
+
+    if(th->time < (uint32_t)b->expected)
+        b->latency_ns[th->time] = (uint32_t)now_ns - (uint32_t)th->temp;
+    __atomic_store_n(&b->last_rx_ns, now_ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->received, 1, __ATOMIC_RELEASE);
+}
+
+static void *bench_loopback_server(void *arg)
+{
+    bench_loopback_t *b = (bench_loopback_t*)arg;
+
+    while(!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+        if(tbi_server_dispatch(b->server, 10) < 0)
+            break;
+    }
+    return NULL;
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/** @brief Messages per second and latency percentiles of RTM messages sent from
+ * a client to a server over loopback, in the same process */
+static void bench_loopback(void)
+{
+    bench_loopback_t b;
+    msgspec_temp_and_hum_t th = { .hum = 50 };
+    tbi_ctx_t *client = NULL;
+    pthread_t thread;
+    bool started = false;
+    uint64_t start_ns, deadline_ns;
+    int i, pending, pending_bytes, lost;
+    char name[64];
+
+    memset(&b, 0, sizeof(b));
+    b.expected = bench.quick ? BENCH_LOOPBACK_MSGS_QUICK : BENCH_LOOPBACK_MSGS;
+    if(!(b.latency_ns = malloc(b.expected * sizeof(uint32_t))))
+        return;
+    memset(b.latency_ns, 0xff, b.expected * sizeof(uint32_t));
+
+    if(!(b.server = bench_tbi_init()) || !(client = bench_tbi_init()))
+        goto exit;
+    tbi_server_register_msg_callback(b.server, TEMP_AND_HUM, bench_loopback_receive, &b);
+    if(tbi_server_init(b.server) != 0) {
+        fprintf(stderr, "Unable to start the loopback server, is the port in use?\n");
+        goto exit;
+    }
+    if(pthread_create(&thread, NULL, bench_loopback_server, &b) != 0)
+        goto exit;
+    started = true;
+
+    /* Wait for the connection */
+    if(tbi_client_init(client) != 0)
+        goto exit;
+    for(i = 0; i < 50 && tbi_client_wait(client, 100) != 1; i++)
+        tbi_client_flush(client, TBI_FLUSH_NONE, NULL);
+    if(i == 50) {
+        fprintf(stderr, "Unable to connect to the loopback server\n");
+        goto exit;
+    }
+
+    start_ns = get_monotonic_time_ns();
+    for(i = 0; i < b.expected; i++) {
+        th.time = (uint32_t)i;
+        th.temp = (int32_t)(uint32_t)get_monotonic_time_ns();
+        tbi_send_temp_and_hum(client, &th);
+        if((i + 1) % BENCH_LOOPBACK_BATCH != 0)
+            continue;
+
+        /* Keep the message buffer from overflowing while the socket is full */
+        tbi_client_flush(client, TBI_FLUSH_NONE, NULL);
+        while((pending = tbi_client_pending(client, NULL)) > BENCH_LOOPBACK_BATCH * 8) {
+            tbi_client_wait(client, 10);
+            tbi_client_flush(client, TBI_FLUSH_NONE, NULL);
+        }
+    }
+
+    /* Drain, and wait for the server to receive everything */
+    deadline_ns = get_monotonic_time_ns() + BENCH_LOOPBACK_TIMEOUT_MS * 1000000ULL;
+    while(get_monotonic_time_ns() < deadline_ns) {
+        tbi_client_flush(client, TBI_FLUSH_ALL, NULL);
+        if(__atomic_load_n(&b.received, __ATOMIC_ACQUIRE) >= b.expected)
+            break;
+        if(tbi_client_pending(client, &pending_bytes) > 0 || pending_bytes > 0)
+            tbi_client_wait(client, 10);
+        else
+            usleep(1000);
+    }
+
+    lost = b.expected - __atomic_load_n(&b.received, __ATOMIC_ACQUIRE);
+    qsort(b.latency_ns, b.expected, sizeof(uint32_t), bench_cmp_u32);
+
+    snprintf(name, sizeof(name), "rtm/batch%d", BENCH_LOOPBACK_BATCH);
+    if(lost < b.expected) {
+        bench_report("loopback", name, "msgs_per_s",
+            (b.expected - lost) / ((double)(__atomic_load_n(&b.last_rx_ns, __ATOMIC_RELAXED) - start_ns) / 1e9));
+        bench_report("loopback", name, "p50_ns", b.latency_ns[(b.expected - lost) / 2]);
+        bench_report("loopback", name, "p99_ns", b.latency_ns[(int)((b.expected - lost) * 0.99)]);
+    }
+    bench_report("loopback", name, "lost", lost);
+
+exit:
+    if(started) {
+        __atomic_store_n(&b.stop, true, __ATOMIC_RELEASE);
+        pthread_join(thread, NULL);
+    }
+    if(client)
+        bench_tbi_close(client);
+    if(b.server)
+        bench_tbi_close(b.server);
+    free(b.latency_ns);
+}
+
+/* ---------------------------------------------------------------------------
+ * Query
+ * ------------------------------------------------------------------------- */
+
+/** @brief Query benchmark state */
+typedef struct {
+    const char *dir;
+    tbi_query_t query;
+    tbi_query_bucket_t *buckets;
+    int buckets_len;
+    uint64_t rows;
+} bench_query_t;
+
+static void bench_query_count(const int msgtype, const tbi_columns_t *cols, const tbi_batch_info_t *info, void *userdata)
+{
+    *(uint64_t*)userdata += cols->count;
+}
+
+static void bench_query_aggregate(void *arg, long iters)
+{
+    bench_query_t *b = (bench_query_t*)arg;
+    long i;
+
+    for(i = 0; i < iters; i++)
+        bench_sink += tbi_query_aggregate(b->dir, &b->query, 1, BENCH_QUERY_BUCKET_MS, b->buckets, b->buckets_len, NULL);
+}
+
+static void bench_query_scan(void *arg, long iters)
+{
+    bench_query_t *b = (bench_query_t*)arg;
+    uint64_t rows = 0;
+    long i;
+
+    for(i = 0; i < iters; i++)
+        tbi_query_scan(b->dir, &b->query, bench_query_count, &rows, NULL);
+    bench_sink += rows;
+}
+
+static int bench_query_remove(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/** @brief Store a day of acceleration telemetry, then time aggregations and
+ * scans over it, whole and in parts skipped by the index and the column min and max */
+static void bench_query(tbi_ctx_t *tbi)
+{
+    tbi_msg_ctx_t *ctx = tbi_msg_ctx(tbi, ACCELERATION);
+    tbi_batch_info_t info = { .conn_id = 1, .fd = -1, .device_id = 1 };
+    char dir[] = "/tmp/tbi_bench_XXXXXX";
+    bench_query_t b;
+    msgspec_acceleration_t sample;
+    tbi_store_stats_t stats;
+    tbi_query_stats_t qstats;
+    tbi_store_t *store = NULL;
+    tbi_columns_t cols;
+    uint64_t start_ns, start_ts = 1700000000000ULL;
+    uint32_t rand_state = 0x12345678;
+    void *col[4] = { NULL };
+    double ns;
+    int i, j, rows = bench.quick ? BENCH_QUERY_ROWS_QUICK : BENCH_QUERY_ROWS;
+
+    memset(&b, 0, sizeof(b));
+    if(ctx->format_len != 4 || !mkdtemp(dir))
+        return;
+    b.dir = dir;
+    col[0] = malloc(BENCH_QUERY_APPEND * sizeof(uint64_t));
+    for(i = 1; i < 4; i++)
+        col[i] = malloc(BENCH_QUERY_APPEND * sizeof(int32_t));
+    b.buckets_len = rows / 100 * 1000 / BENCH_QUERY_BUCKET_MS;
+    b.buckets = malloc(b.buckets_len * sizeof(tbi_query_bucket_t));
+    if(!col[0] || !col[1] || !col[2] || !col[3] || !b.buckets || !(store = tbi_store_open(dir, NULL)))
+        goto exit;
+
+    /* Append as received, a column batch at a time */
+    cols.fields = ctx->format_len;
+    cols.format = ctx->format;
+    cols.cols = col;
+    start_ns = get_monotonic_time_ns();
+    for(i = 0; i < rows; i += cols.count) {
+        cols.count = (rows - i < BENCH_QUERY_APPEND) ? rows - i : BENCH_QUERY_APPEND;
+        for(j = 0; j < cols.count; j++) {
+            bench_dcb_signal("noisy", i + j, &rand_state, &sample);
+            ((uint64_t*)col[0])[j] = start_ts + (uint64_t)(i + j) * 10;
+            ((int32_t*)col[1])[j] = sample.acc_x;
+            ((int32_t*)col[2])[j] = sample.acc_y;
+            ((int32_t*)col[3])[j] = sample.acc_z;
+        }
+        if(tbi_store_append(store, ACCELERATION, &cols, &info) < 0)
+            goto exit;
+    }
+    tbi_store_get_stats(store, &stats);
+    tbi_store_close(store);
+    store = NULL;
+    bench_report("query", "append", "rows_per_s", rows / ((get_monotonic_time_ns() - start_ns) / 1e9));
+    bench_report("query", "append", "bytes_per_row", (double)stats.bytes / rows);
+
+    /* Whole range, every block decoded */
+    b.query.device_id = info.device_id;
+    b.query.msgtype = ACCELERATION;
+    b.query.from_ts = start_ts;
+    b.query.to_ts = start_ts + (uint64_t)rows * 10;
+    ns = bench_measure(bench_query_aggregate, &b);
+    bench_report("query", "aggregate/all", "ms_per_query", ns / 1e6);
+    bench_report("query", "aggregate/all", "ns_per_row", ns / rows);
+    ns = bench_measure(bench_query_scan, &b);
+    bench_report("query", "scan/all", "ns_per_row", ns / rows);
+
+    /* Predicate evaluated over every block, matching few rows */
+    b.query.preds_len = 1;
+    b.query.preds[0].field = 1;
+    b.query.preds[0].op = TBI_QUERY_GT;
+    b.query.preds[0].value = 1990;
+    tbi_query_scan(dir, &b.query, bench_query_count, &b.rows, &qstats);
+    ns = bench_measure(bench_query_scan, &b);
+    bench_report("query", "scan/filtered", "ns_per_row", ns / rows);
+    bench_report("query", "scan/filtered", "matched", qstats.rows_matched);
+
+    /* A minute of the range, found with the index */
+    b.query.preds_len = 0;
+    b.query.from_ts = start_ts + (uint64_t)rows * 5;
+    b.query.to_ts = b.query.from_ts + 60000;
+    tbi_query_scan(dir, &b.query, bench_query_count, &b.rows, &qstats);
+    bench_report("query", "scan/minute", "us_per_query", bench_measure(bench_query_scan, &b) / 1e3);
+    bench_report("query", "scan/minute", "blocks_read", qstats.blocks - qstats.blocks_skipped);
+
+exit:
+    if(store)
+        tbi_store_close(store);
+    nftw(dir, bench_query_remove, 16, FTW_DEPTH | FTW_PHYS);
+    for(i = 0; i < 4; i++)
+        free(col[i]);
+    free(b.buckets);
+}
+
+/* ---------------------------------------------------------------------------
+ * Main
+ * ------------------------------------------------------------------------- */
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-q] [-r recorded.txt] [serialize|buffer|crc|bitpack|dcb|loopback|query ...]\n"
+        "  -q    Quick run, with less time spent on each result\n"
+        "  -r    Recorded acceleration signal for the DCB benchmark: a sample per line,\n"
+        "        time in ms and three axes as integers\n"
+        "Runs every benchmark group by default. Results are written to stdout as JSON,\n"
+        "everything else to stderr\n", prog);
+}
+
+/** @brief Check if a benchmark group was selected on the command line */
+static bool bench_selected(int argc, char *argv[], const char *group)
+{
+    int i;
+
+    if(optind >= argc)
+        return true;
+    for(i = optind; i < argc; i++) {
+        if(!strcmp(argv[i], group))
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char* argv[])
+{
+    tbi_ctx_t *tbi;
+    int opt, fd;
+
+    while((opt = getopt(argc, argv, "qr:h")) != -1) {
+        switch(opt) {
+            case 'q':
+                bench.quick = true;
+                break;
+            case 'r':
+                bench.recorded = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    /* Results own stdout, the library logs to stderr instead */
+    fflush(stdout);
+    if((fd = dup(STDOUT_FILENO)) < 0 || !(bench.out = fdopen(fd, "w")))
+        return 1;
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    if(!(tbi = bench_tbi_init()))
+        return 1;
+
+    fprintf(bench.out, "{\n  \"msgspec_version\": %u,\n  \"protocol_version\": %d,\n",
+        tbi->msgspec_version, TBI_PROTOCOL_VERSION);
+#ifdef __OPTIMIZE__
+    fprintf(bench.out, "  \"optimized\": true,\n");
+#else
+    fprintf(bench.out, "  \"optimized\": false,\n");
+#endif
+    fprintf(bench.out, "  \"bitpack_isa\": \"%s\",\n  \"crc32c\": \"%s\",\n  \"quick\": %s,\n  \"results\": [",
+        tbi_bitpack_isa_name(tbi_bitpack_get_isa()), crc32c_impl_name(), bench.quick ? "true" : "false");
+
+    if(bench_selected(argc, argv, "serialize"))
+        bench_serialize(tbi);
+    if(bench_selected(argc, argv, "buffer"))
+        bench_buffer(tbi);
+    if(bench_selected(argc, argv, "crc"))
+        bench_crc();
+    if(bench_selected(argc, argv, "bitpack"))
+        bench_bitpack();
+    if(bench_selected(argc, argv, "dcb"))
+        bench_dcb(tbi);
+    if(bench_selected(argc, argv, "loopback"))
+        bench_loopback();
+    if(bench_selected(argc, argv, "query"))
+        bench_query(tbi);
+
+    fprintf(bench.out, "\n  ]\n}\n");
+    fclose(bench.out);
+    bench_tbi_close(tbi);
+    return 0;
+}
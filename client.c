@@ -4,17 +4,29 @@
 *           before compiling 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "tbi.h"
 #include "messagespec.h"
 
+/** @brief Max number of waits for the connection and sending to complete */
+#define CLIENT_MAX_WAITS 30
+
+/** @brief Size of the optional spool file */
+#define CLIENT_SPOOL_SIZE (1024 * 1024)
+
+/** @brief Number of acceleration samples to send, delta-compressed into DCB frames */
+#define CLIENT_ACC_SAMPLES 100
 
 int main(int argc, char* arv[])
 {
     tbi_ctx_t* tbi;
-    int ret;
+    tbi_flush_result_t res;
+    msgspec_acceleration_t acc = {0};
+    int i, ret, pending_bytes;
     
     tbi = tbi_init();
     if(!tbi)
@@ -24,6 +36,18 @@ int main(int argc, char* arv[])
     if((ret = tbi_register_msgspec(tbi)) != 0)
         goto exit_init;
 
+    /* Checksum every frame, if the server agrees */
+    if((ret = tbi_set_features(tbi, TBI_FEATURE_CRC32C)) != 0)
+        goto exit_init;
+
+    /* Identify the device to the server, e.g. for storing its telemetry */
+    if((ret = tbi_set_device_id(tbi, (uint32_t)gethostid())) != 0)
+        goto exit_init;
+
+    /* Optional spool file, keeping telemetry until the server acknowledges it */
+    if(argc > 1 && (ret = tbi_set_spool(tbi, arv[1], CLIENT_SPOOL_SIZE)) != 0)
+        goto exit_init;
+
     printf("Client init...\n");
     if((ret = tbi_client_init(tbi)) != 0)
         goto exit_init;
@@ -41,16 +65,41 @@ int main(int argc, char* arv[])
     temp1->hum = 0xff;
 
     printf("Scheduling telemetry...\n");
-    if((ret = tbi_send_temp_and_hum(tbi, temp1)) != 0)
+    if((ret = tbi_send_temp_and_hum(tbi, temp1)) < 0)
         goto exit_alloc;
 
-    if((ret = tbi_send_temp_and_hum(tbi, &temp2)) != 0)
+    if((ret = tbi_send_temp_and_hum(tbi, &temp2)) < 0)
         goto exit_alloc;
 
     free(temp1);
 
-    printf("Calling process() to send telemetry...\n");
-    while((ret = tbi_client_process(tbi)) > 0) {;}
+    /* Slowly changing samples at 10 ms intervals compress to a few bits each */
+    for(i = 0; i < CLIENT_ACC_SAMPLES; i++) {
+        acc.time.seconds = (i * 10) / 1000;
+        acc.time.ms = (i * 10) % 1000;
+        acc.acc_x = 1000 + (i % 7);
+        acc.acc_y = -500 - (i / 10);
+        acc.acc_z = 9810;
+        if((ret = tbi_send_acceleration(tbi, &acc)) < 0)
+            goto exit_init;
+    }
+
+    /* Connection completes in the background, keep flushing until everything is sent,
+        bundled types too, without waiting for their send interval */
+    printf("Flushing telemetry...\n");
+    for(i = 0; i < CLIENT_MAX_WAITS; i++) {
+        if((ret = tbi_client_flush(tbi, TBI_FLUSH_CORK | TBI_FLUSH_ALL, &res)) < 0)
+            goto exit_init;
+        if(res.msgs > 0 || res.bytes > 0)
+            printf("Sent %d messages, %d bytes in %d syscalls\n", res.msgs, res.bytes, res.syscalls);
+
+        if(tbi_client_pending(tbi, &pending_bytes) == 0 && pending_bytes == 0)
+            break;
+        if((ret = tbi_client_wait(tbi, 1000)) < 0)
+            goto exit_init;
+    }
+    if(i == CLIENT_MAX_WAITS)
+        printf("Gave up with telemetry still unsent!\n");
 
     tbi_close(tbi);
 
@@ -0,0 +1,202 @@
+/**
+* @file     batch.c
+* @brief    Collecting received messages for batch and column callbacks. 
+*           Messages are decoded straight into a contiguous array, or into a
+*           column per struct member, and the callback is invoked once the 
+*           type or the client changes, the batch is full, or at the end of 
+*           a receive
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "schema.h"
+#include "stats.h"
+#include "utils.h"
+
+/**
+ * @brief Create a batch, large enough for the largest message type of the
+ * message spec and of the specs bound to the context
+ * 
+ * @param[in] tbi       TBI context, with message spec registered
+ * 
+ * @return batch, or NULL on failure
+*/
+tbi_batch_t *tbi_batch_create(tbi_ctx_t* tbi)
+{
+    tbi_batch_t *batch;
+    uint8_t *data;
+    int i, size, fields, dcb_fields;
+
+    tbi_schema_limits(tbi, &size, &fields, &dcb_fields);
+    if(size < 1)
+        size = 1;
+    if(fields < 1)
+        fields = 1;
+
+    batch = calloc(1, sizeof(tbi_batch_t));
+    if(!batch)
+        return NULL;
+    batch->msg_size = size;
+    batch->cols_len = fields;
+    batch->msgs = malloc((size_t)size * TBI_BATCH_MAX_MSGS);
+    batch->cols = calloc(fields, sizeof(void*));
+
+    /* Columns are as wide as the widest member, a timestamp. The first column
+     * owns the data, so it is set only once every allocation succeeded */
+    data = malloc((size_t)fields * TBI_BATCH_MAX_MSGS * sizeof(uint64_t));
+    if(!batch->msgs || !batch->cols || !data) {
+        free(data);
+        tbi_batch_free(batch);
+        return NULL;
+    }
+    for(i = 0; i < fields; i++)
+        batch->cols[i] = data + (size_t)i * TBI_BATCH_MAX_MSGS * sizeof(uint64_t);
+    return batch;
+}
+
+/**
+ * @brief Reserve rows for messages in a batch. Messages collected so far are
+ * delivered first if they are of another type or client, or leave no room. 
+ * The messages are added with @ref tbi_batch_commit()
+ * 
+ * @param[in] batch     Batch
+ * @param[in] ctx       Context of the message type
+ * @param[in] conn      Client the messages were received from, or NULL if not known
+ * @param[in] count     Number of messages, at most @ref TBI_BATCH_MAX_MSGS
+ * 
+ * @return first reserved row
+*/
+int tbi_batch_reserve(tbi_batch_t* batch, tbi_msg_ctx_t* ctx, const tbi_conn_t* conn, int count)
+{
+    uint64_t conn_id = conn ? conn->id : 0;
+
+    if(batch->len > 0 && (batch->ctx != ctx || batch->info.conn_id != conn_id || batch->len + count > TBI_BATCH_MAX_MSGS))
+        tbi_batch_deliver(batch);
+
+    if(batch->len == 0) {
+        batch->ctx = ctx;
+        batch->info.conn_id = conn_id;
+        batch->info.fd = conn ? conn->fd : -1;
+        batch->info.start_ts = conn ? conn->start_ts : 0;
+        batch->info.device_id = conn ? conn->device_id : 0;
+        batch->info.recv_ts = get_current_time_ms();
+        batch->info.schema_version = (conn && conn->schema) ? conn->schema->version : 0;
+        batch->info.schema_csum = (conn && conn->schema) ? conn->schema->csum : 0;
+    }
+    return batch->len;
+}
+
+/**
+ * @brief Get the slot for the next message of a batch of native messages, 
+ * see @ref tbi_batch_reserve()
+ * 
+ * @param[in] batch     Batch
+ * @param[in] ctx       Context of the message type, with a batch callback
+ * @param[in] conn      Client the message was received from, or NULL if not known
+ * 
+ * @return slot of ctx->raw_size bytes
+*/
+void *tbi_batch_next(tbi_batch_t* batch, tbi_msg_ctx_t* ctx, const tbi_conn_t* conn)
+{
+    int row = tbi_batch_reserve(batch, ctx, conn, 1);
+
+    return batch->msgs + (size_t)row * ctx->raw_size;
+}
+
+/**
+ * @brief Add a native message to a batch, as a row or into the columns
+ * 
+ * @param[in] batch     Batch
+ * @param[in] ctx       Context of the message type
+ * @param[in] conn      Client the message was received from, or NULL if not known
+ * @param[in] msg       Native message
+ * @param[in] start_ts  Client start timestamp in ms, the timestamps of the message are relative to this
+*/
+void tbi_batch_add(tbi_batch_t* batch, tbi_msg_ctx_t* ctx, const tbi_conn_t* conn, const void* msg, uint64_t start_ts)
+{
+    const uint8_t *native = (const uint8_t*)msg;
+    timediff_ms tms;
+    uint32_t v32;
+    int row, off, f;
+
+    row = tbi_batch_reserve(batch, ctx, conn, 1);
+    if(!ctx->column_cb) {
+        memcpy(batch->msgs + (size_t)row * ctx->raw_size, msg, ctx->raw_size);
+        tbi_batch_commit(batch, 1);
+        return;
+    }
+
+    /* Transpose, rebuilding the timestamps */
+    off = 0;
+    for(f = 0; f < ctx->format_len; f++) {
+        off = msg_field_native_offset(ctx->format[f], off);
+        switch(ctx->format[f]) {
+            case TBI_TIMEDIFF_MS:
+                memcpy(&tms, native + off, sizeof(tms));
+                ((uint64_t*)batch->cols[f])[row] = start_ts + (uint64_t)tms.seconds * 1000 + tms.ms;
+                break;
+            case TBI_TIMEDIFF_S:
+                memcpy(&v32, native + off, sizeof(v32));
+                ((uint64_t*)batch->cols[f])[row] = start_ts + (uint64_t)v32 * 1000;
+                break;
+            default:
+                memcpy((uint8_t*)batch->cols[f] + (size_t)row * msg_field_type_len(ctx->format[f]), native + off,
+                    msg_field_type_len(ctx->format[f]));
+                break;
+        }
+        off += msg_field_type_len(ctx->format[f]);
+    }
+    tbi_batch_commit(batch, 1);
+}
+
+/**
+ * @brief Invoke the batch or column callback of the collected messages, and
+ * empty the batch
+ * 
+ * @param[in] batch     Batch
+ * 
+ * @return number of messages delivered
+*/
+int tbi_batch_deliver(tbi_batch_t* batch)
+{
+    tbi_msg_ctx_t *ctx = batch->ctx;
+    tbi_columns_t cols;
+    uint64_t start_ns;
+    int len = batch->len;
+
+    if(len == 0)
+        return 0;
+
+    start_ns = get_monotonic_time_ns();
+    if(ctx->column_cb) {
+        cols.count = len;
+        cols.fields = ctx->format_len;
+        cols.format = ctx->format;
+        cols.cols = batch->cols;
+        ctx->column_cb(ctx->msgtype, &cols, &batch->info, ctx->batch_cb_userdata);
+    } else {
+        ctx->batch_cb(ctx->msgtype, batch->msgs, len, &batch->info, ctx->batch_cb_userdata);
+    }
+    tbi_hist_add_n(&ctx->stats.callback, get_monotonic_time_ns() - start_ns, len);
+
+    batch->len = 0;
+    return len;
+}
+
+/**
+ * @brief Free a batch, dropping any messages not delivered
+ * 
+ * @param[in] batch     Batch to free
+*/
+void tbi_batch_free(tbi_batch_t* batch)
+{
+    if(!batch)
+        return;
+    if(batch->cols)
+        free(batch->cols[0]);
+    free(batch->cols);
+    free(batch->msgs);
+    free(batch);
+}
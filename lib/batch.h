@@ -0,0 +1,39 @@
+/**
+* @file     batch.h
+* @brief    Header file for collecting received messages for batch and column callbacks
+*/
+
+#ifndef __TBI_BATCH_H
+#define __TBI_BATCH_H
+
+#include <stdint.h>
+#include "tbi_types.h"
+
+/** @brief Received messages of a single type from a single client, handed to
+ * the batch callback of the type as one contiguous array, or to its column 
+ * callback as a column per struct member */
+typedef struct tbi_batch {
+    tbi_msg_ctx_t *ctx;         /** @brief Message type of the collected messages */
+    tbi_batch_info_t info;      /** @brief Where and when the messages were received */
+    int len;                    /** @brief Messages collected */
+    int msg_size;               /** @brief Size of the largest type */
+    uint8_t *msgs;              /** @brief Native messages, room for @ref TBI_BATCH_MAX_MSGS of the largest type */
+    int cols_len;               /** @brief Number of columns, the most members of any message type */
+    void **cols;                /** @brief Columns, room for @ref TBI_BATCH_MAX_MSGS values each */
+} tbi_batch_t;
+
+tbi_batch_t *tbi_batch_create(tbi_ctx_t* tbi);
+int tbi_batch_reserve(tbi_batch_t* batch, tbi_msg_ctx_t* ctx, const tbi_conn_t* conn, int count);
+void *tbi_batch_next(tbi_batch_t* batch, tbi_msg_ctx_t* ctx, const tbi_conn_t* conn);
+void tbi_batch_add(tbi_batch_t* batch, tbi_msg_ctx_t* ctx, const tbi_conn_t* conn, const void* msg, uint64_t start_ts);
+int tbi_batch_deliver(tbi_batch_t* batch);
+void tbi_batch_free(tbi_batch_t* batch);
+
+/** @brief Add messages written to the rows or columns reserved with 
+ * @ref tbi_batch_reserve() or @ref tbi_batch_next() to the batch */
+static inline void tbi_batch_commit(tbi_batch_t* batch, int count)
+{
+    batch->len += count;
+}
+
+#endif /* __TBI_BATCH_H */
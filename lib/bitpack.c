@@ -0,0 +1,573 @@
+/**
+* @file     bitpack.c
+* @brief    Bit packing and unpacking of 0-32-bit values in an MSB-first bit
+*           stream, as used by DCB bundles. Values are stride bits apart, so
+*           one struct member of interleaved samples is packed or unpacked per
+*           call. Kernels are specialized for every width, in scalar, SSE4.1 and
+*           AVX2 variants, and the fastest variant the CPU supports is chosen at
+*           runtime. Vector kernels fall back to the scalar ones near the end of
+*           the buffer, so no padding is needed past the data
+*/
+
+#include <string.h>
+#include <pthread.h>
+#include "bitpack.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TBI_BITPACK_X86
+#include <immintrin.h>
+#endif
+
+/** @brief Invoke X for every non-zero width */
+#define TBI_BITPACK_WIDTHS(X) \
+    X(1)  X(2)  X(3)  X(4)  X(5)  X(6)  X(7)  X(8)  X(9)  X(10) X(11) X(12) X(13) X(14) X(15) X(16) \
+    X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31) X(32)
+
+/** @brief Widest value the SSE4.1 unpack kernel extracts from a 32-bit window */
+#define TBI_BITPACK_SSE41_MAX_WIDTH 25
+
+typedef void (*tbi_unpack_fn)(const uint8_t *in, int in_len, uint32_t bit, uint32_t stride, int count, uint32_t *out);
+typedef void (*tbi_pack_fn)(uint8_t *out, int out_len, uint32_t bit, uint32_t stride, int count, const uint32_t *in);
+typedef void (*tbi_delta_encode_fn)(const uint32_t *values, int count, uint32_t prev, uint32_t *out);
+typedef uint32_t (*tbi_delta_decode_fn)(uint32_t *values, int count, uint32_t prev);
+
+/** @brief Kernels of an instruction set, indexed by width */
+typedef struct {
+    tbi_bitpack_isa_t isa;
+    tbi_unpack_fn unpack[33];
+    tbi_pack_fn pack[33];
+    tbi_delta_encode_fn delta_encode;
+    tbi_delta_decode_fn delta_decode;
+} tbi_bitpack_kernels_t;
+
+/** @brief Load 8 bytes as a big-endian value */
+static inline uint64_t tbi_load_be64(const uint8_t *ptr)
+{
+    uint64_t value;
+
+    memcpy(&value, ptr, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+/** @brief Store a value as 8 big-endian bytes */
+static inline void tbi_store_be64(uint8_t *ptr, uint64_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    memcpy(ptr, &value, sizeof(value));
+}
+
+/** @brief Read a value near the end of the buffer, a byte at a time */
+static uint32_t tbi_bits_get_tail(const uint8_t *in, int in_len, uint32_t bit, int width)
+{
+    uint32_t byte = bit / 8;
+    uint64_t window = 0;
+    int i;
+
+    for(i = 0; i < 8; i++) {
+        window <<= 8;
+        if(byte + i < (uint32_t)in_len)
+            window |= in[byte + i];
+    }
+    return (uint32_t)((window << (bit % 8)) >> (64 - width));
+}
+
+/** @brief Write a value near the end of the buffer, a byte at a time */
+static void tbi_bits_put_tail(uint8_t *out, int out_len, uint32_t bit, int width, uint32_t value)
+{
+    uint32_t byte = bit / 8;
+    uint64_t window = (uint64_t)value << (64 - width - bit % 8);
+    int i;
+
+    for(i = 0; i < 8; i++) {
+        if(byte + i < (uint32_t)out_len)
+            out[byte + i] |= (uint8_t)(window >> (56 - 8 * i));
+    }
+}
+
+/** @brief Mask of the lowest width bits */
+#define TBI_BITPACK_MASK(width) ((width) == 32 ? 0xFFFFFFFFu : ((1u << (width)) - 1))
+
+/*
+ * Scalar kernels. Packing is scalar in every variant: strided values are ORed 
+ * into memory one by one, which vector shifts do not speed up, and contiguous
+ * values are bound by the byte stores of the accumulator
+ */
+
+static inline __attribute__((always_inline)) void tbi_unpack_scalar(const uint8_t *in, int in_len,
+    uint32_t bit, uint32_t stride, int count, uint32_t *out, const int width)
+{
+    int i;
+
+    for(i = 0; i < count && bit / 8 + 8 <= (uint32_t)in_len; i++, bit += stride) {
+        out[i] = (uint32_t)((tbi_load_be64(in + bit / 8) << (bit % 8)) >> (64 - width));
+    }
+    for(; i < count; i++, bit += stride) {
+        out[i] = tbi_bits_get_tail(in, in_len, bit, width);
+    }
+}
+
+static inline __attribute__((always_inline)) void tbi_pack_scalar(uint8_t *out, int out_len,
+    uint32_t bit, uint32_t stride, int count, const uint32_t *in, const int width)
+{
+    uint64_t window, acc;
+    uint32_t byte;
+    int i, bits;
+
+    /* Contiguous values through an accumulator, keeping the bits before the first */
+    if(stride == (uint32_t)width) {
+        byte = bit / 8;
+        bits = bit % 8;
+        acc = (bits && byte < (uint32_t)out_len) ? out[byte] >> (8 - bits) : 0;
+        for(i = 0; i < count; i++) {
+            acc = (acc << width) | (in[i] & TBI_BITPACK_MASK(width));
+            bits += width;
+            while(bits >= 8) {
+                bits -= 8;
+                if(byte < (uint32_t)out_len)
+                    out[byte] = (uint8_t)(acc >> bits);
+                byte++;
+            }
+        }
+        if(bits && byte < (uint32_t)out_len)
+            out[byte] |= (uint8_t)(acc << (8 - bits));
+        return;
+    }
+
+    for(i = 0; i < count && bit / 8 + 8 <= (uint32_t)out_len; i++, bit += stride) {
+        window = tbi_load_be64(out + bit / 8);
+        window |= (uint64_t)(in[i] & TBI_BITPACK_MASK(width)) << (64 - width - bit % 8);
+        tbi_store_be64(out + bit / 8, window);
+    }
+    for(; i < count; i++, bit += stride) {
+        tbi_bits_put_tail(out, out_len, bit, width, in[i] & TBI_BITPACK_MASK(width));
+    }
+}
+
+#define TBI_BITPACK_SCALAR_W(W) \
+static void tbi_unpack_scalar_##W(const uint8_t *in, int in_len, uint32_t bit, uint32_t stride, int count, uint32_t *out) \
+{ \
+    tbi_unpack_scalar(in, in_len, bit, stride, count, out, W); \
+} \
+static void tbi_pack_scalar_##W(uint8_t *out, int out_len, uint32_t bit, uint32_t stride, int count, const uint32_t *in) \
+{ \
+    tbi_pack_scalar(out, out_len, bit, stride, count, in, W); \
+}
+TBI_BITPACK_WIDTHS(TBI_BITPACK_SCALAR_W)
+
+static void tbi_delta_encode_scalar(const uint32_t *values, int count, uint32_t prev, uint32_t *out)
+{
+    int i;
+
+    for(i = 0; i < count; i++) {
+        out[i] = tbi_zigzag32((int32_t)(values[i] - prev));
+        prev = values[i];
+    }
+}
+
+static uint32_t tbi_delta_decode_scalar(uint32_t *values, int count, uint32_t prev)
+{
+    int i;
+
+    for(i = 0; i < count; i++) {
+        prev += (uint32_t)tbi_unzigzag32(values[i]);
+        values[i] = prev;
+    }
+    return prev;
+}
+
+#define TBI_BITPACK_UNPACK_ENTRY(W, ISA) tbi_unpack_##ISA##_##W,
+#define TBI_BITPACK_PACK_ENTRY(W, ISA) tbi_pack_##ISA##_##W,
+#define TBI_BITPACK_UNPACK_SCALAR(W) TBI_BITPACK_UNPACK_ENTRY(W, scalar)
+#define TBI_BITPACK_PACK_SCALAR(W) TBI_BITPACK_PACK_ENTRY(W, scalar)
+
+static const tbi_bitpack_kernels_t tbi_bitpack_scalar = {
+    .isa = TBI_BITPACK_SCALAR,
+    .unpack = { NULL, TBI_BITPACK_WIDTHS(TBI_BITPACK_UNPACK_SCALAR) },
+    .pack = { NULL, TBI_BITPACK_WIDTHS(TBI_BITPACK_PACK_SCALAR) },
+    .delta_encode = tbi_delta_encode_scalar,
+    .delta_decode = tbi_delta_decode_scalar,
+};
+
+#ifdef TBI_BITPACK_X86
+/*
+ * SSE4.1 kernels. Values up to 25 bits wide fit a 32-bit window at any bit
+ * offset: four windows are loaded, byte-swapped, shifted left by the bit offset
+ * with a multiply, and right by the constant width
+ */
+
+__attribute__((target("sse4.1")))
+static inline __attribute__((always_inline)) void tbi_unpack_sse41(const uint8_t *in, int in_len,
+    uint32_t bit, uint32_t stride, int count, uint32_t *out, const int width)
+{
+    const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m128i pow2 = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i seven = _mm_set1_epi32(7);
+    const __m128i high = _mm_set1_epi32((int)0x80808000);
+    uint32_t w0, w1, w2, w3, p1, p2, p3;
+    __m128i pos, step, win;
+    int i = 0;
+
+    if(width > TBI_BITPACK_SSE41_MAX_WIDTH) {
+        tbi_unpack_scalar(in, in_len, bit, stride, count, out, width);
+        return;
+    }
+
+    pos = _mm_setr_epi32(bit, bit + stride, bit + 2 * stride, bit + 3 * stride);
+    step = _mm_set1_epi32(4 * stride);
+    for(; i + 4 <= count; i += 4, bit += 4 * stride) {
+        p1 = bit + stride;
+        p2 = p1 + stride;
+        p3 = p2 + stride;
+        if(p3 / 8 + 4 > (uint32_t)in_len)
+            break;
+
+        memcpy(&w0, in + bit / 8, 4);
+        memcpy(&w1, in + p1 / 8, 4);
+        memcpy(&w2, in + p2 / 8, 4);
+        memcpy(&w3, in + p3 / 8, 4);
+        win = _mm_shuffle_epi8(_mm_setr_epi32(w0, w1, w2, w3), bswap);
+
+        /* 1 << (bit % 8) of each lane from a byte table */
+        win = _mm_mullo_epi32(win, _mm_shuffle_epi8(pow2, _mm_or_si128(_mm_and_si128(pos, seven), high)));
+        win = _mm_srli_epi32(win, 32 - width);
+        _mm_storeu_si128((__m128i*)(out + i), win);
+        pos = _mm_add_epi32(pos, step);
+    }
+    tbi_unpack_scalar(in, in_len, bit, stride, count - i, out + i, width);
+}
+
+#define TBI_BITPACK_SSE41_W(W) \
+__attribute__((target("sse4.1"))) \
+static void tbi_unpack_sse41_##W(const uint8_t *in, int in_len, uint32_t bit, uint32_t stride, int count, uint32_t *out) \
+{ \
+    tbi_unpack_sse41(in, in_len, bit, stride, count, out, W); \
+}
+TBI_BITPACK_WIDTHS(TBI_BITPACK_SSE41_W)
+
+__attribute__((target("sse4.1")))
+static void tbi_delta_encode_sse41(const uint32_t *values, int count, uint32_t prev, uint32_t *out)
+{
+    __m128i cur, last, d;
+    int i = 0;
+
+    if(count > 0) {
+        out[0] = tbi_zigzag32((int32_t)(values[0] - prev));
+        i = 1;
+    }
+    for(; i + 4 <= count; i += 4) {
+        cur = _mm_loadu_si128((const __m128i*)(values + i));
+        last = _mm_loadu_si128((const __m128i*)(values + i - 1));
+        d = _mm_sub_epi32(cur, last);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(_mm_slli_epi32(d, 1), _mm_srai_epi32(d, 31)));
+    }
+    if(i < count)
+        tbi_delta_encode_scalar(values + i, count - i, values[i - 1], out + i);
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t tbi_delta_decode_sse41(uint32_t *values, int count, uint32_t prev)
+{
+    const __m128i one = _mm_set1_epi32(1);
+    __m128i carry = _mm_set1_epi32(prev);
+    __m128i x;
+    int i;
+
+    for(i = 0; i + 4 <= count; i += 4) {
+        x = _mm_loadu_si128((const __m128i*)(values + i));
+        x = _mm_xor_si128(_mm_srli_epi32(x, 1), _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(x, one)));
+
+        /* Inclusive scan in log2(4) steps, then add the running total */
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, carry);
+        carry = _mm_shuffle_epi32(x, 0xFF);
+        _mm_storeu_si128((__m128i*)(values + i), x);
+    }
+    return tbi_delta_decode_scalar(values + i, count - i, (uint32_t)_mm_cvtsi128_si32(carry));
+}
+
+#define TBI_BITPACK_UNPACK_SSE41(W) TBI_BITPACK_UNPACK_ENTRY(W, sse41)
+
+static const tbi_bitpack_kernels_t tbi_bitpack_sse41 = {
+    .isa = TBI_BITPACK_SSE41,
+    .unpack = { NULL, TBI_BITPACK_WIDTHS(TBI_BITPACK_UNPACK_SSE41) },
+    .pack = { NULL, TBI_BITPACK_WIDTHS(TBI_BITPACK_PACK_SCALAR) },
+    .delta_encode = tbi_delta_encode_sse41,
+    .delta_decode = tbi_delta_decode_sse41,
+};
+
+/*
+ * AVX2 kernels. The 64-bit window of each value is gathered, byte-swapped and
+ * shifted with per-lane variable shifts, four values per vector
+ */
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void tbi_unpack_avx2(const uint8_t *in, int in_len,
+    uint32_t bit, uint32_t stride, int count, uint32_t *out, const int width)
+{
+    const __m256i bswap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                           7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m256i seven = _mm256_set1_epi64x(7);
+    __m256i pos, step, win0, win1;
+    uint64_t last;
+    int i = 0;
+
+    pos = _mm256_setr_epi64x(bit, bit + (uint64_t)stride, bit + 2 * (uint64_t)stride, bit + 3 * (uint64_t)stride);
+    step = _mm256_set1_epi64x(4 * (uint64_t)stride);
+    for(; i + 8 <= count; i += 8) {
+        /* Last window of the eight must end within the data */
+        last = bit + (uint64_t)(i + 7) * stride;
+        if(last / 8 + 8 > (uint64_t)in_len)
+            break;
+
+        win0 = _mm256_i64gather_epi64((const long long*)in, _mm256_srli_epi64(pos, 3), 1);
+        win0 = _mm256_shuffle_epi8(win0, bswap);
+        win0 = _mm256_srli_epi64(_mm256_sllv_epi64(win0, _mm256_and_si256(pos, seven)), 64 - width);
+        pos = _mm256_add_epi64(pos, step);
+
+        win1 = _mm256_i64gather_epi64((const long long*)in, _mm256_srli_epi64(pos, 3), 1);
+        win1 = _mm256_shuffle_epi8(win1, bswap);
+        win1 = _mm256_srli_epi64(_mm256_sllv_epi64(win1, _mm256_and_si256(pos, seven)), 64 - width);
+        pos = _mm256_add_epi64(pos, step);
+
+        /* Low halves of the eight 64-bit lanes, in order */
+        win0 = _mm256_permutevar8x32_epi32(win0, pack);
+        win1 = _mm256_permutevar8x32_epi32(win1, pack);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permute2x128_si256(win0, win1, 0x20));
+    }
+    tbi_unpack_scalar(in, in_len, bit + (uint32_t)i * stride, stride, count - i, out + i, width);
+}
+
+#define TBI_BITPACK_AVX2_W(W) \
+__attribute__((target("avx2"))) \
+static void tbi_unpack_avx2_##W(const uint8_t *in, int in_len, uint32_t bit, uint32_t stride, int count, uint32_t *out) \
+{ \
+    tbi_unpack_avx2(in, in_len, bit, stride, count, out, W); \
+}
+TBI_BITPACK_WIDTHS(TBI_BITPACK_AVX2_W)
+
+__attribute__((target("avx2")))
+static void tbi_delta_encode_avx2(const uint32_t *values, int count, uint32_t prev, uint32_t *out)
+{
+    __m256i cur, last, d;
+    int i = 0;
+
+    if(count > 0) {
+        out[0] = tbi_zigzag32((int32_t)(values[0] - prev));
+        i = 1;
+    }
+    for(; i + 8 <= count; i += 8) {
+        cur = _mm256_loadu_si256((const __m256i*)(values + i));
+        last = _mm256_loadu_si256((const __m256i*)(values + i - 1));
+        d = _mm256_sub_epi32(cur, last);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_xor_si256(_mm256_slli_epi32(d, 1), _mm256_srai_epi32(d, 31)));
+    }
+    if(i < count)
+        tbi_delta_encode_scalar(values + i, count - i, values[i - 1], out + i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t tbi_delta_decode_avx2(uint32_t *values, int count, uint32_t prev)
+{
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i last = _mm256_set1_epi32(7);
+    __m256i carry = _mm256_set1_epi32(prev);
+    __m256i x, t;
+    int i;
+
+    for(i = 0; i + 8 <= count; i += 8) {
+        x = _mm256_loadu_si256((const __m256i*)(values + i));
+        x = _mm256_xor_si256(_mm256_srli_epi32(x, 1), _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(x, one)));
+
+        /* Scan each 128-bit lane, then carry the low lane total to the high lane */
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+        t = _mm256_shuffle_epi32(x, 0xFF);
+        x = _mm256_add_epi32(x, _mm256_permute2x128_si256(t, t, 0x08));
+        x = _mm256_add_epi32(x, carry);
+        carry = _mm256_permutevar8x32_epi32(x, last);
+        _mm256_storeu_si256((__m256i*)(values + i), x);
+    }
+    return tbi_delta_decode_scalar(values + i, count - i, (uint32_t)_mm256_extract_epi32(carry, 0));
+}
+
+#define TBI_BITPACK_UNPACK_AVX2(W) TBI_BITPACK_UNPACK_ENTRY(W, avx2)
+
+static const tbi_bitpack_kernels_t tbi_bitpack_avx2 = {
+    .isa = TBI_BITPACK_AVX2,
+    .unpack = { NULL, TBI_BITPACK_WIDTHS(TBI_BITPACK_UNPACK_AVX2) },
+    .pack = { NULL, TBI_BITPACK_WIDTHS(TBI_BITPACK_PACK_SCALAR) },
+    .delta_encode = tbi_delta_encode_avx2,
+    .delta_decode = tbi_delta_decode_avx2,
+};
+#endif
+
+/** @brief Kernels in use */
+static const tbi_bitpack_kernels_t *tbi_bitpack_kernels;
+static pthread_once_t tbi_bitpack_once = PTHREAD_ONCE_INIT;
+
+/** @brief Choose the fastest kernels the CPU supports */
+static void tbi_bitpack_init(void)
+{
+    const tbi_bitpack_kernels_t *kernels = &tbi_bitpack_scalar;
+
+#ifdef TBI_BITPACK_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        kernels = &tbi_bitpack_avx2;
+    else if(__builtin_cpu_supports("sse4.1"))
+        kernels = &tbi_bitpack_sse41;
+#endif
+    __atomic_store_n(&tbi_bitpack_kernels, kernels, __ATOMIC_RELEASE);
+}
+
+/** @brief Get the kernels in use, choosing them on first use */
+static inline const tbi_bitpack_kernels_t *tbi_bitpack_get(void)
+{
+    pthread_once(&tbi_bitpack_once, tbi_bitpack_init);
+    return __atomic_load_n(&tbi_bitpack_kernels, __ATOMIC_ACQUIRE);
+}
+
+/** @brief Get the instruction set of the kernels in use
+ *
+ * @return instruction set
+ */
+tbi_bitpack_isa_t tbi_bitpack_get_isa(void)
+{
+    return tbi_bitpack_get()->isa;
+}
+
+/** @brief Select the kernels of an instruction set, e.g. to compare them. The
+ * fastest supported one is selected by default
+ *
+ * @param[in] isa   Instruction set
+ *
+ * @return 0 on success, or a negative error value if the CPU does not support it
+ */
+int tbi_bitpack_set_isa(tbi_bitpack_isa_t isa)
+{
+    const tbi_bitpack_kernels_t *kernels = NULL;
+
+    tbi_bitpack_get();
+    switch(isa) {
+        case TBI_BITPACK_SCALAR:
+            kernels = &tbi_bitpack_scalar;
+            break;
+#ifdef TBI_BITPACK_X86
+        case TBI_BITPACK_SSE41:
+            if(__builtin_cpu_supports("sse4.1"))
+                kernels = &tbi_bitpack_sse41;
+            break;
+        case TBI_BITPACK_AVX2:
+            if(__builtin_cpu_supports("avx2"))
+                kernels = &tbi_bitpack_avx2;
+            break;
+#endif
+        default:
+            break;
+    }
+    if(!kernels)
+        return -1;
+
+    __atomic_store_n(&tbi_bitpack_kernels, kernels, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/** @brief Get the name of an instruction set
+ *
+ * @param[in] isa   Instruction set
+ *
+ * @return name
+ */
+const char *tbi_bitpack_isa_name(tbi_bitpack_isa_t isa)
+{
+    switch(isa) {
+        case TBI_BITPACK_SCALAR:
+            return "scalar";
+        case TBI_BITPACK_SSE41:
+            return "sse4.1";
+        case TBI_BITPACK_AVX2:
+            return "avx2";
+        default:
+            return "unknown";
+    }
+}
+
+/** @brief Unpack values from an MSB-first bit stream
+ *
+ * @param[in]  in       Bit stream, nothing past in_len bytes is read
+ * @param[in]  in_len   Bit stream length in bytes
+ * @param[in]  bit      Position of the first value
+ * @param[in]  stride   Distance between the starts of consecutive values in bits,
+ *                      width for contiguous values
+ * @param[in]  width    Width of each value, 0 to 32 bits
+ * @param[in]  count    Number of values
+ * @param[out] out      Values
+ */
+void tbi_bitpack_unpack(const uint8_t *in, int in_len, uint32_t bit, uint32_t stride, int width,
+    int count, uint32_t *out)
+{
+    if(count <= 0 || width < 0 || width > 32)
+        return;
+    if(width == 0) {
+        memset(out, 0, count * sizeof(uint32_t));
+        return;
+    }
+    tbi_bitpack_get()->unpack[width](in, in_len, bit, stride, count, out);
+}
+
+/** @brief Pack values into an MSB-first bit stream. Values are ORed into the
+ * stream, which must be zeroed beforehand where the values go
+ *
+ * @param[out] out      Bit stream, nothing past out_len bytes is written
+ * @param[in]  out_len  Bit stream length in bytes
+ * @param[in]  bit      Position of the first value
+ * @param[in]  stride   Distance between the starts of consecutive values in bits,
+ *                      width for contiguous values
+ * @param[in]  width    Width of each value, 0 to 32 bits. Higher bits of the values are ignored
+ * @param[in]  count    Number of values
+ * @param[in]  in       Values
+ */
+void tbi_bitpack_pack(uint8_t *out, int out_len, uint32_t bit, uint32_t stride, int width,
+    int count, const uint32_t *in)
+{
+    if(count <= 0 || width <= 0 || width > 32)
+        return;
+    tbi_bitpack_get()->pack[width](out, out_len, bit, stride, count, in);
+}
+
+/** @brief Zigzag-encode the differences of consecutive values, for signed and
+ * unsigned values alike. Differences wrap around in 32 bits, so 8- and 16-bit
+ * signed values must be sign-extended first
+ *
+ * @param[in]  values   Values
+ * @param[in]  count    Number of values
+ * @param[in]  prev     Value preceding the first one
+ * @param[out] out      Zigzag-encoded differences, may not be the same as values
+ */
+void tbi_zigzag_delta_encode(const uint32_t *values, int count, uint32_t prev, uint32_t *out)
+{
+    if(count > 0)
+        tbi_bitpack_get()->delta_encode(values, count, prev, out);
+}
+
+/** @brief Turn zigzag-encoded differences back into values, with a prefix sum
+ *
+ * @param[in,out] values    Zigzag-encoded differences in, values out
+ * @param[in]     count     Number of values
+ * @param[in]     prev      Value preceding the first one
+ *
+ * @return last value, or prev if there are none
+ */
+uint32_t tbi_zigzag_delta_decode(uint32_t *values, int count, uint32_t prev)
+{
+    if(count <= 0)
+        return prev;
+    return tbi_bitpack_get()->delta_decode(values, count, prev);
+}
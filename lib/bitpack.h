@@ -0,0 +1,49 @@
+/**
+* @file     bitpack.h
+* @brief    Header file for bit packing and unpacking of 0-32-bit values
+*/
+
+#ifndef __TBI_BITPACK_H
+#define __TBI_BITPACK_H
+
+#include <stdint.h>
+
+/** @brief Instruction set used by the bit packing kernels */
+typedef enum {
+    TBI_BITPACK_SCALAR = 0,     /** @brief Plain C */
+    TBI_BITPACK_SSE41  = 1,     /** @brief SSE4.1 */
+    TBI_BITPACK_AVX2   = 2,     /** @brief AVX2 */
+} tbi_bitpack_isa_t;
+
+/** @brief Zigzag-encode a signed value, so that small values of either sign
+ * become small unsigned values: 0, -1, 1, -2, ... as 0, 1, 2, 3, ... */
+static inline uint32_t tbi_zigzag32(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/** @brief Decode a zigzag-encoded value, see @ref tbi_zigzag32() */
+static inline int32_t tbi_unzigzag32(uint32_t value)
+{
+    return (int32_t)((value >> 1) ^ -(value & 1));
+}
+
+/** @brief Get the number of bits needed for an unsigned value, 0 to 32 */
+static inline int tbi_bit_width(uint32_t value)
+{
+    return value ? 32 - __builtin_clz(value) : 0;
+}
+
+tbi_bitpack_isa_t tbi_bitpack_get_isa(void);
+int tbi_bitpack_set_isa(tbi_bitpack_isa_t isa);
+const char *tbi_bitpack_isa_name(tbi_bitpack_isa_t isa);
+
+void tbi_bitpack_unpack(const uint8_t *in, int in_len, uint32_t bit, uint32_t stride, int width,
+    int count, uint32_t *out);
+void tbi_bitpack_pack(uint8_t *out, int out_len, uint32_t bit, uint32_t stride, int width,
+    int count, const uint32_t *in);
+
+void tbi_zigzag_delta_encode(const uint32_t *values, int count, uint32_t prev, uint32_t *out);
+uint32_t tbi_zigzag_delta_decode(uint32_t *values, int count, uint32_t prev);
+
+#endif /* __TBI_BITPACK_H */
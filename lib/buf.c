@@ -1,85 +1,339 @@
 /**
 * @file     buf.c
-* @brief    TBI telemetry message buffer implementation
+* @brief    TBI telemetry message buffer implementation. Each message type has a 
+*           bounded ring of fixed-size slots, in one contiguous region allocated 
+*           at init or supplied by the caller. Every slot carries a sequence number
+*           telling whether it is free for the producer of a given lap, or holds a
+*           message for the consumer. Producers claim slots with compare-and-swap,
+*           so any number of threads may push concurrently without locks. Pops 
+*           claim slots the same way, so that producers can drop the oldest 
+*           messages on overflow while the consumer is reading. Push and pop are
+*           O(1), with no allocations
 */
 
 #include <stdlib.h>
+#include <string.h>
 #include "tbi_types.h"
 #include "buf.h"
 
+/** @brief Default number of messages buffered per message type */
+#define TBI_BUF_DEFAULT_CAPACITY 1024
+
+/** @brief Max number of oldest messages a producer drops to make room for its own */
+#define TBI_BUF_MAX_DROP_ATTEMPTS 4
+
+/** @brief Slot header, followed by the message */
+typedef struct {
+    uint64_t seq;
+    uint64_t start_ts;          /** @brief Start timestamp of the client the message came from, 0 if not known */
+} tbi_buf_slot_t;
+
+/** @brief Get the buffer capacity, rounded up to a power of two */
+static int tbi_buf_capacity(int capacity)
+{
+    int n = 1;
+
+    if(capacity <= 0)
+        capacity = TBI_BUF_DEFAULT_CAPACITY;
+    while(n < capacity)
+        n <<= 1;
+    return n;
+}
+
+/** @brief Get the size of a slot holding a message, keeping slots 8-byte aligned */
+static int tbi_buf_stride(int raw_size)
+{
+    return (sizeof(tbi_buf_slot_t) + raw_size + 7) & ~7;
+}
+
+/** @brief Get the slot for a position */
+static tbi_buf_slot_t *tbi_buf_slot(tbi_msg_ctx_t *msg_ctx, uint64_t pos)
+{
+    return (tbi_buf_slot_t*)(msg_ctx->ring + (size_t)(pos & (uint64_t)(msg_ctx->capacity - 1)) * msg_ctx->stride);
+}
+
 /**
- * @brief Insert a message to end of list
+ * @brief Get the size of the memory region needed for a message buffer
  * 
- * @param[in] msg_ctx   Telemetry message buffer context for a message type
- * @param[in] buflen    Length of buffer to be stored
- * @param[in] buf       Pointer to buffer to be stored
+ * @param[in] raw_size  Message size
+ * @param[in] capacity  Number of messages, rounded up to a power of two, or 0 for default
+ * 
+ * @return size in bytes
+*/
+size_t tbi_buf_region_size(int raw_size, int capacity)
+{
+    return (size_t)tbi_buf_capacity(capacity) * tbi_buf_stride(raw_size);
+}
+
+/**
+ * @brief Set up the message buffer of a message type, with the capacity set in
+ * its context
+ * 
+ * @param[in] msg_ctx       Telemetry message buffer context for a message type
+ * @param[in] region        Memory for the buffer, 8-byte aligned, or NULL to allocate it
+ * @param[in] region_size   Size of region, see @ref tbi_buf_region_size()
  * 
  * @return 0 on success, negative error code on failure
 */
-int tbi_buf_push_back(tbi_msg_ctx_t *msg_ctx, int buflen, void* buf)
+int tbi_buf_init(tbi_msg_ctx_t *msg_ctx, void* region, size_t region_size)
 {
-    struct tbi_msg_node *new;
-    struct tbi_msg_node *curr;
-    int index;
-
-    /* Allocate memory for new message node */
-    new = (struct tbi_msg_node*)malloc(sizeof(struct tbi_msg_node));
-    if(new == NULL) return -1;
-
-    /* Update metadata */
-    new->len = buflen;
-    new->buf = buf;
-    new->next = NULL;
-
-    if(msg_ctx->buflen == 0 || msg_ctx->head == NULL) {
-        /* New node is the first element, replace head */
-        msg_ctx->head = new;
-        msg_ctx->buflen = 1;
+    size_t size;
+    uint64_t i;
+
+    if(msg_ctx->ring)
+        return -1;
+
+    /* A byte budget gives the largest capacity that stays within it */
+    if(msg_ctx->capacity <= 0 && msg_ctx->quota_bytes > 0) {
+        msg_ctx->capacity = 1;
+        while((size_t)msg_ctx->capacity * 2 * tbi_buf_stride(msg_ctx->raw_size) <= (size_t)msg_ctx->quota_bytes)
+            msg_ctx->capacity *= 2;
+    }
+
+    size = tbi_buf_region_size(msg_ctx->raw_size, msg_ctx->capacity);
+    if(region) {
+        if(region_size < size || ((uintptr_t)region & 7) != 0)
+            return -1;
+        msg_ctx->ring = (uint8_t*)region;
+        msg_ctx->ring_owned = false;
     } else {
-        /* Insert as last element */
-        curr = msg_ctx->head;
-        while(curr->next != NULL) {
-            curr = curr->next;
-            index++;
-        }
-        curr->next = new;
-        msg_ctx->buflen++;
+        msg_ctx->ring = (uint8_t*)malloc(size);
+        if(!msg_ctx->ring)
+            return -1;
+        msg_ctx->ring_owned = true;
+    }
 
+    msg_ctx->capacity = tbi_buf_capacity(msg_ctx->capacity);
+    msg_ctx->stride = tbi_buf_stride(msg_ctx->raw_size);
+    msg_ctx->enq_pos = 0;
+    msg_ctx->deq_pos = 0;
+    msg_ctx->overflows = 0;
+
+    /* Every slot is free for the first lap */
+    for(i = 0; i < (uint64_t)msg_ctx->capacity; i++) {
+        tbi_buf_slot(msg_ctx, i)->seq = i;
     }
 
     return 0;
 }
 
 /**
- * @brief Retrieve first message in the list
+ * @brief Copy a message to end of the buffer, if there is room
  * 
- * @param[in]   msg_ctx   Telemetry message buffer context for a message type
- * @param[out]  buflen    Length of buffer retrieved
- * @param[out]  buf       Pointer to address of retrieved buffer
+ * @param[in] msg_ctx   Telemetry message buffer context for a message type
+ * @param[in] buf       Message to store
+ * @param[in] buflen    Message length
+ * @param[in] start_ts  Client start timestamp of the message
  * 
- * @return 0 on success, negative error code on failure
+ * @return 0 on success, or negative error code if the buffer is full
 */
-int tbi_buf_pop_front(tbi_msg_ctx_t *msg_ctx, int *buflen, void** buf)
+static int tbi_buf_try_push(tbi_msg_ctx_t *msg_ctx, const void* buf, int buflen, uint64_t start_ts)
 {
-    struct tbi_msg_node *first;
+    tbi_buf_slot_t *slot;
+    uint64_t pos, seq;
+    int64_t diff;
 
-    /* Return error if list empty */
-    if(msg_ctx->buflen == 0 || msg_ctx->head == NULL)
-        return -1;
+    pos = __atomic_load_n(&msg_ctx->enq_pos, __ATOMIC_RELAXED);
+    while(1) {
+        slot = tbi_buf_slot(msg_ctx, pos);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t)(seq - pos);
+
+        if(diff == 0) {
+            /* Slot is free on this lap, claim it */
+            if(__atomic_compare_exchange_n(&msg_ctx->enq_pos, &pos, pos + 1, true, 
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            /* Slot still holds a message from the previous lap */
+            return -1;
+        } else {
+            /* Another producer claimed the slot, catch up */
+            pos = __atomic_load_n(&msg_ctx->enq_pos, __ATOMIC_RELAXED);
+        }
+    }
 
-    /* Change head to point to the second element (may be NULL) */
-    first = msg_ctx->head;
-    *buflen = first->len;
-    *buf = first->buf;
-    msg_ctx->head = first->next;
-    
-    /* Decrement buffer length and free memory taken by old first element */
-    msg_ctx->buflen--;
-    free(first);
+    /* Copy and publish to the consumer */
+    memcpy(slot + 1, buf, buflen);
+    slot->start_ts = start_ts;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
 
     return 0;
 }
 
+/**
+ * @brief Drop the oldest message in the buffer to make room
+ * 
+ * @param[in] msg_ctx   Telemetry message buffer context for a message type
+ * 
+ * @return 0 if a message was dropped, negative error code if none was available
+*/
+static int tbi_buf_drop_oldest(tbi_msg_ctx_t *msg_ctx)
+{
+    uint64_t pos;
+
+    if(!tbi_buf_pop_front(msg_ctx, &pos))
+        return -1;
+
+    tbi_buf_release(msg_ctx, pos);
+    __atomic_add_fetch(&msg_ctx->stats.dropped, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Copy a message to end of the buffer, applying the overflow policy of 
+ * the message type if the buffer is full. May be called from any number of 
+ * threads concurrently
+ * 
+ * @param[in] msg_ctx   Telemetry message buffer context for a message type
+ * @param[in] buf       Message to store
+ * @param[in] buflen    Message length, at most the raw size of the message type
+ * 
+ * @return 0 if stored, 1 if the message was dropped by the overflow policy, 
+ *          or negative error code on failure
+*/
+int tbi_buf_push_back(tbi_msg_ctx_t *msg_ctx, const void* buf, int buflen)
+{
+    return tbi_buf_push_back_ts(msg_ctx, buf, buflen, 0);
+}
+
+/**
+ * @brief Copy a message received from a client to end of the buffer, keeping
+ * the client start timestamp its timestamps are relative to, see 
+ * @ref tbi_buf_push_back() and @ref tbi_buf_start_ts()
+ * 
+ * @param[in] msg_ctx   Telemetry message buffer context for a message type
+ * @param[in] buf       Message to store
+ * @param[in] buflen    Message length, at most the raw size of the message type
+ * @param[in] start_ts  Client start timestamp in ms
+ * 
+ * @return 0 if stored, 1 if the message was dropped by the overflow policy, 
+ *          or negative error code on failure
+*/
+int tbi_buf_push_back_ts(tbi_msg_ctx_t *msg_ctx, const void* buf, int buflen, uint64_t start_ts)
+{
+    uint64_t n;
+    int i;
+
+    if(!msg_ctx->ring || buflen > msg_ctx->raw_size)
+        return -1;
+
+    if(tbi_buf_try_push(msg_ctx, buf, buflen, start_ts) == 0)
+        return 0;
+
+    switch(msg_ctx->overflow) {
+        case TBI_OVERFLOW_DECIMATE:
+            /* Keep every k-th message arriving to a full buffer */
+            n = __atomic_fetch_add(&msg_ctx->overflows, 1, __ATOMIC_RELAXED);
+            if(msg_ctx->decimate > 1 && n % (uint64_t)msg_ctx->decimate != 0)
+                break;
+            /* fall through */
+
+        case TBI_OVERFLOW_DROP_OLDEST:
+            /* Make room, others may take it first or the consumer may be
+                reading the oldest slot, so retry a few times at most */
+            for(i = 0; i < TBI_BUF_MAX_DROP_ATTEMPTS; i++) {
+                if(tbi_buf_drop_oldest(msg_ctx) != 0)
+                    break;
+                if(tbi_buf_try_push(msg_ctx, buf, buflen, start_ts) == 0)
+                    return 0;
+            }
+            break;
+
+        case TBI_OVERFLOW_DROP_NEWEST:
+        default:
+            break;
+    }
+
+    __atomic_add_fetch(&msg_ctx->stats.dropped, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * @brief Take the first message in the buffer. The message stays in its slot
+ * until released with @ref tbi_buf_release(). Messages are taken in order, but
+ * may be released in any order
+ * 
+ * @param[in]   msg_ctx   Telemetry message buffer context for a message type
+ * @param[out]  pos       Position of the message, for releasing it
+ * 
+ * @return pointer to the message, or NULL if empty
+*/
+void *tbi_buf_pop_front(tbi_msg_ctx_t *msg_ctx, uint64_t* pos)
+{
+    tbi_buf_slot_t *slot;
+    uint64_t p, seq;
+    int64_t diff;
+
+    if(!msg_ctx->ring)
+        return NULL;
+
+    p = __atomic_load_n(&msg_ctx->deq_pos, __ATOMIC_RELAXED);
+    while(1) {
+        slot = tbi_buf_slot(msg_ctx, p);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t)(seq - (p + 1));
+
+        if(diff == 0) {
+            /* Slot holds a message on this lap, claim it */
+            if(__atomic_compare_exchange_n(&msg_ctx->deq_pos, &p, p + 1, true, 
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            /* Empty, or the producer is still copying */
+            return NULL;
+        } else {
+            /* Taken by someone else, catch up */
+            p = __atomic_load_n(&msg_ctx->deq_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *pos = p;
+    return slot + 1;
+}
+
+/**
+ * @brief Get the client start timestamp of a message taken with 
+ * @ref tbi_buf_pop_front(), before releasing it
+ * 
+ * @param[in]   msg       Message
+ * 
+ * @return start timestamp in ms, 0 if the message was stored without one
+*/
+uint64_t tbi_buf_start_ts(const void* msg)
+{
+    return ((const tbi_buf_slot_t*)msg - 1)->start_ts;
+}
+
+/**
+ * @brief Release the slot of a message taken with @ref tbi_buf_pop_front(), 
+ * for reuse by producers
+ * 
+ * @param[in]   msg_ctx   Telemetry message buffer context for a message type
+ * @param[in]   pos       Position of the message
+*/
+void tbi_buf_release(tbi_msg_ctx_t *msg_ctx, uint64_t pos)
+{
+    /* Free the slot for the next lap */
+    __atomic_store_n(&tbi_buf_slot(msg_ctx, pos)->seq, pos + msg_ctx->capacity, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get the number of messages in the buffer. Messages being pushed 
+ * concurrently may be counted before they can be taken
+ * 
+ * @param[in]   msg_ctx   Telemetry message buffer context for a message type
+ * 
+ * @return number of messages
+*/
+int tbi_buf_len(tbi_msg_ctx_t *msg_ctx)
+{
+    uint64_t deq = __atomic_load_n(&msg_ctx->deq_pos, __ATOMIC_RELAXED);
+    uint64_t enq = __atomic_load_n(&msg_ctx->enq_pos, __ATOMIC_RELAXED);
+
+    return (enq > deq) ? (int)(enq - deq) : 0;
+}
+
 /**
  * @brief Free up memory used by message buffer
  * 
@@ -87,10 +341,11 @@ int tbi_buf_pop_front(tbi_msg_ctx_t *msg_ctx, int *buflen, void** buf)
  */
 void tbi_buf_free(tbi_msg_ctx_t *msg_ctx)
 {
-    int buflen;
-    void *buf;
+    if(msg_ctx->ring_owned)
+        free(msg_ctx->ring);
 
-    while(tbi_buf_pop_front(msg_ctx, &buflen, &buf) == 0) {
-        free(buf);
-    }
+    msg_ctx->ring = NULL;
+    msg_ctx->ring_owned = false;
+    msg_ctx->enq_pos = 0;
+    msg_ctx->deq_pos = 0;
 }
@@ -6,11 +6,19 @@
 #ifndef __TBI_BUF_H
 #define __TBI_BUF_H
 
+#include <stddef.h>
 #include "tbi_types.h"
 
-int tbi_buf_push_back(tbi_msg_ctx_t *msg_ctx, int buflen, void* buf);
-int tbi_buf_pop_front(tbi_msg_ctx_t *msg_ctx, int *buflen, void** buf);
+size_t tbi_buf_region_size(int raw_size, int capacity);
+int tbi_buf_init(tbi_msg_ctx_t *msg_ctx, void* region, size_t region_size);
+
+int tbi_buf_push_back(tbi_msg_ctx_t *msg_ctx, const void* buf, int buflen);
+int tbi_buf_push_back_ts(tbi_msg_ctx_t *msg_ctx, const void* buf, int buflen, uint64_t start_ts);
+void *tbi_buf_pop_front(tbi_msg_ctx_t *msg_ctx, uint64_t* pos);
+uint64_t tbi_buf_start_ts(const void* msg);
+void tbi_buf_release(tbi_msg_ctx_t *msg_ctx, uint64_t pos);
+int tbi_buf_len(tbi_msg_ctx_t *msg_ctx);
 
 void tbi_buf_free(tbi_msg_ctx_t *msg_ctx);
 
-#endif /* __TBI_BUF_H */
\ No newline at end of file
+#endif /* __TBI_BUF_H */
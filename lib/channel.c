@@ -3,101 +3,462 @@
 * @brief    Socket based channel interface for sending telemetry
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <poll.h>
 
 #include "channel.h"
 #include "protocol.h"
 #include "utils.h"
+#include "uring.h"
+#include "spool.h"
+#include "stats.h"
+#include "schema.h"
+#include "log.h"
 
 #define TBI_DEFAULT_SERVER_ADDRESS "127.0.0.1"
 #define TBI_CHANNEL_MTU 1500U
+#define TBI_CHANNEL_RX_SIZE 65536
+#define TBI_CHANNEL_RX_TOPUP 4096
+#define TBI_CHANNEL_READ_BUDGET (4 * TBI_CHANNEL_RX_SIZE)
+#define TBI_CHANNEL_TX_SIZE 65536
+#define TBI_CHANNEL_MAX_FRAME (16 * 1024 * 1024)
 #define TBI_DEFAULT_PORT 8000U
-#define TBI_MAX_CLIENTS 1U
+#define TBI_MAX_CLIENTS 16384
+#define TBI_LISTEN_BACKLOG SOMAXCONN
+#define TBI_MAX_EVENTS 64
+#define TBI_CLIENT_BACKOFF_MIN_MS 500U
+#define TBI_CLIENT_BACKOFF_MAX_MS 60000U
+#define TBI_CLIENT_CONNECT_TIMEOUT_MS 10000U
+
+/** @brief Last connection number given out, shared by all server workers */
+static uint64_t tbi_conn_ids;
+
+/** @brief Get a jittered delay for the next reconnect attempt, and grow the backoff.
+ * The delay is drawn from [backoff/2, backoff], so that clients that lost their
+ * connection at the same moment spread their reconnects over time
+ * 
+ * @param[in]  channel  Client channel
+ * 
+ * @return delay in milliseconds
+ */
+static uint32_t tbi_client_backoff(tbi_channel_t* channel)
+{
+    uint32_t x = channel->rand_state;
+    uint32_t backoff = channel->backoff_ms;
+
+    /* xorshift32 */
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    channel->rand_state = x;
+
+    if(channel->backoff_ms < TBI_CLIENT_BACKOFF_MAX_MS / 2)
+        channel->backoff_ms *= 2;
+    else
+        channel->backoff_ms = TBI_CLIENT_BACKOFF_MAX_MS;
 
-/** @brief Connect to server (blocking)
+    return backoff / 2 + x % (backoff / 2 + 1);
+}
+
+/** @brief Rewind the transmit buffer to the first frame that was not completely
+ * sent, so that it is sent again in full after reconnecting
  * 
  * @param[in]  tbi     TBI context
+ */
+static void tbi_client_tx_rewind(tbi_ctx_t* tbi)
+{
+    tbi_channel_t *channel = tbi->channel;
+    int off = 0;
+    int len;
+
+    while(off < channel->tx_len) {
+        len = tbi_protocol_frame_len(tbi, channel->tx_buf + off, channel->tx_len - off);
+        if(len <= 0 || off + len > channel->tx_off)
+            break;
+        off += len;
+    }
+
+    memmove(channel->tx_buf, channel->tx_buf + off, channel->tx_len - off);
+    channel->tx_len -= off;
+    channel->tx_off = 0;
+}
+
+/** @brief Drop the connection to server, and schedule a reconnect 
  * 
- * @return 0 on success, or a negative error value
+ * @param[in]  tbi     TBI context
  */
-int tbi_client_channel_open(tbi_ctx_t* tbi)
+void tbi_client_channel_disconnect(tbi_ctx_t* tbi)
 {
-    struct sockaddr_in address;
-    int ret, len;
+    tbi_channel_t *channel = tbi->channel;
+    uint32_t delay;
 
-    /* Allocate new channel context */
-	tbi->channel = (tbi_channel_t*)malloc(sizeof(tbi_channel_t));
-    if(!tbi->channel)
-        goto exit;
+    if(channel->conn_fd >= 0) {
+        close(channel->conn_fd);
+        channel->conn_fd = -1;
+    }
 
-    /* Allocate buffer for stored data */
-    tbi->channel->buf = (uint8_t*)malloc(TBI_CHANNEL_MTU * sizeof(uint8_t));
-    if(!tbi->channel->buf)
-        goto exit_channel_allocated;
+    if(channel->state == TBI_CLIENT_CONNECTED)
+        tbi_client_tx_rewind(tbi);
+
+    delay = tbi_client_backoff(channel);
+    TBI_STAT_INC(channel->stats.connect_failures);
+    channel->state = TBI_CLIENT_DISCONNECTED;
+    channel->connected = false;
+    channel->retry_ts = get_current_time_ms() + delay;
+    TBI_LOG_INFO("Disconnected from server, reconnecting in %u ms\n", delay);
+}
+
+/** @brief Start a non-blocking connection attempt
+ * 
+ * @param[in]  tbi     TBI context
+ * 
+ * @return 0 if the attempt was started, or a negative error value
+ */
+static int tbi_client_connect(tbi_ctx_t* tbi)
+{
+    tbi_channel_t *channel = tbi->channel;
+    struct sockaddr_in address;
+
+    channel->attempt_ts = get_current_time_ms();
+    channel->state = TBI_CLIENT_CONNECTING;
+    channel->hs_len = 0;
 
     /* Create socket */
-    tbi->channel->server = false;
-    tbi->channel->connected = false;
-    if((tbi->channel->conn_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        goto exit_buf_allocated;
+    if((channel->conn_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
 
     /* Set up server address */
-    memset(&address, '0', sizeof(address));
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_port = htons(TBI_DEFAULT_PORT);
 
     if(inet_pton(AF_INET, TBI_DEFAULT_SERVER_ADDRESS, &address.sin_addr) <= 0) {
-        printf("Invalid server address!\n");
-        goto exit_buf_allocated;
+        TBI_LOG_ERROR("Invalid server address!\n");
+        return -1;
     }
 
-    /* Connect to server */
-    if((ret = connect(tbi->channel->conn_fd, (struct sockaddr*)&address, sizeof(address))) < 0) {
+    /* Connect to server, completes in the background */
+    if(connect(channel->conn_fd, (struct sockaddr*)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
         perror("Unable to connect to server");
-        goto exit_buf_allocated;
+        return -1;
     }
+    return 0;
+}
 
-    /* Create timestamp that will be shared with server. All future telemetry
-        msgs should have timestamps relative to this */
-    tbi->channel->start_ts = get_current_time_ms();
-    tbi->channel->connected = true;
+/** @brief Get the protocol features a client requests, acknowledges are needed by the spool */
+static uint8_t tbi_client_features(tbi_ctx_t* tbi)
+{
+    return tbi->features | (tbi->spool ? TBI_FEATURE_ACK : 0);
+}
 
-    /* Form client handshake message */
-    len = tbi_protocol_client_handshake(tbi->channel->buf, tbi->msgspec_version, 
-        msgspec_checksum(tbi), tbi->channel->start_ts);
+/** @brief Send client handshake on a connected socket
+ * 
+ * @param[in]  tbi     TBI context
+ * 
+ * @return 0 on success, or a negative error value
+ */
+static int tbi_client_send_handshake(tbi_ctx_t* tbi)
+{
+    tbi_channel_t *channel = tbi->channel;
+    int ret, len;
+
+    /* Form client handshake message. The start timestamp is kept over reconnects, 
+        so that telemetry queued earlier stays valid */
+    len = tbi_protocol_client_handshake(channel->buf, tbi->msgspec_version, 
+        msgspec_checksum(tbi), channel->start_ts, tbi_client_features(tbi), tbi->device_id);
     if(len <= 0)
-        goto exit_socket_opened;
+        return -1;
 
-    /* Send handshake */
-    if((ret = write(tbi->channel->conn_fd, tbi->channel->buf, len)) < len) {
+    /* Send handshake, always fits into the empty socket send buffer */
+    if((ret = send(channel->conn_fd, channel->buf, len, MSG_NOSIGNAL)) < len) {
         if(ret < 0)
             perror("Error writing to socket");
-        goto exit_socket_opened;
+        return -1;
+    }
+
+    channel->state = TBI_CLIENT_HANDSHAKE;
+    return 0;
+}
+
+/** @brief Read the acknowledges of the server without blocking, and advance the
+ * spool read cursor past the frames they cover
+ * 
+ * @param[in]  tbi     TBI context, with a spool
+ * 
+ * @return 0 on success, or a negative error value if the connection must be dropped
+ */
+static int tbi_client_recv_acks(tbi_ctx_t* tbi)
+{
+    tbi_channel_t *channel = tbi->channel;
+    uint64_t pos, acked = 0;
+    int len, off;
+
+    while(1) {
+        len = recv(channel->conn_fd, channel->buf + channel->ack_len,
+            TBI_CHANNEL_MTU / TBI_ACK_LEN * TBI_ACK_LEN - channel->ack_len, MSG_DONTWAIT);
+        TBI_STAT_INC(channel->stats.syscalls);
+        if(len < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            perror("Error reading from socket");
+            return -1;
+        }
+        if(len == 0)
+            return -1;
+        TBI_STAT_ADD(channel->stats.bytes_recvd, len);
+
+        /* Acknowledges are cumulative, only the last complete one counts */
+        len += channel->ack_len;
+        for(off = 0; off + TBI_ACK_LEN <= len; off += TBI_ACK_LEN) {
+            if(tbi_protocol_parse_ack(channel->buf + off, TBI_ACK_LEN, &pos) != 0 ||
+                pos > channel->send_pos - channel->conn_pos) {
+                TBI_LOG_ERROR("Invalid acknowledge from server!\n");
+                return -1;
+            }
+            acked = pos;
+        }
+        channel->ack_len = len - off;
+        memmove(channel->buf, channel->buf + off, channel->ack_len);
+    }
+
+    if(acked > 0)
+        tbi_spool_ack(tbi->spool, channel->conn_pos + acked);
+    return 0;
+}
+
+/** @brief Advance the client connection state machine without blocking: start
+ * connection attempts once their backoff has expired, complete connects and 
+ * verify the server handshake
+ * 
+ * @param[in]  tbi     TBI context
+ * 
+ * @return 1 if connected, 0 if not (yet) connected, or a negative error value
+ */
+int tbi_client_channel_poll(tbi_ctx_t* tbi)
+{
+    tbi_channel_t *channel;
+    struct pollfd pfd;
+    socklen_t optlen;
+    uint64_t now;
+    int err, len;
+
+    if(!tbi || !tbi->channel || tbi->channel->server)
+        return -1;
+
+    channel = tbi->channel;
+    now = get_current_time_ms();
+
+    switch(channel->state) {
+        case TBI_CLIENT_DISCONNECTED:
+            if(now < channel->retry_ts)
+                return 0;
+            if(tbi_client_connect(tbi) != 0)
+                goto exit_failed;
+            /* fall through */
+
+        case TBI_CLIENT_CONNECTING:
+            /* Connect is complete once the socket becomes writable */
+            pfd.fd = channel->conn_fd;
+            pfd.events = POLLOUT;
+            if(poll(&pfd, 1, 0) <= 0)
+                break;
+
+            err = 0;
+            optlen = sizeof(err);
+            if(getsockopt(channel->conn_fd, SOL_SOCKET, SO_ERROR, &err, &optlen) != 0 || err != 0) {
+                if(err != 0)
+                    TBI_LOG_WARN("Unable to connect to server: %s\n", strerror(err));
+                goto exit_failed;
+            }
+            if(tbi_client_send_handshake(tbi) != 0)
+                goto exit_failed;
+            /* fall through */
+
+        case TBI_CLIENT_HANDSHAKE:
+            /* Verify server handshake */
+            len = recv(channel->conn_fd, channel->buf + channel->hs_len, TBI_HANDSHAKE_ACK_LEN - channel->hs_len, 0);
+            if(len < 0) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("Error reading from socket");
+                    goto exit_failed;
+                }
+                break;
+            }
+            if(len == 0)
+                goto exit_failed;
+
+            channel->hs_len += len;
+            if(channel->hs_len < TBI_HANDSHAKE_ACK_LEN)
+                break;
+
+            if(tbi_protocol_client_verify_handshake_ack(channel->buf, channel->hs_len, tbi_client_features(tbi),
+                &channel->features) != 0) {
+                TBI_LOG_ERROR("Invalid handshake from server of length %d bytes!\n", channel->hs_len);
+                goto exit_failed;
+            }
+
+            channel->state = TBI_CLIENT_CONNECTED;
+            channel->connected = true;
+            channel->backoff_ms = TBI_CLIENT_BACKOFF_MIN_MS;
+            TBI_STAT_INC(channel->stats.connects);
+
+            /* Everything not acknowledged is sent again */
+            if(tbi->spool) {
+                channel->conn_pos = channel->send_pos = tbi->spool->hdr->tail;
+                channel->ack_len = 0;
+                if(!(channel->features & TBI_FEATURE_ACK))
+                    TBI_LOG_WARN("Server does not acknowledge frames, spooled frames are dropped once sent\n");
+            }
+            return 1;
+
+        case TBI_CLIENT_CONNECTED:
+            if(tbi->spool && (channel->features & TBI_FEATURE_ACK) && tbi_client_recv_acks(tbi) != 0)
+                goto exit_failed;
+            return 1;
+    }
+
+    /* Give up on attempts that take too long */
+    if(now - channel->attempt_ts > TBI_CLIENT_CONNECT_TIMEOUT_MS) {
+        TBI_LOG_WARN("Timeout connecting to server\n");
+        goto exit_failed;
     }
+    return 0;
+
+exit_failed:
+    tbi_client_channel_disconnect(tbi);
+    return 0;
+}
+
+/** @brief Wait until the client connection can make progress: the next connection
+ * attempt is due, the connect or handshake completes, or unsent data fits 
+ * into the socket again
+ * 
+ * @param[in]  tbi          TBI context
+ * @param[in]  timeout_ms   Max time to wait, -1 waits indefinitely
+ * 
+ * @return 1 if connected, 0 if not (yet) connected, or a negative error value
+ */
+int tbi_client_channel_wait(tbi_ctx_t* tbi, int timeout_ms)
+{
+    tbi_channel_t *channel;
+    struct pollfd pfd;
+    uint64_t now;
+
+    if(!tbi || !tbi->channel || tbi->channel->server)
+        return -1;
+
+    channel = tbi->channel;
+    pfd.fd = channel->conn_fd;
+    pfd.events = 0;
 
-    /* Verify server handshake */
-    len = read(tbi->channel->conn_fd, tbi->channel->buf, TBI_CHANNEL_MTU);
-    if(len < 0) {
-        perror("Error reading from socket");
-        goto exit_socket_opened;
+    switch(channel->state) {
+        case TBI_CLIENT_DISCONNECTED:
+            /* Sleep until the next attempt at most */
+            now = get_current_time_ms();
+            if(channel->retry_ts <= now)
+                timeout_ms = 0;
+            else if(timeout_ms < 0 || channel->retry_ts - now < (uint64_t)timeout_ms)
+                timeout_ms = (int)(channel->retry_ts - now);
+            pfd.fd = -1;
+            break;
+        case TBI_CLIENT_CONNECTING:
+            pfd.events = POLLOUT;
+            break;
+        case TBI_CLIENT_HANDSHAKE:
+            pfd.events = POLLIN;
+            break;
+        case TBI_CLIENT_CONNECTED:
+            if(channel->tx_off < channel->tx_len && !tbi->spool)
+                pfd.events = POLLOUT;
+            if(tbi->spool) {
+                /* Spooled frames are sent, and then wait for their acknowledge */
+                if(channel->send_pos < tbi->spool->hdr->head)
+                    pfd.events |= POLLOUT;
+                if(tbi->spool->hdr->tail < channel->send_pos)
+                    pfd.events |= POLLIN;
+            }
+            break;
     }
 
-    if(tbi_protocol_client_verify_handshake_ack(tbi->channel->buf, len) != 0) {
-        printf("Invalid handshake from server of length %d bytes!\n", len);
-        goto exit_socket_opened;
+    if(poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+        perror("Error in poll");
+        return -1;
+    }
+
+    return tbi_client_channel_poll(tbi);
+}
+
+/** @brief Open the client channel and start connecting to server. The connection
+ * is completed, and re-established whenever lost, by @ref tbi_client_channel_poll()
+ * 
+ * @param[in]  tbi     TBI context
+ * 
+ * @return 0 on success, or a negative error value
+ */
+int tbi_client_channel_open(tbi_ctx_t* tbi)
+{
+    /* Allocate new channel context */
+    tbi->channel = (tbi_channel_t*)malloc(sizeof(tbi_channel_t));
+    if(!tbi->channel)
+        goto exit;
+    memset(tbi->channel, 0, sizeof(tbi_channel_t));
+
+    /* Allocate buffer for stored data */
+    tbi->channel->buf = (uint8_t*)malloc(TBI_CHANNEL_MTU * sizeof(uint8_t));
+    if(!tbi->channel->buf)
+        goto exit_channel_allocated;
+
+    /* Allocate buffer for serializing batches of outgoing messages */
+    tbi->channel->tx_buf = (uint8_t*)malloc(TBI_CHANNEL_TX_SIZE * sizeof(uint8_t));
+    if(!tbi->channel->tx_buf)
+        goto exit_buf_allocated;
+    tbi->channel->tx_size = TBI_CHANNEL_TX_SIZE;
+
+    tbi->channel->server = false;
+    tbi->channel->connected = false;
+    tbi->channel->conn_fd = -1;
+    tbi->channel->listen_fd = -1;
+    tbi->channel->epoll_fd = -1;
+    tbi->channel->state = TBI_CLIENT_DISCONNECTED;
+    tbi->channel->backoff_ms = TBI_CLIENT_BACKOFF_MIN_MS;
+    tbi->channel->retry_ts = 0;
+
+    /* Create timestamp that will be shared with server. All future telemetry
+        msgs should have timestamps relative to this */
+    tbi->channel->start_ts = get_current_time_ms();
+
+    /* Frames left in the spool by an earlier run stay relative to its start */
+    if(tbi->spool) {
+        if(tbi_spool_len(tbi->spool) > 0)
+            tbi->channel->start_ts = tbi->spool->hdr->start_ts;
+        else
+            tbi->spool->hdr->start_ts = tbi->channel->start_ts;
     }
 
+    /* Seed the backoff jitter differently on every client */
+    tbi->channel->rand_state = (uint32_t)tbi->channel->start_ts ^ ((uint32_t)getpid() << 16) ^ (uint32_t)(uintptr_t)tbi->channel;
+    if(tbi->channel->rand_state == 0)
+        tbi->channel->rand_state = 1;
+
+    /* Start the first connection attempt */
+    tbi_client_channel_poll(tbi);
     return 0;
 
-exit_socket_opened:
-    close(tbi->channel->conn_fd);
 exit_buf_allocated:
     free(tbi->channel->buf);
 exit_channel_allocated:
@@ -107,46 +468,82 @@ exit:
     return -1;
 }
 
-/** @brief Send RTM message to server
+/** @brief Send a batch of serialized messages to server without blocking, with
+ * a single syscall unless the kernel accepts only part of it. A fatal socket 
+ * error drops the connection, see @ref tbi_client_channel_disconnect()
  * 
- * @param[in]  tbi     TBI context
- * @param[in]  flags   Message flags
- * @param[in]  msgtype Message type
- * @param[in]  buf     Buffer containing the message
- * @param[in]  buf_len Buffer length
+ * @param[in]  tbi       TBI context
+ * @param[in]  iov       Messages to send, modified on partial sends
+ * @param[in]  iovcnt    Number of elements in iov
+ * @param[in]  more      More batches follow, lets the kernel hold back a partial segment (MSG_MORE)
+ * @param[out] syscalls  Incremented by the number of syscalls made
  * 
- * @return 0 on success, or a negative error value
+ * @return number of bytes sent, which is less than requested when the socket
+ *          send buffer is full, or a negative error value
  */
-int tbi_client_channel_send_rtm(tbi_ctx_t* tbi, uint8_t flags, uint8_t msgtype, uint8_t* buf, int buf_len)
+int tbi_client_channel_send_iov(tbi_ctx_t* tbi, struct iovec* iov, int iovcnt, bool more, int* syscalls)
 {
-    int ret;
+    struct msghdr msg;
+    int sent = 0;
+    ssize_t ret;
 
     if(!tbi || !tbi->channel || !tbi->channel->connected)
         return -1;
 
-    /* Set flags to first byte (RTM/DCB) */
-    if((ret = tbi_set_client_flags(buf, TBI_FLAGS_RTM)) != 0)
-        return -1;
-
-    /* Debug */
-    printf("Channel sending RTM: ");
-    for(int i = 0; i < buf_len; i++) { printf("0x%X ", buf[i]); }
-    printf("\n");
+    while(iovcnt > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
 
-    /* Send it */
-    if((ret = write(tbi->channel->conn_fd, buf, buf_len)) < buf_len) {
-        if(ret < 0)
+        ret = sendmsg(tbi->channel->conn_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
+        (*syscalls)++;
+        TBI_STAT_INC(tbi->channel->stats.syscalls);
+        if(ret < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
             perror("Error writing to socket");
-        return -1;
+            tbi_client_channel_disconnect(tbi);
+            return -1;
+        }
+        sent += ret;
+        TBI_STAT_ADD(tbi->channel->stats.bytes_sent, ret);
+
+        /* Skip over what was sent */
+        while(iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
     }
-    printf("...Sent!\n");
 
-    return 0;
+    return sent;
 }
 
-int tbi_client_channel_send_dcb(tbi_ctx_t* tbi)
+/** @brief Cork or uncork the connection to server (TCP_CORK). While corked,
+ * only full segments are sent, uncorking sends out the rest
+ * 
+ * @param[in]  tbi     TBI context
+ * @param[in]  cork    Cork or uncork
+ * 
+ * @return 0 on success, or a negative error value
+ */
+int tbi_client_channel_cork(tbi_ctx_t* tbi, bool cork)
 {
-    printf("DUMMY channel send DCB!\n");
+    int opt = cork ? 1 : 0;
+
+    if(!tbi || !tbi->channel || !tbi->channel->connected)
+        return -1;
+
+    if(setsockopt(tbi->channel->conn_fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt)) != 0) {
+        perror("Error setting TCP_CORK");
+        return -1;
+    }
     return 0;
 }
 
@@ -155,102 +552,108 @@ void tbi_client_channel_close(tbi_ctx_t* tbi)
 {
     if(tbi->channel) {
         /* Close connection */
-        if(tbi->channel->connected)
+        if(tbi->channel->conn_fd >= 0)
             close(tbi->channel->conn_fd);
 
         /* Free memory */
         if(tbi->channel->buf)
             free(tbi->channel->buf);
+        if(tbi->channel->tx_buf)
+            free(tbi->channel->tx_buf);
         free(tbi->channel);
         tbi->channel = NULL;
     }
 }
 
-/** @brief Open socket and wait for a client to connect (blocking)
+/** @brief Open a non-blocking listening socket and register it to epoll.
+ * Clients are accepted and their handshakes handled in @ref tbi_server_channel_recv()
  * 
- * @param[in]  tbi     TBI context
+ * @param[in]  tbi        TBI context
+ * @param[in]  reuseport  Share the listening port with other channels (SO_REUSEPORT),
+ *                        the kernel distributes incoming clients between them
  * 
  * @return 0 on success, or a negative error value
  */
-int tbi_server_channel_open(tbi_ctx_t* tbi)
+int tbi_server_channel_open(tbi_ctx_t* tbi, bool reuseport)
 {
     struct sockaddr_in address;
-    int ret, len;
+    struct epoll_event ev;
+    int ret, opt = 1;
 
     /* Allocate new channel context */
-	tbi->channel = (tbi_channel_t*)malloc(sizeof(tbi_channel_t));
+    tbi->channel = (tbi_channel_t*)malloc(sizeof(tbi_channel_t));
     if(!tbi->channel)
         goto exit;
+    memset(tbi->channel, 0, sizeof(tbi_channel_t));
 
     /* Allocate buffer for stored data */
-    tbi->channel->buf = (uint8_t*)malloc(TBI_CHANNEL_MTU * sizeof(uint8_t));
+    tbi->channel->buf = (uint8_t*)malloc(TBI_CHANNEL_RX_SIZE * sizeof(uint8_t));
     if(!tbi->channel->buf)
         goto exit_channel_allocated;
 
     /* Set metadata and create a listening socket */
     tbi->channel->server = true;
     tbi->channel->connected = false;
-    tbi->channel->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    tbi->channel->conn_fd = -1;
+    tbi->channel->epoll_fd = -1;
+    tbi->channel->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
     if(tbi->channel->listen_fd < 0)
         goto exit_buf_allocated;
 
-	memset(&address, '0', sizeof(address));
-	memset(tbi->channel->buf, 0, sizeof(TBI_CHANNEL_MTU * sizeof(uint8_t)));
+    memset(&address, 0, sizeof(address));
+    memset(tbi->channel->buf, 0, TBI_CHANNEL_RX_SIZE * sizeof(uint8_t));
 
-	address.sin_family = AF_INET;
-	address.sin_addr.s_addr = htonl(INADDR_ANY);
-	address.sin_port = htons(TBI_DEFAULT_PORT);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(TBI_DEFAULT_PORT);
+
+    if(reuseport && (ret = setsockopt(tbi->channel->listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) != 0) {
+        perror("Error setting SO_REUSEPORT");
+        goto exit_listen_socket_opened;
+    }
 
     if((ret = bind(tbi->channel->listen_fd, (struct sockaddr*)&address, sizeof(address))) != 0) {
         perror("Error binding server socket");
-        goto exit_buf_allocated;
+        goto exit_listen_socket_opened;
     }
 
-    if((ret = listen(tbi->channel->listen_fd, TBI_MAX_CLIENTS)) != 0) {
+    if((ret = listen(tbi->channel->listen_fd, TBI_LISTEN_BACKLOG)) != 0) {
         perror("Error in socket listen()");
-        goto exit_buf_allocated;
-    }
-
-    tbi->channel->conn_fd = accept(tbi->channel->listen_fd, (struct sockaddr*)NULL, NULL);
-    if(tbi->channel->conn_fd < 0) {
-        perror("Error in server accept");
         goto exit_listen_socket_opened;
     }
 
-    printf("Client connected!\n");
-    tbi->channel->connected = true;
-
-    /* Receive client handshake */
-    len = read(tbi->channel->conn_fd, tbi->channel->buf, TBI_CHANNEL_MTU);
-    if(len < 0) {
-        perror("Error reading from socket");
-        goto exit_client_connected;
+#ifdef TBI_WITH_IO_URING
+    /* Prefer io_uring when the kernel supports it, epoll otherwise */
+    if(tbi_uring_supported()) {
+        if(tbi_uring_open(tbi) == 0) {
+            tbi->channel->connected = true;
+            return 0;
+        }
+        TBI_LOG_WARN("io_uring setup failed, falling back to epoll\n");
     }
-    
-    /* Verify client handshake, and form server handshake */
-    len = tbi_protocol_server_handshake(
-        tbi->channel->buf, len,
-        tbi->msgspec_version,
-        msgspec_checksum(tbi),
-        &tbi->channel->start_ts
-    );
-    if(len <= 0) {
-        printf("Invalid client handshake!\n");
-        goto exit_client_connected;
+#endif
+
+    /* Register listening socket to epoll, NULL data marks the listener */
+    tbi->channel->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(tbi->channel->epoll_fd < 0) {
+        perror("Error creating epoll instance");
+        goto exit_listen_socket_opened;
     }
 
-   /* Send handshake */
-    if((ret = write(tbi->channel->conn_fd, tbi->channel->buf, len)) < len) {
-        if(ret < 0)
-            perror("Error writing to socket");
-        goto exit_client_connected;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if((ret = epoll_ctl(tbi->channel->epoll_fd, EPOLL_CTL_ADD, tbi->channel->listen_fd, &ev)) != 0) {
+        perror("Error registering listening socket to epoll");
+        goto exit_epoll_opened;
     }
 
+    tbi->channel->connected = true;
     return 0;
 
-exit_client_connected:
-    close(tbi->channel->conn_fd);
+exit_epoll_opened:
+    close(tbi->channel->epoll_fd);
 exit_listen_socket_opened:
     close(tbi->channel->listen_fd);
 exit_buf_allocated:
@@ -262,38 +665,597 @@ exit:
     return -1;
 }
 
-/** @brief Receive a message from client (blocking)
+/** @brief Watch an additional file descriptor (e.g. an eventfd) that wakes up
+ * @ref tbi_server_channel_recv() when it becomes readable. The descriptor is
+ * level-triggered and never read by the channel
  * 
  * @param[in]  tbi     TBI context
+ * @param[in]  fd      File descriptor to watch
  * 
- * @return Number of bytes received
+ * @return 0 on success, or a negative error value
  */
-int tbi_server_channel_recv(tbi_ctx_t* tbi)
+int tbi_server_channel_watch(tbi_ctx_t* tbi, int fd)
 {
-    int len;
+    struct epoll_event ev;
+
+    if(!tbi || !tbi->channel || !tbi->channel->server)
+        return -1;
+
+#ifdef TBI_WITH_IO_URING
+    if(tbi->channel->uring)
+        return tbi_uring_watch(tbi, fd);
+#endif
+
+    /* Channel pointer marks watched descriptors, as it can never be a connection */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = tbi->channel;
+    if(epoll_ctl(tbi->channel->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("Error registering watched descriptor to epoll");
+        return -1;
+    }
+    return 0;
+}
+
+/** @brief Create a context for an accepted client and link it to the connection list
+ * 
+ * @param[in]  channel  Server channel
+ * @param[in]  fd       Accepted non-blocking client socket, closed on failure
+ * 
+ * @return new connection, or NULL on failure
+ */
+tbi_conn_t *tbi_server_conn_add(tbi_channel_t* channel, int fd)
+{
+    tbi_conn_t *conn;
+
+    /* Refuse clients above the connection limit */
+    if(channel->conns_len >= TBI_MAX_CLIENTS) {
+        TBI_LOG_WARN("Connection limit reached, refusing client!\n");
+        close(fd);
+        return NULL;
+    }
+
+    conn = (tbi_conn_t*)malloc(sizeof(tbi_conn_t));
+    if(!conn) {
+        close(fd);
+        return NULL;
+    }
+    memset(conn, 0, sizeof(tbi_conn_t));
+    conn->id = __atomic_add_fetch(&tbi_conn_ids, 1, __ATOMIC_RELAXED);
+    conn->fd = fd;
+    conn->state = TBI_CONN_HANDSHAKE;
+
+    /* Insert to the front of the connection list */
+    conn->next = channel->conns;
+    if(channel->conns)
+        channel->conns->prev = conn;
+    channel->conns = conn;
+    channel->conns_len++;
+    TBI_STAT_INC(channel->stats.conns_accepted);
+
+    TBI_LOG_INFO("Client connected! (%d connections)\n", channel->conns_len);
+    return conn;
+}
+
+/** @brief Put a connection with data left to read at the end of the ready list */
+static void tbi_server_conn_ready_add(tbi_channel_t* channel, tbi_conn_t* conn)
+{
+    if(conn->ready)
+        return;
+    conn->ready = true;
+    conn->ready_next = NULL;
+    conn->ready_prev = channel->ready_tail;
+    if(channel->ready_tail)
+        channel->ready_tail->ready_next = conn;
+    else
+        channel->ready = conn;
+    channel->ready_tail = conn;
+    channel->ready_len++;
+}
+
+/** @brief Take a connection off the ready list */
+static void tbi_server_conn_ready_remove(tbi_channel_t* channel, tbi_conn_t* conn)
+{
+    if(!conn->ready)
+        return;
+    if(conn->ready_prev)
+        conn->ready_prev->ready_next = conn->ready_next;
+    else
+        channel->ready = conn->ready_next;
+    if(conn->ready_next)
+        conn->ready_next->ready_prev = conn->ready_prev;
+    else
+        channel->ready_tail = conn->ready_prev;
+    conn->ready = false;
+    channel->ready_len--;
+}
+
+/** @brief Close a client connection and unlink it from the connection list */
+void tbi_server_conn_close(tbi_channel_t* channel, tbi_conn_t* conn)
+{
+    /* Closing the socket also removes it from the epoll set */
+    close(conn->fd);
+    tbi_server_conn_ready_remove(channel, conn);
+
+    if(conn->prev)
+        conn->prev->next = conn->next;
+    else
+        channel->conns = conn->next;
+    if(conn->next)
+        conn->next->prev = conn->prev;
+
+    channel->conns_len--;
+    TBI_STAT_INC(channel->stats.conns_closed);
+    free(conn->rx_buf);
+    free(conn->scratch);
+    free(conn);
+}
+
+/** @brief Accept all pending client connections (edge-triggered listener)
+ * 
+ * @param[in]  channel  Server channel
+ */
+static void tbi_server_accept_all(tbi_channel_t* channel)
+{
+    struct epoll_event ev;
+    tbi_conn_t *conn;
+    int fd;
+
+    while(1) {
+        fd = accept4(channel->listen_fd, (struct sockaddr*)NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Error in server accept");
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+
+        conn = tbi_server_conn_add(channel, fd);
+        if(!conn)
+            continue;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if(epoll_ctl(channel->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            perror("Error registering client socket to epoll");
+            tbi_server_conn_close(channel, conn);
+            continue;
+        }
+    }
+}
+
+/** @brief Verify client handshake and respond with server handshake
+ * 
+ * @param[in]  tbi     TBI context
+ * @param[in]  conn    Client connection in handshake state
+ * @param[in]  buf     Client handshake, server handshake is written over it
+ * 
+ * @return 0 on success, or a negative error value if the client must be dropped
+ */
+static int tbi_server_conn_handshake(tbi_ctx_t* tbi, tbi_conn_t* conn, uint8_t* buf)
+{
+    tbi_schema_bind_t *bind;
+    uint16_t schema_csum;
+    uint8_t schema_version;
+    int len, ret;
 
-    /* Receive message from client */
-    printf("Server receiving...\n");
-    len = read(tbi->channel->conn_fd, tbi->channel->buf, TBI_CHANNEL_MTU);
-    if(len < 0) {
-        perror("Error reading from socket");
+    /* Verify client handshake, and form server handshake */
+    len = tbi_protocol_server_handshake(
+        buf, TBI_HANDSHAKE_LEN,
+        tbi->features,
+        &conn->start_ts,
+        &schema_version,
+        &schema_csum,
+        &conn->features,
+        &conn->device_id
+    );
+    if(len <= 0) {
+        TBI_LOG_WARN("Invalid client handshake!\n");
+        TBI_STAT_INC(tbi->channel->stats.handshake_rejects);
+        return -1;
+    }
+
+    /* Frames of the client are dispatched by its message spec */
+    if(!(bind = tbi_schema_bind(tbi, schema_version, schema_csum))) {
+        TBI_LOG_WARN("Unknown message spec version %u with checksum 0x%04X from client!\n", schema_version, schema_csum);
+        TBI_STAT_INC(tbi->channel->stats.handshake_rejects);
+        return -1;
     }
-    
-    /* Debug */
-    printf("Received %d bytes: ", len);
-    for(int i = 0; i < len; i++) { printf("0x%X ", tbi->channel->buf[i]);}
-    printf("\n");
+    conn->schema = bind->schema;
+    conn->types = bind->types;
 
-    return len;
+    /* Send handshake, it always fits into an empty socket send buffer */
+    if((ret = write(conn->fd, buf, len)) < len) {
+        if(ret < 0)
+            perror("Error writing to socket");
+        return -1;
+    }
+
+    conn->state = TBI_CONN_STREAMING;
+    return 0;
 }
 
-/** @brief Close connection, free up resources */
+/** @brief Acknowledge the frames received from a client, if agreed in the
+ * handshake. Acknowledges are cumulative, so one that does not fit into the
+ * socket is covered by the next
+ * 
+ * @param[in]  tbi     TBI context
+ * @param[in]  conn    Client connection
+ */
+static void tbi_server_conn_ack(tbi_ctx_t* tbi, tbi_conn_t* conn)
+{
+    uint64_t pos;
+    int ret;
+
+    if(!(conn->features & TBI_FEATURE_ACK))
+        return;
+
+    /* Finish a partially sent acknowledge first */
+    if(conn->ack_off == 0) {
+        if(conn->ack_pos == conn->rx_pos)
+            return;
+        tbi_protocol_ack(conn->ack, conn->rx_pos);
+    }
+    ret = send(conn->fd, conn->ack + conn->ack_off, TBI_ACK_LEN - conn->ack_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+    TBI_STAT_INC(tbi->channel->stats.syscalls);
+    if(ret <= 0)
+        return;
+    TBI_STAT_ADD(tbi->channel->stats.bytes_sent, ret);
+
+    conn->ack_off += ret;
+    if(conn->ack_off == TBI_ACK_LEN) {
+        tbi_protocol_parse_ack(conn->ack, TBI_ACK_LEN, &pos);
+        conn->ack_pos = pos;
+        conn->ack_off = 0;
+    }
+}
+
+/** @brief Extract every complete frame from received bytes, handing them to
+ * the frame handler
+ * 
+ * @param[in]  tbi      TBI context
+ * @param[in]  conn     Client connection
+ * @param[in]  buf      Received bytes, beginning at a frame boundary
+ * @param[in]  len      Number of received bytes
+ * @param[in]  handler  Handler for received frames
+ * @param[out] recvd    Incremented by the number of messages handled
+ * 
+ * @return Number of bytes consumed, or a negative error value if the stream is malformed
+ */
+static int tbi_server_conn_parse(tbi_ctx_t* tbi, tbi_conn_t* conn, uint8_t* buf, int len,
+    tbi_frame_handler handler, int* recvd)
+{
+    int off = 0;
+    int frame_len, data_len, ret;
+
+    while(off < len) {
+        if(conn->state == TBI_CONN_HANDSHAKE) {
+            if(len - off < TBI_HANDSHAKE_LEN)
+                break;
+            if(tbi_server_conn_handshake(tbi, conn, buf + off) != 0)
+                return -1;
+            off += TBI_HANDSHAKE_LEN;
+            continue;
+        }
+
+        frame_len = tbi_protocol_type_frame_len(conn->types[buf[off] & 0xF], buf + off, len - off);
+        if(frame_len < 0) {
+            TBI_LOG_WARN("Malformed frame from client!\n");
+            TBI_STAT_INC(conn->stats.decode_errors);
+            TBI_STAT_INC(tbi->channel->stats.frame_errors);
+            return -1;
+        }
+        if(frame_len == 0)
+            break;
+
+        TBI_STAT_INC(conn->stats.frames_recvd);
+        conn->rx_pos += frame_len;
+
+        /* Drop a corrupted frame, the frames after it are still delimited correctly */
+        data_len = tbi_protocol_frame_verify(buf + off, frame_len, conn->features);
+        if(data_len < 0) {
+            TBI_LOG_WARN("Frame checksum mismatch from client!\n");
+            TBI_STAT_INC(conn->stats.checksum_errors);
+            TBI_STAT_INC(conn->stats.decode_errors);
+            TBI_STAT_INC(tbi->channel->stats.checksum_errors);
+            off += frame_len;
+            continue;
+        }
+
+        ret = handler(tbi, conn, buf + off, data_len);
+        if(ret > 0)
+            *recvd += ret;
+        else if(ret < 0)
+            TBI_STAT_INC(conn->stats.decode_errors);
+        off += frame_len;
+    }
+
+    return off;
+}
+
+/** @brief Make sure the connection can carry over a number of bytes
+ * 
+ * @param[in]  conn     Client connection
+ * @param[in]  size     Required size of the connection buffer
+ * 
+ * @return 0 on success, or a negative error value
+ */
+static int tbi_server_conn_reserve(tbi_conn_t* conn, int size)
+{
+    uint8_t *buf;
+
+    if(size <= conn->rx_size)
+        return 0;
+    if(size > TBI_CHANNEL_MAX_FRAME)
+        return -1;
+
+    buf = (uint8_t*)realloc(conn->rx_buf, size);
+    if(!buf)
+        return -1;
+
+    conn->rx_buf = buf;
+    conn->rx_size = size;
+    return 0;
+}
+
+/** @brief Handle bytes received from a client into a buffer not owned by the 
+ * connection, handing each complete frame to the frame handler. Frames are 
+ * handled in place. A partial frame pending from earlier input is completed in
+ * the connection buffer first, taking only as many of the received bytes as it
+ * needs, and the partial frame at the end is carried over for the next input
+ * 
+ * @param[in]  tbi      TBI context
+ * @param[in]  conn     Client connection
+ * @param[in]  buf      Received bytes
+ * @param[in]  len      Number of received bytes
+ * @param[in]  handler  Handler for received frames
+ * @param[out] recvd    Incremented by the number of messages handled
+ * 
+ * @return 0 on success, or a negative error value if the connection must be closed
+ */
+int tbi_server_conn_input(tbi_ctx_t* tbi, tbi_conn_t* conn, uint8_t* buf, int len,
+    tbi_frame_handler handler, int* recvd)
+{
+    int pending, n, used;
+
+    TBI_STAT_ADD(conn->stats.bytes_recvd, len);
+    TBI_STAT_ADD(tbi->channel->stats.bytes_recvd, len);
+
+    /* Complete the pending frame first. Its length is known only once it is
+     * complete, so received bytes are moved over in growing steps */
+    while(conn->rx_len > 0 && len > 0) {
+        pending = conn->rx_len;
+        n = (pending > TBI_CHANNEL_RX_TOPUP) ? pending : TBI_CHANNEL_RX_TOPUP;
+        if(n > len)
+            n = len;
+        if(tbi_server_conn_reserve(conn, pending + n) != 0) {
+            TBI_LOG_WARN("Frame from client too large!\n");
+            return -1;
+        }
+        memcpy(conn->rx_buf + pending, buf, n);
+
+        used = tbi_server_conn_parse(tbi, conn, conn->rx_buf, pending + n, handler, recvd);
+        if(used < 0)
+            return -1;
+        if(used == 0) {
+            conn->rx_len = pending + n;
+            buf += n;
+            len -= n;
+            continue;
+        }
+
+        /* Handle the rest in place, the moved bytes after the frame are still there */
+        conn->rx_len = 0;
+        buf += used - pending;
+        len -= used - pending;
+    }
+
+    if(len > 0) {
+        used = tbi_server_conn_parse(tbi, conn, buf, len, handler, recvd);
+        if(used < 0)
+            return -1;
+
+        /* Carry over the partial frame */
+        conn->rx_len = len - used;
+        if(conn->rx_len > 0) {
+            if(tbi_server_conn_reserve(conn, conn->rx_len) != 0)
+                return -1;
+            memcpy(conn->rx_buf, buf + used, conn->rx_len);
+        }
+    }
+
+    /* Release memory taken by a large frame */
+    if(conn->rx_len == 0 && conn->rx_size > TBI_CHANNEL_RX_SIZE) {
+        free(conn->rx_buf);
+        conn->rx_buf = NULL;
+        conn->rx_size = 0;
+    }
+
+    tbi_server_conn_ack(tbi, conn);
+    return 0;
+}
+
+/** @brief Read what is available from a client (edge-triggered), up to 
+ * @ref TBI_CHANNEL_READ_BUDGET bytes, handing each complete frame to the frame
+ * handler. A client with data left after its budget must be read again without
+ * waiting for another edge, so that one fast client does not hold up the others.
+ * 
+ * Reads go to the channel buffer shared by all connections, and are handled
+ * by @ref tbi_server_conn_input() like the receive buffers of io_uring.
+ * 
+ * @param[in]  tbi      TBI context
+ * @param[in]  conn     Client connection
+ * @param[in]  handler  Handler for received frames
+ * 
+ * @param[out] closed  Set if the connection must be closed
+ * @param[out] more    Set if the budget ran out before the socket was drained
+ * 
+ * @return Number of messages handled
+ */
+static int tbi_server_conn_read(tbi_ctx_t* tbi, tbi_conn_t* conn, tbi_frame_handler handler, bool* closed, bool* more)
+{
+    uint8_t *buf = tbi->channel->buf;
+    int len, budget = TBI_CHANNEL_READ_BUDGET;
+    int recvd = 0;
+
+    *closed = true;
+    *more = false;
+
+    while(1) {
+        if(budget <= 0) {
+            *closed = false;
+            *more = true;
+            return recvd;
+        }
+
+        len = read(conn->fd, buf, TBI_CHANNEL_RX_SIZE);
+        TBI_STAT_INC(tbi->channel->stats.syscalls);
+        if(len < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* Socket drained, finish a partially sent acknowledge */
+                tbi_server_conn_ack(tbi, conn);
+                *closed = false;
+                return recvd;
+            }
+            perror("Error reading from socket");
+            return recvd;
+        }
+
+        /* Orderly shutdown by client, its last frames are acknowledged by now */
+        if(len == 0) {
+            tbi_server_conn_ack(tbi, conn);
+            return recvd;
+        }
+
+        TBI_LOG_HEXDUMP("Received", buf, len);
+        if(tbi_server_conn_input(tbi, conn, buf, len, handler, &recvd) != 0)
+            return recvd;
+        budget -= len;
+    }
+}
+
+/** @brief Read a client, closing it or keeping it on the ready list as needed
+ * 
+ * @param[in]  tbi      TBI context
+ * @param[in]  conn     Client connection
+ * @param[in]  events   epoll events of the connection, 0 if read from the ready list
+ * @param[in]  handler  Handler for received frames
+ * 
+ * @return Number of messages handled
+ */
+static int tbi_server_conn_service(tbi_ctx_t* tbi, tbi_conn_t* conn, uint32_t events, tbi_frame_handler handler)
+{
+    bool closed, more;
+    int recvd;
+
+    /* Drain the socket first, the client may have sent data before hanging up.
+     * A half-closed connection (EPOLLRDHUP) is read to its end, so that its last
+     * frames are handled and acknowledged before it is closed */
+    recvd = tbi_server_conn_read(tbi, conn, handler, &closed, &more);
+
+    if(closed || (events & (EPOLLERR | EPOLLHUP))) {
+        tbi_server_conn_close(tbi->channel, conn);
+        TBI_LOG_INFO("Client disconnected! (%d connections)\n", tbi->channel->conns_len);
+    } else if(more) {
+        tbi_server_conn_ready_add(tbi->channel, conn);
+    }
+    return recvd;
+}
+
+/** @brief Wait for client activity, accepting new clients and handing
+ * received messages to the frame handler
+ * 
+ * @param[in]  tbi          TBI context
+ * @param[in]  timeout_ms   Max time to wait, or -1 to block until activity
+ * @param[in]  handler      Handler for received frames
+ * 
+ * @return Number of messages handled, or a negative error value
+ */
+int tbi_server_channel_recv(tbi_ctx_t* tbi, int timeout_ms, tbi_frame_handler handler)
+{
+    struct epoll_event events[TBI_MAX_EVENTS];
+    tbi_channel_t *channel = tbi->channel;
+    tbi_conn_t *conn;
+    int nevents, i, n;
+    int recvd = 0;
+
+#ifdef TBI_WITH_IO_URING
+    if(tbi->channel->uring)
+        return tbi_uring_recv(tbi, timeout_ms, handler);
+#endif
+
+    /* Clients with data left from the last pass are read without waiting */
+    n = channel->ready_len;
+    if(n > 0)
+        timeout_ms = 0;
+
+    nevents = epoll_wait(channel->epoll_fd, events, TBI_MAX_EVENTS, timeout_ms);
+    if(nevents < 0) {
+        /* Interrupted by a signal, let the caller decide whether to continue */
+        if(errno == EINTR)
+            return 0;
+        perror("Error in epoll_wait");
+        return -1;
+    }
+
+    for(i = 0; i < nevents; i++) {
+        conn = (tbi_conn_t*)events[i].data.ptr;
+
+        /* Listening socket */
+        if(!conn) {
+            tbi_server_accept_all(tbi->channel);
+            continue;
+        }
+
+        /* Watched descriptor, only wakes up the caller */
+        if((void*)conn == (void*)channel)
+            continue;
+
+        /* A client on the ready list is read in its turn, below */
+        if(conn->ready) {
+            if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+                n--;
+                tbi_server_conn_close(channel, conn);
+                TBI_LOG_INFO("Client disconnected! (%d connections)\n", channel->conns_len);
+            }
+            continue;
+        }
+        recvd += tbi_server_conn_service(tbi, conn, events[i].events, handler);
+    }
+
+    /* Clients left with data by an earlier pass, each once. Those still not
+     * drained go to the back of the list, behind the ones added above */
+    for(; n > 0 && channel->ready; n--) {
+        conn = channel->ready;
+        tbi_server_conn_ready_remove(channel, conn);
+        recvd += tbi_server_conn_service(tbi, conn, 0, handler);
+    }
+
+    return recvd;
+}
+
+/** @brief Close connections, free up resources */
 void tbi_server_channel_close(tbi_ctx_t* tbi)
 {
     if(tbi->channel) {
-        /* Close connection */
+#ifdef TBI_WITH_IO_URING
+        /* Cancel outstanding requests before closing their sockets */
+        if(tbi->channel->uring)
+            tbi_uring_close(tbi);
+#endif
+
+        /* Close client connections */
+        while(tbi->channel->conns)
+            tbi_server_conn_close(tbi->channel, tbi->channel->conns);
+
+        /* Close listener */
         if(tbi->channel->connected) {
-            close(tbi->channel->conn_fd);
+            if(tbi->channel->epoll_fd >= 0)
+                close(tbi->channel->epoll_fd);
             close(tbi->channel->listen_fd);
         }
 
@@ -303,4 +1265,4 @@ void tbi_server_channel_close(tbi_ctx_t* tbi)
         free(tbi->channel);
         tbi->channel = NULL;
     }
-}
\ No newline at end of file
+}
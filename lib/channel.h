@@ -7,16 +7,32 @@
 #define __TBI_CHANNEL_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 #include "tbi_types.h"
 
+/** @brief Handler for a single frame received from a streaming client connection
+ *
+ * @return 1 if a message was accepted, 0 if ignored, or a negative error value
+ */
+typedef int (*tbi_frame_handler)(tbi_ctx_t* tbi, tbi_conn_t* conn, uint8_t* buf, int len);
 
 int tbi_client_channel_open(tbi_ctx_t* tbi);
-int tbi_client_channel_send_rtm(tbi_ctx_t* tbi, uint8_t flags, uint8_t msgtype, uint8_t* buf, int buf_len);
-int tbi_client_channel_send_dcb(tbi_ctx_t* tbi);
+int tbi_client_channel_poll(tbi_ctx_t* tbi);
+int tbi_client_channel_wait(tbi_ctx_t* tbi, int timeout_ms);
+void tbi_client_channel_disconnect(tbi_ctx_t* tbi);
+int tbi_client_channel_send_iov(tbi_ctx_t* tbi, struct iovec* iov, int iovcnt, bool more, int* syscalls);
+int tbi_client_channel_cork(tbi_ctx_t* tbi, bool cork);
 void tbi_client_channel_close(tbi_ctx_t* tbi);
 
-int tbi_server_channel_open(tbi_ctx_t* tbi);
-int tbi_server_channel_recv(tbi_ctx_t* tbi);
+int tbi_server_channel_open(tbi_ctx_t* tbi, bool reuseport);
+int tbi_server_channel_watch(tbi_ctx_t* tbi, int fd);
+int tbi_server_channel_recv(tbi_ctx_t* tbi, int timeout_ms, tbi_frame_handler handler);
 void tbi_server_channel_close(tbi_ctx_t* tbi);
 
-#endif /* __TBI_SERIALIZER_H */
\ No newline at end of file
+tbi_conn_t *tbi_server_conn_add(tbi_channel_t* channel, int fd);
+int tbi_server_conn_input(tbi_ctx_t* tbi, tbi_conn_t* conn, uint8_t* buf, int len,
+    tbi_frame_handler handler, int* recvd);
+void tbi_server_conn_close(tbi_channel_t* channel, tbi_conn_t* conn);
+
+#endif /* __TBI_CHANNEL_H */
\ No newline at end of file
@@ -0,0 +1,179 @@
+/**
+* @file     crc32c.c
+* @brief    CRC32C (Castagnoli, reflected polynomial 0x82F63B78) implementation,
+*           as used for frame checksums. Computed with the CRC32 instructions of
+*           SSE4.2 or ARMv8 when the CPU has them, chosen at runtime, and with
+*           slicing-by-8 tables otherwise
+*/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#define TBI_CRC32C_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#define TBI_CRC32C_ARM
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define POLYNOMIAL_CRC32C 0x82F63B78
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *buf, size_t len);
+
+/** @brief Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zero bytes */
+static uint32_t crc32c_table[8][256];
+
+/** @brief Load 8 bytes as a little-endian value */
+static inline uint64_t crc32c_load_le64(const uint8_t *ptr)
+{
+    uint64_t value;
+
+    memcpy(&value, ptr, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+/** @brief Software CRC32C of a buffer, 8 bytes per step with slicing-by-8 */
+static uint32_t crc32c_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t word;
+
+    for(; len >= 8; len -= 8, buf += 8) {
+        word = crc32c_load_le64(buf) ^ crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+    }
+    while(len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+    return crc;
+}
+
+#ifdef TBI_CRC32C_X86
+/** @brief CRC32C of a buffer with the SSE4.2 crc32 instruction */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t crc64 = crc;
+    uint64_t word;
+
+    for(; len >= 8; len -= 8, buf += 8) {
+        memcpy(&word, buf, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    while(len--)
+        crc = _mm_crc32_u8(crc, *buf++);
+    return crc;
+}
+#endif
+
+#ifdef TBI_CRC32C_ARM
+/** @brief CRC32C of a buffer with the ARMv8 CRC32 instructions */
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t word;
+
+    for(; len >= 8; len -= 8, buf += 8) {
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    while(len--)
+        crc = __crc32cb(crc, *buf++);
+    return crc;
+}
+#endif
+
+/** @brief Implementation in use */
+static crc32c_fn crc32c_impl;
+static const char *crc32c_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/** @brief Build the software tables, and choose the fastest implementation */
+static void crc32c_init(void)
+{
+    crc32c_fn impl = crc32c_slice8;
+    const char *name = "slice8";
+    uint32_t crc;
+    int i, j, k;
+
+    for(i = 0; i < 256; i++) {
+        crc = i;
+        for(j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (POLYNOMIAL_CRC32C & -(crc & 1));
+        crc32c_table[0][i] = crc;
+    }
+    for(i = 0; i < 256; i++) {
+        crc = crc32c_table[0][i];
+        for(k = 1; k < 8; k++) {
+            crc = (crc >> 8) ^ crc32c_table[0][crc & 0xff];
+            crc32c_table[k][i] = crc;
+        }
+    }
+
+#ifdef TBI_CRC32C_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) {
+        impl = crc32c_sse42;
+        name = "sse4.2";
+    }
+#endif
+#ifdef TBI_CRC32C_ARM
+    if(getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        impl = crc32c_armv8;
+        name = "armv8";
+    }
+#endif
+    crc32c_name = name;
+    __atomic_store_n(&crc32c_impl, impl, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Compute the CRC32C of a buffer, continuing from the CRC of the preceding bytes
+ *
+ * @param[in] crc       CRC32C of the preceding bytes, or 0 to start a new computation
+ * @param[in] buf       Bytes to add
+ * @param[in] len       Number of bytes
+ *
+ * @return CRC32C of the preceding bytes and buf
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~__atomic_load_n(&crc32c_impl, __ATOMIC_ACQUIRE)(~crc, (const uint8_t*)buf, len);
+}
+
+/**
+ * @brief Compute the CRC32C of a buffer in software, see @ref crc32c()
+ *
+ * @param[in] crc       CRC32C of the preceding bytes, or 0 to start a new computation
+ * @param[in] buf       Bytes to add
+ * @param[in] len       Number of bytes
+ *
+ * @return CRC32C of the preceding bytes and buf
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_slice8(~crc, (const uint8_t*)buf, len);
+}
+
+/** @brief Get the name of the implementation @ref crc32c() uses */
+const char *crc32c_impl_name(void)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_name;
+}
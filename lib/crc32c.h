@@ -0,0 +1,16 @@
+/**
+* @file     crc32c.h
+* @brief    Header file for CRC32C (Castagnoli) implementation
+*/
+
+#ifndef __TBI_CRC32C_H
+#define __TBI_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_impl_name(void);
+
+#endif /* __TBI_CRC32C_H */
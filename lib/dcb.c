@@ -0,0 +1,658 @@
+/**
+* @file     dcb.c
+* @brief    DCB (Delta-Compressed Bundle) frame encoder and decoder. Every struct
+*           member is sent as the zigzag-encoded difference to its previous value,
+*           in as many bits as the largest difference in its bundle needs. The run
+*           of samples is split into bundles with a least-cost search over all
+*           split points, so that a new format spec is only sent when the bits
+*           it saves pay for its header. The decoder unpacks a bundle into a 
+*           column per member, and rebuilds the values with a prefix sum over 
+*           each column, with the vectorized kernels of @ref bitpack.c
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "tbi_types.h"
+#include "dcb.h"
+#include "bitpack.h"
+#include "protocol.h"
+#include "serializer.h"
+#include "utils.h"
+
+/** @brief MSB-first bit writer */
+typedef struct {
+    uint8_t *buf;
+    int off;
+    uint64_t acc;
+    int bits;
+} tbi_bit_writer_t;
+
+/** @brief Append the lowest width bits of value, up to 32 bits */
+static inline void tbi_bits_put(tbi_bit_writer_t *w, uint32_t value, int width)
+{
+    if(width == 0)
+        return;
+    w->acc = (w->acc << width) | value;
+    w->bits += width;
+    while(w->bits >= 8) {
+        w->bits -= 8;
+        w->buf[w->off++] = (uint8_t)(w->acc >> w->bits);
+    }
+}
+
+/** @brief Stuff the last partial byte with zero bits */
+static inline void tbi_bits_align(tbi_bit_writer_t *w)
+{
+    if(w->bits > 0)
+        tbi_bits_put(w, 0, 8 - w->bits);
+}
+
+/** @brief Read a struct member of a native message
+ *
+ * @param[in]  field_type   Field type of the member
+ * @param[in]  ptr          Member in the native message
+ * @param[out] raw          Member as sent in an RTM frame
+ *
+ * @return value the deltas are taken of: signed members sign-extended, and
+ *          @ref timediff_ms as total milliseconds
+ */
+static uint32_t tbi_dcb_field_value(tbi_msg_field_types_t field_type, const uint8_t *ptr, uint32_t *raw)
+{
+    timediff_ms tms;
+
+    switch(field_type) {
+        case TBI_TIMEDIFF_MS:
+            memcpy(&tms, ptr, sizeof(tms));
+            *raw = *(const uint32_t*)ptr;
+            return (uint32_t)tms.seconds * 1000 + tms.ms;
+        case TBI_TIMEDIFF_S:
+        case TBI_UINT32:
+        case TBI_INT32:
+            *raw = *(const uint32_t*)ptr;
+            return *raw;
+        case TBI_UINT16:
+            *raw = *(const uint16_t*)ptr;
+            return *raw;
+        case TBI_INT16:
+            *raw = *(const uint16_t*)ptr;
+            return (uint32_t)(int32_t)*(const int16_t*)ptr;
+        case TBI_UINT8:
+            *raw = *ptr;
+            return *raw;
+        case TBI_INT8:
+            *raw = *ptr;
+            return (uint32_t)(int32_t)*(const int8_t*)ptr;
+        default:
+            *raw = 0;
+            return 0;
+    }
+}
+
+/** @brief Create a DCB encoder
+ *
+ * @param[in] max_fields    Max number of struct members of any message type
+ *
+ * @return encoder, or NULL on failure
+ */
+tbi_dcb_enc_t *tbi_dcb_enc_create(int max_fields)
+{
+    tbi_dcb_enc_t *enc;
+
+    if(max_fields < 1)
+        max_fields = 1;
+
+    enc = calloc(1, sizeof(tbi_dcb_enc_t));
+    if(!enc)
+        return NULL;
+
+    enc->max_fields = max_fields;
+    enc->first = malloc(max_fields * sizeof(uint32_t));
+    enc->values = malloc((size_t)max_fields * TBI_DCB_MAX_SAMPLES * sizeof(uint32_t));
+    enc->deltas = malloc((size_t)max_fields * TBI_DCB_MAX_SAMPLES * sizeof(uint32_t));
+    enc->widths = malloc((size_t)max_fields * TBI_DCB_MAX_SAMPLES);
+    enc->cost = malloc(TBI_DCB_MAX_SAMPLES * sizeof(uint32_t));
+    enc->from = malloc(TBI_DCB_MAX_SAMPLES * sizeof(uint16_t));
+    if(!enc->first || !enc->values || !enc->deltas || !enc->widths || !enc->cost || !enc->from) {
+        tbi_dcb_enc_free(enc);
+        return NULL;
+    }
+    return enc;
+}
+
+/** @brief Free a DCB encoder
+ *
+ * @param[in] enc   Encoder to free
+ */
+void tbi_dcb_enc_free(tbi_dcb_enc_t *enc)
+{
+    if(!enc)
+        return;
+    free(enc->first);
+    free(enc->values);
+    free(enc->deltas);
+    free(enc->widths);
+    free(enc->cost);
+    free(enc->from);
+    free(enc);
+}
+
+/** @brief Get the max length of a DCB frame, with every delta taking the full 32 bits
+ *
+ * @param[in] ctx       Context of the message type
+ * @param[in] samples   Number of samples in the frame, including the initial value
+ *
+ * @return length in bytes
+ */
+int tbi_dcb_frame_max_len(const tbi_msg_ctx_t *ctx, int samples)
+{
+    int deltas = (samples > 1) ? samples - 1 : 0;
+    int bundles = (deltas + TBI_DCB_MAX_BUNDLE - 1) / TBI_DCB_MAX_BUNDLE;
+
+    return msg_wire_len(ctx->format, ctx->format_len)
+        + bundles * (2 + tbi_dcb_spec_len(ctx->format_len))
+        + deltas * ctx->format_len * (int)sizeof(uint32_t) + 1;
+}
+
+/** @brief Add a sample to the frame being encoded. The first sample is the initial
+ * value of the frame, and the following ones are sent as deltas to the previous
+ *
+ * @param[in] enc   Encoder
+ * @param[in] ctx   Context of the message type, the same for every sample of the frame
+ * @param[in] msg   Native message
+ *
+ * @return number of samples in the frame, or a negative error value if it is full
+ */
+int tbi_dcb_enc_add(tbi_dcb_enc_t *enc, const tbi_msg_ctx_t *ctx, const void *msg)
+{
+    const uint8_t *ptr = (const uint8_t*)msg;
+    uint32_t raw;
+    int i, off = 0;
+
+    if(ctx->format_len < 1 || ctx->format_len > enc->max_fields || enc->len >= TBI_DCB_MAX_SAMPLES)
+        return -1;
+
+    if(enc->len == 0)
+        enc->fields = ctx->format_len;
+
+    for(i = 0; i < ctx->format_len; i++) {
+        off = msg_field_native_offset(ctx->format[i], off);
+        enc->values[i * TBI_DCB_MAX_SAMPLES + enc->len] = tbi_dcb_field_value(ctx->format[i], ptr + off, &raw);
+        if(enc->len == 0)
+            enc->first[i] = raw;
+        off += msg_field_type_len(ctx->format[i]);
+    }
+    return ++enc->len;
+}
+
+/** @brief Find the least-cost split of the deltas into bundles. A bundle costs its
+ * header, and its count times the sum of the widest delta of each member, rounded
+ * up to whole bytes. Cost of the first i deltas is the least over the start j of
+ * the last bundle of cost(j) + bundle(j..i). As cost(j) never decreases with j,
+ * while the bundle grows as j decreases, the search for j stops once the bundle
+ * alone costs more than the best split found
+ *
+ * @param[in] enc       Encoder with the deltas
+ * @param[in] deltas    Number of deltas
+ * @param[in] hdr_len   Length of a bundle header, including the format spec
+ */
+static void tbi_dcb_split(tbi_dcb_enc_t *enc, int deltas, int hdr_len)
+{
+    uint8_t maxw[enc->fields];
+    const uint8_t *widths;
+    uint32_t best, bundle, bits;
+    int i, j, f, low;
+
+    enc->cost[0] = 0;
+    for(i = 1; i <= deltas; i++) {
+        memset(maxw, 0, enc->fields);
+        bits = 0;
+        best = UINT32_MAX;
+        low = (i > TBI_DCB_MAX_BUNDLE) ? i - TBI_DCB_MAX_BUNDLE : 0;
+
+        for(j = i - 1; j >= low; j--) {
+            widths = enc->widths + j * enc->fields;
+            for(f = 0; f < enc->fields; f++) {
+                if(widths[f] > maxw[f]) {
+                    bits += widths[f] - maxw[f];
+                    maxw[f] = widths[f];
+                }
+            }
+
+            bundle = hdr_len + ((i - j) * bits + 7) / 8;
+            if(bundle >= best)
+                break;
+            if(enc->cost[j] + bundle < best) {
+                best = enc->cost[j] + bundle;
+                enc->from[i] = j;
+            }
+        }
+        enc->cost[i] = best;
+    }
+}
+
+/** @brief Encode the collected samples into a DCB frame, and reset the encoder
+ * for the next frame
+ *
+ * @param[in]  enc       Encoder
+ * @param[in]  ctx       Context of the message type
+ * @param[out] out       Output buffer
+ * @param[in]  out_size  Output buffer size, at least @ref tbi_dcb_frame_max_len()
+ *
+ * @return length of the frame in bytes, or a negative error value
+ */
+int tbi_dcb_enc_finish(tbi_dcb_enc_t *enc, const tbi_msg_ctx_t *ctx, uint8_t *out, int out_size)
+{
+    tbi_bit_writer_t w = {out, 0, 0, 0};
+    uint8_t maxw[enc->max_fields];
+    const uint32_t *values;
+    const uint8_t *widths;
+    uint32_t *deltas;
+    int spec_len, deltas_len, start, end, count, i, f;
+
+    if(enc->len < 1 || ctx->format_len != enc->fields ||
+        tbi_dcb_frame_max_len(ctx, enc->len) > out_size)
+        return -1;
+
+    /* Initial value as an RTM frame */
+    tbi_bits_put(&w, (TBI_FLAGS_DCB << 4) | ctx->msgtype, 8);
+    for(f = 0; f < ctx->format_len; f++) {
+        tbi_bits_put(&w, enc->first[f], msg_field_type_len(ctx->format[f]) * 8);
+    }
+
+    /* Zigzag-encoded deltas of each member, and their widths by sample */
+    deltas_len = enc->len - 1;
+    for(f = 0; f < enc->fields; f++) {
+        values = enc->values + f * TBI_DCB_MAX_SAMPLES;
+        deltas = enc->deltas + f * TBI_DCB_MAX_SAMPLES;
+        tbi_zigzag_delta_encode(values + 1, deltas_len, values[0], deltas);
+        for(i = 0; i < deltas_len; i++) {
+            enc->widths[i * enc->fields + f] = tbi_bit_width(deltas[i]);
+        }
+    }
+
+    spec_len = tbi_dcb_spec_len(ctx->format_len);
+    tbi_dcb_split(enc, deltas_len, 2 + spec_len);
+
+    /* Walk the split back from the end, leaving the bundle starts at the end of
+        cost[], which is no longer needed */
+    i = deltas_len;
+    start = TBI_DCB_MAX_SAMPLES;
+    while(i > 0) {
+        enc->cost[--start] = enc->from[i];
+        i = enc->from[i];
+    }
+
+    for(; start < TBI_DCB_MAX_SAMPLES; start++) {
+        end = (start + 1 < TBI_DCB_MAX_SAMPLES) ? (int)enc->cost[start + 1] : deltas_len;
+        count = end - enc->cost[start];
+
+        /* Format spec: widest delta of each member */
+        memset(maxw, 0, enc->fields);
+        for(i = enc->cost[start]; i < end; i++) {
+            widths = enc->widths + i * enc->fields;
+            for(f = 0; f < enc->fields; f++) {
+                if(widths[f] > maxw[f])
+                    maxw[f] = widths[f];
+            }
+        }
+
+        tbi_bits_put(&w, count, 8);
+        tbi_bits_put(&w, spec_len, 8);
+        for(f = 0; f < enc->fields; f++) {
+            tbi_bits_put(&w, maxw[f], TBI_DCB_WIDTH_BITS);
+        }
+        tbi_bits_align(&w);
+
+        /* Data, members of each sample in turn */
+        for(i = enc->cost[start]; i < end; i++) {
+            for(f = 0; f < enc->fields; f++) {
+                tbi_bits_put(&w, enc->deltas[f * TBI_DCB_MAX_SAMPLES + i], maxw[f]);
+            }
+        }
+        tbi_bits_align(&w);
+    }
+
+    /* Empty bundle terminates the frame */
+    tbi_bits_put(&w, 0, 8);
+
+    enc->len = 0;
+    return w.off;
+}
+
+/** @brief Create a DCB decoder
+ *
+ * @param[in] max_fields    Max number of struct members of any message type
+ *
+ * @return decoder, or NULL on failure
+ */
+tbi_dcb_dec_t *tbi_dcb_dec_create(int max_fields)
+{
+    tbi_dcb_dec_t *dec;
+
+    if(max_fields < 1)
+        max_fields = 1;
+
+    dec = calloc(1, sizeof(tbi_dcb_dec_t));
+    if(!dec)
+        return NULL;
+
+    dec->max_fields = max_fields;
+    dec->prev = malloc(max_fields * sizeof(uint32_t));
+    dec->cols = malloc((size_t)max_fields * TBI_DCB_COLUMN_LEN * sizeof(uint32_t));
+    if(!dec->prev || !dec->cols) {
+        tbi_dcb_dec_free(dec);
+        return NULL;
+    }
+    return dec;
+}
+
+/** @brief Free a DCB decoder
+ *
+ * @param[in] dec   Decoder to free
+ */
+void tbi_dcb_dec_free(tbi_dcb_dec_t *dec)
+{
+    if(!dec)
+        return;
+    free(dec->prev);
+    free(dec->cols);
+    free(dec);
+}
+
+/** @brief Write a value to a struct member of a native message, the inverse
+ * of @ref tbi_dcb_field_value()
+ *
+ * @param[in]  field_type   Field type of the member
+ * @param[out] ptr          Member in the native message
+ * @param[in]  value        Value, truncated to the member size
+ */
+static void tbi_dcb_field_store(tbi_msg_field_types_t field_type, uint8_t *ptr, uint32_t value)
+{
+    timediff_ms tms;
+
+    switch(field_type) {
+        case TBI_TIMEDIFF_MS:
+            tms.seconds = value / 1000;
+            tms.ms = value % 1000;
+            memcpy(ptr, &tms, sizeof(tms));
+            break;
+        case TBI_TIMEDIFF_S:
+        case TBI_UINT32:
+        case TBI_INT32:
+            *(uint32_t*)ptr = value;
+            break;
+        case TBI_UINT16:
+        case TBI_INT16:
+            *(uint16_t*)ptr = (uint16_t)value;
+            break;
+        case TBI_UINT8:
+        case TBI_INT8:
+            *ptr = (uint8_t)value;
+            break;
+        default:
+            break;
+    }
+}
+
+/** @brief Write values to rows of a column, the column counterpart of
+ * @ref tbi_dcb_field_store(). Timestamps are rebuilt into milliseconds since 
+ * the epoch
+ *
+ * @param[in]  field_type   Field type of the member
+ * @param[out] col          Column of the member, see @ref tbi_columns_t
+ * @param[in]  row          First row to write
+ * @param[in]  values       Values, as from @ref tbi_dcb_field_value()
+ * @param[in]  count        Number of values
+ * @param[in]  start_ts     Client start timestamp in ms, timestamps are relative to this
+ */
+static void tbi_dcb_column_store(tbi_msg_field_types_t field_type, void *col, int row, const uint32_t *values, 
+    int count, uint64_t start_ts)
+{
+    uint64_t *ts = (uint64_t*)col + row;
+    uint16_t *u16 = (uint16_t*)col + row;
+    uint8_t *u8 = (uint8_t*)col + row;
+    int i;
+
+    switch(field_type) {
+        case TBI_TIMEDIFF_MS:
+            for(i = 0; i < count; i++)
+                ts[i] = start_ts + values[i];
+            break;
+        case TBI_TIMEDIFF_S:
+            for(i = 0; i < count; i++)
+                ts[i] = start_ts + (uint64_t)values[i] * 1000;
+            break;
+        case TBI_UINT32:
+        case TBI_INT32:
+            memcpy((uint32_t*)col + row, values, count * sizeof(uint32_t));
+            break;
+        case TBI_UINT16:
+        case TBI_INT16:
+            for(i = 0; i < count; i++)
+                u16[i] = (uint16_t)values[i];
+            break;
+        case TBI_UINT8:
+        case TBI_INT8:
+            for(i = 0; i < count; i++)
+                u8[i] = (uint8_t)values[i];
+            break;
+        default:
+            break;
+    }
+}
+
+/** @brief Decode the initial value of a DCB frame, the previous value of every member
+ *
+ * @param[in]  dec       Decoder
+ * @param[in]  ctx       Context of the message type
+ * @param[in]  buf       DCB frame
+ * @param[in]  len       DCB frame length
+ * @param[out] msg       Native message the initial value is decoded into
+ * @param[in]  msg_size  Native message size
+ * @param[out] offsets   Offset of every member in the native message
+ *
+ * @return length of the initial value, or a negative error value if the frame is malformed
+ */
+static int tbi_dcb_decode_first(tbi_dcb_dec_t *dec, const tbi_msg_ctx_t *ctx, const uint8_t *buf, int len,
+    void *msg, int msg_size, int *offsets)
+{
+    uint8_t *native = (uint8_t*)msg;
+    uint32_t raw;
+    int rtm_len, off, f;
+
+    if(ctx->format_len < 1 || ctx->format_len > dec->max_fields)
+        return -1;
+
+    rtm_len = msg_wire_len(ctx->format, ctx->format_len);
+    if(len < rtm_len || tbi_deserialize_rtm_into(ctx->format, ctx->format_len, buf, rtm_len, msg, msg_size) < 0)
+        return -1;
+
+    off = 0;
+    for(f = 0; f < ctx->format_len; f++) {
+        off = msg_field_native_offset(ctx->format[f], off);
+        offsets[f] = off;
+        dec->prev[f] = tbi_dcb_field_value(ctx->format[f], native + off, &raw);
+        off += msg_field_type_len(ctx->format[f]);
+    }
+    return rtm_len;
+}
+
+/** @brief Decode the next bundle of a DCB frame into the decoder columns, and
+ * advance the previous values to its last sample
+ *
+ * @param[in]     dec   Decoder
+ * @param[in]     ctx   Context of the message type
+ * @param[in]     buf   DCB frame
+ * @param[in]     len   DCB frame length
+ * @param[in,out] off   Offset of the bundle, advanced past it
+ *
+ * @return number of samples in the bundle, 0 at the end of the frame, or a 
+ *          negative error value if the frame is malformed
+ */
+static int tbi_dcb_decode_bundle(tbi_dcb_dec_t *dec, const tbi_msg_ctx_t *ctx, const uint8_t *buf, int len, int *off)
+{
+    int widths[dec->max_fields];
+    uint32_t stride, bit, *col;
+    int spec_len, data_len, count, pos = *off, f, i;
+
+    if(pos >= len)
+        return -1;
+    if((count = buf[pos]) == 0)
+        return 0;
+
+    spec_len = tbi_dcb_spec_len(ctx->format_len);
+    if(pos + 2 + spec_len > len || buf[pos + 1] != spec_len)
+        return -1;
+
+    stride = 0;
+    for(f = 0; f < ctx->format_len; f++) {
+        widths[f] = tbi_dcb_spec_width(&buf[pos + 2], spec_len, f);
+        if(widths[f] > 32)
+            return -1;
+        stride += widths[f];
+    }
+    pos += 2 + spec_len;
+    data_len = (count * stride + 7) / 8;
+    if(pos + data_len > len)
+        return -1;
+
+    /* Unpack each member into its column, and sum up the deltas */
+    bit = 0;
+    for(f = 0; f < ctx->format_len; f++) {
+        col = dec->cols + f * TBI_DCB_COLUMN_LEN;
+        if(widths[f] == 0) {
+            for(i = 0; i < count; i++)
+                col[i] = dec->prev[f];
+            continue;
+        }
+        tbi_bitpack_unpack(buf + pos, data_len, bit, stride, widths[f], count, col);
+        bit += widths[f];
+    }
+    for(f = 0; f < ctx->format_len; f++) {
+        col = dec->cols + f * TBI_DCB_COLUMN_LEN;
+        if(widths[f] > 0)
+            dec->prev[f] = tbi_zigzag_delta_decode(col, count, dec->prev[f]);
+    }
+
+    *off = pos + data_len;
+    return count;
+}
+
+/** @brief Count the samples of a DCB frame without decoding them
+ *
+ * @param[in]  ctx       Context of the message type
+ * @param[in]  buf       DCB frame, as delimited by @ref tbi_protocol_frame_len()
+ * @param[in]  len       DCB frame length
+ *
+ * @return number of samples including the initial value, or a negative error 
+ *          value if the frame is malformed
+ */
+int tbi_dcb_frame_samples(const tbi_msg_ctx_t *ctx, const uint8_t *buf, int len)
+{
+    uint32_t stride;
+    int spec_len, count, off, f, samples = 1;
+
+    if(ctx->format_len < 1)
+        return -1;
+
+    spec_len = tbi_dcb_spec_len(ctx->format_len);
+    off = msg_wire_len(ctx->format, ctx->format_len);
+    while(off < len && (count = buf[off]) != 0) {
+        if(off + 2 + spec_len > len || buf[off + 1] != spec_len)
+            return -1;
+        stride = 0;
+        for(f = 0; f < ctx->format_len; f++)
+            stride += tbi_dcb_spec_width(&buf[off + 2], spec_len, f);
+        off += 2 + spec_len + (count * stride + 7) / 8;
+        samples += count;
+    }
+
+    if(off >= len)
+        return -1;
+    return samples;
+}
+
+/** @brief Decode a DCB frame, and emit every sample in it as a native message,
+ * starting with the initial value
+ *
+ * @param[in]  dec       Decoder
+ * @param[in]  ctx       Context of the message type
+ * @param[in]  buf       DCB frame, as delimited by @ref tbi_protocol_frame_len()
+ * @param[in]  len       DCB frame length
+ * @param[out] msg       Native message the samples are reconstructed into
+ * @param[in]  msg_size  Native message size
+ * @param[in]  emit      Called for every sample, decoding stops if it returns non-zero
+ * @param[in]  userdata  Passed to emit
+ *
+ * @return number of samples emitted, or a negative error value if the frame is malformed
+ */
+int tbi_dcb_decode(tbi_dcb_dec_t *dec, const tbi_msg_ctx_t *ctx, const uint8_t *buf, int len,
+    void *msg, int msg_size, tbi_dcb_emit emit, void *userdata)
+{
+    uint8_t *native = (uint8_t*)msg;
+    int offsets[dec->max_fields];
+    int count, samples, off, f, i;
+
+    /* Initial value, which also gives the member offsets */
+    if((off = tbi_dcb_decode_first(dec, ctx, buf, len, msg, msg_size, offsets)) < 0)
+        return -1;
+    if(emit(userdata, msg) != 0)
+        return 1;
+    samples = 1;
+
+    while((count = tbi_dcb_decode_bundle(dec, ctx, buf, len, &off)) > 0) {
+        /* Samples back to native messages */
+        for(i = 0; i < count; i++) {
+            for(f = 0; f < ctx->format_len; f++) {
+                tbi_dcb_field_store(ctx->format[f], native + offsets[f], dec->cols[f * TBI_DCB_COLUMN_LEN + i]);
+            }
+            samples++;
+            if(emit(userdata, msg) != 0)
+                return samples;
+        }
+    }
+
+    if(count < 0)
+        return -1;
+    return samples;
+}
+
+/** @brief Decode a DCB frame into a column per struct member, without 
+ * reconstructing native messages. The decoded bundle columns are copied to
+ * the output columns as they are, converted to the member type
+ *
+ * @param[in]  dec       Decoder
+ * @param[in]  ctx       Context of the message type
+ * @param[in]  buf       DCB frame, as delimited by @ref tbi_protocol_frame_len()
+ * @param[in]  len       DCB frame length
+ * @param[out] cols      Column of every member, see @ref tbi_columns_t, with room
+ *                       for the samples of the frame from row on, see @ref tbi_dcb_frame_samples()
+ * @param[in]  row       Row of the initial value
+ * @param[in]  start_ts  Client start timestamp in ms, timestamps are relative to this
+ *
+ * @return number of samples decoded, or a negative error value if the frame is malformed
+ */
+int tbi_dcb_decode_columns(tbi_dcb_dec_t *dec, const tbi_msg_ctx_t *ctx, const uint8_t *buf, int len,
+    void * const *cols, int row, uint64_t start_ts)
+{
+    uint32_t msg[dec->max_fields];
+    int offsets[dec->max_fields];
+    int count, off, f, first = row;
+
+    /* Every member fits 4 bytes of the scratch message */
+    if((off = tbi_dcb_decode_first(dec, ctx, buf, len, msg, sizeof(msg), offsets)) < 0)
+        return -1;
+    for(f = 0; f < ctx->format_len; f++)
+        tbi_dcb_column_store(ctx->format[f], cols[f], row, &dec->prev[f], 1, start_ts);
+    row++;
+
+    while((count = tbi_dcb_decode_bundle(dec, ctx, buf, len, &off)) > 0) {
+        for(f = 0; f < ctx->format_len; f++)
+            tbi_dcb_column_store(ctx->format[f], cols[f], row, dec->cols + f * TBI_DCB_COLUMN_LEN, count, start_ts);
+        row += count;
+    }
+
+    if(count < 0)
+        return -1;
+    return row - first;
+}
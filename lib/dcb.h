@@ -0,0 +1,62 @@
+/**
+* @file     dcb.h
+* @brief    Header file for the DCB (Delta-Compressed Bundle) frame encoder and decoder
+*/
+
+#ifndef __TBI_DCB_H
+#define __TBI_DCB_H
+
+#include <stdint.h>
+#include "tbi_types.h"
+
+/** @brief Max number of samples in a DCB frame, including the initial value */
+#define TBI_DCB_MAX_SAMPLES 1024
+
+/** @brief Max number of samples in a single bundle, the count takes one byte */
+#define TBI_DCB_MAX_BUNDLE 255
+
+/** @brief DCB encoder state, collecting the samples of a single frame */
+typedef struct tbi_dcb_enc {
+    int max_fields;         /** @brief Max number of struct members of any message type */
+    int fields;             /** @brief Struct members of the message type being encoded */
+    int len;                /** @brief Samples collected, including the initial value */
+    uint32_t *first;        /** @brief Initial value of each member, in wire representation */
+    uint32_t *values;       /** @brief Values of each sample, a column per member */
+    uint32_t *deltas;       /** @brief Zigzag-encoded deltas, a column per member */
+    uint8_t *widths;        /** @brief Bit width of each delta, a row of members per sample */
+    uint32_t *cost;         /** @brief Least number of bytes to encode the first i deltas */
+    uint16_t *from;         /** @brief Start of the last bundle in the least-cost encoding */
+} tbi_dcb_enc_t;
+
+/** @brief Number of values in each member column of the decoder, a bundle 
+ * rounded up to a multiple of the vector width */
+#define TBI_DCB_COLUMN_LEN 256
+
+/** @brief Called by the decoder for every sample of a frame, with the sample
+ * reconstructed as a native message */
+typedef int (*tbi_dcb_emit)(void *userdata, const void *msg);
+
+/** @brief DCB decoder state, reused for every frame */
+typedef struct tbi_dcb_dec {
+    int max_fields;         /** @brief Max number of struct members of any message type */
+    uint32_t *prev;         /** @brief Previous value of each member */
+    uint32_t *cols;         /** @brief Values of the bundle being decoded, a column per member */
+} tbi_dcb_dec_t;
+
+tbi_dcb_enc_t *tbi_dcb_enc_create(int max_fields);
+void tbi_dcb_enc_free(tbi_dcb_enc_t *enc);
+
+int tbi_dcb_frame_max_len(const tbi_msg_ctx_t *ctx, int samples);
+int tbi_dcb_enc_add(tbi_dcb_enc_t *enc, const tbi_msg_ctx_t *ctx, const void *msg);
+int tbi_dcb_enc_finish(tbi_dcb_enc_t *enc, const tbi_msg_ctx_t *ctx, uint8_t *out, int out_size);
+
+tbi_dcb_dec_t *tbi_dcb_dec_create(int max_fields);
+void tbi_dcb_dec_free(tbi_dcb_dec_t *dec);
+
+int tbi_dcb_decode(tbi_dcb_dec_t *dec, const tbi_msg_ctx_t *ctx, const uint8_t *buf, int len,
+    void *msg, int msg_size, tbi_dcb_emit emit, void *userdata);
+int tbi_dcb_frame_samples(const tbi_msg_ctx_t *ctx, const uint8_t *buf, int len);
+int tbi_dcb_decode_columns(tbi_dcb_dec_t *dec, const tbi_msg_ctx_t *ctx, const uint8_t *buf, int len,
+    void * const *cols, int row, uint64_t start_ts);
+
+#endif /* __TBI_DCB_H */
@@ -0,0 +1,40 @@
+/**
+* @file     log.h
+* @brief    Library log messages with a compile-time log level. Messages above
+*           TBI_LOG_LEVEL are removed from the build altogether
+*/
+
+#ifndef __TBI_LOG_H
+#define __TBI_LOG_H
+
+#include <stdio.h>
+
+#define TBI_LOG_LEVEL_NONE  0
+#define TBI_LOG_LEVEL_ERROR 1
+#define TBI_LOG_LEVEL_WARN  2
+#define TBI_LOG_LEVEL_INFO  3
+#define TBI_LOG_LEVEL_DEBUG 4
+
+#ifndef TBI_LOG_LEVEL
+#define TBI_LOG_LEVEL TBI_LOG_LEVEL_INFO
+#endif
+
+#define TBI_LOG(level, ...) \
+    do { if(TBI_LOG_LEVEL >= (level)) printf(__VA_ARGS__); } while(0)
+
+#define TBI_LOG_ERROR(...)  TBI_LOG(TBI_LOG_LEVEL_ERROR, __VA_ARGS__)
+#define TBI_LOG_WARN(...)   TBI_LOG(TBI_LOG_LEVEL_WARN, __VA_ARGS__)
+#define TBI_LOG_INFO(...)   TBI_LOG(TBI_LOG_LEVEL_INFO, __VA_ARGS__)
+#define TBI_LOG_DEBUG(...)  TBI_LOG(TBI_LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/** @brief Dump bytes in hex at debug level */
+#define TBI_LOG_HEXDUMP(prefix, buf, len) \
+    do { \
+        if(TBI_LOG_LEVEL >= TBI_LOG_LEVEL_DEBUG) { \
+            printf("%s %d bytes: ", (prefix), (int)(len)); \
+            for(int _i = 0; _i < (int)(len); _i++) { printf("0x%X ", (buf)[_i]); } \
+            printf("\n"); \
+        } \
+    } while(0)
+
+#endif /* __TBI_LOG_H */
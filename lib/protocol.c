@@ -5,8 +5,10 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <netinet/in.h>
 #include "protocol.h"
+#include "crc32c.h"
 #include "utils.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -49,10 +51,13 @@ int tbi_get_client_flags(uint8_t *buf, uint8_t *flags, uint8_t *msgtype)
  * @param[in] schema_version    Schema version from messagespec
  * @param[in] schema_csum       Machine-readable schema checksum
  * @param[in] ts                Connection start timestamp that future telemetry msgs will be relative to
+ * @param[in] features          Requested protocol features, see @ref TBI_FEATURE_CRC32C
+ * @param[in] device_id         Identifier of the device, 0 if not set
  * 
  * @return length of bytes written to buf, or negative error value
  */
-int tbi_protocol_client_handshake(uint8_t *buf, uint8_t schema_version, uint16_t schema_csum, uint64_t ts)
+int tbi_protocol_client_handshake(uint8_t *buf, uint8_t schema_version, uint16_t schema_csum, uint64_t ts, uint8_t features,
+    uint64_t device_id)
 {
     uint8_t* buf_ptr;
     int len = 0;
@@ -84,23 +89,37 @@ int tbi_protocol_client_handshake(uint8_t *buf, uint8_t schema_version, uint16_t
 
     /* Schema checksum */
     *(uint16_t*)buf_ptr = htons(schema_csum);
+    buf_ptr += sizeof(uint16_t);
     len += sizeof(uint16_t);
 
+    /* Requested features */
+    *buf_ptr++ = features;
+    len++;
+
+    /* Device identifier, uint64_t big-endian */
+    *(uint32_t*)buf_ptr = htonl((uint32_t)((device_id >> 32) & 0xFFFFFFFF));
+    buf_ptr += sizeof(uint32_t);
+    *(uint32_t*)buf_ptr = htonl((uint32_t)(device_id & 0xFFFFFFFF));
+    buf_ptr += sizeof(uint32_t);
+    len += sizeof(uint32_t) * 2;
+
     return len;
 
 }
 
 /** @brief Verify server handshake acknowledge
  * 
- * @param[in] buf   Server handshake acknowledge message
- * @param[in] len   Server message length
+ * @param[in] buf           Server handshake acknowledge message
+ * @param[in] len           Server message length
+ * @param[in] features      Features requested in the client handshake
+ * @param[out] out_features Features agreed by the server
  * 
  * @return 0 on valid handshake, or negative error value
  */
-int tbi_protocol_client_verify_handshake_ack(uint8_t *buf, int len)
+int tbi_protocol_client_verify_handshake_ack(uint8_t *buf, int len, uint8_t features, uint8_t *out_features)
 {
     uint8_t expected_header[] = {'T', 'B', 'I', TBI_PROTOCOL_VERSION};
-    int min_len = ARRAY_SIZE(expected_header);
+    int min_len = ARRAY_SIZE(expected_header) + sizeof(uint8_t);
     int i;
 
     /* Ensure there's enough to read */
@@ -113,28 +132,40 @@ int tbi_protocol_client_verify_handshake_ack(uint8_t *buf, int len)
             return -1;
     }
 
+    /* Server may only agree to features that were requested */
+    if(*buf & ~features)
+        return -1;
+    *out_features = *buf;
+
     return 0;
 }
 
 
-/** @brief Verify client handshake message, and form acknowledge message
+/** @brief Verify client handshake message, and form acknowledge message. The
+ * message spec of the client is returned for the caller to look up, as a server
+ * may accept several
  * 
- * @param[in,out] buf           Buffer with client message, server response written back in it
- * @param[in] len               Client message length
- * @param[in] schema_version    Schema version from messagespec
- * @param[in] schema_csum       Machine-readable schema checksum
- * @param[out] out_ts           Connection start timestamp form client that future telemetry msgs will be relative to
+ * @param[in,out] buf               Buffer with client message, server response written back in it
+ * @param[in] len                   Client message length
+ * @param[in] features              Features the server supports
+ * @param[out] out_ts               Connection start timestamp form client that future telemetry msgs will be relative to
+ * @param[out] out_schema_version   Message spec version of the client
+ * @param[out] out_schema_csum      Message spec checksum of the client
+ * @param[out] out_features         Features agreed, requested by the client and supported by the server
+ * @param[out] out_device_id        Identifier of the client device, 0 if not set
  * 
  * @return length of bytes written to buf, or negative error value
  */
-int tbi_protocol_server_handshake(uint8_t *buf, int len, uint8_t schema_version, uint16_t schema_csum, uint64_t *out_ts)
+int tbi_protocol_server_handshake(uint8_t *buf, int len, uint8_t features, uint64_t *out_ts,
+    uint8_t *out_schema_version, uint16_t *out_schema_csum, uint8_t *out_features, uint64_t *out_device_id)
 {
     uint8_t expected_header[] = {'T', 'B', 'I', TBI_PROTOCOL_VERSION};
-    uint32_t ts_hi, ts_lo;
+    uint8_t *ack = buf;
+    uint32_t ts_hi, ts_lo, id_hi, id_lo;
     int i, min_len;
 
-    /* Calculate min len of client msg, so that we don't read past the end; header + ts + schema ver + csum */
-    min_len = ARRAY_SIZE(expected_header) + sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint16_t);
+    /* Calculate min len of client msg, so that we don't read past the end; header + ts + schema ver + csum + features + device id */
+    min_len = ARRAY_SIZE(expected_header) + sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint64_t);
     if(len != min_len)
         return -1;
 
@@ -151,13 +182,214 @@ int tbi_protocol_server_handshake(uint8_t *buf, int len, uint8_t schema_version,
     buf += sizeof(uint32_t);
     *out_ts = (uint64_t)ts_hi << 32 | (uint64_t)ts_lo;
 
-    /* Verify schema version */
-    if(*buf++ != schema_version)
+    /* Schema version and checksum, converted to native endianness */
+    *out_schema_version = *buf++;
+    *out_schema_csum = ntohs(*(uint16_t*)buf);
+    buf += sizeof(uint16_t);
+
+    /* Agree to the requested features that are supported, following the header in the ACK */
+    *out_features = *buf++ & features;
+    ack[ARRAY_SIZE(expected_header)] = *out_features;
+
+    /* Client device identifier, converted to native endianness */
+    id_hi = ntohl(*(uint32_t*)buf);
+    buf += sizeof(uint32_t);
+    id_lo = ntohl(*(uint32_t*)buf);
+    *out_device_id = (uint64_t)id_hi << 32 | (uint64_t)id_lo;
+
+    return ARRAY_SIZE(expected_header) + sizeof(uint8_t);
+}
+
+/** @brief Form a server acknowledge of received frames, see @ref TBI_FEATURE_ACK
+ * 
+ * @param[out] buf      Buffer of at least @ref TBI_ACK_LEN bytes
+ * @param[in] pos       Bytes of frames received from the client since the handshake
+ * 
+ * @return length of bytes written to buf
+ */
+int tbi_protocol_ack(uint8_t *buf, uint64_t pos)
+{
+    uint32_t hi = htonl((uint32_t)(pos >> 32)), lo = htonl((uint32_t)pos);
+
+    buf[0] = 'A';
+    memcpy(buf + 1, &hi, sizeof(hi));
+    memcpy(buf + 1 + sizeof(hi), &lo, sizeof(lo));
+    return TBI_ACK_LEN;
+}
+
+/** @brief Parse a server acknowledge of received frames
+ * 
+ * @param[in] buf       Server acknowledge
+ * @param[in] len       Length of the acknowledge
+ * @param[out] out_pos  Bytes of frames received by the server since the handshake
+ * 
+ * @return 0 on valid acknowledge, or negative error value
+ */
+int tbi_protocol_parse_ack(const uint8_t *buf, int len, uint64_t *out_pos)
+{
+    uint32_t hi, lo;
+
+    if(len != TBI_ACK_LEN || buf[0] != 'A')
         return -1;
+    memcpy(&hi, buf + 1, sizeof(hi));
+    memcpy(&lo, buf + 1 + sizeof(hi), sizeof(lo));
+    *out_pos = (uint64_t)ntohl(hi) << 32 | ntohl(lo);
+    return 0;
+}
 
-    /* Verify checksum */
-    if(schema_csum != ntohs(*(uint16_t*)buf))
+/** @brief Get total length of a DCB format spec in bytes
+ * 
+ * @param[in] fields    Number of struct members in the format spec
+ * 
+ * @return length in bytes
+ */
+int tbi_dcb_spec_len(int fields)
+{
+    return (fields * TBI_DCB_WIDTH_BITS + 7) / 8;
+}
+
+/** @brief Get the width of a struct member from a DCB format spec
+ * 
+ * @param[in] spec      Format spec, struct member widths packed MSB first
+ * @param[in] spec_len  Format spec length in bytes
+ * @param[in] field     Struct member index
+ * 
+ * @return width in bits
+ */
+int tbi_dcb_spec_width(const uint8_t *spec, int spec_len, int field)
+{
+    int bit = field * TBI_DCB_WIDTH_BITS;
+    uint16_t word = (uint16_t)spec[bit / 8] << 8;
+
+    if(bit / 8 + 1 < spec_len)
+        word |= spec[bit / 8 + 1];
+    return (word >> (16 - TBI_DCB_WIDTH_BITS - (bit % 8))) & ((1 << TBI_DCB_WIDTH_BITS) - 1);
+}
+
+/** @brief Get the length of the frame at the beginning of a received byte stream.
+ * RTM length is derived from the message format of the type, and DCB length by walking
+ * through the bundle headers until the terminating empty bundle. The length includes
+ * the checksum of frames with @ref TBI_FLAGS_CRC
+ * 
+ * @param[in] tbi   TBI context, with message spec registered
+ * @param[in] buf   Received bytes, beginning with a frame
+ * @param[in] len   Number of received bytes
+ * 
+ * @return frame length in bytes, 0 if more bytes are needed to complete the frame,
+ *          or a negative error value if the stream is malformed
+ */
+int tbi_protocol_frame_len(tbi_ctx_t *tbi, const uint8_t *buf, int len)
+{
+    if(len < 1)
+        return 0;
+    return tbi_protocol_type_frame_len(tbi_msg_ctx(tbi, buf[0] & 0xF), buf, len);
+}
+
+/** @brief Get the length of the frame at the beginning of a received byte stream,
+ * of a message type already looked up, see @ref tbi_protocol_frame_len()
+ * 
+ * @param[in] ctx   Context of the message type of the frame, NULL if the type is unknown
+ * @param[in] buf   Received bytes, beginning with a frame
+ * @param[in] len   Number of received bytes
+ * 
+ * @return frame length in bytes, 0 if more bytes are needed to complete the frame,
+ *          or a negative error value if the stream is malformed
+ */
+int tbi_protocol_type_frame_len(const tbi_msg_ctx_t *ctx, const uint8_t *buf, int len)
+{
+    uint8_t flags;
+    int rtm_len, spec_len, count, bits, off, crc_len, i;
+
+    if(len < 1)
+        return 0;
+    if(!ctx)
+        return -1;
+
+    flags = (buf[0] >> 4) & 0xF;
+
+    /* Checksum follows the frame */
+    crc_len = (flags & TBI_FLAGS_CRC) ? TBI_FRAME_CRC_LEN : 0;
+    flags &= ~TBI_FLAGS_CRC;
+
+    /* Flags & msgtype, followed by the structure data */
+    rtm_len = msg_wire_len(ctx->format, ctx->format_len);
+
+    if(flags == TBI_FLAGS_RTM)
+        return (len >= rtm_len + crc_len) ? rtm_len + crc_len : 0;
+
+    if(flags != TBI_FLAGS_DCB)
         return -1;
 
-    return ARRAY_SIZE(expected_header);
-}
\ No newline at end of file
+    /* DCB begins with the initial value, followed by bundles */
+    off = rtm_len;
+    spec_len = tbi_dcb_spec_len(ctx->format_len);
+    while(1) {
+        /* No. of values, zero terminates the frame */
+        if(len < off + 1)
+            return 0;
+        count = buf[off];
+        if(count == 0)
+            return (len >= off + 1 + crc_len) ? off + 1 + crc_len : 0;
+
+        /* Format spec len and format spec */
+        if(len < off + 2)
+            return 0;
+        if(buf[off + 1] != spec_len)
+            return -1;
+        if(len < off + 2 + spec_len)
+            return 0;
+
+        bits = 0;
+        for(i = 0; i < ctx->format_len; i++) {
+            int width = tbi_dcb_spec_width(&buf[off + 2], spec_len, i);
+            if(width > 32)
+                return -1;
+            bits += width;
+        }
+
+        /* Data, byte-aligned at the end of the bundle */
+        off += 2 + spec_len + (count * bits + 7) / 8;
+    }
+}
+
+/** @brief Flag a serialized frame as checksummed, and append its CRC32C.
+ * The frame buffer must have room for @ref TBI_FRAME_CRC_LEN more bytes
+ * 
+ * @param[in,out] buf   Serialized frame
+ * @param[in] len       Frame length
+ * 
+ * @return frame length including the checksum
+ */
+int tbi_protocol_frame_seal(uint8_t *buf, int len)
+{
+    uint32_t crc;
+
+    tbi_set_client_flags(buf, TBI_FLAGS_CRC);
+    crc = htonl(crc32c(0, buf, len));
+    memcpy(buf + len, &crc, sizeof(crc));
+    return len + TBI_FRAME_CRC_LEN;
+}
+
+/** @brief Verify the checksum of a received frame
+ * 
+ * @param[in] buf       Frame, as delimited by @ref tbi_protocol_frame_len()
+ * @param[in] len       Frame length, including the checksum
+ * @param[in] features  Features agreed with the client, frames must be checksummed 
+ *                      if @ref TBI_FEATURE_CRC32C was agreed
+ * 
+ * @return frame length without the checksum, or a negative error value if the
+ *          checksum is missing or does not match
+ */
+int tbi_protocol_frame_verify(const uint8_t *buf, int len, uint8_t features)
+{
+    uint32_t crc;
+
+    if(!(buf[0] & (TBI_FLAGS_CRC << 4)))
+        return (features & TBI_FEATURE_CRC32C) ? -1 : len;
+
+    len -= TBI_FRAME_CRC_LEN;
+    memcpy(&crc, buf + len, sizeof(crc));
+    if(ntohl(crc) != crc32c(0, buf, len))
+        return -1;
+    return len;
+}
@@ -7,13 +7,36 @@
 #define __TBI_PROTOCOL_H
 
 #include <stdint.h>
+#include "tbi_types.h"
 
-#define TBI_PROTOCOL_VERSION 1
+#define TBI_PROTOCOL_VERSION 3
+
+/** @brief Length of the client handshake request */
+#define TBI_HANDSHAKE_LEN 24
+
+/** @brief Length of the server handshake acknowledge */
+#define TBI_HANDSHAKE_ACK_LEN 5
+
+/** @brief Length of the CRC32C following a frame with @ref TBI_FLAGS_CRC */
+#define TBI_FRAME_CRC_LEN 4
+
+/** @brief Number of bits used for each struct member width in a DCB format spec */
+#define TBI_DCB_WIDTH_BITS 6
 
 int tbi_set_client_flags(uint8_t *buf, uint8_t flags);
 int tbi_get_client_flags(uint8_t *buf, uint8_t *flags, uint8_t *msgtype);
-int tbi_protocol_client_handshake(uint8_t *buf, uint8_t schema_version, uint16_t schema_csum, uint64_t ts);
-int tbi_protocol_client_verify_handshake_ack(uint8_t *buf, int len);
-int tbi_protocol_server_handshake(uint8_t *buf, int len, uint8_t schema_version, uint16_t schema_csum, uint64_t *out_ts);
+int tbi_protocol_client_handshake(uint8_t *buf, uint8_t schema_version, uint16_t schema_csum, uint64_t ts, uint8_t features,
+    uint64_t device_id);
+int tbi_protocol_client_verify_handshake_ack(uint8_t *buf, int len, uint8_t features, uint8_t *out_features);
+int tbi_protocol_server_handshake(uint8_t *buf, int len, uint8_t features, uint64_t *out_ts,
+    uint8_t *out_schema_version, uint16_t *out_schema_csum, uint8_t *out_features, uint64_t *out_device_id);
+int tbi_protocol_ack(uint8_t *buf, uint64_t pos);
+int tbi_protocol_parse_ack(const uint8_t *buf, int len, uint64_t *out_pos);
+int tbi_dcb_spec_len(int fields);
+int tbi_dcb_spec_width(const uint8_t *spec, int spec_len, int field);
+int tbi_protocol_frame_len(tbi_ctx_t *tbi, const uint8_t *buf, int len);
+int tbi_protocol_type_frame_len(const tbi_msg_ctx_t *ctx, const uint8_t *buf, int len);
+int tbi_protocol_frame_seal(uint8_t *buf, int len);
+int tbi_protocol_frame_verify(const uint8_t *buf, int len, uint8_t features);
 
 #endif /* __TBI_PROTOCOL_H */
\ No newline at end of file
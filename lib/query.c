@@ -0,0 +1,796 @@
+/**
+* @file     query.c
+* @brief    Time-range queries over the telemetry segment store. Segments and
+*           blocks outside the time range are skipped with the segment headers
+*           and the sparse time index, and blocks no row of which can match a
+*           predicate with the min and max of the column. Only the columns a
+*           query needs are decoded, a whole block at a time, and predicates
+*           are evaluated over the decoded columns into a row bitmask, with
+*           AVX2 where the CPU has it
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "query.h"
+#include "bitpack.h"
+#include "log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TBI_QUERY_X86
+#include <immintrin.h>
+#endif
+
+/** @brief Words of a row bitmask of a block */
+#define TBI_QUERY_MASK_LEN (TBI_STORE_BLOCK_ROWS / 64)
+
+/** @brief Which rows of a block a predicate holds for, from the min and max of the column */
+typedef enum {
+    TBI_QUERY_MATCH_NONE = 0,
+    TBI_QUERY_MATCH_SOME = 1,
+    TBI_QUERY_MATCH_ALL  = 2,
+} tbi_query_match_t;
+
+/** @brief Block being read, with its columns decoded on demand */
+typedef struct {
+    const tbi_query_t *query;
+    const tbi_store_header_t *seg;
+    const tbi_store_column_t *cols;
+    const uint8_t *data[TBI_STORE_MAX_FIELDS]; /** @brief Packed differences of each column */
+    uint64_t min_ts;            /** @brief Timestamps are relative to this */
+    uint64_t max_ts;
+    int rows;
+    uint32_t decoded;           /** @brief Columns decoded into values, a bit each */
+    uint32_t *values;           /** @brief Decoded columns, @ref TBI_STORE_BLOCK_ROWS values each */
+    bool all;                   /** @brief Every row matches, mask is not set */
+    uint64_t mask[TBI_QUERY_MASK_LEN]; /** @brief Matching rows, a bit each */
+} tbi_query_block_t;
+
+/** @brief Called for every block with matching rows */
+typedef int (*tbi_query_block_fn)(tbi_query_block_t *blk, void *userdata);
+
+/** @brief Called for every segment of a stream */
+typedef int (*tbi_query_segment_fn)(const tbi_store_header_t *seg, long size, void *userdata);
+
+/** @brief Is the field type a timestamp, stored relative to the block min_ts */
+static inline int tbi_query_is_ts(uint8_t field_type)
+{
+    return field_type == TBI_TIMEDIFF_S || field_type == TBI_TIMEDIFF_MS;
+}
+
+/** @brief Is the 32-bit value of a field type signed */
+static inline int tbi_query_is_signed(uint8_t field_type)
+{
+    return field_type == TBI_INT8 || field_type == TBI_INT16 || field_type == TBI_INT32 || tbi_query_is_ts(field_type);
+}
+
+/** @brief Compare a column to a value, setting a bit per row, see @ref tbi_query_cmp().
+ * Only EQ, LT and GT, the others are their inverse */
+static void tbi_query_cmp_scalar(const uint32_t *values, int count, uint32_t bias, tbi_query_op_t op, uint32_t value,
+    uint64_t *bits)
+{
+    int32_t c = (int32_t)(value ^ bias);
+    int i;
+
+#define TBI_QUERY_CMP_LOOP(EXPR) \
+    for(i = 0; i < count; i++) { \
+        int32_t v = (int32_t)(values[i] ^ bias); \
+        bits[i >> 6] |= (uint64_t)(EXPR) << (i & 63); \
+    }
+
+    switch(op) {
+        case TBI_QUERY_EQ: TBI_QUERY_CMP_LOOP(v == c); break;
+        case TBI_QUERY_LT: TBI_QUERY_CMP_LOOP(v < c); break;
+        case TBI_QUERY_GT: TBI_QUERY_CMP_LOOP(v > c); break;
+        default: break;
+    }
+#undef TBI_QUERY_CMP_LOOP
+}
+
+#ifdef TBI_QUERY_X86
+/** @brief Compare a column to a value with AVX2, 8 rows per step */
+__attribute__((target("avx2")))
+static void tbi_query_cmp_avx2(const uint32_t *values, int count, uint32_t bias, tbi_query_op_t op, uint32_t value,
+    uint64_t *bits)
+{
+    __m256i vbias = _mm256_set1_epi32((int32_t)bias);
+    __m256i vc = _mm256_set1_epi32((int32_t)(value ^ bias));
+    __m256i v;
+    uint32_t m;
+    int i;
+
+#define TBI_QUERY_CMP_LOOP(EXPR) \
+    for(i = 0; i + 8 <= count; i += 8) { \
+        v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(values + i)), vbias); \
+        m = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(EXPR)); \
+        bits[i >> 6] |= (uint64_t)m << (i & 63); \
+    }
+
+    switch(op) {
+        case TBI_QUERY_EQ: TBI_QUERY_CMP_LOOP(_mm256_cmpeq_epi32(v, vc)); break;
+        case TBI_QUERY_LT: TBI_QUERY_CMP_LOOP(_mm256_cmpgt_epi32(vc, v)); break;
+        case TBI_QUERY_GT: TBI_QUERY_CMP_LOOP(_mm256_cmpgt_epi32(v, vc)); break;
+        default: return;
+    }
+#undef TBI_QUERY_CMP_LOOP
+
+    /* Rows past the last full vector, 8-aligned so the bit positions line up */
+    if(i < count) {
+        uint64_t tail[TBI_QUERY_MASK_LEN] = {0};
+        tbi_query_cmp_scalar(values + i, count - i, bias, op, value, tail);
+        bits[i >> 6] |= tail[0] << (i & 63);
+    }
+}
+#endif
+
+/**
+ * @brief Evaluate a predicate over a decoded column, clearing the bits of the
+ * rows it does not hold for. Kernels follow the instruction set chosen for bit
+ * packing, see @ref tbi_bitpack_set_isa()
+ *
+ * @param[in] values    Column, as 32-bit values
+ * @param[in] count     Number of rows
+ * @param[in] is_signed Compare values as signed
+ * @param[in] op        Comparison
+ * @param[in] value     Value to compare to, as 32 bits
+ * @param[in,out] mask  Row bitmask
+*/
+static void tbi_query_cmp(const uint32_t *values, int count, int is_signed, tbi_query_op_t op, uint32_t value,
+    uint64_t *mask)
+{
+    uint64_t bits[TBI_QUERY_MASK_LEN] = {0};
+    uint32_t bias = is_signed ? 0 : 0x80000000U;
+    tbi_query_op_t base;
+    int invert, w, words = (count + 63) / 64;
+
+    /* Unsigned values are compared as signed, offset by 2^31 */
+    invert = (op == TBI_QUERY_NE || op == TBI_QUERY_LE || op == TBI_QUERY_GE);
+    base = (op == TBI_QUERY_NE) ? TBI_QUERY_EQ : (op == TBI_QUERY_LE) ? TBI_QUERY_GT :
+        (op == TBI_QUERY_GE) ? TBI_QUERY_LT : op;
+
+#ifdef TBI_QUERY_X86
+    if(tbi_bitpack_get_isa() == TBI_BITPACK_AVX2)
+        tbi_query_cmp_avx2(values, count, bias, base, value, bits);
+    else
+#endif
+        tbi_query_cmp_scalar(values, count, bias, base, value, bits);
+
+    for(w = 0; w < words; w++)
+        mask[w] &= invert ? ~bits[w] : bits[w];
+}
+
+/**
+ * @brief Tell which rows of a block a predicate can hold for, from the min and
+ * max of the column
+ *
+ * @param[in] op        Comparison
+ * @param[in] value     Value compared to
+ * @param[in] min       Smallest value of the column
+ * @param[in] max       Largest value of the column
+ *
+ * @return none, some or all rows
+*/
+static tbi_query_match_t tbi_query_match(tbi_query_op_t op, int64_t value, int64_t min, int64_t max)
+{
+    switch(op) {
+        case TBI_QUERY_EQ:
+            if(value < min || value > max)
+                return TBI_QUERY_MATCH_NONE;
+            return (min == max) ? TBI_QUERY_MATCH_ALL : TBI_QUERY_MATCH_SOME;
+        case TBI_QUERY_NE:
+            if(value < min || value > max)
+                return TBI_QUERY_MATCH_ALL;
+            return (min == max) ? TBI_QUERY_MATCH_NONE : TBI_QUERY_MATCH_SOME;
+        case TBI_QUERY_LT:
+            return (min >= value) ? TBI_QUERY_MATCH_NONE : (max < value) ? TBI_QUERY_MATCH_ALL : TBI_QUERY_MATCH_SOME;
+        case TBI_QUERY_LE:
+            return (min > value) ? TBI_QUERY_MATCH_NONE : (max <= value) ? TBI_QUERY_MATCH_ALL : TBI_QUERY_MATCH_SOME;
+        case TBI_QUERY_GT:
+            return (max <= value) ? TBI_QUERY_MATCH_NONE : (min > value) ? TBI_QUERY_MATCH_ALL : TBI_QUERY_MATCH_SOME;
+        case TBI_QUERY_GE:
+            return (max < value) ? TBI_QUERY_MATCH_NONE : (min >= value) ? TBI_QUERY_MATCH_ALL : TBI_QUERY_MATCH_SOME;
+        default:
+            return TBI_QUERY_MATCH_NONE;
+    }
+}
+
+/**
+ * @brief Get a column of a block, decoding it on first use
+ *
+ * @param[in] blk       Block
+ * @param[in] field     Column
+ *
+ * @return values, as 32 bits
+*/
+static const uint32_t *tbi_query_column(tbi_query_block_t *blk, int field)
+{
+    uint32_t *values = blk->values + (size_t)field * TBI_STORE_BLOCK_ROWS;
+    const tbi_store_column_t *col = &blk->cols[field];
+
+    if(!(blk->decoded & (1U << field))) {
+        values[0] = col->first;
+        tbi_bitpack_unpack(blk->data[field], ((blk->rows - 1) * col->width + 7) / 8, 0, col->width, col->width,
+            blk->rows - 1, values + 1);
+        tbi_zigzag_delta_decode(values + 1, blk->rows - 1, values[0]);
+        blk->decoded |= 1U << field;
+    }
+    return values;
+}
+
+/**
+ * @brief Narrow the matching rows of a block with a predicate
+ *
+ * @param[in] blk       Block
+ * @param[in] field     Column
+ * @param[in] op        Comparison
+ * @param[in] value     Value in the type of the column, a timestamp in ms since the epoch
+ *
+ * @return 0 if no row can match anymore, 1 otherwise
+*/
+static int tbi_query_filter(tbi_query_block_t *blk, int field, tbi_query_op_t op, int64_t value)
+{
+    uint8_t field_type = blk->seg->format[field];
+    int w;
+
+    switch(tbi_query_match(op, value, blk->cols[field].min, blk->cols[field].max)) {
+        case TBI_QUERY_MATCH_NONE:
+            return 0;
+        case TBI_QUERY_MATCH_ALL:
+            return 1;
+        default:
+            break;
+    }
+
+    /* Some rows match, so the value is within min and max, and fits 32 bits */
+    if(blk->all) {
+        memset(blk->mask, 0, sizeof(blk->mask));
+        for(w = 0; w < blk->rows / 64; w++)
+            blk->mask[w] = ~0ULL;
+        if(blk->rows % 64)
+            blk->mask[w] = (1ULL << (blk->rows % 64)) - 1;
+        blk->all = false;
+    }
+    if(tbi_query_is_ts(field_type))
+        value -= (int64_t)blk->min_ts;
+    tbi_query_cmp(tbi_query_column(blk, field), blk->rows, tbi_query_is_signed(field_type), op, (uint32_t)value,
+        blk->mask);
+
+    for(w = 0; w < TBI_QUERY_MASK_LEN; w++) {
+        if(blk->mask[w])
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Set up a block for reading, checking that it lies within its segment
+ *
+ * @param[in,out] blk   Block, with query and seg set
+ * @param[in] entry     Index entry of the block
+ * @param[in] size      Segment size
+ *
+ * @return 0 on success, or a negative error value if the block is malformed
+*/
+static int tbi_query_block_init(tbi_query_block_t *blk, const tbi_store_index_t *entry, long size)
+{
+    const tbi_store_block_t *block;
+    const uint8_t *data, *end;
+    int f;
+
+    if(entry->offset < TBI_STORE_HEADER_SIZE || (long)entry->offset + (long)sizeof(tbi_store_block_t) > size)
+        return -1;
+    block = (const tbi_store_block_t*)((const uint8_t*)blk->seg + entry->offset);
+    if(block->fields != blk->seg->fields || block->rows < 1 || block->rows > TBI_STORE_BLOCK_ROWS ||
+        (long)entry->offset + block->len > size)
+        return -1;
+
+    blk->cols = (const tbi_store_column_t*)(block + 1);
+    blk->rows = block->rows;
+    blk->min_ts = entry->min_ts;
+    blk->max_ts = entry->max_ts;
+    blk->decoded = 0;
+    blk->all = true;
+    data = (const uint8_t*)(blk->cols + block->fields);
+    end = (const uint8_t*)block + block->len;
+    for(f = 0; f < block->fields; f++) {
+        if(blk->cols[f].width > 32)
+            return -1;
+        blk->data[f] = data;
+        data += ((block->rows - 1) * blk->cols[f].width + 7) / 8;
+    }
+    return (data > end) ? -1 : 0;
+}
+
+/**
+ * @brief Map every segment of a stream in turn, oldest first
+ *
+ * @param[in] dir       Store directory
+ * @param[in] device_id Device
+ * @param[in] msgtype   Message type
+ * @param[in] fn        Called for every valid segment, stops if it returns nonzero
+ * @param[in] userdata  Passed to fn
+ *
+ * @return number of segments, or a negative error value
+*/
+static int tbi_query_segments(const char *dir, uint64_t device_id, int msgtype, tbi_query_segment_fn fn, void *userdata)
+{
+    char path[PATH_MAX];
+    const tbi_store_header_t *seg;
+    struct dirent *entry;
+    unsigned int type, seq, *seqs = NULL, *grown;
+    int seqs_len = 0, seqs_size = 0, i, j, fd, ret = 0, segments = 0;
+    struct stat st;
+    DIR *d;
+
+    if(snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)device_id) >= (int)sizeof(path))
+        return -1;
+    if(!(d = opendir(path)))
+        return (errno == ENOENT) ? 0 : -1;
+    while((entry = readdir(d))) {
+        if(sscanf(entry->d_name, "%2u-%8u.seg", &type, &seq) != 2 || type != (unsigned int)msgtype)
+            continue;
+        if(seqs_len == seqs_size) {
+            seqs_size = seqs_size ? seqs_size * 2 : 16;
+            if(!(grown = realloc(seqs, seqs_size * sizeof(unsigned int)))) {
+                ret = -1;
+                break;
+            }
+            seqs = grown;
+        }
+        seqs[seqs_len++] = seq;
+    }
+    closedir(d);
+
+    /* Sequence numbers grow with time */
+    for(i = 1; i < seqs_len; i++) {
+        for(seq = seqs[i], j = i; j > 0 && seqs[j - 1] > seq; j--)
+            seqs[j] = seqs[j - 1];
+        seqs[j] = seq;
+    }
+
+    for(i = 0; i < seqs_len && ret == 0; i++) {
+        snprintf(path, sizeof(path), "%s/%016llx/%02d-%08u.seg", dir, (unsigned long long)device_id, msgtype, seqs[i]);
+        if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            continue;
+        if(fstat(fd, &st) != 0 || st.st_size < TBI_STORE_HEADER_SIZE) {
+            close(fd);
+            continue;
+        }
+        seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(seg == MAP_FAILED)
+            continue;
+
+        if(memcmp(seg->magic, TBI_STORE_MAGIC, sizeof(seg->magic)) == 0 && seg->version == TBI_STORE_VERSION &&
+            seg->msgtype == msgtype && seg->device_id == device_id && seg->fields <= TBI_STORE_MAX_FIELDS &&
+            seg->ts_field < seg->fields) {
+            segments++;
+            ret = fn(seg, (long)st.st_size, userdata);
+        } else {
+            TBI_LOG_WARN("Skipping invalid segment %s\n", path);
+        }
+        munmap((void*)seg, st.st_size);
+    }
+
+    free(seqs);
+    return (ret < 0) ? -1 : segments;
+}
+
+/** @brief Earliest and latest timestamp of a stream, see @ref tbi_query_range() */
+typedef struct {
+    uint64_t min_ts;
+    uint64_t max_ts;
+    uint64_t rows;
+} tbi_query_range_t;
+
+static int tbi_query_range_segment(const tbi_store_header_t *seg, long size, void *userdata)
+{
+    tbi_query_range_t *range = (tbi_query_range_t*)userdata;
+
+    if(__atomic_load_n(&seg->blocks, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+    if(seg->min_ts < range->min_ts)
+        range->min_ts = seg->min_ts;
+    if(seg->max_ts > range->max_ts)
+        range->max_ts = seg->max_ts;
+    range->rows += seg->rows;
+    return 0;
+}
+
+/**
+ * @brief Get the time range and number of rows stored for a device and message type
+ *
+ * @param[in] dir       Store directory
+ * @param[in] device_id Device
+ * @param[in] msgtype   Message type
+ * @param[out] min_ts   Earliest timestamp, ms since the epoch
+ * @param[out] max_ts   Latest timestamp, ms since the epoch
+ * @param[out] rows     Rows stored, may be NULL
+ *
+ * @return 0 on success, or a negative error value if nothing is stored
+*/
+int tbi_query_range(const char *dir, uint64_t device_id, int msgtype, uint64_t *min_ts, uint64_t *max_ts, uint64_t *rows)
+{
+    tbi_query_range_t range = { UINT64_MAX, 0, 0 };
+
+    if(!dir || !min_ts || !max_ts)
+        return -1;
+    if(tbi_query_segments(dir, device_id, msgtype, tbi_query_range_segment, &range) < 0 || range.rows == 0)
+        return -1;
+
+    *min_ts = range.min_ts;
+    *max_ts = range.max_ts;
+    if(rows)
+        *rows = range.rows;
+    return 0;
+}
+
+/** @brief Query being run over the segments of a stream */
+typedef struct {
+    tbi_query_block_t blk;
+    tbi_query_block_fn fn;
+    void *userdata;
+    tbi_query_stats_t stats;
+} tbi_query_run_t;
+
+/** @brief Read the blocks of a segment that may match the query */
+static int tbi_query_run_segment(const tbi_store_header_t *seg, long size, void *userdata)
+{
+    tbi_query_run_t *run = (tbi_query_run_t*)userdata;
+    tbi_query_block_t *blk = &run->blk;
+    const tbi_query_t *query = blk->query;
+    const tbi_store_index_t *entry;
+    uint32_t blocks, b;
+    int i, ret, match;
+
+    /* Blocks are complete up to the published count, even while the segment is written */
+    blocks = __atomic_load_n(&seg->blocks, __ATOMIC_ACQUIRE);
+    if(blocks > TBI_STORE_INDEX_LEN)
+        return 0;
+    run->stats.segments++;
+    if(blocks == 0 || seg->max_ts < query->from_ts || (query->to_ts && seg->min_ts >= query->to_ts)) {
+        run->stats.segments_skipped++;
+        return 0;
+    }
+    for(i = 0; i < query->preds_len; i++) {
+        if(query->preds[i].field < 0 || query->preds[i].field >= seg->fields) {
+            TBI_LOG_ERROR("Predicate on column %d, message type %d has %d!\n", query->preds[i].field,
+                seg->msgtype, seg->fields);
+            return -1;
+        }
+    }
+
+    blk->seg = seg;
+    for(b = 0; b < blocks; b++) {
+        entry = &seg->index[b];
+        run->stats.blocks++;
+        if(entry->max_ts < query->from_ts || (query->to_ts && entry->min_ts >= query->to_ts)) {
+            run->stats.blocks_skipped++;
+            continue;
+        }
+        if(tbi_query_block_init(blk, entry, size) != 0) {
+            TBI_LOG_WARN("Skipping malformed block %u of segment for message type %d\n", b, seg->msgtype);
+            continue;
+        }
+
+        /* Time range first, then the predicates, until no row can match */
+        match = 1;
+        if(entry->min_ts < query->from_ts)
+            match = tbi_query_filter(blk, seg->ts_field, TBI_QUERY_GE, (int64_t)query->from_ts);
+        if(match && query->to_ts && entry->max_ts >= query->to_ts)
+            match = tbi_query_filter(blk, seg->ts_field, TBI_QUERY_LT, (int64_t)query->to_ts);
+        for(i = 0; match && i < query->preds_len; i++)
+            match = tbi_query_filter(blk, query->preds[i].field, query->preds[i].op, query->preds[i].value);
+        if(!match) {
+            run->stats.blocks_skipped += (blk->decoded == 0);
+            run->stats.rows_scanned += (blk->decoded != 0) ? blk->rows : 0;
+            continue;
+        }
+
+        run->stats.rows_scanned += blk->rows;
+        if(blk->all) {
+            run->stats.rows_matched += blk->rows;
+        } else {
+            for(i = 0; i < TBI_QUERY_MASK_LEN; i++)
+                run->stats.rows_matched += __builtin_popcountll(blk->mask[i]);
+        }
+        if((ret = run->fn(blk, run->userdata)) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Run a query over the segments of its stream, calling fn for every
+ * block with matching rows
+ *
+ * @return 0 on success, or a negative error value
+*/
+static int tbi_query_run(const char *dir, const tbi_query_t *query, tbi_query_block_fn fn, void *userdata,
+    tbi_query_stats_t *stats)
+{
+    tbi_query_run_t *run;
+    int ret;
+
+    if(!dir || !query || query->preds_len < 0 || query->preds_len > TBI_QUERY_MAX_PREDS)
+        return -1;
+
+    /* Decoded columns take 128 KiB, kept off the stack */
+    if(!(run = calloc(1, sizeof(tbi_query_run_t))))
+        return -1;
+    if(!(run->blk.values = malloc((size_t)TBI_STORE_MAX_FIELDS * TBI_STORE_BLOCK_ROWS * sizeof(uint32_t)))) {
+        free(run);
+        return -1;
+    }
+    run->blk.query = query;
+    run->fn = fn;
+    run->userdata = userdata;
+
+    ret = tbi_query_segments(dir, query->device_id, query->msgtype, tbi_query_run_segment, run);
+    if(stats)
+        *stats = run->stats;
+    free(run->blk.values);
+    free(run);
+    return (ret < 0) ? -1 : 0;
+}
+
+/**
+ * @brief Get the matching rows of a block, as a list of row numbers
+ *
+ * @param[in] blk       Block
+ * @param[out] rows     Row numbers
+ *
+ * @return number of rows
+*/
+static int tbi_query_selection(const tbi_query_block_t *blk, uint16_t *rows)
+{
+    uint64_t bits;
+    int w, n = 0;
+
+    if(blk->all) {
+        for(n = 0; n < blk->rows; n++)
+            rows[n] = n;
+        return n;
+    }
+    for(w = 0; w < TBI_QUERY_MASK_LEN; w++) {
+        for(bits = blk->mask[w]; bits; bits &= bits - 1)
+            rows[n++] = w * 64 + __builtin_ctzll(bits);
+    }
+    return n;
+}
+
+/** @brief Scan being run, see @ref tbi_query_scan() */
+typedef struct {
+    tbi_msg_column_callback cb;
+    void *userdata;
+    void *cols[TBI_STORE_MAX_FIELDS];
+    uint16_t rows[TBI_STORE_BLOCK_ROWS];
+} tbi_query_scan_t;
+
+/** @brief Hand the matching rows of a block to the scan callback, in the types of their columns */
+static int tbi_query_scan_block(tbi_query_block_t *blk, void *userdata)
+{
+    tbi_query_scan_t *scan = (tbi_query_scan_t*)userdata;
+    const tbi_store_header_t *seg = blk->seg;
+    tbi_batch_info_t info = {0};
+    tbi_columns_t cols;
+    const uint32_t *values;
+    int f, i, n;
+
+    n = tbi_query_selection(blk, scan->rows);
+    for(f = 0; f < seg->fields; f++) {
+        values = tbi_query_column(blk, f);
+        switch(seg->format[f]) {
+            case TBI_TIMEDIFF_S:
+            case TBI_TIMEDIFF_MS:
+                for(i = 0; i < n; i++)
+                    ((uint64_t*)scan->cols[f])[i] = blk->min_ts + (int64_t)(int32_t)values[scan->rows[i]];
+                break;
+            case TBI_UINT32:
+            case TBI_INT32:
+                for(i = 0; i < n; i++)
+                    ((uint32_t*)scan->cols[f])[i] = values[scan->rows[i]];
+                break;
+            case TBI_UINT16:
+            case TBI_INT16:
+                for(i = 0; i < n; i++)
+                    ((uint16_t*)scan->cols[f])[i] = (uint16_t)values[scan->rows[i]];
+                break;
+            default:
+                for(i = 0; i < n; i++)
+                    ((uint8_t*)scan->cols[f])[i] = (uint8_t)values[scan->rows[i]];
+                break;
+        }
+    }
+
+    cols.count = n;
+    cols.fields = seg->fields;
+    cols.format = seg->format;
+    cols.cols = scan->cols;
+    info.fd = -1;
+    info.device_id = seg->device_id;
+    scan->cb(seg->msgtype, &cols, &info, scan->userdata);
+    return 0;
+}
+
+/**
+ * @brief Scan the rows of a device and message type within a time range that
+ * match all predicates. Rows are handed to the callback a block at a time, as
+ * columns in the types of their fields, with timestamps in ms since the epoch,
+ * see @ref tbi_columns_t. The batch info only has the device set
+ *
+ * @param[in] dir       Store directory
+ * @param[in] query     Query
+ * @param[in] cb        Called for every block with matching rows
+ * @param[in] userdata  Passed to cb
+ * @param[out] stats    How much of the store was read, may be NULL
+ *
+ * @return 0 on success, or a negative error value
+*/
+int tbi_query_scan(const char *dir, const tbi_query_t *query, tbi_msg_column_callback cb, void *userdata,
+    tbi_query_stats_t *stats)
+{
+    tbi_query_scan_t *scan;
+    uint8_t *data;
+    int f, ret;
+
+    if(!cb)
+        return -1;
+    if(!(scan = calloc(1, sizeof(tbi_query_scan_t))))
+        return -1;
+    if(!(data = malloc((size_t)TBI_STORE_MAX_FIELDS * TBI_STORE_BLOCK_ROWS * sizeof(uint64_t)))) {
+        free(scan);
+        return -1;
+    }
+    for(f = 0; f < TBI_STORE_MAX_FIELDS; f++)
+        scan->cols[f] = data + (size_t)f * TBI_STORE_BLOCK_ROWS * sizeof(uint64_t);
+    scan->cb = cb;
+    scan->userdata = userdata;
+
+    ret = tbi_query_run(dir, query, tbi_query_scan_block, scan, stats);
+    free(data);
+    free(scan);
+    return ret;
+}
+
+/** @brief Aggregation being run, see @ref tbi_query_aggregate() */
+typedef struct {
+    int field;
+    uint64_t from_ts;
+    uint32_t bucket_ms;
+    tbi_query_bucket_t *buckets;
+    int buckets_len;
+    uint16_t rows[TBI_STORE_BLOCK_ROWS];
+} tbi_query_agg_t;
+
+/** @brief Add a value to a bucket */
+static inline void tbi_query_bucket_add(tbi_query_bucket_t *bucket, int64_t value)
+{
+    if(bucket->count == 0 || value < bucket->min)
+        bucket->min = value;
+    if(bucket->count == 0 || value > bucket->max)
+        bucket->max = value;
+    bucket->sum += value;
+    bucket->count++;
+}
+
+/** @brief Add the matching rows of a block to their buckets */
+static int tbi_query_agg_block(tbi_query_block_t *blk, void *userdata)
+{
+    tbi_query_agg_t *agg = (tbi_query_agg_t*)userdata;
+    uint8_t field_type = blk->seg->format[agg->field];
+    const uint32_t *values, *ts;
+    tbi_query_bucket_t *bucket;
+    int64_t min, max, sum, base = 0, value;
+    uint64_t first, last;
+    int i, n;
+
+    values = tbi_query_column(blk, agg->field);
+    if(tbi_query_is_ts(field_type))
+        base = (int64_t)blk->min_ts;
+
+    /* Block within a single bucket, aggregated in one pass */
+    first = ((blk->min_ts > agg->from_ts ? blk->min_ts : agg->from_ts) - agg->from_ts) / agg->bucket_ms;
+    last = (blk->max_ts - agg->from_ts) / agg->bucket_ms;
+    if(first == last && blk->all && first < (uint64_t)agg->buckets_len) {
+        bucket = &agg->buckets[first];
+        if(tbi_query_is_signed(field_type)) {
+            min = max = (int32_t)values[0];
+            sum = 0;
+            for(i = 0; i < blk->rows; i++) {
+                min = (int32_t)values[i] < min ? (int32_t)values[i] : min;
+                max = (int32_t)values[i] > max ? (int32_t)values[i] : max;
+                sum += (int32_t)values[i];
+            }
+        } else {
+            min = max = values[0];
+            sum = 0;
+            for(i = 0; i < blk->rows; i++) {
+                min = values[i] < min ? values[i] : min;
+                max = values[i] > max ? values[i] : max;
+                sum += values[i];
+            }
+        }
+        min += base;
+        max += base;
+        sum += base * blk->rows;
+        if(bucket->count == 0 || min < bucket->min)
+            bucket->min = min;
+        if(bucket->count == 0 || max > bucket->max)
+            bucket->max = max;
+        bucket->sum += sum;
+        bucket->count += blk->rows;
+        return 0;
+    }
+
+    ts = tbi_query_column(blk, blk->seg->ts_field);
+    n = tbi_query_selection(blk, agg->rows);
+    for(i = 0; i < n; i++) {
+        first = (blk->min_ts + (int64_t)(int32_t)ts[agg->rows[i]] - agg->from_ts) / agg->bucket_ms;
+        if(first >= (uint64_t)agg->buckets_len)
+            continue;
+        value = tbi_query_is_signed(field_type) ? (int32_t)values[agg->rows[i]] : (int64_t)values[agg->rows[i]];
+        tbi_query_bucket_add(&agg->buckets[first], value + base);
+    }
+    return 0;
+}
+
+/**
+ * @brief Downsample a column of the rows of a device and message type that
+ * match all predicates: min, max, sum and count over consecutive time buckets,
+ * starting from the start of the time range
+ *
+ * @param[in] dir           Store directory
+ * @param[in] query         Query, with a start of the time range
+ * @param[in] field         Column to aggregate
+ * @param[in] bucket_ms     Length of a bucket
+ * @param[out] buckets      Buckets
+ * @param[in] buckets_len   Max number of buckets. The time range is cut to fit them
+ * @param[out] stats        How much of the store was read, may be NULL
+ *
+ * @return number of buckets in the time range, or a negative error value
+*/
+int tbi_query_aggregate(const char *dir, const tbi_query_t *query, int field, uint32_t bucket_ms,
+    tbi_query_bucket_t *buckets, int buckets_len, tbi_query_stats_t *stats)
+{
+    tbi_query_agg_t *agg;
+    tbi_query_t cut;
+    uint64_t end_ts;
+    int i, ret;
+
+    if(!query || !buckets || bucket_ms == 0 || buckets_len <= 0 || field < 0 || field >= TBI_STORE_MAX_FIELDS)
+        return -1;
+
+    /* Time range ends with the last bucket */
+    cut = *query;
+    end_ts = query->from_ts + (uint64_t)bucket_ms * buckets_len;
+    if(cut.to_ts == 0 || cut.to_ts > end_ts)
+        cut.to_ts = end_ts;
+    if(cut.to_ts <= cut.from_ts)
+        return 0;
+    buckets_len = (int)((cut.to_ts - cut.from_ts + bucket_ms - 1) / bucket_ms);
+    memset(buckets, 0, buckets_len * sizeof(tbi_query_bucket_t));
+    for(i = 0; i < buckets_len; i++)
+        buckets[i].start_ts = cut.from_ts + (uint64_t)bucket_ms * i;
+
+    if(!(agg = calloc(1, sizeof(tbi_query_agg_t))))
+        return -1;
+    agg->field = field;
+    agg->from_ts = cut.from_ts;
+    agg->bucket_ms = bucket_ms;
+    agg->buckets = buckets;
+    agg->buckets_len = buckets_len;
+
+    ret = tbi_query_run(dir, &cut, tbi_query_agg_block, agg, stats);
+    free(agg);
+    return (ret < 0) ? -1 : buckets_len;
+}
@@ -0,0 +1,68 @@
+/**
+* @file     query.h
+* @brief    Header file for time-range queries over the telemetry segment store
+*/
+
+#ifndef __TBI_QUERY_H
+#define __TBI_QUERY_H
+
+#include <stdint.h>
+#include "tbi_types.h"
+#include "store.h"
+
+/** @brief Max number of field predicates in a query */
+#define TBI_QUERY_MAX_PREDS 8
+
+/** @brief Comparison of a field predicate */
+typedef enum {
+    TBI_QUERY_EQ = 0,
+    TBI_QUERY_NE = 1,
+    TBI_QUERY_LT = 2,
+    TBI_QUERY_LE = 3,
+    TBI_QUERY_GT = 4,
+    TBI_QUERY_GE = 5,
+} tbi_query_op_t;
+
+/** @brief Field predicate, comparing a column to a value */
+typedef struct {
+    int field;                  /** @brief Column */
+    tbi_query_op_t op;          /** @brief Comparison of the column to the value */
+    int64_t value;              /** @brief Value in the type of the column, a timestamp in ms since the epoch */
+} tbi_query_pred_t;
+
+/** @brief Rows of a device and message type within a time range, matching all predicates */
+typedef struct {
+    uint64_t device_id;         /** @brief Device */
+    int msgtype;                /** @brief Message type */
+    uint64_t from_ts;           /** @brief Start of the time range, ms since the epoch */
+    uint64_t to_ts;             /** @brief End of the time range, exclusive. 0 for no end */
+    int preds_len;              /** @brief Number of predicates */
+    tbi_query_pred_t preds[TBI_QUERY_MAX_PREDS]; /** @brief Predicates, all must hold */
+} tbi_query_t;
+
+/** @brief Aggregates of a column over a time bucket, see @ref tbi_query_aggregate() */
+typedef struct {
+    uint64_t start_ts;          /** @brief Start of the bucket, ms since the epoch */
+    uint64_t count;             /** @brief Matching rows in the bucket */
+    int64_t min;                /** @brief Smallest value, if count is nonzero */
+    int64_t max;                /** @brief Largest value, if count is nonzero */
+    int64_t sum;                /** @brief Sum of the values, the average is sum / count */
+} tbi_query_bucket_t;
+
+/** @brief How much of the store a query read */
+typedef struct {
+    uint64_t segments;          /** @brief Segments of the stream */
+    uint64_t segments_skipped;  /** @brief Segments outside the time range */
+    uint64_t blocks;            /** @brief Blocks in the segments read */
+    uint64_t blocks_skipped;    /** @brief Blocks skipped by the time index or the column min and max */
+    uint64_t rows_scanned;      /** @brief Rows of the blocks read */
+    uint64_t rows_matched;      /** @brief Rows matching the query */
+} tbi_query_stats_t;
+
+int tbi_query_range(const char *dir, uint64_t device_id, int msgtype, uint64_t *min_ts, uint64_t *max_ts, uint64_t *rows);
+int tbi_query_scan(const char *dir, const tbi_query_t *query, tbi_msg_column_callback cb, void *userdata,
+    tbi_query_stats_t *stats);
+int tbi_query_aggregate(const char *dir, const tbi_query_t *query, int field, uint32_t bucket_ms,
+    tbi_query_bucket_t *buckets, int buckets_len, tbi_query_stats_t *stats);
+
+#endif /* __TBI_QUERY_H */
@@ -0,0 +1,505 @@
+/**
+* @file     schema.c
+* @brief    Server registry of message specs. The compiled-in message spec is joined
+*           by specs loaded at runtime from binary descriptors, which compose.py
+*           generates along with messagespec.h. A client is accepted if its spec is
+*           in the registry, and its connection is bound in the handshake to the
+*           dispatch table of the spec, so that frames need no further lookups
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include "schema.h"
+#include "batch.h"
+#include "dcb.h"
+#include "crc16.h"
+#include "utils.h"
+#include "log.h"
+
+/** @brief Max length of a descriptor: header, and ID, flags, number of members
+ * and members of every message type */
+#define TBI_SCHEMA_DESC_MAX_LEN (TBI_SCHEMA_HEADER_LEN + TBI_MAX_MSG_TYPES * (3 + TBI_SCHEMA_MAX_FIELDS))
+
+/** @brief Compute the checksum of a spec, as @ref msgspec_checksum() does for
+ * the compiled-in spec: ID, flags and format of every type, so that specs
+ * differing only in bundling do not collide */
+static uint16_t tbi_schema_checksum(const tbi_schema_t *schema)
+{
+    const tbi_schema_type_t *type;
+    uint16_t crc = crc16_begin();
+    int i, j;
+
+    for(i = 0; i < schema->types_len; i++) {
+        type = &schema->types[i];
+        crc = crc16(crc, type->msgtype);
+        crc = crc16(crc, type->dcb ? TBI_SCHEMA_FLAG_DCB : 0);
+        for(j = 0; j < type->format_len; j++) {
+            crc = crc16(crc, type->format[j]);
+        }
+    }
+    return crc;
+}
+
+/** @brief Check whether two specs describe the same message types */
+static bool tbi_schema_equal(const tbi_schema_t *a, const tbi_schema_t *b)
+{
+    int i;
+
+    if(a->version != b->version || a->types_len != b->types_len)
+        return false;
+    for(i = 0; i < a->types_len; i++) {
+        if(a->types[i].msgtype != b->types[i].msgtype || a->types[i].dcb != b->types[i].dcb ||
+            a->types[i].format_len != b->types[i].format_len ||
+            memcmp(a->types[i].format, b->types[i].format, a->types[i].format_len) != 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Parse a binary descriptor: @ref TBI_SCHEMA_MAGIC, format version, message
+ * spec version and number of message types, then for every type in message spec
+ * order its ID, flags (@ref TBI_SCHEMA_FLAG_DCB), number of members and the field
+ * type of each member
+ *
+ * @param[in] desc      Descriptor
+ * @param[in] len       Descriptor length
+ *
+ * @return spec, or NULL if the descriptor is invalid
+*/
+static tbi_schema_t *tbi_schema_parse(const uint8_t *desc, int len)
+{
+    tbi_schema_t *schema;
+    tbi_schema_type_t *type;
+    uint16_t seen = 0;
+    uint8_t flags;
+    int off, i, j;
+
+    if(len < TBI_SCHEMA_HEADER_LEN || memcmp(desc, TBI_SCHEMA_MAGIC, 4) != 0 || desc[4] != TBI_SCHEMA_DESC_VERSION)
+        return NULL;
+    if(desc[6] == 0 || desc[6] > TBI_MAX_MSG_TYPES)
+        return NULL;
+
+    if(!(schema = calloc(1, sizeof(tbi_schema_t))))
+        return NULL;
+    schema->version = desc[5];
+    schema->types_len = desc[6];
+
+    off = TBI_SCHEMA_HEADER_LEN;
+    for(i = 0; i < schema->types_len; i++) {
+        type = &schema->types[i];
+        if(len < off + 3)
+            goto exit_invalid;
+        type->msgtype = desc[off];
+        flags = desc[off + 1];
+        type->format_len = desc[off + 2];
+        off += 3;
+
+        /* Every type once, with at least one member */
+        if(type->msgtype >= TBI_MAX_MSG_TYPES || (seen & (1u << type->msgtype)) || (flags & ~TBI_SCHEMA_FLAG_DCB) ||
+            type->format_len == 0 || len < off + type->format_len)
+            goto exit_invalid;
+        seen |= 1u << type->msgtype;
+        type->dcb = (flags & TBI_SCHEMA_FLAG_DCB) != 0;
+
+        for(j = 0; j < type->format_len; j++) {
+            if(desc[off + j] > TBI_INT32)
+                goto exit_invalid;
+            type->format[j] = desc[off + j];
+        }
+        off += type->format_len;
+    }
+    if(off != len)
+        goto exit_invalid;
+
+    schema->csum = tbi_schema_checksum(schema);
+    return schema;
+
+exit_invalid:
+    free(schema);
+    return NULL;
+}
+
+/** @brief Describe the compiled-in message spec of a context as a registry entry */
+static tbi_schema_t *tbi_schema_from_ctx(tbi_ctx_t *tbi)
+{
+    tbi_schema_t *schema;
+    tbi_msg_ctx_t *ctx;
+    int i;
+
+    if(tbi->msg_ctxs_len <= 0 || tbi->msg_ctxs_len > TBI_MAX_MSG_TYPES)
+        return NULL;
+    if(!(schema = calloc(1, sizeof(tbi_schema_t))))
+        return NULL;
+
+    schema->version = tbi->msgspec_version;
+    schema->csum = msgspec_checksum(tbi);
+    schema->types_len = tbi->msg_ctxs_len;
+    for(i = 0; i < tbi->msg_ctxs_len; i++) {
+        ctx = &tbi->msg_ctxs[i];
+        if(ctx->format_len < 0 || ctx->format_len > TBI_SCHEMA_MAX_FIELDS) {
+            free(schema);
+            return NULL;
+        }
+        schema->types[i].msgtype = ctx->msgtype;
+        schema->types[i].dcb = ctx->dcb;
+        schema->types[i].format_len = ctx->format_len;
+        memcpy(schema->types[i].format, ctx->format, ctx->format_len);
+    }
+    return schema;
+}
+
+/**
+ * @brief Create the registry of a server, holding its compiled-in message spec.
+ * Does nothing if the registry exists
+ *
+ * @param[in] tbi       TBI context, with message spec registered
+ *
+ * @return 0 on success, or a negative error value
+*/
+int tbi_schemas_init(tbi_ctx_t *tbi)
+{
+    tbi_schemas_t *schemas;
+
+    if(tbi->schemas)
+        return 0;
+    if(!tbi->msg_ctxs)
+        return -1;
+
+    if(!(schemas = calloc(1, sizeof(tbi_schemas_t))))
+        return -1;
+    if(!(schemas->schemas[0] = tbi_schema_from_ctx(tbi))) {
+        free(schemas);
+        return -1;
+    }
+    pthread_mutex_init(&schemas->lock, NULL);
+    schemas->len = 1;
+    tbi->schemas = schemas;
+    return 0;
+}
+
+/**
+ * @brief Add a message spec to the registry from its binary descriptor. Specs
+ * already running servers look up are never changed or removed, so this may be
+ * called while the server and its workers are running
+ *
+ * @param[in] tbi       TBI context, with message spec registered
+ * @param[in] desc      Descriptor
+ * @param[in] len       Descriptor length
+ *
+ * @return 1 if added, 0 if already in the registry, or a negative error value
+*/
+int tbi_schemas_add(tbi_ctx_t *tbi, const uint8_t *desc, int len)
+{
+    tbi_schemas_t *schemas;
+    tbi_schema_t *schema, *known;
+    int i, ret = 1;
+
+    if(tbi_schemas_init(tbi) != 0)
+        return -1;
+    schemas = tbi->schemas;
+
+    if(!(schema = tbi_schema_parse(desc, len))) {
+        TBI_LOG_ERROR("Invalid message spec descriptor!\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&schemas->lock);
+    for(i = 0; i < schemas->len; i++) {
+        known = schemas->schemas[i];
+        if(known->version != schema->version || known->csum != schema->csum)
+            continue;
+
+        /* Clients are told apart by version and checksum only */
+        if(!tbi_schema_equal(known, schema)) {
+            TBI_LOG_ERROR("Message spec version %u with checksum 0x%04X differs from the one registered!\n",
+                schema->version, schema->csum);
+            ret = -1;
+        } else {
+            ret = 0;
+        }
+        goto exit;
+    }
+    if(schemas->len == TBI_MAX_SCHEMAS) {
+        TBI_LOG_ERROR("Too many message specs, max %d!\n", TBI_MAX_SCHEMAS);
+        ret = -1;
+        goto exit;
+    }
+
+    /* Handshakes see the spec once it is complete */
+    schemas->schemas[schemas->len] = schema;
+    __atomic_store_n(&schemas->len, schemas->len + 1, __ATOMIC_RELEASE);
+    TBI_LOG_INFO("Registered message spec version %u with checksum 0x%04X\n", schema->version, schema->csum);
+    schema = NULL;
+
+exit:
+    pthread_mutex_unlock(&schemas->lock);
+    free(schema);
+    return ret;
+}
+
+/**
+ * @brief Add a message spec to the registry from a descriptor file
+ *
+ * @param[in] tbi       TBI context, with message spec registered
+ * @param[in] path      Descriptor file
+ *
+ * @return 1 if added, 0 if already in the registry, or a negative error value
+*/
+int tbi_schemas_load(tbi_ctx_t *tbi, const char *path)
+{
+    uint8_t desc[TBI_SCHEMA_DESC_MAX_LEN + 1];
+    FILE *f;
+    int len, ret;
+
+    if(!(f = fopen(path, "rb"))) {
+        TBI_LOG_ERROR("Unable to open message spec %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    len = (int)fread(desc, 1, sizeof(desc), f);
+    fclose(f);
+
+    if(len > TBI_SCHEMA_DESC_MAX_LEN || (ret = tbi_schemas_add(tbi, desc, len)) < 0) {
+        TBI_LOG_ERROR("Unable to register message spec %s\n", path);
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief Add the message specs of every descriptor file in a directory, named
+ * *@ref TBI_SCHEMA_EXT. Descriptors that fail to load are skipped
+ *
+ * @param[in] tbi       TBI context, with message spec registered
+ * @param[in] dir       Directory
+ *
+ * @return number of specs added, or a negative error value if the directory
+ *          could not be read
+*/
+int tbi_schemas_load_dir(tbi_ctx_t *tbi, const char *dir)
+{
+    char path[4096];
+    struct dirent *ent;
+    size_t name_len, ext_len = strlen(TBI_SCHEMA_EXT);
+    int ret, added = 0;
+    DIR *d;
+
+    if(!(d = opendir(dir))) {
+        TBI_LOG_ERROR("Unable to open message spec directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    while((ent = readdir(d))) {
+        name_len = strlen(ent->d_name);
+        if(name_len <= ext_len || strcmp(ent->d_name + name_len - ext_len, TBI_SCHEMA_EXT) != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if((ret = tbi_schemas_load(tbi, path)) > 0)
+            added += ret;
+    }
+    closedir(d);
+    return added;
+}
+
+/**
+ * @brief Free a registry and its specs, once no context refers to them
+ *
+ * @param[in] schemas   Registry
+*/
+void tbi_schemas_free(tbi_schemas_t *schemas)
+{
+    int i;
+
+    if(!schemas)
+        return;
+    for(i = 0; i < schemas->len; i++) {
+        free(schemas->schemas[i]);
+    }
+    pthread_mutex_destroy(&schemas->lock);
+    free(schemas);
+}
+
+/** @brief Add a message type to the largest native message, and the most
+ * members of any type and any bundled type */
+static void tbi_schema_limits_add(const tbi_msg_ctx_t *ctx, int *max_size, int *max_fields, int *max_dcb_fields)
+{
+    int native_len = msg_native_len(ctx->format, ctx->format_len);
+
+    if(native_len > *max_size)
+        *max_size = native_len;
+    if(ctx->raw_size > *max_size)
+        *max_size = ctx->raw_size;
+    if(ctx->format_len > *max_fields)
+        *max_fields = ctx->format_len;
+    if(ctx->dcb && ctx->format_len > *max_dcb_fields)
+        *max_dcb_fields = ctx->format_len;
+}
+
+/**
+ * @brief Get the largest native message, and the most members of any type and
+ * any bundled type, over the message spec of a context and the specs bound to it
+ *
+ * @param[in]  tbi              TBI context
+ * @param[out] max_size         Largest native message, in bytes
+ * @param[out] max_fields       Most members of any type
+ * @param[out] max_dcb_fields   Most members of any bundled type
+*/
+void tbi_schema_limits(tbi_ctx_t *tbi, int *max_size, int *max_fields, int *max_dcb_fields)
+{
+    tbi_schema_bind_t *bind;
+    int i, j;
+
+    *max_size = *max_fields = *max_dcb_fields = 0;
+    for(i = 0; i < tbi->msg_ctxs_len; i++) {
+        tbi_schema_limits_add(&tbi->msg_ctxs[i], max_size, max_fields, max_dcb_fields);
+    }
+    if(!tbi->binds)
+        return;
+    for(i = 0; i < TBI_MAX_SCHEMAS; i++) {
+        if(!(bind = tbi->binds[i]))
+            continue;
+        for(j = 0; j < bind->foreign_len; j++) {
+            tbi_schema_limits_add(&bind->foreign[j], max_size, max_fields, max_dcb_fields);
+        }
+    }
+}
+
+/** @brief Take the batch and column callbacks of a foreign type from the
+ * server's type of the same ID */
+static void tbi_schema_foreign_callbacks(tbi_ctx_t *tbi, tbi_msg_ctx_t *foreign)
+{
+    tbi_msg_ctx_t *own = tbi_msg_ctx(tbi, foreign->msgtype);
+
+    foreign->batch_cb = own ? own->batch_cb : NULL;
+    foreign->column_cb = own ? own->column_cb : NULL;
+    foreign->batch_cb_userdata = own ? own->batch_cb_userdata : NULL;
+}
+
+/**
+ * @brief Bind a message spec of the registry to a context, for the connections
+ * of its clients. Done once per context and spec, on the first handshake
+ *
+ * @param[in] tbi       TBI context
+ * @param[in] version   Message spec version of the client
+ * @param[in] csum      Message spec checksum of the client
+ *
+ * @return bound spec, or NULL if the spec is not in the registry or on failure
+*/
+tbi_schema_bind_t *tbi_schema_bind(tbi_ctx_t *tbi, uint8_t version, uint16_t csum)
+{
+    tbi_schemas_t *schemas = tbi->schemas;
+    const tbi_schema_t *schema = NULL;
+    const tbi_schema_type_t *type;
+    tbi_schema_bind_t *bind;
+    tbi_msg_ctx_t *own, *ctx, **binds;
+    int i, t, len, size, fields, dcb_fields;
+
+    if(!schemas)
+        return NULL;
+
+    /* Specs are published once complete */
+    len = __atomic_load_n(&schemas->len, __ATOMIC_ACQUIRE);
+    for(i = 0; i < len; i++) {
+        if(schemas->schemas[i]->version == version && schemas->schemas[i]->csum == csum) {
+            schema = schemas->schemas[i];
+            break;
+        }
+    }
+    if(!schema)
+        return NULL;
+
+    if(!tbi->binds) {
+        if(!(binds = calloc(TBI_MAX_SCHEMAS, sizeof(tbi_schema_bind_t*))))
+            return NULL;
+        __atomic_store_n(&tbi->binds, (tbi_schema_bind_t**)binds, __ATOMIC_RELEASE);
+    }
+    if(tbi->binds[i])
+        return tbi->binds[i];
+
+    if(!(bind = calloc(1, sizeof(tbi_schema_bind_t))))
+        return NULL;
+    bind->schema = schema;
+    for(t = 0; t < schema->types_len; t++) {
+        type = &schema->types[t];
+
+        /* Same format as the server's type, generated codec and every callback apply */
+        own = tbi_msg_ctx(tbi, type->msgtype);
+        if(own && own->dcb == type->dcb && own->format_len == type->format_len &&
+            memcmp(own->format, type->format, type->format_len) == 0) {
+            bind->types[type->msgtype] = own;
+            continue;
+        }
+
+        /* Interpreted codec, messages are laid out by the client's format */
+        ctx = &bind->foreign[bind->foreign_len++];
+        ctx->msgtype = type->msgtype;
+        ctx->dcb = type->dcb;
+        ctx->format_len = type->format_len;
+        ctx->format = type->format;
+        ctx->raw_size = msg_native_len(type->format, type->format_len);
+        ctx->foreign = true;
+        tbi_schema_foreign_callbacks(tbi, ctx);
+        bind->types[type->msgtype] = ctx;
+    }
+    __atomic_store_n(&tbi->binds[i], bind, __ATOMIC_RELEASE);
+
+    /* Batch and DCB decoder fit the largest type, recreate them on next use if the spec has larger */
+    tbi_schema_limits(tbi, &size, &fields, &dcb_fields);
+    if(tbi->batch && (tbi->batch->msg_size < size || tbi->batch->cols_len < fields)) {
+        tbi_batch_deliver(tbi->batch);
+        tbi_batch_free(tbi->batch);
+        tbi->batch = NULL;
+    }
+    if(tbi->dcb_dec && tbi->dcb_dec->max_fields < dcb_fields) {
+        tbi_dcb_dec_free(tbi->dcb_dec);
+        tbi->dcb_dec = NULL;
+    }
+
+    TBI_LOG_INFO("Bound message spec version %u with checksum 0x%04X, %d of %d types differ from the server\n",
+        schema->version, schema->csum, bind->foreign_len, schema->types_len);
+    return bind;
+}
+
+/**
+ * @brief Update the foreign types of the specs bound to a context after its
+ * batch or column callbacks changed
+ *
+ * @param[in] tbi       TBI context
+*/
+void tbi_schema_binds_refresh(tbi_ctx_t *tbi)
+{
+    tbi_schema_bind_t *bind;
+    int i, j;
+
+    if(!tbi->binds)
+        return;
+    for(i = 0; i < TBI_MAX_SCHEMAS; i++) {
+        if(!(bind = tbi->binds[i]))
+            continue;
+        for(j = 0; j < bind->foreign_len; j++) {
+            tbi_schema_foreign_callbacks(tbi, &bind->foreign[j]);
+        }
+    }
+}
+
+/**
+ * @brief Free the specs bound to a context, once its connections are closed
+ *
+ * @param[in] tbi       TBI context
+*/
+void tbi_schema_binds_free(tbi_ctx_t *tbi)
+{
+    int i;
+
+    if(!tbi->binds)
+        return;
+    for(i = 0; i < TBI_MAX_SCHEMAS; i++) {
+        free(tbi->binds[i]);
+    }
+    free(tbi->binds);
+    tbi->binds = NULL;
+}
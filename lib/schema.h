@@ -0,0 +1,82 @@
+/**
+* @file     schema.h
+* @brief    Header file for the server registry of message specs, loaded at runtime
+*           from binary descriptors so that clients of several firmware generations
+*           can connect to the same server
+*/
+
+#ifndef __TBI_SCHEMA_H
+#define __TBI_SCHEMA_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "tbi_types.h"
+
+/** @brief Binary schema descriptor magic and format version */
+#define TBI_SCHEMA_MAGIC "TBIS"
+#define TBI_SCHEMA_DESC_VERSION 1
+
+/** @brief File name extension of descriptors */
+#define TBI_SCHEMA_EXT ".tbis"
+
+/** @brief Length of the descriptor header: magic, format version, message spec
+ * version and number of message types */
+#define TBI_SCHEMA_HEADER_LEN 7
+
+/** @brief Message type flag in a descriptor: bundled into DCB frames */
+#define TBI_SCHEMA_FLAG_DCB (1)
+
+/** @brief Max number of message specs in a registry */
+#define TBI_MAX_SCHEMAS 64
+
+/** @brief Max number of members of a message type, the count takes a byte in a descriptor */
+#define TBI_SCHEMA_MAX_FIELDS 255
+
+/** @brief Message type of a message spec, as described in its descriptor */
+typedef struct {
+    uint8_t msgtype;                        /** @brief Message type ID */
+    bool dcb;                               /** @brief Sent in DCB frames */
+    int format_len;                         /** @brief Number of members */
+    uint8_t format[TBI_SCHEMA_MAX_FIELDS];  /** @brief Field type of each member, @ref tbi_msg_field_types_t */
+} tbi_schema_type_t;
+
+/** @brief Message spec known to the server. Immutable once registered, connections
+ * of every worker refer to it for their lifetime */
+typedef struct tbi_schema {
+    uint8_t version;                            /** @brief Message spec version */
+    uint16_t csum;                              /** @brief Checksum of the message spec, see @ref msgspec_checksum() */
+    int types_len;                              /** @brief Number of message types */
+    tbi_schema_type_t types[TBI_MAX_MSG_TYPES]; /** @brief Message types, in message spec order */
+} tbi_schema_t;
+
+/** @brief Registry of message specs, shared by a server and its workers. Specs
+ * are only ever added, so that handshakes look them up without locking */
+typedef struct tbi_schemas {
+    pthread_mutex_t lock;                       /** @brief Serializes adding specs */
+    int len;                                    /** @brief Number of specs, published after the spec */
+    tbi_schema_t *schemas[TBI_MAX_SCHEMAS];     /** @brief Specs, the compiled-in message spec first */
+} tbi_schemas_t;
+
+/** @brief Message spec bound to a TBI context: the dispatch table connections of
+ * the spec use for every frame. A message type of the same format as the type
+ * of the server is the server's own context, with its generated codec, callbacks
+ * and message buffer. Any other type has a context of its own, delivered only to
+ * the batch and column callbacks of its ID */
+typedef struct tbi_schema_bind {
+    const tbi_schema_t *schema;                 /** @brief Bound message spec */
+    tbi_msg_ctx_t *types[TBI_MAX_MSG_TYPES];    /** @brief Context of each message type by ID, NULL if not in the spec */
+    int foreign_len;                            /** @brief Number of contexts in foreign */
+    tbi_msg_ctx_t foreign[TBI_MAX_MSG_TYPES];   /** @brief Contexts of the types that differ from the server's */
+} tbi_schema_bind_t;
+
+int tbi_schemas_init(tbi_ctx_t *tbi);
+int tbi_schemas_add(tbi_ctx_t *tbi, const uint8_t *desc, int len);
+int tbi_schemas_load(tbi_ctx_t *tbi, const char *path);
+int tbi_schemas_load_dir(tbi_ctx_t *tbi, const char *dir);
+void tbi_schemas_free(tbi_schemas_t *schemas);
+tbi_schema_bind_t *tbi_schema_bind(tbi_ctx_t *tbi, uint8_t version, uint16_t csum);
+void tbi_schema_binds_refresh(tbi_ctx_t *tbi);
+void tbi_schema_binds_free(tbi_ctx_t *tbi);
+void tbi_schema_limits(tbi_ctx_t *tbi, int *max_size, int *max_fields, int *max_dcb_fields);
+
+#endif /* __TBI_SCHEMA_H */
@@ -3,66 +3,67 @@
 * @brief    Message (de)serializer implementation
 */
 #include <netinet/in.h>
-#include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include "serializer.h"
 #include "utils.h"
+#include "log.h"
 
-/** @brief Serialize RTM message to a byte stream in a platform-agnostic manner
+/** @brief Serialize RTM message to a byte stream in a platform-agnostic manner,
+ * into a caller-provided buffer
  * 
  * @param[in] msgspec   Binary message spec for given message type
+ * @param[in] msgtype   Message type
  * @param[in] spec_len  Binary message spec length
  * @param[in] in_buf    Buffer to serialize
- * @param[in] in_len    Buffer to serialize length
- * @param[out] out_buf  Output buffer (must be freed after use)
- * @param[out] out_len  Output buffer length
+ * @param[in] in_len    Buffer to serialize length, at least the native length of the message
+ * @param[out] out_buf  Output buffer
+ * @param[in] out_size  Output buffer size
  * 
- * @return 0 on success, or a negative error code
+ * @return number of bytes written, or a negative error code
  */
-int tbi_serialize_rtm(const uint8_t* msgspec, uint8_t msgtype, int spec_len, void *in_buf, int in_len, uint8_t **out_buf, int *out_len)
+int tbi_serialize_rtm_into(const uint8_t* msgspec, uint8_t msgtype, int spec_len, const void *in_buf, int in_len, uint8_t *out_buf, int out_size)
 {
-    uint8_t *buf;
-    uint8_t *in_ptr;
+    const uint8_t *in_ptr;
     uint8_t *out_ptr;
-    int len = 0;
+    int in_off, len;
     int i;
 
-    /* Get total length in bytes and allocate buffer based on it */
-    for(i = 0; i < spec_len; i++) {
-        len += msg_field_type_len(msgspec[i]);
-    }
-    len += 1; // Flags & msgtype
-    buf = (uint8_t*)malloc(len);
-    if(!buf) 
+    /* Input must hold every member, and output must fit the whole message */
+    if(in_len < msg_native_len(msgspec, spec_len))
+        return -1;
+    len = msg_wire_len(msgspec, spec_len);
+    if(len > out_size)
         return -1;
 
-    *out_len = len;
-    in_ptr = (uint8_t*)in_buf;
-    out_ptr = buf;
+    in_ptr = (const uint8_t*)in_buf;
+    out_ptr = out_buf;
     *out_ptr++ = msgtype;
+    in_off = 0;
 
-    /* Convert each element to network-endian byte stream based on size */
+    /* Convert each element to network-endian byte stream based on size, 
+        reading the members from their naturally aligned offsets */
     for(i = 0; i < spec_len; i++) {
-        len = msg_field_type_len(msgspec[i]);
-        switch(len) {
+        in_off = msg_field_native_offset(msgspec[i], in_off);
+        switch(msg_field_type_len(msgspec[i])) {
             case 4:
             {
-                *(uint32_t*)out_ptr = htonl(*(uint32_t*)in_ptr);
-                in_ptr = (void*)((uint32_t*)in_ptr + 1);
+                *(uint32_t*)out_ptr = htonl(*(const uint32_t*)(in_ptr + in_off));
+                in_off += sizeof(uint32_t);
                 out_ptr += sizeof(uint32_t);
                 break;
             }
             case 2:
             {
-                *(uint16_t*)out_ptr = htons(*(uint16_t*)in_ptr);
-                in_ptr = (void*)((uint16_t*)in_ptr + 1);
+                *(uint16_t*)out_ptr = htons(*(const uint16_t*)(in_ptr + in_off));
+                in_off += sizeof(uint16_t);
                 out_ptr += sizeof(uint16_t);
                 break;
             }
             case 1:
             {
-                *out_ptr = *(uint8_t*)in_ptr;
-                in_ptr = (void*)((uint8_t*)in_ptr + 1);
+                *out_ptr = in_ptr[in_off];
+                in_off += sizeof(uint8_t);
                 out_ptr += sizeof(uint8_t);
                 break;
             }
@@ -71,73 +72,67 @@ int tbi_serialize_rtm(const uint8_t* msgspec, uint8_t msgtype, int spec_len, voi
         }
     }
 
-    *out_buf = buf;
-
-    return 0;
+    return len;
 }
 
-/** @brief Deserialize RTM message from a platform-agnostic byte stream to native endianness
+/** @brief Deserialize RTM message from a platform-agnostic byte stream to native endianness,
+ * into a caller-provided buffer
  * 
  * @param[in] msgspec   Binary message spec for given message type
  * @param[in] spec_len  Binary message spec length
- * @param[in] in_buf    Buffer to serialize
- * @param[in] in_len    Buffer to serialize length
- * @param[out] out_buf  Output buffer (must be freed after use if success returned)
- * @param[out] out_len  Output buffer length
+ * @param[in] in_buf    Buffer to deserialize
+ * @param[in] in_len    Buffer to deserialize length
+ * @param[out] out_buf  Output buffer
+ * @param[in] out_size  Output buffer size
  * 
- * @return 0 on success, or a negative error code
+ * @return number of bytes written, up to the end of the last member, or a negative error code
  */
-int tbi_deserialize_rtm(const uint8_t* msgspec, int spec_len, uint8_t *in_buf, int in_len, void** out_buf, int *out_len)
+int tbi_deserialize_rtm_into(const uint8_t* msgspec, int spec_len, const uint8_t *in_buf, int in_len, void* out_buf, int out_size)
 {
-    uint8_t *buf;
-    uint8_t *in_ptr;
+    const uint8_t *in_ptr;
     uint8_t *out_ptr;
-    int len = 1; // Msgtype & flags
+    int out_off, len;
     int i;
 
-    /* Get total length in bytes and allocate buffer based on it */
-    for(i = 0; i < spec_len; i++) {
-        len += msg_field_type_len(msgspec[i]);
-    }
-
     /* Expected and received buffer size must match exactly */
+    len = msg_wire_len(msgspec, spec_len);
     if(in_len != len) {
-        printf("Deserialize length mismatch! Received: %d, expected: %d bytes\n", in_len, len);
+        TBI_LOG_WARN("Deserialize length mismatch! Received: %d, expected: %d bytes\n", in_len, len);
         return -1;
     }
 
-    /* Allocate memory for output buffer */
-    buf = (uint8_t*)malloc(len);
-    if(!buf)
+    /* Output must fit the whole message */
+    if(msg_native_len(msgspec, spec_len) > out_size)
         return -1;
 
-    *out_len = len;
     in_ptr = in_buf;
-    out_ptr = buf;
+    out_ptr = (uint8_t*)out_buf;
+    out_off = 0;
     in_ptr++; // skip msgtype and flags (1st byte)
 
-    /* Convert network-endian byte stream to native in chunk sizes defined by spec */
+    /* Convert network-endian byte stream to native in chunk sizes defined by spec,
+        writing the members to their naturally aligned offsets */
     for(i = 0; i < spec_len; i++) {
-        len = msg_field_type_len(msgspec[i]);
-        switch(len) {
+        out_off = msg_field_native_offset(msgspec[i], out_off);
+        switch(msg_field_type_len(msgspec[i])) {
             case 4:
             {
-                *(uint32_t*)out_ptr = ntohl(*(uint32_t*)in_ptr);
-                out_ptr = (void*)((uint32_t*)out_ptr + 1);
+                *(uint32_t*)(out_ptr + out_off) = ntohl(*(const uint32_t*)in_ptr);
+                out_off += sizeof(uint32_t);
                 in_ptr += sizeof(uint32_t);
                 break;
             }
             case 2:
             {
-                *(uint16_t*)out_ptr = ntohs(*(uint16_t*)in_ptr);
-                out_ptr = (void*)((uint16_t*)out_ptr + 1);
+                *(uint16_t*)(out_ptr + out_off) = ntohs(*(const uint16_t*)in_ptr);
+                out_off += sizeof(uint16_t);
                 in_ptr += sizeof(uint16_t);
                 break;
             }
             case 1:
             {
-                *out_ptr = *(uint8_t*)in_ptr;
-                out_ptr = (void*)((uint8_t*)out_ptr + 1);
+                out_ptr[out_off] = *in_ptr;
+                out_off += sizeof(uint8_t);
                 in_ptr += sizeof(uint8_t);
                 break;
             }
@@ -146,7 +141,70 @@ int tbi_deserialize_rtm(const uint8_t* msgspec, int spec_len, uint8_t *in_buf, i
         }
     }
 
-    *out_buf = (void*)buf;
+    return out_off;
+}
+
+/** @brief Deserialize RTM message from a platform-agnostic byte stream into a row of
+ * a column per struct member, see @ref tbi_columns_t. Timestamps are rebuilt into
+ * milliseconds since the epoch
+ * 
+ * @param[in] msgspec   Binary message spec for given message type
+ * @param[in] spec_len  Binary message spec length
+ * @param[in] in_buf    Buffer to deserialize
+ * @param[in] in_len    Buffer to deserialize length
+ * @param[out] cols     Column of each member
+ * @param[in] row       Row to write
+ * @param[in] start_ts  Client start timestamp in ms, timestamps are relative to this
+ * 
+ * @return 0 on success, or a negative error code
+ */
+int tbi_deserialize_rtm_columns(const uint8_t* msgspec, int spec_len, const uint8_t *in_buf, int in_len, 
+    void* const* cols, int row, uint64_t start_ts)
+{
+    const uint8_t *in_ptr;
+    timediff_ms tms;
+    uint32_t v32;
+    uint16_t v16;
+    int i;
+
+    /* Expected and received buffer size must match exactly */
+    if(in_len != msg_wire_len(msgspec, spec_len)) {
+        TBI_LOG_WARN("Deserialize length mismatch! Received: %d, expected: %d bytes\n", in_len, msg_wire_len(msgspec, spec_len));
+        return -1;
+    }
+
+    in_ptr = in_buf + 1; // skip msgtype and flags (1st byte)
+    for(i = 0; i < spec_len; i++) {
+        switch(msgspec[i]) {
+            case TBI_TIMEDIFF_MS:
+                memcpy(&v32, in_ptr, sizeof(v32));
+                v32 = ntohl(v32);
+                memcpy(&tms, &v32, sizeof(tms));
+                ((uint64_t*)cols[i])[row] = start_ts + (uint64_t)tms.seconds * 1000 + tms.ms;
+                break;
+            case TBI_TIMEDIFF_S:
+                memcpy(&v32, in_ptr, sizeof(v32));
+                ((uint64_t*)cols[i])[row] = start_ts + (uint64_t)ntohl(v32) * 1000;
+                break;
+            case TBI_UINT32:
+            case TBI_INT32:
+                memcpy(&v32, in_ptr, sizeof(v32));
+                ((uint32_t*)cols[i])[row] = ntohl(v32);
+                break;
+            case TBI_UINT16:
+            case TBI_INT16:
+                memcpy(&v16, in_ptr, sizeof(v16));
+                ((uint16_t*)cols[i])[row] = ntohs(v16);
+                break;
+            case TBI_UINT8:
+            case TBI_INT8:
+                ((uint8_t*)cols[i])[row] = *in_ptr;
+                break;
+            default:
+                break;
+        }
+        in_ptr += msg_field_type_len(msgspec[i]);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
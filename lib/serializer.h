@@ -9,7 +9,9 @@
 #include <stdint.h>
 
 
-int tbi_serialize_rtm(const uint8_t* msgspec, uint8_t msgtype, int spec_len, void *in_buf, int in_len, uint8_t **out_buf, int *out_len);
-int tbi_deserialize_rtm(const uint8_t* msgspec, int spec_len, uint8_t *in_buf, int in_len, void** out_buf, int *out_len);
+int tbi_serialize_rtm_into(const uint8_t* msgspec, uint8_t msgtype, int spec_len, const void *in_buf, int in_len, uint8_t *out_buf, int out_size);
+int tbi_deserialize_rtm_into(const uint8_t* msgspec, int spec_len, const uint8_t *in_buf, int in_len, void* out_buf, int out_size);
+int tbi_deserialize_rtm_columns(const uint8_t* msgspec, int spec_len, const uint8_t *in_buf, int in_len, 
+    void* const* cols, int row, uint64_t start_ts);
 
 #endif /* __TBI_SERIALIZER_H */
\ No newline at end of file
@@ -0,0 +1,218 @@
+/**
+* @file     spool.c
+* @brief    Persistent client spool of serialized frames. A ring buffer in a file,
+*           mapped into memory, holding the frames a client has serialized until the
+*           server acknowledges them. Frames survive a crash or reboot of the client,
+*           and are sent straight from the mapping after reconnecting
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+#include "protocol.h"
+#include "utils.h"
+#include "log.h"
+
+/**
+ * @brief Drop what follows the last complete frame, e.g. a frame that was being
+ * written when the client crashed
+ *
+ * @param[in] tbi       TBI context, with message spec registered
+ * @param[in] spool     Spool
+*/
+static void tbi_spool_recover(tbi_ctx_t *tbi, tbi_spool_t *spool)
+{
+    tbi_spool_header_t *hdr = spool->hdr;
+    uint64_t pos;
+    int len;
+
+    if(hdr->tail > hdr->head || hdr->head - hdr->tail > spool->size) {
+        TBI_LOG_WARN("Spool cursors are invalid, discarding its frames\n");
+        hdr->head = hdr->tail = 0;
+        return;
+    }
+
+    for(pos = hdr->tail; pos < hdr->head; pos += len) {
+        len = tbi_protocol_frame_len(tbi, tbi_spool_at(spool, pos), (int)(hdr->head - pos));
+        if(len <= 0) {
+            TBI_LOG_WARN("Dropping %llu bytes of incomplete frames from the spool\n",
+                (unsigned long long)(hdr->head - pos));
+            hdr->head = pos;
+            break;
+        }
+    }
+    if(hdr->head > hdr->tail)
+        TBI_LOG_INFO("Spool holds %llu bytes of unacknowledged frames\n", (unsigned long long)(hdr->head - hdr->tail));
+}
+
+/**
+ * @brief Open a spool file, creating it if needed. Frames left in it by an
+ * earlier run are kept if they were serialized with the same message spec and
+ * checksum feature
+ *
+ * @param[in] tbi       TBI context, with message spec and features set
+ * @param[in] path      Spool file
+ * @param[in] size      Ring size, at least @ref TBI_SPOOL_MIN_SIZE. Rounded up to the page size
+ *
+ * @return spool, or NULL on failure
+*/
+tbi_spool_t *tbi_spool_open(tbi_ctx_t *tbi, const char *path, uint32_t size)
+{
+    tbi_spool_t *spool;
+    tbi_spool_header_t *hdr;
+    uint8_t *ring = MAP_FAILED;
+    uint16_t csum;
+    long page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    bool fresh;
+    int fd;
+
+    if(!tbi || !path || size < TBI_SPOOL_MIN_SIZE || size > UINT32_MAX / 4)
+        return NULL;
+    size = (uint32_t)((size + page - 1) / page * page);
+    csum = msgspec_checksum(tbi);
+
+    if(!(spool = calloc(1, sizeof(tbi_spool_t))))
+        return NULL;
+    if((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 || fstat(fd, &st) != 0) {
+        TBI_LOG_ERROR("Unable to open spool %s: %s\n", path, strerror(errno));
+        goto exit_failed;
+    }
+
+    /* A spool of another size is started over */
+    fresh = (st.st_size != (off_t)page + size);
+    if(fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)page + size) != 0)) {
+        TBI_LOG_ERROR("Unable to size spool %s: %s\n", path, strerror(errno));
+        goto exit_failed;
+    }
+    hdr = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(hdr == MAP_FAILED)
+        goto exit_mmap;
+    spool->hdr = hdr;
+    spool->size = size;
+    spool->page = page;
+
+    /* Ring is mapped twice back to back, in a reserved range */
+    ring = mmap(NULL, 2 * (size_t)size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED ||
+        mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, page) == MAP_FAILED ||
+        mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, page) == MAP_FAILED)
+        goto exit_mmap;
+    spool->data = ring;
+    close(fd);
+    fd = -1;
+
+    if(!fresh && (memcmp(hdr->magic, TBI_SPOOL_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != TBI_SPOOL_VERSION ||
+        hdr->size != size)) {
+        TBI_LOG_WARN("Spool %s is invalid, starting over\n", path);
+        fresh = true;
+    }
+    if(!fresh && (hdr->schema_version != tbi->msgspec_version || hdr->schema_csum != csum ||
+        hdr->features != (tbi->features & TBI_FEATURE_CRC32C))) {
+        if(hdr->head != hdr->tail)
+            TBI_LOG_WARN("Spool %s was written with another message spec or features, discarding %llu bytes of frames\n",
+                path, (unsigned long long)(hdr->head - hdr->tail));
+        fresh = true;
+    }
+    if(fresh) {
+        memset(hdr, 0, sizeof(tbi_spool_header_t));
+        memcpy(hdr->magic, TBI_SPOOL_MAGIC, sizeof(hdr->magic));
+        hdr->version = TBI_SPOOL_VERSION;
+        hdr->schema_version = tbi->msgspec_version;
+        hdr->schema_csum = csum;
+        hdr->size = size;
+        hdr->features = tbi->features & TBI_FEATURE_CRC32C;
+    }
+
+    tbi_spool_recover(tbi, spool);
+    return spool;
+
+exit_mmap:
+    TBI_LOG_ERROR("Unable to map spool %s: %s\n", path, strerror(errno));
+exit_failed:
+    if(ring != MAP_FAILED)
+        munmap(ring, 2 * (size_t)size);
+    if(spool->hdr)
+        munmap(spool->hdr, page);
+    if(fd >= 0)
+        close(fd);
+    free(spool);
+    return NULL;
+}
+
+/**
+ * @brief Append serialized frames to the spool
+ *
+ * @param[in] spool     Spool
+ * @param[in] buf       Complete frames
+ * @param[in] len       Length of the frames
+ *
+ * @return 1 if appended, 0 if the spool has no room for them
+*/
+int tbi_spool_append(tbi_spool_t *spool, const uint8_t *buf, int len)
+{
+    tbi_spool_header_t *hdr = spool->hdr;
+
+    if((uint64_t)len > spool->size - tbi_spool_len(spool))
+        return 0;
+
+    /* Frames are complete before the head covers them */
+    memcpy(tbi_spool_at(spool, hdr->head), buf, len);
+    __atomic_store_n(&hdr->head, hdr->head + len, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * @brief Advance the read cursor past frames acknowledged by the server, freeing
+ * their room in the spool
+ *
+ * @param[in] spool     Spool
+ * @param[in] pos       Position up to which the frames were received
+*/
+void tbi_spool_ack(tbi_spool_t *spool, uint64_t pos)
+{
+    tbi_spool_header_t *hdr = spool->hdr;
+
+    if(pos > hdr->tail && pos <= hdr->head)
+        __atomic_store_n(&hdr->tail, pos, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Write the spool to disk, so that its frames also survive a power loss.
+ * The mapping alone keeps them over a crash of the process
+ *
+ * @param[in] spool     Spool
+ *
+ * @return 0 on success, or a negative error value
+*/
+int tbi_spool_sync(tbi_spool_t *spool)
+{
+    /* Frames first, then the cursors that cover them */
+    if(msync(spool->data, 2 * (size_t)spool->size, MS_SYNC) != 0 || msync(spool->hdr, spool->page, MS_SYNC) != 0) {
+        TBI_LOG_ERROR("Unable to sync spool: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Unmap the spool, keeping its unacknowledged frames in the file
+ *
+ * @param[in] spool     Spool
+*/
+void tbi_spool_close(tbi_spool_t *spool)
+{
+    if(!spool)
+        return;
+    munmap(spool->data, 2 * (size_t)spool->size);
+    munmap(spool->hdr, spool->page);
+    free(spool);
+}
@@ -0,0 +1,61 @@
+/**
+* @file     spool.h
+* @brief    Header file for the persistent client spool of serialized frames
+*/
+
+#ifndef __TBI_SPOOL_H
+#define __TBI_SPOOL_H
+
+#include <stdint.h>
+#include "tbi_types.h"
+
+/** @brief Spool file magic and format version */
+#define TBI_SPOOL_MAGIC "TBIQ"
+#define TBI_SPOOL_VERSION 1
+
+/** @brief Spool file header, in the first page of the file. Positions count
+ * bytes ever written to the spool, the frame at position p is at p modulo size
+ * of the ring. Frames are written before head is advanced past them, so a spool
+ * left behind by a crash is valid up to its last complete frame. Stored in host
+ * byte order */
+typedef struct {
+    char magic[4];              /** @brief @ref TBI_SPOOL_MAGIC */
+    uint8_t version;            /** @brief @ref TBI_SPOOL_VERSION */
+    uint8_t schema_version;     /** @brief Message spec the frames were serialized with */
+    uint16_t schema_csum;       /** @brief Message spec checksum */
+    uint32_t size;              /** @brief Size of the ring following the header page */
+    uint8_t features;           /** @brief @ref TBI_FEATURE_CRC32C if the frames are checksummed */
+    uint8_t reserved[3];
+    uint64_t start_ts;          /** @brief Client start timestamp the frames are relative to */
+    uint64_t head;              /** @brief Position past the last complete frame */
+    uint64_t tail;              /** @brief Position of the first frame not acknowledged by the server */
+} tbi_spool_header_t;
+
+/** @brief Open spool. The ring is mapped twice back to back, so that up to
+ * size bytes from any position are contiguous in memory */
+typedef struct tbi_spool {
+    tbi_spool_header_t *hdr;    /** @brief Mapped file header */
+    uint8_t *data;              /** @brief Mapped ring, 2 * size bytes */
+    uint32_t size;              /** @brief Ring size, a multiple of the page size */
+    long page;                  /** @brief Page size, the length of the header mapping */
+} tbi_spool_t;
+
+tbi_spool_t *tbi_spool_open(tbi_ctx_t *tbi, const char *path, uint32_t size);
+int tbi_spool_append(tbi_spool_t *spool, const uint8_t *buf, int len);
+void tbi_spool_ack(tbi_spool_t *spool, uint64_t pos);
+int tbi_spool_sync(tbi_spool_t *spool);
+void tbi_spool_close(tbi_spool_t *spool);
+
+/** @brief Get the bytes of frames not acknowledged by the server */
+static inline uint64_t tbi_spool_len(const tbi_spool_t *spool)
+{
+    return spool->hdr->head - spool->hdr->tail;
+}
+
+/** @brief Get the frames from a position up to the head, contiguous in memory */
+static inline uint8_t *tbi_spool_at(const tbi_spool_t *spool, uint64_t pos)
+{
+    return spool->data + (pos % spool->size);
+}
+
+#endif /* __TBI_SPOOL_H */
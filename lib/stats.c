@@ -0,0 +1,169 @@
+/**
+* @file     stats.c
+* @brief    Library statistics implementation
+*/
+
+#include <string.h>
+
+#include "stats.h"
+#include "schema.h"
+#include "buf.h"
+
+#define TBI_STAT_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/** @brief Add a duration to a histogram
+ * 
+ * @param[in] hist  Histogram
+ * @param[in] ns    Duration in nanoseconds
+ */
+void tbi_hist_add(tbi_hist_t* hist, uint64_t ns)
+{
+    int bucket = 0;
+
+    if(ns > 0) {
+        bucket = 64 - __builtin_clzll(ns);
+        if(bucket >= TBI_HIST_BUCKETS)
+            bucket = TBI_HIST_BUCKETS - 1;
+    }
+
+    TBI_STAT_INC(hist->count);
+    TBI_STAT_ADD(hist->sum_ns, ns);
+    TBI_STAT_INC(hist->buckets[bucket]);
+}
+
+/** @brief Add a duration spent on several operations to a histogram, as n
+ * samples of their average
+ * 
+ * @param[in] hist  Histogram
+ * @param[in] ns    Total duration in nanoseconds
+ * @param[in] n     Number of operations
+ */
+void tbi_hist_add_n(tbi_hist_t* hist, uint64_t ns, int n)
+{
+    uint64_t avg;
+    int bucket = 0;
+
+    if(n <= 0)
+        return;
+
+    avg = ns / n;
+    if(avg > 0) {
+        bucket = 64 - __builtin_clzll(avg);
+        if(bucket >= TBI_HIST_BUCKETS)
+            bucket = TBI_HIST_BUCKETS - 1;
+    }
+
+    TBI_STAT_ADD(hist->count, n);
+    TBI_STAT_ADD(hist->sum_ns, ns);
+    TBI_STAT_ADD(hist->buckets[bucket], n);
+}
+
+/** @brief Add a histogram to another */
+static void tbi_hist_sum(tbi_hist_t* out, tbi_hist_t* hist)
+{
+    int i;
+
+    out->count += TBI_STAT_LOAD(hist->count);
+    out->sum_ns += TBI_STAT_LOAD(hist->sum_ns);
+    for(i = 0; i < TBI_HIST_BUCKETS; i++) {
+        out->buckets[i] += TBI_STAT_LOAD(hist->buckets[i]);
+    }
+}
+
+/** @brief Add channel statistics to another */
+static void tbi_channel_stats_sum(tbi_channel_stats_t* out, tbi_channel_stats_t* stats)
+{
+    out->conns_accepted += TBI_STAT_LOAD(stats->conns_accepted);
+    out->conns_closed += TBI_STAT_LOAD(stats->conns_closed);
+    out->handshake_rejects += TBI_STAT_LOAD(stats->handshake_rejects);
+    out->frame_errors += TBI_STAT_LOAD(stats->frame_errors);
+    out->checksum_errors += TBI_STAT_LOAD(stats->checksum_errors);
+    out->connects += TBI_STAT_LOAD(stats->connects);
+    out->connect_failures += TBI_STAT_LOAD(stats->connect_failures);
+    out->bytes_sent += TBI_STAT_LOAD(stats->bytes_sent);
+    out->bytes_recvd += TBI_STAT_LOAD(stats->bytes_recvd);
+    out->syscalls += TBI_STAT_LOAD(stats->syscalls);
+}
+
+/** @brief Add message type statistics to another */
+static void tbi_msg_stats_sum(tbi_msg_stats_t* out, tbi_msg_ctx_t* ctx)
+{
+    tbi_msg_stats_t *stats = &ctx->stats;
+
+    out->msgtype = ctx->msgtype;
+    out->queue_depth += tbi_buf_len(ctx);
+    out->frames_sent += TBI_STAT_LOAD(stats->frames_sent);
+    out->bytes_sent += TBI_STAT_LOAD(stats->bytes_sent);
+    out->frames_recvd += TBI_STAT_LOAD(stats->frames_recvd);
+    out->bytes_recvd += TBI_STAT_LOAD(stats->bytes_recvd);
+    out->decode_errors += TBI_STAT_LOAD(stats->decode_errors);
+    out->dropped += TBI_STAT_LOAD(stats->dropped);
+    tbi_hist_sum(&out->serialize, &stats->serialize);
+    tbi_hist_sum(&out->deserialize, &stats->deserialize);
+    tbi_hist_sum(&out->callback, &stats->callback);
+}
+
+/** @brief Add the statistics of a context, and those of its workers, to the output
+ * 
+ * @param[in]  tbi  TBI context
+ * @param[out] out  Statistics, message types are matched by index. Types of
+ *                  other message specs are matched by ID
+ */
+void tbi_stats_collect(tbi_ctx_t* tbi, tbi_stats_t* out)
+{
+    tbi_schema_bind_t **binds, *bind;
+    int i, j, k;
+
+    if(tbi->channel) {
+        tbi_channel_stats_sum(&out->channel, &tbi->channel->stats);
+        out->conns_len += TBI_STAT_LOAD(tbi->channel->conns_len);
+    }
+
+    out->msgs_len = (tbi->msg_ctxs_len < TBI_MAX_MSG_TYPES) ? tbi->msg_ctxs_len : TBI_MAX_MSG_TYPES;
+    for(i = 0; i < out->msgs_len; i++) {
+        tbi_msg_stats_sum(&out->msgs[i], &tbi->msg_ctxs[i]);
+    }
+
+    /* Types of other message specs count towards the server's type of the same ID */
+    if((binds = __atomic_load_n(&tbi->binds, __ATOMIC_ACQUIRE))) {
+        for(i = 0; i < TBI_MAX_SCHEMAS; i++) {
+            if(!(bind = __atomic_load_n(&binds[i], __ATOMIC_ACQUIRE)))
+                continue;
+            for(j = 0; j < bind->foreign_len; j++) {
+                for(k = 0; k < out->msgs_len; k++) {
+                    if(tbi->msg_ctxs[k].msgtype == bind->foreign[j].msgtype) {
+                        tbi_msg_stats_sum(&out->msgs[k], &bind->foreign[j]);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    for(i = 0; i < tbi->workers_len; i++) {
+        tbi_stats_collect(tbi->workers[i].tbi, out);
+    }
+}
+
+/** @brief Copy statistics of the server connections owned by the context
+ * 
+ * @param[in]  tbi  TBI context
+ * @param[out] out  Connection statistics
+ * @param[in]  max  Max number of elements in out
+ * 
+ * @return number of connections written to out
+ */
+int tbi_stats_collect_conns(tbi_ctx_t* tbi, tbi_conn_stats_t* out, int max)
+{
+    tbi_conn_t *conn;
+    int n = 0;
+
+    for(conn = tbi->channel->conns; conn && n < max; conn = conn->next) {
+        out[n] = conn->stats;
+        out[n].fd = conn->fd;
+        out[n].start_ts = conn->start_ts;
+        out[n].device_id = conn->device_id;
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,24 @@
+/**
+* @file     stats.h
+* @brief    Header file for library statistics
+*/
+
+#ifndef __TBI_STATS_H
+#define __TBI_STATS_H
+
+#include <stdint.h>
+#include "tbi_types.h"
+
+/** @brief Add to a counter. Every counter has a single writer, the thread owning
+ * the context, but may be read from other threads by @ref tbi_get_stats() */
+#define TBI_STAT_ADD(counter, n) \
+    __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+#define TBI_STAT_INC(counter) TBI_STAT_ADD(counter, 1)
+
+void tbi_hist_add(tbi_hist_t* hist, uint64_t ns);
+void tbi_hist_add_n(tbi_hist_t* hist, uint64_t ns, int n);
+void tbi_stats_collect(tbi_ctx_t* tbi, tbi_stats_t* out);
+int tbi_stats_collect_conns(tbi_ctx_t* tbi, tbi_conn_stats_t* out, int max);
+
+#endif /* __TBI_STATS_H */
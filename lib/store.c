@@ -0,0 +1,683 @@
+/**
+* @file     store.c
+* @brief    Append-only telemetry store. Received messages are appended per
+*           device and message type into segment files through a shared
+*           mapping, as blocks of delta-compressed, bit-packed columns with a
+*           sparse time index. Rows are staged in memory until a block is
+*           full, so every byte is written once, sequentially. Segments roll
+*           by size, time span or index length. Streams of different devices
+*           are appended concurrently, each under its own lock
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "bitpack.h"
+#include "utils.h"
+#include "log.h"
+
+/** @brief Number of hash buckets for the streams */
+#define TBI_STORE_BUCKETS 4096
+
+/** @brief Rows staged for a stream at first, doubled up to a block */
+#define TBI_STORE_STAGE_MIN 64
+
+/** @brief Defaults, see @ref tbi_store_config_t */
+#define TBI_STORE_SEGMENT_BYTES (16 * 1024 * 1024)
+#define TBI_STORE_SEGMENT_MS (3600 * 1000)
+#define TBI_STORE_BLOCK_MS 1000
+
+/** @brief Smallest segment, fits the largest block */
+#define TBI_STORE_SEGMENT_MIN (1024 * 1024)
+
+/** @brief Rows and their open segment, for a single device and message type */
+typedef struct tbi_store_stream {
+    uint64_t device_id;
+    uint8_t msgtype;
+    int fields;                 /** @brief Number of columns */
+    int ts_field;               /** @brief Column the rows are indexed by */
+    uint8_t format[TBI_STORE_MAX_FIELDS];
+    pthread_mutex_t lock;       /** @brief Held while appending */
+    int rows;                   /** @brief Rows staged */
+    int cap;                    /** @brief Rows that fit the staging columns */
+    uint32_t *values;           /** @brief Staged rows, a column of cap values per member, as 32 bits */
+    uint64_t min_ts;            /** @brief Earliest staged timestamp */
+    uint64_t max_ts;            /** @brief Latest staged timestamp */
+    uint64_t staged_ms;         /** @brief Monotonic time the first row was staged */
+    tbi_store_header_t *seg;    /** @brief Mapping of the open segment, NULL if none */
+    uint32_t seg_seq;           /** @brief Sequence number of the open segment */
+    uint32_t next_seq;          /** @brief Sequence number of the next segment */
+    struct tbi_store_stream *next; /** @brief Next stream in the hash bucket */
+} tbi_store_stream_t;
+
+/** @brief Store context */
+struct tbi_store {
+    char *dir;                  /** @brief Directory of the segments, a subdirectory per device */
+    tbi_store_config_t config;
+    pthread_rwlock_t lock;      /** @brief Guards the stream buckets */
+    tbi_store_stream_t *buckets[TBI_STORE_BUCKETS];
+    tbi_store_stats_t stats;
+};
+
+/** @brief Is the field type a timestamp, rebuilt into ms since the epoch in columns */
+static inline int tbi_store_is_ts(uint8_t field_type)
+{
+    return field_type == TBI_TIMEDIFF_S || field_type == TBI_TIMEDIFF_MS;
+}
+
+/** @brief Is the 32-bit value of a field type signed, see @ref tbi_store_column_t */
+static inline int tbi_store_is_signed(uint8_t field_type)
+{
+    return field_type == TBI_INT8 || field_type == TBI_INT16 || field_type == TBI_INT32 || tbi_store_is_ts(field_type);
+}
+
+/** @brief Get the path of a segment, or of the device directory if msgtype is negative */
+static int tbi_store_path(const tbi_store_t *store, uint64_t device_id, int msgtype, uint32_t seq, char *buf, int size)
+{
+    int len;
+
+    if(msgtype < 0)
+        len = snprintf(buf, size, "%s/%016llx", store->dir, (unsigned long long)device_id);
+    else
+        len = snprintf(buf, size, "%s/%016llx/%02d-%08u.seg", store->dir, (unsigned long long)device_id, msgtype, seq);
+    return (len < 0 || len >= size) ? -1 : 0;
+}
+
+/**
+ * @brief Get the length of a block
+ *
+ * @param[in] fields    Number of columns
+ * @param[in] rows      Number of rows
+ * @param[in] widths    Bit width of the differences of each column
+ *
+ * @return length in bytes, a multiple of 8
+*/
+int tbi_store_block_len(int fields, int rows, const uint8_t *widths)
+{
+    int f, len = sizeof(tbi_store_block_t) + fields * sizeof(tbi_store_column_t);
+
+    for(f = 0; f < fields; f++)
+        len += ((rows - 1) * widths[f] + 7) / 8;
+    return (len + 7) & ~7;
+}
+
+/**
+ * @brief Create a segment for a stream, and map it
+ *
+ * @param[in] store     Store
+ * @param[in] stream    Stream, with no open segment
+ *
+ * @return 0 on success, or a negative error value
+*/
+static int tbi_store_segment_open(tbi_store_t *store, tbi_store_stream_t *stream)
+{
+    char path[PATH_MAX];
+    tbi_store_header_t *seg;
+    int fd = -1, tries;
+
+    /* Segments left over from an earlier run are never appended to */
+    for(tries = 0; tries < 16 && fd < 0; tries++) {
+        if(tbi_store_path(store, stream->device_id, stream->msgtype, stream->next_seq++, path, sizeof(path)) != 0)
+            return -1;
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if(fd < 0 && errno != EEXIST)
+            break;
+    }
+    if(fd < 0) {
+        TBI_LOG_ERROR("Unable to create segment %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* File is sparse, blocks take disk space as they are written */
+    if(ftruncate(fd, store->config.segment_bytes) != 0) {
+        TBI_LOG_ERROR("Unable to size segment %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    seg = mmap(NULL, store->config.segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(seg == MAP_FAILED) {
+        TBI_LOG_ERROR("Unable to map segment %s: %s\n", path, strerror(errno));
+        unlink(path);
+        return -1;
+    }
+
+    memcpy(seg->magic, TBI_STORE_MAGIC, sizeof(seg->magic));
+    seg->version = TBI_STORE_VERSION;
+    seg->msgtype = stream->msgtype;
+    seg->fields = stream->fields;
+    seg->ts_field = stream->ts_field;
+    seg->device_id = stream->device_id;
+    seg->min_ts = UINT64_MAX;
+    seg->data_end = TBI_STORE_HEADER_SIZE;
+    memcpy(seg->format, stream->format, stream->fields);
+
+    stream->seg = seg;
+    stream->seg_seq = stream->next_seq - 1;
+    __atomic_add_fetch(&store->stats.segments, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Seal and unmap the open segment of a stream, and give back the unused
+ * part of the file
+ *
+ * @param[in] store     Store
+ * @param[in] stream    Stream
+*/
+static void tbi_store_segment_close(tbi_store_t *store, tbi_store_stream_t *stream)
+{
+    tbi_store_header_t *seg = stream->seg;
+    char path[PATH_MAX];
+    uint32_t len;
+
+    if(!seg)
+        return;
+
+    seg->sealed = 1;
+    len = seg->data_end;
+    munmap(seg, store->config.segment_bytes);
+    stream->seg = NULL;
+
+    if(tbi_store_path(store, stream->device_id, stream->msgtype, stream->seg_seq, path, sizeof(path)) == 0 &&
+        truncate(path, len) != 0)
+        TBI_LOG_WARN("Unable to truncate segment %s: %s\n", path, strerror(errno));
+}
+
+/**
+ * @brief Compress the staged rows of a stream into a block of its open segment,
+ * rolling the segment first if the block does not fit it
+ *
+ * @param[in] store     Store
+ * @param[in] stream    Stream, locked
+ *
+ * @return number of rows written, or a negative error value if they were lost
+*/
+static int tbi_store_write_block(tbi_store_t *store, tbi_store_stream_t *stream)
+{
+    uint32_t deltas[TBI_STORE_BLOCK_ROWS];
+    uint8_t widths[TBI_STORE_MAX_FIELDS];
+    tbi_store_header_t *seg;
+    tbi_store_block_t *block;
+    tbi_store_column_t *col;
+    uint32_t *values, acc, base;
+    uint8_t *data;
+    int rows = stream->rows, f, i, len, bytes;
+    int64_t min, max;
+
+    if(rows == 0)
+        return 0;
+
+    /* Timestamps as ms from the earliest in the block, then the width of each column */
+    base = (uint32_t)stream->min_ts;
+    for(f = 0; f < stream->fields; f++) {
+        values = stream->values + (size_t)f * stream->cap;
+        if(tbi_store_is_ts(stream->format[f])) {
+            for(i = 0; i < rows; i++)
+                values[i] -= base;
+        }
+        tbi_zigzag_delta_encode(values + 1, rows - 1, values[0], deltas);
+        for(acc = 0, i = 0; i < rows - 1; i++)
+            acc |= deltas[i];
+        widths[f] = tbi_bit_width(acc);
+    }
+    len = tbi_store_block_len(stream->fields, rows, widths);
+
+    /* Roll by index length, size and time span */
+    seg = stream->seg;
+    if(seg && (seg->blocks == TBI_STORE_INDEX_LEN || seg->data_end + len > store->config.segment_bytes ||
+        (stream->max_ts > seg->max_ts ? stream->max_ts : seg->max_ts) -
+        (stream->min_ts < seg->min_ts ? stream->min_ts : seg->min_ts) >= store->config.segment_ms))
+        tbi_store_segment_close(store, stream);
+    if(!stream->seg && tbi_store_segment_open(store, stream) != 0) {
+        __atomic_add_fetch(&store->stats.errors, rows, __ATOMIC_RELAXED);
+        stream->rows = 0;
+        return -1;
+    }
+    seg = stream->seg;
+
+    /* Fresh file space reads as zeros, so the differences are packed in place */
+    block = (tbi_store_block_t*)((uint8_t*)seg + seg->data_end);
+    block->len = len;
+    block->rows = rows;
+    block->fields = stream->fields;
+    col = (tbi_store_column_t*)(block + 1);
+    data = (uint8_t*)(col + stream->fields);
+    for(f = 0; f < stream->fields; f++, col++) {
+        values = stream->values + (size_t)f * stream->cap;
+        if(tbi_store_is_signed(stream->format[f])) {
+            min = max = (int32_t)values[0];
+            for(i = 1; i < rows; i++) {
+                min = (int32_t)values[i] < min ? (int32_t)values[i] : min;
+                max = (int32_t)values[i] > max ? (int32_t)values[i] : max;
+            }
+        } else {
+            min = max = values[0];
+            for(i = 1; i < rows; i++) {
+                min = values[i] < min ? values[i] : min;
+                max = values[i] > max ? values[i] : max;
+            }
+        }
+        if(tbi_store_is_ts(stream->format[f])) {
+            min += (int64_t)stream->min_ts;
+            max += (int64_t)stream->min_ts;
+        }
+        col->min = min;
+        col->max = max;
+        col->first = values[0];
+        col->width = widths[f];
+
+        bytes = ((rows - 1) * widths[f] + 7) / 8;
+        tbi_zigzag_delta_encode(values + 1, rows - 1, values[0], deltas);
+        tbi_bitpack_pack(data, bytes, 0, widths[f], widths[f], rows - 1, deltas);
+        data += bytes;
+    }
+
+    /* Publish the block with its index entry */
+    seg->index[seg->blocks].min_ts = stream->min_ts;
+    seg->index[seg->blocks].max_ts = stream->max_ts;
+    seg->index[seg->blocks].offset = seg->data_end;
+    seg->index[seg->blocks].rows = rows;
+    if(stream->min_ts < seg->min_ts)
+        seg->min_ts = stream->min_ts;
+    if(stream->max_ts > seg->max_ts)
+        seg->max_ts = stream->max_ts;
+    seg->rows += rows;
+    seg->data_end += len;
+    __atomic_store_n(&seg->blocks, seg->blocks + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&store->stats.rows, rows, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&store->stats.blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&store->stats.bytes, len, __ATOMIC_RELAXED);
+    stream->rows = 0;
+    return rows;
+}
+
+/**
+ * @brief Grow the staging columns of a stream to fit more rows
+ *
+ * @param[in] stream    Stream, locked
+ * @param[in] rows      Rows to fit, at most a block
+ *
+ * @return 0 on success, or a negative error value
+*/
+static int tbi_store_stage_grow(tbi_store_stream_t *stream, int rows)
+{
+    uint32_t *values;
+    int cap = stream->cap ? stream->cap : TBI_STORE_STAGE_MIN, f;
+
+    while(cap < rows)
+        cap *= 2;
+    if(cap == stream->cap)
+        return 0;
+
+    if(!(values = malloc((size_t)stream->fields * cap * sizeof(uint32_t))))
+        return -1;
+    for(f = 0; f < stream->fields && stream->rows > 0; f++)
+        memcpy(values + (size_t)f * cap, stream->values + (size_t)f * stream->cap, stream->rows * sizeof(uint32_t));
+    free(stream->values);
+    stream->values = values;
+    stream->cap = cap;
+    return 0;
+}
+
+/**
+ * @brief Stage rows of a batch of columns, as 32-bit values
+ *
+ * @param[in] stream    Stream, locked, with room for the rows
+ * @param[in] cols      Columns
+ * @param[in] from      First row
+ * @param[in] count     Number of rows
+*/
+static void tbi_store_stage(tbi_store_stream_t *stream, const tbi_columns_t *cols, int from, int count)
+{
+    uint32_t *out;
+    int f, i;
+
+    for(f = 0; f < stream->fields; f++) {
+        out = stream->values + (size_t)f * stream->cap + stream->rows;
+        switch(stream->format[f]) {
+            case TBI_TIMEDIFF_S:
+            case TBI_TIMEDIFF_MS:
+                for(i = 0; i < count; i++)
+                    out[i] = (uint32_t)((const uint64_t*)cols->cols[f])[from + i];
+                break;
+            case TBI_UINT32:
+            case TBI_INT32:
+                memcpy(out, (const uint32_t*)cols->cols[f] + from, count * sizeof(uint32_t));
+                break;
+            case TBI_UINT16:
+                for(i = 0; i < count; i++)
+                    out[i] = ((const uint16_t*)cols->cols[f])[from + i];
+                break;
+            case TBI_INT16:
+                for(i = 0; i < count; i++)
+                    out[i] = (uint32_t)(int32_t)((const int16_t*)cols->cols[f])[from + i];
+                break;
+            case TBI_UINT8:
+                for(i = 0; i < count; i++)
+                    out[i] = ((const uint8_t*)cols->cols[f])[from + i];
+                break;
+            case TBI_INT8:
+                for(i = 0; i < count; i++)
+                    out[i] = (uint32_t)(int32_t)((const int8_t*)cols->cols[f])[from + i];
+                break;
+            default:
+                memset(out, 0, count * sizeof(uint32_t));
+                break;
+        }
+    }
+    stream->rows += count;
+}
+
+/**
+ * @brief Find the stream of a device and message type, creating it if new
+ *
+ * @param[in] store     Store
+ * @param[in] device_id Device
+ * @param[in] msgtype   Message type
+ *
+ * @return stream, or NULL on failure
+*/
+static tbi_store_stream_t *tbi_store_stream_get(tbi_store_t *store, uint64_t device_id, uint8_t msgtype)
+{
+    unsigned int bucket = (unsigned int)(((device_id ^ msgtype) * 0x9E3779B97F4A7C15ULL) >> 52) % TBI_STORE_BUCKETS;
+    tbi_store_stream_t *stream, *created;
+    char path[PATH_MAX];
+    struct dirent *entry;
+    unsigned int type, seq;
+    DIR *dir;
+
+    pthread_rwlock_rdlock(&store->lock);
+    for(stream = store->buckets[bucket]; stream; stream = stream->next) {
+        if(stream->device_id == device_id && stream->msgtype == msgtype)
+            break;
+    }
+    pthread_rwlock_unlock(&store->lock);
+    if(stream)
+        return stream;
+
+    /* New stream continues after the segments of earlier runs */
+    if(!(created = calloc(1, sizeof(tbi_store_stream_t))))
+        return NULL;
+    created->device_id = device_id;
+    created->msgtype = msgtype;
+    pthread_mutex_init(&created->lock, NULL);
+    if(tbi_store_path(store, device_id, -1, 0, path, sizeof(path)) == 0) {
+        if(mkdir(path, 0755) != 0 && errno != EEXIST)
+            TBI_LOG_ERROR("Unable to create directory %s: %s\n", path, strerror(errno));
+        if((dir = opendir(path))) {
+            while((entry = readdir(dir))) {
+                if(sscanf(entry->d_name, "%2u-%8u.seg", &type, &seq) == 2 && type == msgtype && seq >= created->next_seq)
+                    created->next_seq = seq + 1;
+            }
+            closedir(dir);
+        }
+    }
+
+    /* Another thread may have created it meanwhile */
+    pthread_rwlock_wrlock(&store->lock);
+    for(stream = store->buckets[bucket]; stream; stream = stream->next) {
+        if(stream->device_id == device_id && stream->msgtype == msgtype)
+            break;
+    }
+    if(!stream) {
+        created->next = store->buckets[bucket];
+        store->buckets[bucket] = created;
+        stream = created;
+        created = NULL;
+        __atomic_add_fetch(&store->stats.streams, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&store->lock);
+
+    if(created) {
+        pthread_mutex_destroy(&created->lock);
+        free(created);
+    }
+    return stream;
+}
+
+/**
+ * @brief Open a store, creating its directory if needed
+ *
+ * @param[in] dir       Directory of the segments
+ * @param[in] config    Configuration, or NULL for the defaults
+ *
+ * @return store, or NULL on failure
+*/
+tbi_store_t *tbi_store_open(const char *dir, const tbi_store_config_t *config)
+{
+    tbi_store_t *store;
+
+    if(!dir)
+        return NULL;
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        TBI_LOG_ERROR("Unable to create store directory %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+
+    if(!(store = calloc(1, sizeof(tbi_store_t))))
+        return NULL;
+    if(config)
+        store->config = *config;
+    if(store->config.segment_bytes == 0)
+        store->config.segment_bytes = TBI_STORE_SEGMENT_BYTES;
+    if(store->config.segment_ms == 0)
+        store->config.segment_ms = TBI_STORE_SEGMENT_MS;
+    if(store->config.block_rows <= 0 || store->config.block_rows > TBI_STORE_BLOCK_ROWS)
+        store->config.block_rows = TBI_STORE_BLOCK_ROWS;
+    if(store->config.block_ms <= 0)
+        store->config.block_ms = TBI_STORE_BLOCK_MS;
+    if(store->config.segment_bytes < TBI_STORE_SEGMENT_MIN) {
+        TBI_LOG_ERROR("Store segments must be at least %d bytes!\n", TBI_STORE_SEGMENT_MIN);
+        free(store);
+        return NULL;
+    }
+
+    if(!(store->dir = strdup(dir))) {
+        free(store);
+        return NULL;
+    }
+    pthread_rwlock_init(&store->lock, NULL);
+    return store;
+}
+
+/**
+ * @brief Append a batch of received messages to the stream of their device and
+ * type. Rows are indexed by their first timestamp member, and written once a
+ * block is full, or the oldest has waited for the block interval
+ *
+ * @param[in] store     Store
+ * @param[in] msgtype   Message type
+ * @param[in] cols      Messages as columns, see @ref tbi_columns_t
+ * @param[in] info      Where the messages were received, must have a connection
+ *
+ * @return number of rows appended, or a negative error value
+*/
+int tbi_store_append(tbi_store_t *store, int msgtype, const tbi_columns_t *cols, const tbi_batch_info_t *info)
+{
+    tbi_store_stream_t *stream;
+    const uint64_t *ts;
+    uint64_t min, max;
+    int ts_field = -1, f, i, n, ret = cols ? cols->count : -1;
+
+    if(!store || !cols || !info || cols->count <= 0)
+        return ret;
+
+    /* Rows must belong to a device, and have a time */
+    for(f = 0; f < cols->fields && ts_field < 0; f++) {
+        if(tbi_store_is_ts(cols->format[f]))
+            ts_field = f;
+    }
+    if(info->conn_id == 0 || ts_field < 0 || cols->fields > TBI_STORE_MAX_FIELDS || msgtype < 0 || msgtype > 0xFF) {
+        __atomic_add_fetch(&store->stats.rejected, cols->count, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if(!(stream = tbi_store_stream_get(store, info->device_id, msgtype)))
+        return -1;
+
+    pthread_mutex_lock(&stream->lock);
+
+    /* New message format, e.g. after a firmware update, starts a new segment */
+    if(stream->fields != cols->fields || memcmp(stream->format, cols->format, cols->fields) != 0) {
+        tbi_store_write_block(store, stream);
+        tbi_store_segment_close(store, stream);
+        free(stream->values);
+        stream->values = NULL;
+        stream->cap = 0;
+        stream->fields = cols->fields;
+        stream->ts_field = ts_field;
+        memcpy(stream->format, cols->format, cols->fields);
+    }
+
+    ts = (const uint64_t*)cols->cols[stream->ts_field];
+    for(i = 0; i < cols->count; i += n) {
+        /* Rows up to a full block, with timestamps less than 2^31 ms apart */
+        min = stream->rows ? stream->min_ts : ts[i];
+        max = stream->rows ? stream->max_ts : ts[i];
+        for(n = 0; i + n < cols->count && stream->rows + n < store->config.block_rows; n++) {
+            if((ts[i + n] > max ? ts[i + n] : max) - (ts[i + n] < min ? ts[i + n] : min) > INT32_MAX)
+                break;
+            min = ts[i + n] < min ? ts[i + n] : min;
+            max = ts[i + n] > max ? ts[i + n] : max;
+        }
+        if(n == 0) {
+            tbi_store_write_block(store, stream);
+            continue;
+        }
+
+        if(tbi_store_stage_grow(stream, stream->rows + n) != 0) {
+            __atomic_add_fetch(&store->stats.errors, cols->count - i, __ATOMIC_RELAXED);
+            ret = -1;
+            break;
+        }
+        if(stream->rows == 0)
+            stream->staged_ms = get_monotonic_time_ms();
+        tbi_store_stage(stream, cols, i, n);
+        stream->min_ts = min;
+        stream->max_ts = max;
+        if(stream->rows == store->config.block_rows && tbi_store_write_block(store, stream) < 0)
+            ret = -1;
+    }
+
+    if(stream->rows > 0 && get_monotonic_time_ms() - stream->staged_ms >= (uint64_t)store->config.block_ms &&
+        tbi_store_write_block(store, stream) < 0)
+        ret = -1;
+
+    pthread_mutex_unlock(&stream->lock);
+    return ret;
+}
+
+/**
+ * @brief Column callback appending every batch to a store, see @ref
+ * tbi_server_register_column_callback()
+ *
+ * @param[in] msgtype   Message type
+ * @param[in] cols      Messages as columns
+ * @param[in] info      Where the messages were received
+ * @param[in] userdata  Store
+*/
+void tbi_store_column_callback(const int msgtype, const tbi_columns_t *cols, const tbi_batch_info_t *info, void *userdata)
+{
+    tbi_store_append((tbi_store_t*)userdata, msgtype, cols, info);
+}
+
+/**
+ * @brief Write the staged rows of every stream that have waited long enough
+ * into blocks. Called periodically, so that rows of idle streams are not kept
+ * in memory. May be called from any thread
+ *
+ * @param[in] store         Store
+ * @param[in] max_age_ms    Write rows staged at least this long ago, 0 for all
+ *
+ * @return number of rows written, or a negative error value if some were lost
+*/
+int tbi_store_flush(tbi_store_t *store, int max_age_ms)
+{
+    tbi_store_stream_t *stream;
+    uint64_t now_ms = get_monotonic_time_ms();
+    int i, ret, rows = 0, failed = 0;
+
+    if(!store)
+        return -1;
+
+    pthread_rwlock_rdlock(&store->lock);
+    for(i = 0; i < TBI_STORE_BUCKETS; i++) {
+        for(stream = store->buckets[i]; stream; stream = stream->next) {
+            pthread_mutex_lock(&stream->lock);
+            if(stream->rows > 0 && now_ms - stream->staged_ms >= (uint64_t)max_age_ms) {
+                if((ret = tbi_store_write_block(store, stream)) < 0)
+                    failed = 1;
+                else
+                    rows += ret;
+            }
+            pthread_mutex_unlock(&stream->lock);
+        }
+    }
+    pthread_rwlock_unlock(&store->lock);
+    return failed ? -1 : rows;
+}
+
+/**
+ * @brief Get store statistics. May be called from any thread
+ *
+ * @param[in] store     Store
+ * @param[out] out      Statistics
+ *
+ * @return 0 on success, or a negative error value
+*/
+int tbi_store_get_stats(tbi_store_t *store, tbi_store_stats_t *out)
+{
+    if(!store || !out)
+        return -1;
+
+    out->streams = __atomic_load_n(&store->stats.streams, __ATOMIC_RELAXED);
+    out->rows = __atomic_load_n(&store->stats.rows, __ATOMIC_RELAXED);
+    out->blocks = __atomic_load_n(&store->stats.blocks, __ATOMIC_RELAXED);
+    out->bytes = __atomic_load_n(&store->stats.bytes, __ATOMIC_RELAXED);
+    out->segments = __atomic_load_n(&store->stats.segments, __ATOMIC_RELAXED);
+    out->rejected = __atomic_load_n(&store->stats.rejected, __ATOMIC_RELAXED);
+    out->errors = __atomic_load_n(&store->stats.errors, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Write all staged rows, seal the open segments and free the store.
+ * Nothing may append to the store anymore
+ *
+ * @param[in] store     Store
+*/
+void tbi_store_close(tbi_store_t *store)
+{
+    tbi_store_stream_t *stream, *next;
+    int i;
+
+    if(!store)
+        return;
+
+    for(i = 0; i < TBI_STORE_BUCKETS; i++) {
+        for(stream = store->buckets[i]; stream; stream = next) {
+            next = stream->next;
+            tbi_store_write_block(store, stream);
+            tbi_store_segment_close(store, stream);
+            pthread_mutex_destroy(&stream->lock);
+            free(stream->values);
+            free(stream);
+        }
+    }
+    pthread_rwlock_destroy(&store->lock);
+    free(store->dir);
+    free(store);
+}
@@ -0,0 +1,110 @@
+/**
+* @file     store.h
+* @brief    Header file for the append-only telemetry segment store
+*/
+
+#ifndef __TBI_STORE_H
+#define __TBI_STORE_H
+
+#include <stdint.h>
+#include "tbi_types.h"
+
+/** @brief Segment file magic and format version */
+#define TBI_STORE_MAGIC "TBIS"
+#define TBI_STORE_VERSION 1
+
+/** @brief Max number of struct members of a stored message type */
+#define TBI_STORE_MAX_FIELDS 32
+
+/** @brief Max number of rows in a compressed block */
+#define TBI_STORE_BLOCK_ROWS 1024
+
+/** @brief Number of blocks a segment can hold, one index entry each */
+#define TBI_STORE_INDEX_LEN 1000
+
+/** @brief Size of the segment header, including the block index. Blocks follow it */
+#define TBI_STORE_HEADER_SIZE 24576
+
+/** @brief Sparse time index entry, one per block */
+typedef struct {
+    uint64_t min_ts;            /** @brief Earliest timestamp in the block, ms since the epoch */
+    uint64_t max_ts;            /** @brief Latest timestamp in the block, ms since the epoch */
+    uint32_t offset;            /** @brief Offset of the block from the start of the segment */
+    uint32_t rows;              /** @brief Rows in the block */
+} tbi_store_index_t;
+
+/** @brief Segment file header, at the start of the file. Blocks and their index
+ * entries are written first, and made visible by incrementing blocks, so a
+ * segment left unsealed by a crash is valid up to its last complete block.
+ * Stored in host byte order */
+typedef struct {
+    char magic[4];              /** @brief @ref TBI_STORE_MAGIC */
+    uint8_t version;            /** @brief @ref TBI_STORE_VERSION */
+    uint8_t msgtype;            /** @brief Message type of the rows */
+    uint8_t fields;             /** @brief Number of columns */
+    uint8_t ts_field;           /** @brief Column of the timestamp the rows are indexed by */
+    uint8_t sealed;             /** @brief Set once the segment is complete */
+    uint8_t reserved[3];
+    uint32_t blocks;            /** @brief Blocks written */
+    uint64_t device_id;         /** @brief Device the rows were received from */
+    uint64_t min_ts;            /** @brief Earliest timestamp in the segment */
+    uint64_t max_ts;            /** @brief Latest timestamp in the segment */
+    uint64_t rows;              /** @brief Rows written */
+    uint32_t data_end;          /** @brief End of the last block from the start of the segment */
+    uint32_t reserved2;
+    uint8_t format[TBI_STORE_MAX_FIELDS]; /** @brief Field type of each column, @ref tbi_msg_field_types_t */
+    tbi_store_index_t index[TBI_STORE_INDEX_LEN]; /** @brief Index entry of each block */
+} tbi_store_header_t;
+
+/** @brief Compressed column of a block. Values are taken as 32 bits, signed
+ * members sign-extended, and timestamps as ms from the min_ts of the block. The
+ * first value is stored as is, and the rest as zigzag-encoded differences to
+ * the previous value, bit-packed with the width of the largest, as in DCB bundles */
+typedef struct {
+    int64_t min;                /** @brief Smallest value in the block, a timestamp in ms since the epoch */
+    int64_t max;                /** @brief Largest value in the block */
+    uint32_t first;             /** @brief First value */
+    uint8_t width;              /** @brief Bit width of the differences */
+    uint8_t reserved[3];
+} tbi_store_column_t;
+
+/** @brief Block header. Followed by a @ref tbi_store_column_t for each column,
+ * then the packed differences of each column, each starting at a byte boundary */
+typedef struct {
+    uint32_t len;               /** @brief Block length in bytes, including the header, a multiple of 8 */
+    uint16_t rows;              /** @brief Rows in the block */
+    uint8_t fields;             /** @brief Number of columns */
+    uint8_t reserved;
+} tbi_store_block_t;
+
+/** @brief Store configuration, see @ref tbi_store_open() */
+typedef struct {
+    uint32_t segment_bytes;     /** @brief Max size of a segment file, 0 for 16 MiB */
+    uint32_t segment_ms;        /** @brief Max telemetry time spanned by a segment, 0 for 1 hour */
+    int block_rows;             /** @brief Rows per block, at most @ref TBI_STORE_BLOCK_ROWS. 0 for the max */
+    int block_ms;               /** @brief Rows wait at most this long to be written into a block, 0 for 1 s */
+} tbi_store_config_t;
+
+/** @brief Store statistics, see @ref tbi_store_get_stats() */
+typedef struct {
+    uint64_t streams;           /** @brief Device and message type streams seen */
+    uint64_t rows;              /** @brief Rows written into blocks */
+    uint64_t blocks;            /** @brief Blocks written */
+    uint64_t bytes;             /** @brief Bytes of blocks written */
+    uint64_t segments;          /** @brief Segment files created */
+    uint64_t rejected;          /** @brief Rows not stored, without a device or a timestamp member */
+    uint64_t errors;            /** @brief Rows lost to file errors */
+} tbi_store_stats_t;
+
+typedef struct tbi_store tbi_store_t;
+
+tbi_store_t *tbi_store_open(const char *dir, const tbi_store_config_t *config);
+int tbi_store_append(tbi_store_t *store, int msgtype, const tbi_columns_t *cols, const tbi_batch_info_t *info);
+void tbi_store_column_callback(const int msgtype, const tbi_columns_t *cols, const tbi_batch_info_t *info, void *userdata);
+int tbi_store_flush(tbi_store_t *store, int max_age_ms);
+int tbi_store_get_stats(tbi_store_t *store, tbi_store_stats_t *out);
+void tbi_store_close(tbi_store_t *store);
+
+int tbi_store_block_len(int fields, int rows, const uint8_t *widths);
+
+#endif /* __TBI_STORE_H */
@@ -3,194 +3,1344 @@
 * @brief    TBI library main interface implemenetation
 */
 
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "tbi_types.h"
+#include "tbi.h"
+#include "buf.h"
+#include "dcb.h"
+#include "batch.h"
+#include "serializer.h"
+#include "protocol.h"
+#include "channel.h"
+#include "spool.h"
+#include "worker.h"
+#include "schema.h"
+#include "utils.h"
+#include "stats.h"
+#include "log.h"
+
+
+tbi_ctx_t *tbi_init(void)
+{
+    tbi_ctx_t *tbi;
+    tbi = malloc(sizeof(tbi_ctx_t));
+    if(!tbi) 
+        return NULL;
+    
+    memset(tbi, 0, sizeof(tbi_ctx_t));
+
+    return tbi;
+}
+
+/**
+ * @brief Set up the message buffers that were not given a region with
+ * @ref tbi_set_buffer()
+ * 
+ * @param[in] tbi       TBI context
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+static int tbi_buffers_init(tbi_ctx_t* tbi)
+{
+    int i;
+
+    for(i = 0; i < tbi->msg_ctxs_len; i++) {
+        if(!tbi->msg_ctxs[i].ring && tbi_buf_init(&tbi->msg_ctxs[i], NULL, 0) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int tbi_client_init(tbi_ctx_t* tbi)
+{
+    int i, max_fields = 0;
+
+    if(tbi_buffers_init(tbi) != 0)
+        return -1;
+
+    /* DCB encoder fits the message type with the most members */
+    for(i = 0; i < tbi->msg_ctxs_len; i++) {
+        if(tbi->msg_ctxs[i].dcb && tbi->msg_ctxs[i].format_len > max_fields)
+            max_fields = tbi->msg_ctxs[i].format_len;
+    }
+    if(max_fields > 0 && !tbi->dcb_enc && !(tbi->dcb_enc = tbi_dcb_enc_create(max_fields)))
+        return -1;
+
+    /* Frames left by an earlier run are sent once connected */
+    if(tbi->spool_path && !tbi->spool && !(tbi->spool = tbi_spool_open(tbi, tbi->spool_path, tbi->spool_size)))
+        return -1;
+
+    return tbi_client_channel_open(tbi);
+}
+
+int tbi_server_init(tbi_ctx_t* tbi)
+{
+    if(tbi_buffers_init(tbi) != 0 || tbi_schemas_init(tbi) != 0)
+        return -1;
+
+    return tbi_server_channel_open(tbi, false);
+}
+
+/**
+ * @brief Get the size of the memory region needed for the message buffer of
+ * a message type
+ * 
+ * @param[in] tbi       TBI context, with message spec registered
+ * @param[in] msgtype   Message type
+ * @param[in] capacity  Number of messages, rounded up to a power of two
+ * 
+ * @return size in bytes, or negative error code on failure
+*/
+long tbi_get_buffer_size(tbi_ctx_t* tbi, uint8_t msgtype, int capacity)
+{
+    tbi_msg_ctx_t *ctx;
+
+    if(!tbi || capacity <= 0)
+        return -1;
+
+    if(!(ctx = tbi_msg_ctx(tbi, msgtype)))
+        return -1;
+    return (long)tbi_buf_region_size(ctx->raw_size, capacity);
+}
+
+/**
+ * @brief Set the capacity of the message buffer of a message type, and 
+ * optionally the memory for it, e.g. a static region on constrained devices.
+ * Must be called after registering the message spec, and before 
+ * @ref tbi_client_init() or @ref tbi_server_init(). A message type not set up
+ * here gets a buffer of the capacity or byte quota in its message spec, or 
+ * 1024 messages
+ * 
+ * @param[in] tbi           TBI context, with message spec registered
+ * @param[in] msgtype       Message type
+ * @param[in] capacity      Number of messages, rounded up to a power of two
+ * @param[in] region        Memory for the buffer, 8-byte aligned, or NULL to allocate it
+ *                          at init. Must stay valid until @ref tbi_close()
+ * @param[in] region_size   Size of region, see @ref tbi_get_buffer_size()
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_set_buffer(tbi_ctx_t* tbi, uint8_t msgtype, int capacity, void* region, long region_size)
+{
+    tbi_msg_ctx_t *ctx;
+
+    if(!tbi || tbi->channel || tbi->workers || capacity <= 0)
+        return -1;
+
+    if(!(ctx = tbi_msg_ctx(tbi, msgtype)))
+        return -1;
+
+    /* Replace an earlier setting */
+    tbi_buf_free(ctx);
+    ctx->capacity = capacity;
+    if(region)
+        return tbi_buf_init(ctx, region, region_size > 0 ? (size_t)region_size : 0);
+    return 0;
+}
+
+/**
+ * @brief Set the policy for messages of a type arriving to a full message buffer.
+ * Must be called after registering the message spec, and before 
+ * @ref tbi_client_init() or @ref tbi_server_init(). A message type not set up 
+ * here uses the policy in its message spec, or drops new messages. Dropped
+ * messages are counted in @ref tbi_get_stats()
+ * 
+ * @param[in] tbi       TBI context, with message spec registered
+ * @param[in] msgtype   Message type
+ * @param[in] policy    Overflow policy
+ * @param[in] decimate  Keep every k-th message with @ref TBI_OVERFLOW_DECIMATE
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_set_overflow(tbi_ctx_t* tbi, uint8_t msgtype, tbi_overflow_policy_t policy, int decimate)
+{
+    tbi_msg_ctx_t *ctx;
+
+    if(!tbi || tbi->channel || tbi->workers)
+        return -1;
+    if(policy == TBI_OVERFLOW_DECIMATE && decimate < 2)
+        return -1;
+
+    if(!(ctx = tbi_msg_ctx(tbi, msgtype)))
+        return -1;
+
+    ctx->overflow = policy;
+    ctx->decimate = decimate;
+    return 0;
+}
+
+/**
+ * @brief Set the optional protocol features a client requests from the server, 
+ * or a server accepts from its clients. A feature is used on a connection only 
+ * if both ends have it set. Must be called before @ref tbi_client_init() or 
+ * @ref tbi_server_init()
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] features  Features, e.g. @ref TBI_FEATURE_CRC32C to checksum every frame.
+ *                      Servers set @ref TBI_FEATURE_ACK to acknowledge frames to spooling 
+ *                      clients, clients request it with @ref tbi_set_spool()
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_set_features(tbi_ctx_t* tbi, uint8_t features)
+{
+    if(!tbi || tbi->channel || tbi->workers)
+        return -1;
+    if(features & ~(TBI_FEATURE_CRC32C | TBI_FEATURE_ACK))
+        return -1;
+
+    tbi->features = features;
+    return 0;
+}
+
+/**
+ * @brief Keep the frames of a client in a file until the server acknowledges 
+ * them, so that telemetry survives a lost connection, a crash or a restart of 
+ * the client. Frames are serialized into the memory-mapped file, and sent from
+ * it once connected. Frames left in the file by an earlier run are sent first,
+ * and the client keeps the start timestamp they are relative to, see 
+ * @ref tbi_get_start_ts(). Delivery is at least once: frames sent before a lost
+ * connection and not yet acknowledged are sent again. When the spool is full, 
+ * messages stay in their message buffers. Must be called before 
+ * @ref tbi_client_init()
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] path      Spool file, created if needed
+ * @param[in] size      Spool size in bytes, at least @ref TBI_SPOOL_MIN_SIZE. 
+ *                      A spool of another size is started over
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_set_spool(tbi_ctx_t* tbi, const char* path, uint32_t size)
+{
+    char *copy;
+
+    if(!tbi || !path || tbi->channel || size < TBI_SPOOL_MIN_SIZE)
+        return -1;
+    if(!(copy = strdup(path)))
+        return -1;
+
+    free(tbi->spool_path);
+    tbi->spool_path = copy;
+    tbi->spool_size = size;
+    return 0;
+}
+
+/**
+ * @brief Write the spool of a client to disk, so that its frames also survive
+ * a power loss. Without it they survive a crash of the client
+ * 
+ * @param[in] tbi       TBI context, with a spool
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_client_spool_sync(tbi_ctx_t* tbi)
+{
+    if(!tbi || !tbi->spool)
+        return -1;
+
+    return tbi_spool_sync(tbi->spool);
+}
+
+/**
+ * @brief Get the start timestamp of a client, the timestamps of its messages 
+ * are relative to. The time of @ref tbi_client_init(), or the start of an 
+ * earlier run whose frames are still in the spool
+ * 
+ * @param[in] tbi       TBI context
+ * 
+ * @return start timestamp in ms since the epoch, 0 if not initialized
+*/
+uint64_t tbi_get_start_ts(tbi_ctx_t* tbi)
+{
+    if(!tbi || !tbi->channel || tbi->channel->server)
+        return 0;
+
+    return tbi->channel->start_ts;
+}
+
+/**
+ * @brief Set the identifier a client sends in the handshake, so that the server
+ * can tell its devices apart over reconnects, e.g. to store their telemetry. 
+ * Must be called before @ref tbi_client_init()
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] device_id Device identifier, unique within the fleet. 0 for none
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_set_device_id(tbi_ctx_t* tbi, uint64_t device_id)
+{
+    if(!tbi || tbi->channel)
+        return -1;
+
+    tbi->device_id = device_id;
+    return 0;
+}
+
+/**
+ * @brief Start a multi-threaded server. Every worker thread owns its own
+ * listening socket on the same port, its own connections and message buffers,
+ * and receives and processes telemetry independently of the others
+ * 
+ * Callbacks must be registered before starting the workers. They are invoked 
+ * concurrently from the worker threads, so any shared user context must be
+ * thread-safe
+ * 
+ * @param[in] tbi           TBI context, not initialized with @ref tbi_server_init()
+ * @param[in] workers_len   Number of worker threads
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_server_start_workers(tbi_ctx_t* tbi, int workers_len)
+{
+    if(!tbi || tbi->channel || tbi->workers || workers_len <= 0)
+        return -1;
+
+    return tbi_workers_start(tbi, workers_len);
+}
+
+/**
+ * @brief Stop the worker threads started with @ref tbi_server_start_workers()
+ * 
+ * @param[in] tbi       TBI context
+*/
+void tbi_server_stop_workers(tbi_ctx_t* tbi)
+{
+    if(!tbi) return;
+
+    tbi_workers_stop(tbi);
+}
+
+/**
+ * @brief Accept clients of another message spec, e.g. an older or newer 
+ * firmware, from its binary descriptor generated by compose.py. Message types
+ * of the same format as the server's are handled as usual. Types that differ
+ * are delivered only to the batch and column callbacks of their ID, laid out
+ * by the client's format, see @ref tbi_batch_info_t. The server's own message
+ * spec is always accepted. May be called before @ref tbi_server_init(), or at
+ * any time after it, also with workers running; specs are never removed
+ * 
+ * @param[in] tbi       TBI context, with message spec registered
+ * @param[in] desc      Descriptor
+ * @param[in] len       Descriptor length
+ * 
+ * @return 1 if added, 0 if already accepted, negative error code on failure
+*/
+int tbi_server_add_schema(tbi_ctx_t* tbi, const uint8_t* desc, int len)
+{
+    if(!tbi || !desc || len <= 0)
+        return -1;
+
+    return tbi_schemas_add(tbi, desc, len);
+}
+
+/**
+ * @brief Accept clients of the message spec in a descriptor file, see
+ * @ref tbi_server_add_schema()
+ * 
+ * @param[in] tbi       TBI context, with message spec registered
+ * @param[in] path      Descriptor file
+ * 
+ * @return 1 if added, 0 if already accepted, negative error code on failure
+*/
+int tbi_server_load_schema(tbi_ctx_t* tbi, const char* path)
+{
+    if(!tbi || !path)
+        return -1;
+
+    return tbi_schemas_load(tbi, path);
+}
+
+/**
+ * @brief Accept clients of the message specs of every descriptor file (*.tbis)
+ * in a directory, see @ref tbi_server_add_schema(). Invalid descriptors are 
+ * skipped. Calling it again picks up descriptors added since
+ * 
+ * @param[in] tbi       TBI context, with message spec registered
+ * @param[in] dir       Directory
+ * 
+ * @return number of specs added, negative error code if the directory could
+ *          not be read
+*/
+int tbi_server_load_schemas(tbi_ctx_t* tbi, const char* dir)
+{
+    if(!tbi || !dir)
+        return -1;
+
+    return tbi_schemas_load_dir(tbi, dir);
+}
+
+/**
+ * @brief Set the deadline of a bundled message type, unless already set
+ * 
+ * @param[in] ctx       Context of the message type
+ * @param[in] now       Current monotonic time in ms
+*/
+static void tbi_client_bundle_arm(tbi_msg_ctx_t* ctx, uint64_t now)
+{
+    uint64_t unset = 0;
+
+    __atomic_compare_exchange_n(&ctx->deadline_ms, &unset, now + ctx->send_interval, false,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Get the time until the buffered messages of a type are due for sending.
+ * Message types sent in RTM frames, or without a send interval, are due as soon
+ * as there are messages, and bundled types when the send interval of the oldest
+ * message expires, or enough messages for a full bundle are buffered
+ * 
+ * @param[in] ctx       Context of the message type
+ * @param[in] now       Current monotonic time in ms
+ * 
+ * @return time in ms until due, 0 if due now, or -1 if there are no messages
+*/
+static int64_t tbi_client_bundle_due_in(tbi_msg_ctx_t* ctx, uint64_t now)
+{
+    uint64_t deadline;
+    int len;
+
+    /* Drop a deadline set for messages that were sent meanwhile */
+    if((len = tbi_buf_len(ctx)) == 0) {
+        if(__atomic_load_n(&ctx->deadline_ms, __ATOMIC_RELAXED) != 0)
+            __atomic_store_n(&ctx->deadline_ms, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if(!ctx->dcb || ctx->send_interval <= 0 || (ctx->max_bundle > 0 && len >= ctx->max_bundle))
+        return 0;
+
+    /* Messages are there, but the producer has not set the deadline yet */
+    if((deadline = __atomic_load_n(&ctx->deadline_ms, __ATOMIC_RELAXED)) == 0) {
+        tbi_client_bundle_arm(ctx, now);
+        deadline = __atomic_load_n(&ctx->deadline_ms, __ATOMIC_RELAXED);
+    }
+    return (deadline > now) ? (int64_t)(deadline - now) : 0;
+}
+
+/**
+ * @brief Schedule a new telemetry message, storing it into 
+ * dedicated buffer for sending. Thread-safe and lock-free: any number of 
+ * threads may schedule concurrently with each other, and with the single
+ * thread sending the telemetry
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] msg_type  Message type @ref msgspec_types_t
+ * @param[in] buf       Message content
+ * 
+ * @return 0 if queued, 1 if dropped by the overflow policy of its type because
+ *          the buffer is full (see @ref tbi_set_overflow()), negative error code on failure
+*/
+int tbi_telemetry_schedule(tbi_ctx_t* tbi, int msg_type, const void* buf, int len)
+{
+    tbi_msg_ctx_t * ctx = NULL;
+
+    if(!tbi || !tbi->channel || tbi->channel->server)
+        return -1;
+
+
+    /* Find the correct context for this message type */
+    if(msg_type < 0 || !(ctx = tbi_msg_ctx(tbi, (uint8_t)msg_type)))
+        return -1;
+
+    /* Input size must match expected */
+    if(len != ctx->raw_size)
+        return -1;
+
+    /* First message of a bundle starts its send interval */
+    if(ctx->send_interval > 0 && __atomic_load_n(&ctx->deadline_ms, __ATOMIC_RELAXED) == 0)
+        tbi_client_bundle_arm(ctx, get_monotonic_time_ms());
+
+    /* Copy message from user into dedicated buffer */
+    return tbi_buf_push_back(ctx, buf, len);
+}
+
+/**
+ * @brief Advance the connection to server, and send every pending message once
+ * connected. While disconnected, messages stay queued in their message buffers
+ * and are drained in bulk after reconnecting
+ * 
+ * @param[in] tbi       TBI context
+ * 
+ * @return number of messages sent, 
+ *          or a negative error code on failure
+*/
+int tbi_client_process(tbi_ctx_t* tbi)
+{
+    return tbi_client_flush(tbi, TBI_FLUSH_NONE, NULL);
+}
+
+/**
+ * @brief Move the channel transmit buffer into the spool, and send the spooled 
+ * frames not yet sent on this connection straight from the mapping
+ * 
+ * @param[in]     tbi       TBI context, with a spool
+ * @param[in]     more      More data follows (MSG_MORE)
+ * @param[in,out] res       Bytes and syscalls are added to it
+ * 
+ * @return number of bytes sent (0 if not connected), 
+ *          or a negative error code on failure
+*/
+static int tbi_client_spool_send(tbi_ctx_t* tbi, bool more, tbi_flush_result_t* res)
+{
+    tbi_channel_t *channel = tbi->channel;
+    tbi_spool_t *spool = tbi->spool;
+    struct iovec iov;
+    int ret;
+
+    /* All or nothing, the buffer keeps its frames while the spool is full */
+    if(channel->tx_len > 0 && tbi_spool_append(spool, channel->tx_buf, channel->tx_len))
+        channel->tx_len = 0;
+
+    if(!channel->connected || channel->send_pos == spool->hdr->head)
+        return 0;
+
+    /* Contiguous up to the head, the ring is mapped twice */
+    iov.iov_base = tbi_spool_at(spool, channel->send_pos);
+    iov.iov_len = spool->hdr->head - channel->send_pos;
+    if((ret = tbi_client_channel_send_iov(tbi, &iov, 1, more, &res->syscalls)) < 0)
+        return channel->connected ? ret : 0;
+    channel->send_pos += ret;
+    res->bytes += ret;
+
+    /* A server that does not acknowledge gets every frame once */
+    if(!(channel->features & TBI_FEATURE_ACK))
+        tbi_spool_ack(spool, channel->send_pos);
+    return ret;
+}
+
+/**
+ * @brief Send the unsent part of the channel transmit buffer with a single 
+ * sendmsg(), and compact the buffer
+ * 
+ * @param[in]     tbi       TBI context
+ * @param[in]     more      More data follows (MSG_MORE)
+ * @param[in,out] res       Bytes and syscalls are added to it
+ * 
+ * @return number of bytes sent (0 if the connection was lost), 
+ *          or a negative error code on failure
+*/
+static int tbi_client_tx_send(tbi_ctx_t* tbi, bool more, tbi_flush_result_t* res)
+{
+    tbi_channel_t *channel = tbi->channel;
+    struct iovec iov;
+    int ret;
+
+    if(tbi->spool)
+        return tbi_client_spool_send(tbi, more, res);
+
+    if(channel->tx_off < channel->tx_len) {
+        iov.iov_base = channel->tx_buf + channel->tx_off;
+        iov.iov_len = channel->tx_len - channel->tx_off;
+        /* Connection lost, unsent data is kept for reconnecting */
+        if((ret = tbi_client_channel_send_iov(tbi, &iov, 1, more, &res->syscalls)) < 0)
+            return channel->connected ? ret : 0;
+        channel->tx_off += ret;
+        res->bytes += ret;
+    }
+    else {
+        ret = 0;
+    }
+
+    /* Reclaim the sent part */
+    if(channel->tx_off == channel->tx_len) {
+        channel->tx_off = 0;
+        channel->tx_len = 0;
+    }
+    return ret;
+}
+
+/**
+ * @brief Make room for len bytes at the end of the channel transmit buffer, 
+ * sending and compacting it if needed
+ * 
+ * @param[in]     tbi       TBI context
+ * @param[in]     len       Bytes needed
+ * @param[in,out] res       Bytes and syscalls are added to it
+ * 
+ * @return 1 if there is room, 0 if the socket or spool is full or the connection 
+ *          was lost, or a negative error code on failure
+*/
+static int tbi_client_tx_reserve(tbi_ctx_t* tbi, int len, tbi_flush_result_t* res)
+{
+    tbi_channel_t *channel = tbi->channel;
+    int ret;
+
+    /* Spooled frames are sent from the spool, the buffer is emptied into it */
+    if(tbi->spool) {
+        if(channel->tx_len + len > channel->tx_size && (ret = tbi_client_tx_send(tbi, true, res)) < 0)
+            return ret;
+        return (channel->tx_len + len <= channel->tx_size) ? 1 : 0;
+    }
+
+    while(channel->tx_len + len > channel->tx_size) {
+        if(channel->tx_off == 0 && (ret = tbi_client_tx_send(tbi, true, res)) < 0)
+            return ret;
+        if(!channel->connected)
+            return 0;
+        if(channel->tx_off == 0 && channel->tx_len + len > channel->tx_size)
+            return 0;
+
+        memmove(channel->tx_buf, channel->tx_buf + channel->tx_off, channel->tx_len - channel->tx_off);
+        channel->tx_len -= channel->tx_off;
+        channel->tx_off = 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Get the features frames are serialized with: those agreed in the
+ * handshake, or with a spool those requested, as spooled frames may be sent 
+ * on a later connection
+ * 
+ * @param[in] tbi       TBI context
+ * 
+ * @return features
+*/
+static uint8_t tbi_client_frame_features(tbi_ctx_t* tbi)
+{
+    return tbi->spool ? tbi->features : tbi->channel->features;
+}
+
+/**
+ * @brief Encode the messages of a bundled message type into DCB frames at the 
+ * end of the channel transmit buffer, up to @ref TBI_DCB_MAX_SAMPLES messages
+ * in each frame
+ * 
+ * @param[in]     tbi       TBI context
+ * @param[in]     ctx       Context of the message type
+ * @param[in,out] res       Messages, bytes and syscalls are added to it
+ * 
+ * @return 1 if the message buffer was emptied, 0 if the socket is full or the 
+ *          connection was lost, or a negative error code on failure
+*/
+static int tbi_client_flush_dcb(tbi_ctx_t* tbi, tbi_msg_ctx_t* ctx, tbi_flush_result_t* res)
+{
+    tbi_channel_t *channel = tbi->channel;
+    uint64_t start_ns, pos;
+    int samples, max_len, crc_len, ret;
+    void *msg;
+
+    if(!tbi->dcb_enc)
+        return -1;
+
+    crc_len = (tbi_client_frame_features(tbi) & TBI_FEATURE_CRC32C) ? TBI_FRAME_CRC_LEN : 0;
+
+    while((samples = tbi_buf_len(ctx)) > 0) {
+        /* Worst case must fit in the transmit buffer */
+        if(samples > TBI_DCB_MAX_SAMPLES)
+            samples = TBI_DCB_MAX_SAMPLES;
+        if(ctx->max_bundle > 0 && samples > ctx->max_bundle)
+            samples = ctx->max_bundle;
+        while(samples > 1 && tbi_dcb_frame_max_len(ctx, samples) + crc_len > channel->tx_size)
+            samples /= 2;
+
+        max_len = tbi_dcb_frame_max_len(ctx, samples) + crc_len;
+        if((ret = tbi_client_tx_reserve(tbi, max_len, res)) <= 0)
+            return ret;
+
+        /* Collect the deltas straight from the message buffer */
+        start_ns = get_monotonic_time_ns();
+        while(tbi->dcb_enc->len < samples && (msg = tbi_buf_pop_front(ctx, &pos))) {
+            ret = tbi_dcb_enc_add(tbi->dcb_enc, ctx, msg);
+            tbi_buf_release(ctx, pos);
+            if(ret < 0)
+                return -1;
+        }
+        if(tbi->dcb_enc->len == 0)
+            break;
+        samples = tbi->dcb_enc->len;
+
+        ret = tbi_dcb_enc_finish(tbi->dcb_enc, ctx, channel->tx_buf + channel->tx_len, 
+            channel->tx_size - channel->tx_len - crc_len);
+        if(ret >= 0 && crc_len)
+            ret = tbi_protocol_frame_seal(channel->tx_buf + channel->tx_len, ret);
+        tbi_hist_add(&ctx->stats.serialize, get_monotonic_time_ns() - start_ns);
+        if(ret < 0)
+            return -1;
+        TBI_STAT_INC(ctx->stats.frames_sent);
+        TBI_STAT_ADD(ctx->stats.bytes_sent, ret);
+
+        channel->tx_len += ret;
+        res->msgs += samples;
+    }
+    return 1;
+}
+
+/**
+ * @brief Send every pending message from every message buffer in as few syscalls
+ * as possible, without blocking. Messages are serialized back to back into the 
+ * channel transmit buffer, and sent with a single sendmsg() whenever the buffer
+ * fills up. Messages of bundled types are delta-compressed into DCB frames of 
+ * everything buffered for the type, once the send interval of the oldest message
+ * expires or max bundle size is buffered, see @ref tbi_client_next_deadline().
+ * 
+ * Whatever the socket does not accept stays in the transmit buffer and message
+ * buffers for the next call, see @ref tbi_client_pending() and @ref tbi_client_wait().
+ * Nothing is sent while the connection to server is (re-)established, except
+ * into the spool, see @ref tbi_set_spool()
+ * 
+ * Sending must take place from a single thread, while telemetry may be scheduled
+ * from any thread
+ * 
+ * @param[in]  tbi       TBI context
+ * @param[in]  flags     @ref TBI_FLUSH_NONE, or any of @ref TBI_FLUSH_CORK to cork the socket 
+ *                      while flushing, and @ref TBI_FLUSH_ALL to send bundled types regardless of
+ *                      their send interval
+ * @param[out] result    Optional, number of messages and bytes sent
+ * 
+ * @return number of messages moved from the message buffers to the transmit stream, 
+ *          or a negative error code on failure
+*/
+int tbi_client_flush(tbi_ctx_t* tbi, int flags, tbi_flush_result_t* result)
+{
+    tbi_flush_result_t res = {0};
+    tbi_channel_t *channel;
+    tbi_msg_ctx_t *ctx;
+    bool corked = false;
+    int i, len_out, crc_len, ret;
+    uint64_t start_ns, pos, now_ms, deadline, unset = 0;
+    void *msg;
+
+    if(!tbi || !tbi->channel || tbi->channel->server)
+        return -1;
+
+    channel = tbi->channel;
+
+    /* Complete (re)connecting first, messages wait in their buffers meanwhile
+        unless they can be spooled */
+    if((ret = tbi_client_channel_poll(tbi)) < 0 || (ret == 0 && !tbi->spool))
+        goto exit;
+
+    if((flags & TBI_FLUSH_CORK) && channel->connected) {
+        if((ret = tbi_client_channel_cork(tbi, true)) != 0)
+            goto exit;
+        corked = true;
+    }
+
+    /* Frames are checksummed if agreed in the handshake */
+    crc_len = (tbi_client_frame_features(tbi) & TBI_FEATURE_CRC32C) ? TBI_FRAME_CRC_LEN : 0;
+
+    now_ms = get_monotonic_time_ms();
+    for(i = 0; i < tbi->msg_ctxs_len; i++) {
+        ctx = &tbi->msg_ctxs[i];
+        if(ctx->dcb) {
+            /* Keep bundling until the send interval or bundle size is reached */
+            if(!(flags & TBI_FLUSH_ALL) && tbi_client_bundle_due_in(ctx, now_ms) != 0)
+                continue;
+
+            /* The next message starts a new interval, unless some stay buffered */
+            deadline = __atomic_exchange_n(&ctx->deadline_ms, 0, __ATOMIC_RELAXED);
+            if((ret = tbi_client_flush_dcb(tbi, ctx, &res)) == 0 && deadline != 0)
+                __atomic_compare_exchange_n(&ctx->deadline_ms, &unset, deadline, false,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            if(ret < 0)
+                goto exit;
+            if(!channel->connected && !tbi->spool)
+                goto exit;
+            if(ret == 0)
+                goto exit_send;
+            continue;
+        }
+
+        len_out = msg_wire_len(ctx->format, ctx->format_len) + crc_len;
+        while(tbi_buf_len(ctx) > 0) {
+            /* Make room if this message does not fit, more will follow */
+            if((ret = tbi_client_tx_reserve(tbi, len_out, &res)) < 0)
+                goto exit;
+            if(!channel->connected && !tbi->spool)
+                goto exit;
+
+            /* Socket or spool is full, leave the rest queued */
+            if(ret == 0)
+                goto exit_send;
+
+            /* Serialize to a platform-agnostic byte stream straight from the 
+                message buffer, directly after the previous message */
+            if(!(msg = tbi_buf_pop_front(ctx, &pos)))
+                break;
+            start_ns = get_monotonic_time_ns();
+            if(ctx->encode)
+                ret = ctx->encode(msg, channel->tx_buf + channel->tx_len, channel->tx_size - channel->tx_len - crc_len);
+            else
+                ret = tbi_serialize_rtm_into(ctx->format, ctx->msgtype, ctx->format_len, msg, ctx->raw_size, 
+                    channel->tx_buf + channel->tx_len, channel->tx_size - channel->tx_len - crc_len);
+            if(ret >= 0) {
+                tbi_set_client_flags(channel->tx_buf + channel->tx_len, TBI_FLAGS_RTM);
+                if(crc_len)
+                    ret = tbi_protocol_frame_seal(channel->tx_buf + channel->tx_len, ret);
+            }
+            tbi_hist_add(&ctx->stats.serialize, get_monotonic_time_ns() - start_ns);
+            tbi_buf_release(ctx, pos);
+            if(ret < 0)
+                goto exit;
+            TBI_STAT_INC(ctx->stats.frames_sent);
+            TBI_STAT_ADD(ctx->stats.bytes_sent, ret);
+
+            channel->tx_len += ret;
+            res.msgs++;
+        }
+    }
+    ret = 0;
+
+exit_send:
+    /* Send the last batch */
+    if((channel->connected || tbi->spool) && tbi_client_tx_send(tbi, false, &res) < 0)
+        ret = -1;
+
+exit:
+    if(corked && channel->connected)
+        tbi_client_channel_cork(tbi, false);
+    if(result)
+        *result = res;
+    return (ret < 0) ? ret : res.msgs;
+}
+
+/**
+ * @brief Get the time until buffered messages are due for sending: immediately
+ * for types sent in RTM frames, and after the send interval of the oldest message,
+ * or once max bundle size is buffered, for bundled types
+ * 
+ * @param[in] tbi       TBI context
+ * 
+ * @return time in ms until @ref tbi_client_flush() sends messages, 0 if due now,
+ *          -1 if no messages are buffered, or a negative error code on failure
+*/
+int tbi_client_next_deadline(tbi_ctx_t* tbi)
+{
+    int64_t due, next = -1;
+    uint64_t now_ms;
+    int i;
+
+    if(!tbi || !tbi->channel || tbi->channel->server)
+        return -2;
+
+    /* Linear scan over at most 16 types beats maintaining a timer wheel */
+    now_ms = get_monotonic_time_ms();
+    for(i = 0; i < tbi->msg_ctxs_len && next != 0; i++) {
+        due = tbi_client_bundle_due_in(&tbi->msg_ctxs[i], now_ms);
+        if(due >= 0 && (next < 0 || due < next))
+            next = due;
+    }
+    return (next > INT_MAX) ? INT_MAX : (int)next;
+}
+
+/**
+ * @brief Wait until the client can make progress: the next reconnect attempt is
+ * due, the connection completes, unsent data fits into the socket again, or 
+ * buffered messages are due for sending (see @ref tbi_client_next_deadline())
+ * 
+ * @param[in] tbi           TBI context
+ * @param[in] timeout_ms    Max time to wait, -1 waits indefinitely
+ * 
+ * @return 1 if connected, 0 if not connected, or a negative error code on failure
+*/
+int tbi_client_wait(tbi_ctx_t* tbi, int timeout_ms)
+{
+    tbi_channel_t *channel;
+    bool idle;
+    int next;
+
+    if(!tbi || !tbi->channel)
+        return -1;
+    channel = tbi->channel;
+
+    /* Data already waiting for the socket is sent first, there is no point 
+        waking up for deadlines meanwhile. Spooled messages are due while
+        disconnected too */
+    idle = channel->tx_len == channel->tx_off;
+    if(tbi->spool)
+        idle = idle && (!channel->connected || channel->send_pos == tbi->spool->hdr->head);
+    if((channel->connected || tbi->spool) && idle) {
+        next = tbi_client_next_deadline(tbi);
+        if(next >= 0 && (timeout_ms < 0 || next < timeout_ms))
+            timeout_ms = next;
+    }
+    return tbi_client_channel_wait(tbi, timeout_ms);
+}
+
+/**
+ * @brief Get the number of messages and bytes not yet sent to server
+ * 
+ * @param[in]  tbi       TBI context
+ * @param[out] bytes     Optional, bytes in the transmit buffer not yet accepted by the socket,
+ *                      or with a spool, bytes not yet acknowledged by the server
+ * 
+ * @return number of messages queued in the message buffers,
+ *          or a negative error code on failure
+*/
+int tbi_client_pending(tbi_ctx_t* tbi, int* bytes)
+{
+    int i, msgs = 0;
+
+    if(!tbi || !tbi->channel || tbi->channel->server)
+        return -1;
+
+    for(i = 0; i < tbi->msg_ctxs_len; i++) {
+        msgs += tbi_buf_len(&tbi->msg_ctxs[i]);
+    }
+    if(bytes) {
+        *bytes = tbi->channel->tx_len - tbi->channel->tx_off;
+        if(tbi->spool)
+            *bytes += (int)tbi_spool_len(tbi->spool);
+    }
+    return msgs;
+}
+
+/**
+ * @brief Validate a frame received from a client, and find the context of its
+ * message type in the message spec of the client
+ * 
+ * @param[in]  conn     Client connection the frame was received from
+ * @param[in]  buf      Received frame
+ * @param[in]  len      Received frame length
+ * @param[out] out      Context of the message type
+ * 
+ * @return 1 if the frame is to be decoded, 0 if unknown type or ignored,
+ *          or a negative error code on failure
+*/
+static int tbi_server_frame_ctx(tbi_conn_t* conn, uint8_t* buf, int len, tbi_msg_ctx_t** out)
+{
+    tbi_msg_ctx_t *ctx;
+    uint8_t flags, msgtype;
 
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <stdbool.h>
+    /* Check flags */
+    if(tbi_get_client_flags(buf, &flags, &msgtype) != 0)
+        return -1;
 
-#include "tbi_types.h"
-#include "tbi.h"
-#include "buf.h"
-#include "serializer.h"
-#include "protocol.h"
-#include "channel.h"
+    if(!(ctx = conn->types[msgtype]))
+        return 0;
+
+    /* Check if msg is RTM or DCB */
+    if((flags & TBI_FLAGS_DCB) == TBI_FLAGS_DCB && !ctx->dcb) {
+        TBI_LOG_WARN("Unexpected DCB for message type %u!\n", msgtype);
+        return -1;
+    }
+    else if((flags & TBI_FLAGS_RTM) == TBI_FLAGS_RTM && ctx->dcb) {
+        TBI_LOG_WARN("Unexpected RTM for message type %u!\n", msgtype);
+        return -1;
+    }
+    TBI_STAT_INC(ctx->stats.frames_recvd);
+    TBI_STAT_ADD(ctx->stats.bytes_recvd, len);
 
+    *out = ctx;
+    return 1;
+}
 
-tbi_ctx_t *tbi_init(void)
+/**
+ * @brief Allocate the connection scratch message on first use, large enough
+ * for the largest message type of the message spec of the client
+ * 
+ * @param[in] conn      Client connection
+ * 
+ * @return 0 on success, or a negative error code on failure
+*/
+static int tbi_server_conn_scratch(tbi_conn_t* conn)
+{
+    tbi_msg_ctx_t *ctx;
+    int i, size, native_len;
+
+    if(conn->scratch)
+        return 0;
+
+    size = 0;
+    for(i = 0; i < TBI_MAX_MSG_TYPES; i++) {
+        if(!(ctx = conn->types[i]))
+            continue;
+        native_len = msg_native_len(ctx->format, ctx->format_len);
+        if(native_len > size)
+            size = native_len;
+        if(ctx->raw_size > size)
+            size = ctx->raw_size;
+    }
+    conn->scratch = malloc(size);
+    if(!conn->scratch)
+        return -1;
+    conn->scratch_size = size;
+    return 0;
+}
+
+/**
+ * @brief Decode a frame straight from the receive buffer into a native message,
+ * the connection scratch message or a batch slot. Neither is allocated per 
+ * message
+ * 
+ * @param[in] ctx       Context of the message type
+ * @param[in] buf       Received frame
+ * @param[in] len       Received frame length
+ * @param[out] out      Decoded message
+ * @param[in] out_size  Size of out, at least ctx->raw_size
+ * 
+ * @return 0 on success, or a negative error code on failure
+*/
+static int tbi_server_frame_decode(tbi_msg_ctx_t* ctx, uint8_t* buf, int len, void* out, int out_size)
+{
+    uint64_t start_ns;
+    int ret;
+
+    /* Deserialize to native byte order */
+    start_ns = get_monotonic_time_ns();
+    if(ctx->decode)
+        ret = ctx->decode(buf, len, out);
+    else
+        ret = tbi_deserialize_rtm_into(ctx->format, ctx->format_len, buf, len, out, out_size);
+    tbi_hist_add(&ctx->stats.deserialize, get_monotonic_time_ns() - start_ns);
+    if(ret < 0) {
+        TBI_STAT_INC(ctx->stats.decode_errors);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Invoke the callback for a decoded message 
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] ctx       Context of the message type
+ * @param[in] msg       Decoded message
+ * 
+ * @return time spent in the callback in nanoseconds
+*/
+static uint64_t tbi_server_invoke_callback(tbi_ctx_t* tbi, tbi_msg_ctx_t* ctx, const void* msg)
 {
+    uint64_t start_ns = get_monotonic_time_ns();
+    uint64_t elapsed_ns;
+
+    /* Global callback has higher precedence */
+    if(tbi->global_cb) {
+        tbi->global_cb(ctx->msgtype, msg, tbi->global_cb_userdata);
+    } else if(ctx->cb) {
+        ctx->cb(ctx->msgtype, msg, ctx->cb_userdata);
+    }
+    elapsed_ns = get_monotonic_time_ns() - start_ns;
+    tbi_hist_add(&ctx->stats.callback, elapsed_ns);
+    return elapsed_ns;
+}
+
+/** @brief Where the samples of a DCB frame go while it is decoded */
+typedef struct {
     tbi_ctx_t *tbi;
-    tbi = malloc(sizeof(tbi_ctx_t));
-    if(!tbi) 
-        return NULL;
-    
-    memset(tbi, 0, sizeof(tbi_ctx_t));
+    tbi_conn_t *conn;
+    tbi_msg_ctx_t *ctx;
+    uint64_t callback_ns;       /** @brief Time spent in callbacks, not counted as decoding */
+    int stored;                 /** @brief Samples stored into the message buffer */
+} tbi_server_dcb_sink_t;
 
-    return tbi;
+/** @brief Invoke the callback for a sample of a DCB frame, see @ref tbi_dcb_emit */
+static int tbi_server_dcb_dispatch(void *userdata, const void *msg)
+{
+    tbi_server_dcb_sink_t *sink = (tbi_server_dcb_sink_t*)userdata;
+
+    sink->callback_ns += tbi_server_invoke_callback(sink->tbi, sink->ctx, msg);
+    return 0;
 }
 
-int tbi_client_init(tbi_ctx_t* tbi)
+/** @brief Add a sample of a DCB frame to the batch, see @ref tbi_dcb_emit */
+static int tbi_server_dcb_batch(void *userdata, const void *msg)
 {
-    return tbi_client_channel_open(tbi);
+    tbi_server_dcb_sink_t *sink = (tbi_server_dcb_sink_t*)userdata;
+    uint64_t start_ns = get_monotonic_time_ns();
+    int len = sink->tbi->batch->len;
+
+    /* Filling the batch delivers it, which is callback time */
+    tbi_batch_add(sink->tbi->batch, sink->ctx, sink->conn, msg, sink->conn->start_ts);
+    if(sink->tbi->batch->len <= len)
+        sink->callback_ns += get_monotonic_time_ns() - start_ns;
+    return 0;
 }
 
-int tbi_server_init(tbi_ctx_t* tbi)
+/** @brief Store a sample of a DCB frame into the message buffer, see @ref tbi_dcb_emit */
+static int tbi_server_dcb_store(void *userdata, const void *msg)
 {
-    return tbi_server_channel_open(tbi);
+    tbi_server_dcb_sink_t *sink = (tbi_server_dcb_sink_t*)userdata;
+    int ret;
+
+    if((ret = tbi_buf_push_back_ts(sink->ctx, msg, sink->ctx->raw_size, sink->conn->start_ts)) == 0)
+        sink->stored++;
+    return (ret < 0) ? -1 : 0;
 }
 
 /**
- * @brief Schedule a new telemetry message, storing it into 
- * dedicated buffer for sending
+ * @brief Get the DCB decoder, fitting the bundled message type with the most 
+ * members, of the message spec and of the specs bound to the context. Allocated
+ * on first use
  * 
  * @param[in] tbi       TBI context
- * @param[in] msg_type  Message type @ref msgspec_types_t
- * @param[in] buf       Message content
  * 
- * @return 0 on success, negative error code on failure
+ * @return decoder, or NULL on failure
 */
-int tbi_telemetry_schedule(tbi_ctx_t* tbi, int msg_type, const void* buf, int len)
+static tbi_dcb_dec_t *tbi_server_dcb_dec(tbi_ctx_t* tbi)
 {
-    tbi_msg_ctx_t * ctx = NULL;
-    uint8_t *msg_copy;
-    int i;
+    int max_size, max_fields, max_dcb_fields;
 
-    if(!tbi || !tbi->channel || tbi->channel->server)
+    if(!tbi->dcb_dec) {
+        tbi_schema_limits(tbi, &max_size, &max_fields, &max_dcb_fields);
+        tbi->dcb_dec = tbi_dcb_dec_create(max_dcb_fields);
+    }
+    return tbi->dcb_dec;
+}
+
+/**
+ * @brief Decode a DCB frame straight from the receive buffer, reconstructing
+ * every sample in turn into the connection scratch message
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] conn      Client connection the frame was received from
+ * @param[in] ctx       Context of the message type
+ * @param[in] buf       Received frame
+ * @param[in] len       Received frame length
+ * @param[in] emit      Called for every sample
+ * @param[in,out] sink  Passed to emit
+ * 
+ * @return number of samples decoded, or a negative error code on failure
+*/
+static int tbi_server_frame_decode_dcb(tbi_ctx_t* tbi, tbi_conn_t* conn, tbi_msg_ctx_t* ctx, uint8_t* buf, int len,
+    tbi_dcb_emit emit, tbi_server_dcb_sink_t* sink)
+{
+    uint64_t start_ns;
+    int ret;
+
+    if(tbi_server_conn_scratch(conn) != 0 || !tbi_server_dcb_dec(tbi))
         return -1;
 
+    start_ns = get_monotonic_time_ns();
+    ret = tbi_dcb_decode(tbi->dcb_dec, ctx, buf, len, conn->scratch, conn->scratch_size, emit, sink);
+    tbi_hist_add(&ctx->stats.deserialize, get_monotonic_time_ns() - start_ns - sink->callback_ns);
+    if(ret < 0) {
+        TBI_LOG_WARN("Malformed DCB frame for message type %u!\n", ctx->msgtype);
+        TBI_STAT_INC(ctx->stats.decode_errors);
+        return -1;
+    }
+    return ret;
+}
 
-    /* Find the correct context for this message type */
-    for(i = 0; i < tbi->msg_ctxs_len; i++) {
-        ctx = &tbi->msg_ctxs[i];
-        if(ctx->msgtype == msg_type) {
+/**
+ * @brief Decode a frame received from a client and store it into the
+ * message buffer of its type
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] conn      Client connection the frame was received from
+ * @param[in] buf       Received frame
+ * @param[in] len       Received frame length
+ * 
+ * @return number of messages stored, more than one for a DCB frame, 0 if unknown
+ *          type or ignored, or a negative error code on failure
+*/
+static int tbi_server_store_frame(tbi_ctx_t* tbi, tbi_conn_t* conn, uint8_t* buf, int len)
+{
+    tbi_msg_ctx_t *ctx;
+    int ret;
 
-            /* Input size must match expected */
-            if(len != ctx->raw_size)
-                return -1;
+    if((ret = tbi_server_frame_ctx(conn, buf, len, &ctx)) <= 0)
+        return ret;
 
-            /* Copy message from user to new buffer */
-            msg_copy = (uint8_t*)malloc(sizeof(uint8_t)*len);
-            memcpy(msg_copy, buf, len);
+    /* Message buffers hold the server's own layout */
+    if(ctx->foreign)
+        return 0;
 
-            /* Store into dedicated buffer */
-            return tbi_buf_push_back(ctx, ctx->raw_size, msg_copy);
-        }
+    /* Store every sample of a bundle, as long as there is room */
+    if(ctx->dcb) {
+        tbi_server_dcb_sink_t sink = {tbi, conn, ctx, 0, 0};
+        if(tbi_server_frame_decode_dcb(tbi, conn, ctx, buf, len, &tbi_server_dcb_store, &sink) < 0)
+            return -1;
+        return sink.stored;
     }
-    
-    /* Return error if not found */
-    return -1;
+
+    if(tbi_server_conn_scratch(conn) != 0 ||
+        tbi_server_frame_decode(ctx, buf, len, conn->scratch, conn->scratch_size) != 0)
+        return -1;
+
+    /* Store the decoded message, applying the overflow policy if full */
+    if((ret = tbi_buf_push_back_ts(ctx, conn->scratch, ctx->raw_size, conn->start_ts)) != 0) {
+        TBI_LOG_DEBUG("Message buffer full for message type %u!\n", ctx->msgtype);
+        return (ret < 0) ? -1 : 0;
+    }
+    return 1;
 }
 
 /**
- * @brief Process the message buffers, looking for any messages to be sent
+ * @brief Decode a frame received from a client straight into the columns of
+ * the batch of its type, every sample of a DCB frame at once
  * 
  * @param[in] tbi       TBI context
+ * @param[in] conn      Client connection the frame was received from
+ * @param[in] ctx       Context of the message type, with a column callback
+ * @param[in] buf       Received frame
+ * @param[in] len       Received frame length
  * 
- * @return number of messages sent, 
- *          or a negative error code on failure
+ * @return number of messages added, or a negative error code on failure
 */
-int tbi_client_process(tbi_ctx_t* tbi)
+static int tbi_server_column_frame(tbi_ctx_t* tbi, tbi_conn_t* conn, tbi_msg_ctx_t* ctx, uint8_t* buf, int len)
 {
-    tbi_msg_ctx_t * ctx = NULL;
-    int i, len_in, len_out, ret;
-    uint8_t* buf_out = NULL;
-    void* buf_in = NULL;
-    
-    if(!tbi ||!tbi->channel || tbi->channel->server)
-        return -1;
-        
-    /* Check for messages to send */
-    for(i = 0; i < tbi->msg_ctxs_len; i++) {
-        ctx = &tbi->msg_ctxs[i];
-        if(ctx->buflen >= 1 && !ctx->dcb) {
-            
-            /* Pull message from buffer */
-            ret = tbi_buf_pop_front(ctx, &len_in, &buf_in);
-            if(ret != 0) 
-                return ret;
-
-            /* Serialize to a platform-agnostic byte stream */
-            ret = tbi_serialize_rtm(ctx->format, ctx->msgtype, ctx->format_len, buf_in, len_in, &buf_out, &len_out);
-            free(buf_in);
-            if(ret != 0) {
-                return ret;
-            }
+    tbi_batch_t *batch = tbi->batch;
+    uint64_t start_ns;
+    int row, count, ret;
 
-            /* Send message through channel */
-            ret = tbi_client_channel_send_rtm(tbi, 0U, ctx->msgtype, buf_out, len_out);
-            free(buf_out);
-            if(ret != 0) {
-                return ret;
-            }
-            return 1;
+    /* Bundle must fit the batch as a whole */
+    count = 1;
+    if(ctx->dcb) {
+        count = tbi_dcb_frame_samples(ctx, buf, len);
+        if(count <= 0 || count > TBI_BATCH_MAX_MSGS || !tbi_server_dcb_dec(tbi)) {
+            TBI_LOG_WARN("Malformed DCB frame for message type %u!\n", ctx->msgtype);
+            TBI_STAT_INC(ctx->stats.decode_errors);
+            return -1;
         }
     }
-    return 0;
+    row = tbi_batch_reserve(batch, ctx, conn, count);
+
+    start_ns = get_monotonic_time_ns();
+    if(ctx->dcb)
+        ret = tbi_dcb_decode_columns(tbi->dcb_dec, ctx, buf, len, batch->cols, row, conn->start_ts);
+    else
+        ret = tbi_deserialize_rtm_columns(ctx->format, ctx->format_len, buf, len, batch->cols, row, conn->start_ts);
+    tbi_hist_add(&ctx->stats.deserialize, get_monotonic_time_ns() - start_ns);
+    if(ret < 0) {
+        if(ctx->dcb)
+            TBI_LOG_WARN("Malformed DCB frame for message type %u!\n", ctx->msgtype);
+        TBI_STAT_INC(ctx->stats.decode_errors);
+        return -1;
+    }
+
+    tbi_batch_commit(batch, count);
+    return count;
 }
 
 /**
- * @brief Blocking receive from client
+ * @brief Decode a frame received from a client into the batch of its type. The
+ * batch is delivered once full, or messages of another type or client follow,
+ * and at the end of the receive
  * 
  * @param[in] tbi       TBI context
+ * @param[in] conn      Client connection the frame was received from
+ * @param[in] ctx       Context of the message type, with a batch callback
+ * @param[in] buf       Received frame
+ * @param[in] len       Received frame length
  * 
- * @return number of messages received, 
- *          or a negative error code on failure
+ * @return number of messages added, more than one for a DCB frame, or a 
+ *          negative error code on failure
 */
-int tbi_server_receive_blocking(tbi_ctx_t* tbi)
+static int tbi_server_batch_frame(tbi_ctx_t* tbi, tbi_conn_t* conn, tbi_msg_ctx_t* ctx, uint8_t* buf, int len)
 {
-    tbi_msg_ctx_t *ctx;
-    uint8_t *buf;
-    uint8_t flags, msgtype;
-    int len, ret, i;
+    void *slot;
 
-    if(!tbi || !tbi->channel || !tbi->channel->server)
+    if(!tbi->batch && !(tbi->batch = tbi_batch_create(tbi)))
         return -1;
 
-    /* Receive from client */
-    len = tbi_server_channel_recv(tbi);
-    if(len <= 0)
-        return -1;
+    if(ctx->column_cb)
+        return tbi_server_column_frame(tbi, conn, ctx, buf, len);
 
-    /* Check flags */
-    if((ret = tbi_get_client_flags(tbi->channel->buf, &flags, &msgtype)) != 0)
+    if(ctx->dcb) {
+        tbi_server_dcb_sink_t sink = {tbi, conn, ctx, 0, 0};
+        return tbi_server_frame_decode_dcb(tbi, conn, ctx, buf, len, &tbi_server_dcb_batch, &sink);
+    }
+
+    /* Decode straight into the batch */
+    slot = tbi_batch_next(tbi->batch, ctx, conn);
+    if(tbi_server_frame_decode(ctx, buf, len, slot, ctx->raw_size) != 0)
         return -1;
+    tbi_batch_commit(tbi->batch, 1);
+    return 1;
+}
 
+/**
+ * @brief Decode a frame received from a client and invoke its callback 
+ * immediately, or add it to the batch of its type
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] conn      Client connection the frame was received from
+ * @param[in] buf       Received frame
+ * @param[in] len       Received frame length
+ * 
+ * @return number of messages dispatched, more than one for a DCB frame, 0 if unknown
+ *          type or ignored, or a negative error code on failure
+*/
+static int tbi_server_dispatch_frame(tbi_ctx_t* tbi, tbi_conn_t* conn, uint8_t* buf, int len)
+{
+    tbi_msg_ctx_t *ctx;
+    int ret;
 
-    /* Check for received messages */
-    for(i = 0; i < tbi->msg_ctxs_len; i++) {
-        ctx = &tbi->msg_ctxs[i];
-        if(ctx->msgtype == msgtype) {
-            /* Check if msg is RTM or DCB */
-            if((flags & TBI_FLAGS_DCB) == TBI_FLAGS_DCB && !ctx->dcb) {
-                printf("Unexpected DCB for message type %u!\n", msgtype);
-                return -1;
-            }
-            else if((flags & TBI_FLAGS_RTM) == TBI_FLAGS_RTM && ctx->dcb) {
-                printf("Unexpected RTM for message type %u!\n", msgtype);
-                return -1;
-            }
-            
-            /* Allocate memory for copying message */
-            buf = (uint8_t*)malloc(len * sizeof(uint8_t));
-            if(!buf)
-                return -1;
+    if((ret = tbi_server_frame_ctx(conn, buf, len, &ctx)) <= 0)
+        return ret;
 
-            /* Copy message over and store in message buffer */
-            memcpy(buf, tbi->channel->buf, len);
-            ret = tbi_buf_push_back(ctx, len, buf);
-            if(ret != 0) 
-                return -1;
-            
-            /* Signal msg received */
-            return 1;
-        }
+    if(ctx->batch_cb || ctx->column_cb)
+        return tbi_server_batch_frame(tbi, conn, ctx, buf, len);
+
+    /* Other callbacks take the server's own layout */
+    if(ctx->foreign)
+        return 0;
+
+    if(ctx->dcb) {
+        tbi_server_dcb_sink_t sink = {tbi, conn, ctx, 0, 0};
+        return tbi_server_frame_decode_dcb(tbi, conn, ctx, buf, len, &tbi_server_dcb_dispatch, &sink);
     }
-    return 0;
+
+    if(tbi_server_conn_scratch(conn) != 0 ||
+        tbi_server_frame_decode(ctx, buf, len, conn->scratch, conn->scratch_size) != 0)
+        return -1;
+
+    tbi_server_invoke_callback(tbi, ctx, conn->scratch);
+    return 1;
+}
+
+/**
+ * @brief Blocking receive from clients. Accepts new clients and completes
+ * their handshakes, and stores messages from all connected clients into
+ * the message buffers
+ * 
+ * @param[in] tbi       TBI context
+ * 
+ * @return number of messages received (may be 0 if only connection
+ *          activity took place), or a negative error code on failure
+*/
+int tbi_server_receive_blocking(tbi_ctx_t* tbi)
+{
+    if(!tbi || !tbi->channel || !tbi->channel->server)
+        return -1;
+
+    /* Receive from clients */
+    return tbi_server_channel_recv(tbi, -1, &tbi_server_store_frame);
 }
 
 
 /**
- * @brief Process the message buffers, invoking callbacks for received msgs
+ * @brief Receive from clients and invoke callbacks for received messages right
+ * away, without storing them into the message buffers. Replaces the pair of 
+ * @ref tbi_server_receive_blocking() and @ref tbi_server_process(), with no 
+ * heap allocations per message. The message passed to callbacks is only valid
+ * until the callback returns. Batch callbacks are invoked with the messages 
+ * of each client received in this call, before returning
+ * 
+ * @param[in] tbi           TBI context
+ * @param[in] timeout_ms    Max time to wait for client activity, -1 waits indefinitely
+ * 
+ * @return number of messages dispatched (may be 0 on timeout, signal, or if only
+ *          connection activity took place), or a negative error code on failure
+*/
+int tbi_server_dispatch(tbi_ctx_t* tbi, int timeout_ms)
+{
+    int ret;
+
+    if(!tbi || !tbi->channel || !tbi->channel->server)
+        return -1;
+
+    ret = tbi_server_channel_recv(tbi, timeout_ms, &tbi_server_dispatch_frame);
+
+    /* Deliver the last batch, messages do not wait for the next receive */
+    if(tbi->batch)
+        tbi_batch_deliver(tbi->batch);
+    return ret;
+}
+
+/**
+ * @brief Process the message buffers, invoking callbacks for received msgs.
+ * Message types with a batch callback are handed over in batches of up to
+ * @ref TBI_BATCH_MAX_MSGS messages, which may be from several clients
  * 
  * @param[in] tbi       TBI context
  * 
@@ -200,9 +1350,9 @@ int tbi_server_receive_blocking(tbi_ctx_t* tbi)
 int tbi_server_process(tbi_ctx_t* tbi)
 {
     tbi_msg_ctx_t * ctx = NULL;
-    int i, len_in, len_out, ret;
-    uint8_t* buf_out = NULL;
-    void* buf_in = NULL;
+    uint64_t pos;
+    void* msg;
+    int i;
     int recvd = 0;
     
     if(!tbi || !tbi->channel || !tbi->channel->server)
@@ -211,28 +1361,27 @@ int tbi_server_process(tbi_ctx_t* tbi)
     /* Check for received messages */
     for(i = 0; i < tbi->msg_ctxs_len; i++) {
         ctx = &tbi->msg_ctxs[i];
-        if(ctx->buflen >= 1 && !ctx->dcb) {
-
-            /* Pull messages from buffer */
-            while((ret = tbi_buf_pop_front(ctx, &len_in, &buf_in)) == 0) {
-
-                /* Deserialize to a native byte stream */
-                ret = tbi_deserialize_rtm(ctx->format, ctx->format_len, (uint8_t*)buf_in, len_in, (void**)&buf_out, &len_out);
-                if(ret != 0) {
-                    free(buf_in);
-                    continue;
-                }
-
-                /* Invoke callback if set. Global callback has higher precedence */
-                if(tbi->global_cb) {
-                    tbi->global_cb(ctx->msgtype, buf_out, tbi->global_cb_userdata);
-                } else if(ctx->cb) {
-                    ctx->cb(ctx->msgtype, buf_out, ctx->cb_userdata);
-                } 
-                free(buf_in);
-                free(buf_out);
+
+        /* Copy into a contiguous batch, the buffer slots are not. Buffered 
+         * messages no longer know their client, but keep its start timestamp 
+         * for rebuilding column timestamps */
+        if(ctx->batch_cb || ctx->column_cb) {
+            if(!tbi->batch && !(tbi->batch = tbi_batch_create(tbi)))
+                return -1;
+            while((msg = tbi_buf_pop_front(ctx, &pos)) != NULL) {
+                tbi_batch_add(tbi->batch, ctx, NULL, msg, tbi_buf_start_ts(msg));
+                tbi_buf_release(ctx, pos);
                 recvd++;
             }
+            tbi_batch_deliver(tbi->batch);
+            continue;
+        }
+
+        /* Invoke callbacks directly on the buffered messages */
+        while((msg = tbi_buf_pop_front(ctx, &pos)) != NULL) {
+            tbi_server_invoke_callback(tbi, ctx, msg);
+            tbi_buf_release(ctx, pos);
+            recvd++;
         }
     }
 
@@ -250,6 +1399,12 @@ int tbi_server_process(tbi_ctx_t* tbi)
 void tbi_server_register_global_callback(tbi_ctx_t* tbi, tbi_msg_callback cb, void* userdata)
 {
     if(!tbi) return;
+
+    /* Workers hold their own copy of the callbacks */
+    if(tbi->workers) {
+        TBI_LOG_ERROR("Callbacks must be registered before starting workers!\n");
+        return;
+    }
     
     /* Register global callback, will override msg callbacks */
     tbi->global_cb = cb;
@@ -269,26 +1424,140 @@ void tbi_server_register_global_callback(tbi_ctx_t* tbi, tbi_msg_callback cb, vo
 void tbi_server_register_msg_callback(tbi_ctx_t* tbi, uint8_t msgtype, tbi_msg_callback cb, void* userdata)
 {
     tbi_msg_ctx_t *ctx;
-    int i;
 
     if(!tbi) return;
 
+    /* Workers hold their own copy of the callbacks */
+    if(tbi->workers) {
+        TBI_LOG_ERROR("Callbacks must be registered before starting workers!\n");
+        return;
+    }
+
     /* Find message type from contexts and register cb */
-    for(i = 0; i < tbi->msg_ctxs_len; i++) {
-        ctx = &tbi->msg_ctxs[i];
-        if(ctx->msgtype == msgtype) {
-            ctx->cb = cb;
-            ctx->cb_userdata = userdata;
-            break;
-        }
+    if(!(ctx = tbi_msg_ctx(tbi, msgtype)))
+        return;
+    ctx->cb = cb;
+    ctx->cb_userdata = userdata;
+}
+
+/**
+ * @brief Register a callback for receiving messages of a certain type in 
+ * batches: a contiguous array of decoded messages, with the connection they
+ * were received from and when. Amortizes the callback over many messages, and
+ * lets the application store them in bulk. Has precedence over the global 
+ * callback and the message callback of the type
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] msgtype   Message type to associate the callback with
+ * @param[in] cb        Callback, or NULL to remove it
+ * @param[in] userdata  Optional user context passed to callback
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_server_register_batch_callback(tbi_ctx_t* tbi, uint8_t msgtype, tbi_msg_batch_callback cb, void* userdata)
+{
+    tbi_msg_ctx_t *ctx;
+
+    if(!tbi)
+        return -1;
+
+    /* Workers hold their own copy of the callbacks */
+    if(tbi->workers) {
+        TBI_LOG_ERROR("Callbacks must be registered before starting workers!\n");
+        return -1;
+    }
+
+    if(!(ctx = tbi_msg_ctx(tbi, msgtype)))
+        return -1;
+    ctx->batch_cb = cb;
+    ctx->column_cb = NULL;
+    ctx->batch_cb_userdata = userdata;
+    tbi_schema_binds_refresh(tbi);
+    return 0;
+}
+
+/**
+ * @brief Register a callback for receiving messages of a certain type in 
+ * batches of columns: an array per struct member, with timestamps rebuilt into
+ * milliseconds since the epoch, see @ref tbi_columns_t. DCB frames are decoded
+ * straight into the columns. Replaces the batch callback of the type, and has
+ * precedence over the global callback and the message callback of the type.
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] msgtype   Message type to associate the callback with
+ * @param[in] cb        Callback, or NULL to remove it
+ * @param[in] userdata  Optional user context passed to callback
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_server_register_column_callback(tbi_ctx_t* tbi, uint8_t msgtype, tbi_msg_column_callback cb, void* userdata)
+{
+    tbi_msg_ctx_t *ctx;
+
+    if(!tbi)
+        return -1;
+
+    /* Workers hold their own copy of the callbacks */
+    if(tbi->workers) {
+        TBI_LOG_ERROR("Callbacks must be registered before starting workers!\n");
+        return -1;
     }
+
+    if(!(ctx = tbi_msg_ctx(tbi, msgtype)))
+        return -1;
+    ctx->column_cb = cb;
+    ctx->batch_cb = NULL;
+    ctx->batch_cb_userdata = userdata;
+    tbi_schema_binds_refresh(tbi);
+    return 0;
+}
+
+/**
+ * @brief Get library statistics. With server workers, statistics are summed 
+ * over all workers. May be called from any thread
+ * 
+ * @param[in]  tbi       TBI context
+ * @param[out] out       Statistics
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_get_stats(tbi_ctx_t* tbi, tbi_stats_t* out)
+{
+    if(!tbi || !out)
+        return -1;
+
+    memset(out, 0, sizeof(tbi_stats_t));
+    tbi_stats_collect(tbi, out);
+    return 0;
 }
 
+/**
+ * @brief Get statistics of each connected client. Connections are owned by the
+ * thread receiving from them, so this is only available for a server without
+ * workers, from the thread calling @ref tbi_server_dispatch() or 
+ * @ref tbi_server_receive_blocking()
+ * 
+ * @param[in]  tbi       TBI context
+ * @param[out] out       Connection statistics
+ * @param[in]  max       Max number of elements in out
+ * 
+ * @return number of connections written to out, negative error code on failure
+*/
+int tbi_get_conn_stats(tbi_ctx_t* tbi, tbi_conn_stats_t* out, int max)
+{
+    if(!tbi || !tbi->channel || !tbi->channel->server || !out || max < 0)
+        return -1;
+
+    return tbi_stats_collect_conns(tbi, out, max);
+}
 
 void tbi_close(tbi_ctx_t* tbi)
 {
     if(!tbi) return;
 
+    /* Stop worker threads */
+    tbi_workers_stop(tbi);
+
     /* Close connection */
     if(tbi->channel) {
         if(tbi->channel->server) {
@@ -298,10 +1567,21 @@ void tbi_close(tbi_ctx_t* tbi)
         }
     }
 
+    /* Unacknowledged frames stay in the spool file */
+    tbi_spool_close(tbi->spool);
+    free(tbi->spool_path);
+
     /* Clear message buffers */
     for(int i = 0; i < tbi->msg_ctxs_len; i++) {
         tbi_buf_free(&(tbi->msg_ctxs[i]));
     }
+    tbi_dcb_enc_free(tbi->dcb_enc);
+    tbi_dcb_dec_free(tbi->dcb_dec);
+    tbi_batch_free(tbi->batch);
+
+    /* Connections referring to the specs are closed */
+    tbi_schema_binds_free(tbi);
+    tbi_schemas_free(tbi->schemas);
 
     /* Free main context */
     if(tbi) {
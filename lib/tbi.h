@@ -13,16 +13,40 @@
 tbi_ctx_t *tbi_init(void);
 int tbi_client_init(tbi_ctx_t* tbi);
 int tbi_server_init(tbi_ctx_t* tbi);
+int tbi_server_start_workers(tbi_ctx_t* tbi, int workers_len);
+void tbi_server_stop_workers(tbi_ctx_t* tbi);
+int tbi_server_add_schema(tbi_ctx_t* tbi, const uint8_t* desc, int len);
+int tbi_server_load_schema(tbi_ctx_t* tbi, const char* path);
+int tbi_server_load_schemas(tbi_ctx_t* tbi, const char* dir);
+
+long tbi_get_buffer_size(tbi_ctx_t* tbi, uint8_t msgtype, int capacity);
+int tbi_set_buffer(tbi_ctx_t* tbi, uint8_t msgtype, int capacity, void* region, long region_size);
+int tbi_set_overflow(tbi_ctx_t* tbi, uint8_t msgtype, tbi_overflow_policy_t policy, int decimate);
+int tbi_set_features(tbi_ctx_t* tbi, uint8_t features);
+int tbi_set_device_id(tbi_ctx_t* tbi, uint64_t device_id);
+int tbi_set_spool(tbi_ctx_t* tbi, const char* path, uint32_t size);
+uint64_t tbi_get_start_ts(tbi_ctx_t* tbi);
 
 int tbi_telemetry_schedule(tbi_ctx_t* tbi, int msg_type, const void* buf, int len);
 
 int tbi_client_process(tbi_ctx_t* tbi);
+int tbi_client_flush(tbi_ctx_t* tbi, int flags, tbi_flush_result_t* result);
+int tbi_client_wait(tbi_ctx_t* tbi, int timeout_ms);
+int tbi_client_next_deadline(tbi_ctx_t* tbi);
+int tbi_client_spool_sync(tbi_ctx_t* tbi);
+int tbi_client_pending(tbi_ctx_t* tbi, int* bytes);
 
 int tbi_server_receive_blocking(tbi_ctx_t* tbi);
 int tbi_server_process(tbi_ctx_t* tbi);
+int tbi_server_dispatch(tbi_ctx_t* tbi, int timeout_ms);
 
 void tbi_server_register_global_callback(tbi_ctx_t* tbi, tbi_msg_callback cb, void* userdata);
 void tbi_server_register_msg_callback(tbi_ctx_t* tbi, uint8_t msgtype, tbi_msg_callback cb, void* userdata);
+int tbi_server_register_batch_callback(tbi_ctx_t* tbi, uint8_t msgtype, tbi_msg_batch_callback cb, void* userdata);
+int tbi_server_register_column_callback(tbi_ctx_t* tbi, uint8_t msgtype, tbi_msg_column_callback cb, void* userdata);
+
+int tbi_get_stats(tbi_ctx_t* tbi, tbi_stats_t* out);
+int tbi_get_conn_stats(tbi_ctx_t* tbi, tbi_conn_stats_t* out, int max);
 
 void tbi_close(tbi_ctx_t* tbi);
 
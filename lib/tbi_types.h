@@ -8,10 +8,28 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #define TBI_FLAGS_NONE  (0)
 #define TBI_FLAGS_RTM   (1)
 #define TBI_FLAGS_DCB   (1 << 1)
+#define TBI_FLAGS_CRC   (1 << 2)    /** @brief Frame is followed by its CRC32C */
+
+/** @brief Optional protocol features, negotiated in the handshake, see @ref tbi_set_features() */
+#define TBI_FEATURE_CRC32C  (1)   /** @brief Every frame is followed by its CRC32C */
+#define TBI_FEATURE_ACK     (2)   /** @brief Server acknowledges received frames, see @ref tbi_set_spool() */
+
+/** @brief Length of a server acknowledge: 'A', then the bytes of frames received 
+ * since the handshake as uint64_t big-endian */
+#define TBI_ACK_LEN 9
+
+/** @brief Smallest spool, large enough for a full channel transmit buffer, see @ref tbi_set_spool() */
+#define TBI_SPOOL_MIN_SIZE (256 * 1024)
+
+/** @brief Options for @ref tbi_client_flush() */
+#define TBI_FLUSH_NONE  (0)
+#define TBI_FLUSH_CORK  (1)   /** @brief Cork the socket for the duration of the flush (TCP_CORK) */
+#define TBI_FLUSH_ALL   (2)   /** @brief Send bundled message types before their send interval expires */
 
 /** @brief Message reception callback. 
  * Will be called with message type, the message itself (must be copied
@@ -19,6 +37,51 @@
  */
 typedef void(*tbi_msg_callback)(const int message_type, const void* msg, void* userdata);
 
+/** @brief Max number of messages handed to a batch callback at once */
+#define TBI_BATCH_MAX_MSGS 1024
+
+/** @brief Where and when a batch of messages was received */
+typedef struct {
+  uint64_t conn_id;           /** @brief Client connection, unique within the process. 0 if the messages were
+                                  taken from the message buffers by @ref tbi_server_process(), and may be from several clients */
+  int fd;                     /** @brief Client socket, -1 if conn_id is 0 */
+  uint64_t start_ts;          /** @brief Client start timestamp in ms, telemetry is relative to this. 0 if conn_id is 0 */
+  uint64_t device_id;         /** @brief Client device identifier, see @ref tbi_set_device_id(). 0 if not set or conn_id is 0 */
+  uint64_t recv_ts;           /** @brief Time the first message of the batch was received, in ms */
+  uint8_t schema_version;     /** @brief Message spec version of the client, the messages are laid out
+                                  by its format. 0 if conn_id is 0 */
+  uint16_t schema_csum;       /** @brief Message spec checksum of the client. 0 if conn_id is 0 */
+} tbi_batch_info_t;
+
+/** @brief Batch reception callback. 
+ * Will be called with message type, an array of count messages of that
+ * type, where and when they were received, and optional user context. The
+ * messages are owned by the library, and only valid until the callback returns
+ */
+typedef void(*tbi_msg_batch_callback)(const int message_type, const void* msgs, int count,
+  const tbi_batch_info_t* info, void* userdata);
+
+/** @brief Messages decoded into a column per struct member. Column i holds count values
+ * of member i, in the native type of its field type format[i]: uint8_t, int8_t, uint16_t,
+ * int16_t, uint32_t or int32_t. Timestamps, @ref TBI_TIMEDIFF_S and @ref TBI_TIMEDIFF_MS,
+ * are rebuilt into uint64_t milliseconds since the epoch, from the client start timestamp
+ */
+typedef struct {
+  int count;                  /** @brief Number of messages, the length of every column */
+  int fields;                 /** @brief Number of columns, one per struct member */
+  const uint8_t *format;      /** @brief Field type of each column, @ref tbi_msg_field_types_t */
+  void * const *cols;         /** @brief Column of each member, 8-byte aligned */
+} tbi_columns_t;
+
+/** @brief Column reception callback. 
+ * Will be called with message type, a batch of messages of that type as
+ * a column per struct member, where and when they were received, and
+ * optional user context. The columns are owned by the library, and only
+ * valid until the callback returns
+ */
+typedef void(*tbi_msg_column_callback)(const int message_type, const tbi_columns_t* cols,
+  const tbi_batch_info_t* info, void* userdata);
+
 
 /** @brief Type for storing time difference of full seconds, 32-bit */
 typedef uint32_t timediff_s;
@@ -29,12 +92,121 @@ typedef struct {
   uint32_t ms: 10;  
 } timediff_ms;
 
-/** @brief Telemetry message linked list element */
-typedef struct tbi_msg_node {
-  int   len;
-  void *buf;
-  struct tbi_msg_node * next;
-} tbi_msg_node;
+struct tbi_uring;
+struct tbi_msg_ctx;
+struct tbi_schema;
+
+/** @brief Max number of message types, the type takes 4 bits on the wire */
+#define TBI_MAX_MSG_TYPES 16
+
+/** @brief Number of buckets in a duration histogram */
+#define TBI_HIST_BUCKETS 32
+
+/** @brief Log2-bucketed duration histogram. Bucket 0 counts durations under 1 ns, 
+ * bucket i durations in [2^(i-1), 2^i) ns, and the last bucket everything longer */
+typedef struct {
+  uint64_t count;                       /** @brief Number of samples */
+  uint64_t sum_ns;                      /** @brief Sum of all samples */
+  uint64_t buckets[TBI_HIST_BUCKETS];   /** @brief Number of samples in each bucket */
+} tbi_hist_t;
+
+/** @brief Statistics for a single message type */
+typedef struct {
+  uint8_t msgtype;            /** @brief Message type @ref msgspec_types_t */
+  int queue_depth;            /** @brief Messages in the message buffer, filled in by @ref tbi_get_stats() */
+  uint64_t frames_sent;       /** @brief Frames serialized for sending */
+  uint64_t bytes_sent;        /** @brief Bytes serialized for sending */
+  uint64_t frames_recvd;      /** @brief Frames received */
+  uint64_t bytes_recvd;       /** @brief Bytes received */
+  uint64_t decode_errors;     /** @brief Frames of this type that failed to decode */
+  uint64_t dropped;           /** @brief Messages dropped by the overflow policy */
+  tbi_hist_t serialize;       /** @brief Time to serialize a message */
+  tbi_hist_t deserialize;     /** @brief Time to deserialize a message */
+  tbi_hist_t callback;        /** @brief Time spent in the reception callback */
+} tbi_msg_stats_t;
+
+/** @brief Statistics for a single server-side client connection */
+typedef struct {
+  int fd;                     /** @brief Client socket */
+  uint64_t start_ts;          /** @brief Client start timestamp */
+  uint64_t device_id;         /** @brief Client device identifier, 0 if not set */
+  uint64_t frames_recvd;      /** @brief Frames received */
+  uint64_t bytes_recvd;       /** @brief Bytes received */
+  uint64_t decode_errors;     /** @brief Frames that were malformed or failed to decode */
+  uint64_t checksum_errors;   /** @brief Frames dropped for a missing or mismatching checksum */
+} tbi_conn_stats_t;
+
+/** @brief Channel-level statistics */
+typedef struct {
+  uint64_t conns_accepted;    /** @brief Clients accepted (server) */
+  uint64_t conns_closed;      /** @brief Client connections closed (server) */
+  uint64_t handshake_rejects; /** @brief Client handshakes rejected (server) */
+  uint64_t frame_errors;      /** @brief Malformed frames, closing their connection (server) */
+  uint64_t checksum_errors;   /** @brief Frames dropped for a missing or mismatching checksum (server) */
+  uint64_t connects;          /** @brief Connections established (client) */
+  uint64_t connect_failures;  /** @brief Failed connection attempts and lost connections (client) */
+  uint64_t bytes_sent;        /** @brief Bytes written to sockets */
+  uint64_t bytes_recvd;       /** @brief Bytes read from sockets */
+  uint64_t syscalls;          /** @brief Send and receive syscalls made */
+} tbi_channel_stats_t;
+
+/** @brief Library statistics, see @ref tbi_get_stats() */
+typedef struct {
+  tbi_channel_stats_t channel;                /** @brief Channel statistics, summed over workers */
+  int conns_len;                              /** @brief Number of connected clients (server) */
+  int msgs_len;                               /** @brief Number of elements in msgs */
+  tbi_msg_stats_t msgs[TBI_MAX_MSG_TYPES];    /** @brief Statistics per message type, summed over workers */
+} tbi_stats_t;
+
+/** @brief Result of a client flush */
+typedef struct {
+  int msgs;                   /** @brief Number of messages sent */
+  int bytes;                  /** @brief Number of bytes sent */
+  int syscalls;               /** @brief Number of send syscalls made */
+} tbi_flush_result_t;
+
+/** @brief Server-side connection state */
+typedef enum {
+  TBI_CONN_HANDSHAKE  = 0,
+  TBI_CONN_STREAMING  = 1,
+  TBI_CONN_CLOSING    = 2,
+} tbi_conn_state_t;
+
+/** @brief Server-side context for a single connected client */
+typedef struct tbi_conn {
+  uint64_t id;                /** @brief Connection number, unique within the process */
+  int fd;                     /** @brief Non-blocking client socket */
+  tbi_conn_state_t state;     /** @brief Handshake state of this connection */
+  uint64_t start_ts;          /** @brief Client start timestamp, telemetry is relative to this */
+  uint8_t features;           /** @brief Protocol features agreed with the client */
+  uint64_t device_id;         /** @brief Client device identifier from the handshake, 0 if not set */
+  const struct tbi_schema *schema; /** @brief Message spec of the client, bound in the handshake */
+  struct tbi_msg_ctx * const *types; /** @brief Context of each message type of the client's spec by ID */
+  uint8_t *rx_buf;            /** @brief Bytes of a partially received frame, carried over to next read */
+  int rx_len;                 /** @brief Number of bytes in rx_buf */
+  int rx_size;                /** @brief Allocated size of rx_buf */
+  tbi_conn_stats_t stats;     /** @brief Connection statistics */
+  uint64_t rx_pos;            /** @brief Bytes of frames received since the handshake */
+  uint64_t ack_pos;           /** @brief rx_pos last acknowledged, with @ref TBI_FEATURE_ACK */
+  uint8_t ack[TBI_ACK_LEN];   /** @brief Acknowledge being sent */
+  int ack_off;                /** @brief Bytes of ack sent, nonzero if the socket took only part of it */
+  void *scratch;              /** @brief Decoded message handed to callbacks, reused for every message */
+  int scratch_size;           /** @brief Allocated size of scratch */
+  int uring_reqs;             /** @brief io_uring requests in flight for this connection, freed once none is left */
+  bool ready;                 /** @brief Left with data to read after its read budget, on the ready list */
+  struct tbi_conn *ready_prev; /** @brief Previous connection in the server ready list */
+  struct tbi_conn *ready_next; /** @brief Next connection in the server ready list */
+  struct tbi_conn *prev;      /** @brief Previous connection in the server connection list */
+  struct tbi_conn *next;      /** @brief Next connection in the server connection list */
+} tbi_conn_t;
+
+/** @brief Client-side connection state */
+typedef enum {
+  TBI_CLIENT_DISCONNECTED = 0,  /** @brief Waiting for the next connection attempt */
+  TBI_CLIENT_CONNECTING   = 1,  /** @brief Non-blocking connect in progress */
+  TBI_CLIENT_HANDSHAKE    = 2,  /** @brief Handshake sent, waiting for server acknowledge */
+  TBI_CLIENT_CONNECTED    = 3,  /** @brief Streaming telemetry */
+} tbi_client_state_t;
 
 /** @brief Channel context */
 typedef struct {
@@ -42,8 +214,30 @@ typedef struct {
     bool connected;
     int conn_fd;
     int listen_fd;
+    int epoll_fd;
     uint64_t start_ts;
     uint8_t *buf;
+    uint8_t *tx_buf;
+    int tx_size;
+    int tx_len;                 /** @brief Bytes of serialized frames in tx_buf */
+    int tx_off;                 /** @brief Bytes of tx_buf already sent */
+    tbi_client_state_t state;
+    int hs_len;                 /** @brief Bytes of server handshake received */
+    uint8_t features;           /** @brief Protocol features agreed with the server */
+    uint64_t send_pos;          /** @brief Spool position of the next byte to send */
+    uint64_t conn_pos;          /** @brief Spool position at the start of the connection, acknowledges count from it */
+    int ack_len;                /** @brief Bytes of a partial server acknowledge in buf */
+    uint32_t backoff_ms;        /** @brief Current reconnect backoff */
+    uint64_t attempt_ts;        /** @brief Time of the current connection attempt */
+    uint64_t retry_ts;          /** @brief Time of the next connection attempt */
+    uint32_t rand_state;        /** @brief Backoff jitter generator state */
+    int conns_len;
+    tbi_conn_t *conns;
+    int ready_len;              /** @brief Connections on the ready list */
+    tbi_conn_t *ready;          /** @brief Connections with data left to read, oldest first */
+    tbi_conn_t *ready_tail;     /** @brief Newest connection on the ready list */
+    struct tbi_uring *uring;
+    tbi_channel_stats_t stats;
 } tbi_channel_t;
 
 
@@ -59,27 +253,99 @@ typedef enum {
   TBI_INT32       = 7,
 } tbi_msg_field_types_t;
 
+/** @brief Serializer specialized for a message type, generated by compose.py.
+ * Writes the RTM frame of a native message, see @ref tbi_serialize_rtm_into()
+ * 
+ * @return number of bytes written, or -1 if out_size is too small
+ */
+typedef int(*tbi_msg_encode_fn)(const void* msg, uint8_t* out, int out_size);
+
+/** @brief Deserializer specialized for a message type, generated by compose.py.
+ * Reads a native message from its RTM frame, see @ref tbi_deserialize_rtm_into()
+ * 
+ * @return number of bytes read, or -1 if in_len is not the frame length
+ */
+typedef int(*tbi_msg_decode_fn)(const uint8_t* in, int in_len, void* msg);
+
+/** @brief What to do with a message when the buffer of its type is full */
+typedef enum {
+  TBI_OVERFLOW_DROP_NEWEST = 0, /** @brief Drop the new message */
+  TBI_OVERFLOW_DROP_OLDEST = 1, /** @brief Drop the oldest buffered message to make room */
+  TBI_OVERFLOW_DECIMATE    = 2, /** @brief Keep every k-th new message, dropping the oldest to make room */
+} tbi_overflow_policy_t;
+
 /** @brief Telemetry context for each message type, including a buffer */
-typedef struct {
+typedef struct tbi_msg_ctx {
   uint8_t msgtype;            /** @brief Message type @ref msgspec_types_t */
   bool dcb;                   /** @brief Should these messages be bundled or not */
   int raw_size;               /** @brief Message size when storing into buffer */
   int format_len;             /** @brief Size of the binary message format specifier */
   const uint8_t * format;     /** @brief Array of @ref tbi_msg_field_types_t for this format */
-  int buflen;                 /** @brief Number of items in the message buffer */
-  struct tbi_msg_node *head;  /** @brief Pointer to first element in the message buffer */
+  tbi_msg_encode_fn encode;   /** @brief Specialized serializer, NULL to interpret the format */
+  tbi_msg_decode_fn decode;   /** @brief Specialized deserializer, NULL to interpret the format */
+  int capacity;               /** @brief Message buffer capacity in messages, 0 for default. Rounded up to a power of two */
+  int quota_bytes;            /** @brief Message buffer byte budget, used if no capacity is set */
+  tbi_overflow_policy_t overflow; /** @brief Overflow policy when the message buffer is full */
+  int decimate;               /** @brief Keep every k-th message with @ref TBI_OVERFLOW_DECIMATE */
+  uint64_t overflows;         /** @brief Messages arrived to a full buffer, for decimation */
+  int send_interval;          /** @brief Bundled types: max time in ms a message waits to be sent, 0 sends on every flush */
+  int max_bundle;             /** @brief Bundled types: send as soon as this many messages are buffered, and at most this many per frame. 0 for no limit */
+  uint64_t deadline_ms;       /** @brief Bundled types: monotonic time the buffered messages are due, 0 if not set */
+  int stride;                 /** @brief Size of a message buffer slot */
+  uint8_t *ring;              /** @brief Message buffer slots */
+  bool ring_owned;            /** @brief Message buffer was allocated by the library */
+  uint64_t enq_pos;           /** @brief Next position to push to, shared by producers */
+  uint64_t deq_pos;           /** @brief Next position to pop from, owned by the consumer */
   tbi_msg_callback cb;        /** @brief Message reception callback for this message type */
   void* cb_userdata;          /** @brief Optional user context associated with the callback */
+  tbi_msg_batch_callback batch_cb; /** @brief Batch reception callback, has precedence over the other callbacks */
+  tbi_msg_column_callback column_cb; /** @brief Column reception callback, set instead of batch_cb */
+  void* batch_cb_userdata;    /** @brief Optional user context associated with the batch or column callback */
+  tbi_msg_stats_t stats;      /** @brief Statistics for this message type */
+  bool foreign;               /** @brief Type of a client message spec laid out unlike the server's own, 
+                                  only delivered to batch and column callbacks */
 } tbi_msg_ctx_t;
 
+struct tbi_worker;
+struct tbi_dcb_enc;
+struct tbi_dcb_dec;
+struct tbi_batch;
+struct tbi_spool;
+struct tbi_schemas;
+struct tbi_schema_bind;
+
 /** @brief Main TBI library context data structure */
-typedef struct {
+typedef struct tbi_ctx {
     uint8_t msgspec_version;
+    uint8_t features;           /** @brief Protocol features requested by a client, or accepted by a server */
+    uint64_t device_id;         /** @brief Device identifier a client sends in the handshake, 0 if not set */
     int msg_ctxs_len;
     tbi_msg_ctx_t *msg_ctxs;
+    const int8_t *msg_index;    /** @brief Index into msg_ctxs by message type, -1 if unused. NULL to search msg_ctxs */
     tbi_channel_t *channel;
     tbi_msg_callback global_cb;
     void* global_cb_userdata;
+    int workers_len;
+    struct tbi_worker *workers;
+    int workers_stop_fd;
+    bool workers_stopping;
+    struct tbi_dcb_enc *dcb_enc;
+    struct tbi_dcb_dec *dcb_dec;
+    struct tbi_batch *batch;    /** @brief Messages collected for a batch callback, allocated on first use */
+    char *spool_path;           /** @brief Spool file set with @ref tbi_set_spool(), NULL for none */
+    uint32_t spool_size;        /** @brief Spool ring size */
+    struct tbi_spool *spool;    /** @brief Persistent spool of serialized frames, opened by @ref tbi_client_init() */
+    struct tbi_schemas *schemas; /** @brief Message specs the server accepts, shared with the workers */
+    struct tbi_schema_bind **binds; /** @brief Specs bound to this context by registry index, created on first handshake */
 } tbi_ctx_t;
 
+/** @brief Server worker thread, owning a private copy of the TBI context with its own
+ * listening socket, connections and message buffers */
+typedef struct tbi_worker {
+    int id;                     /** @brief Worker index */
+    pthread_t thread;           /** @brief Worker thread */
+    tbi_ctx_t *parent;          /** @brief Context the worker was started from */
+    tbi_ctx_t *tbi;             /** @brief Worker-private context */
+} tbi_worker_t;
+
 #endif /* __TBI_TYPES_H */
\ No newline at end of file
@@ -0,0 +1,549 @@
+/**
+* @file     uring.c
+* @brief    io_uring server channel backend. Clients are accepted with a multishot accept
+*           and received with multishot recvs into a ring of kernel-provided buffers, so
+*           a busy server makes no syscall per message. Built with TBI_WITH_IO_URING, and
+*           used only if the running kernel supports it
+*/
+
+#ifdef TBI_WITH_IO_URING
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "stats.h"
+#include "log.h"
+
+#define TBI_URING_ENTRIES 1024U
+#define TBI_URING_BUFS 512U
+#define TBI_URING_BUF_SIZE 16384U
+#define TBI_URING_BGID 0
+
+/** @brief Request tags for requests not associated with a connection. Connection
+ * requests are tagged with the (aligned) connection pointer, and the cancel of a
+ * connection's recv with the pointer and @ref TBI_URING_TAG_CONN_CANCEL set */
+#define TBI_URING_TAG_ACCEPT 1
+#define TBI_URING_TAG_WATCH  2
+#define TBI_URING_TAG_CANCEL 3
+#define TBI_URING_TAG_CONN_CANCEL 1
+
+/** @brief io_uring backend state of a server channel */
+struct tbi_uring {
+    int fd;
+    int watch_fd;
+
+    /* Submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_pending;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* Completion queue, shares mapping with submission queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_size;
+
+    /* Provided buffer ring */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint16_t br_tail;
+    uint8_t *bufs;
+};
+
+static int tbi_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int tbi_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int tbi_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/** @brief Check whether the running kernel supports everything the backend needs.
+ * Can be disabled at runtime by setting TBI_DISABLE_IO_URING in the environment
+ *
+ * @return true if the io_uring backend can be used
+ */
+bool tbi_uring_supported(void)
+{
+    static int supported = -1;
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+    unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    int fd, i, result = 0;
+
+    if((result = __atomic_load_n(&supported, __ATOMIC_ACQUIRE)) >= 0)
+        return result;
+    result = 0;
+
+    if(getenv("TBI_DISABLE_IO_URING"))
+        goto exit;
+
+    /* Single issuer setup flag was introduced along with multishot recv (Linux 6.0) */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER;
+    fd = tbi_uring_setup(4, &p);
+    if(fd < 0)
+        goto exit;
+
+    if((p.features & features) != features)
+        goto exit_ring_opened;
+
+    probe = (struct io_uring_probe*)calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if(!probe)
+        goto exit_ring_opened;
+
+    if(tbi_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        result = 1;
+        for(i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+            if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                result = 0;
+        }
+    }
+    free(probe);
+
+exit_ring_opened:
+    close(fd);
+exit:
+    __atomic_store_n(&supported, result, __ATOMIC_RELEASE);
+    return result;
+}
+
+/** @brief Get a cleared submission queue entry, submitting queued entries if the queue is full
+ *
+ * @return submission queue entry, or NULL if none available
+ */
+static struct io_uring_sqe *tbi_uring_get_sqe(struct tbi_uring *ur)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head, tail, idx;
+    int ret;
+
+    tail = *ur->sq_tail;
+    head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+    if(tail - head >= ur->sq_entries) {
+        ret = tbi_uring_enter(ur->fd, ur->sq_pending, 0, 0, NULL, 0);
+        if(ret <= 0)
+            return NULL;
+        ur->sq_pending -= ret;
+        head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+        if(tail - head >= ur->sq_entries)
+            return NULL;
+    }
+
+    idx = tail & *ur->sq_mask;
+    sqe = &ur->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sq_array[idx] = idx;
+
+    /* Kernel reads the queue only in io_uring_enter(), so the entry can be published
+     * before the caller fills it in */
+    __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ur->sq_pending++;
+    return sqe;
+}
+
+/** @brief Queue a multishot accept on the listening socket */
+static int tbi_uring_arm_accept(tbi_channel_t *channel)
+{
+    struct io_uring_sqe *sqe = tbi_uring_get_sqe(channel->uring);
+    if(!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = channel->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = TBI_URING_TAG_ACCEPT;
+    return 0;
+}
+
+/** @brief Queue a multishot recv on a client connection, selecting buffers from the buffer ring */
+static int tbi_uring_arm_recv(struct tbi_uring *ur, tbi_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = tbi_uring_get_sqe(ur);
+    if(!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = TBI_URING_BGID;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+    conn->uring_reqs++;
+    return 0;
+}
+
+/** @brief Queue a multishot poll on the watched descriptor */
+static int tbi_uring_arm_watch(struct tbi_uring *ur)
+{
+    struct io_uring_sqe *sqe = tbi_uring_get_sqe(ur);
+    if(!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ur->watch_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = TBI_URING_TAG_WATCH;
+    return 0;
+}
+
+/** @brief Stop receiving from a connection, whose multishot recv is armed. The
+ * connection is freed once its recv and the cancel have completed, so that the
+ * cancel never matches a later connection allocated at the same address */
+static void tbi_uring_conn_shutdown(struct tbi_uring *ur, tbi_conn_t *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    conn->state = TBI_CONN_CLOSING;
+
+    sqe = tbi_uring_get_sqe(ur);
+    if(!sqe) {
+        /* Without a free entry, a shutdown makes the recv complete instead */
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)conn;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | TBI_URING_TAG_CONN_CANCEL;
+    conn->uring_reqs++;
+}
+
+/** @brief Free a closing connection once it has no requests in flight */
+static void tbi_uring_conn_release(tbi_ctx_t* tbi, tbi_conn_t* conn)
+{
+    if(conn->uring_reqs > 0)
+        return;
+    tbi_server_conn_close(tbi->channel, conn);
+    TBI_LOG_INFO("Client disconnected! (%d connections)\n", tbi->channel->conns_len);
+}
+
+/** @brief Give a buffer (back) to the kernel. Visible to the kernel after @ref tbi_uring_buf_publish() */
+static void tbi_uring_buf_add(struct tbi_uring *ur, unsigned bid, unsigned offset)
+{
+    struct io_uring_buf *buf = &ur->br->bufs[(ur->br_tail + offset) & (TBI_URING_BUFS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ur->bufs + (size_t)bid * TBI_URING_BUF_SIZE);
+    buf->len = TBI_URING_BUF_SIZE;
+    buf->bid = bid;
+}
+
+static void tbi_uring_buf_publish(struct tbi_uring *ur, unsigned count)
+{
+    ur->br_tail += count;
+    __atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
+
+/** @brief Set up the io_uring backend for an opened, listening server channel
+ *
+ * @param[in]  tbi     TBI context
+ *
+ * @return 0 on success, or a negative error value
+ */
+int tbi_uring_open(tbi_ctx_t* tbi)
+{
+    struct tbi_uring *ur;
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size;
+    unsigned i;
+
+    ur = (struct tbi_uring*)calloc(1, sizeof(struct tbi_uring));
+    if(!ur)
+        return -1;
+    ur->watch_fd = -1;
+
+    /* Completions of a multishot recv may outnumber submissions many times */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = TBI_URING_ENTRIES * 4;
+    ur->fd = tbi_uring_setup(TBI_URING_ENTRIES, &p);
+    if(ur->fd < 0) {
+        perror("Error in io_uring_setup");
+        goto exit_allocated;
+    }
+
+    /* Map submission and completion queue rings with a single mapping */
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ur->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ur->ring_ptr = mmap(NULL, ur->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if(ur->ring_ptr == MAP_FAILED) {
+        perror("Error mapping io_uring");
+        goto exit_ring_opened;
+    }
+
+    ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = (struct io_uring_sqe*)mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if(ur->sqes == MAP_FAILED) {
+        perror("Error mapping io_uring");
+        goto exit_ring_mapped;
+    }
+
+    ur->sq_head = (unsigned*)((uint8_t*)ur->ring_ptr + p.sq_off.head);
+    ur->sq_tail = (unsigned*)((uint8_t*)ur->ring_ptr + p.sq_off.tail);
+    ur->sq_mask = (unsigned*)((uint8_t*)ur->ring_ptr + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned*)((uint8_t*)ur->ring_ptr + p.sq_off.array);
+    ur->sq_entries = p.sq_entries;
+    ur->cq_head = (unsigned*)((uint8_t*)ur->ring_ptr + p.cq_off.head);
+    ur->cq_tail = (unsigned*)((uint8_t*)ur->ring_ptr + p.cq_off.tail);
+    ur->cq_mask = (unsigned*)((uint8_t*)ur->ring_ptr + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe*)((uint8_t*)ur->ring_ptr + p.cq_off.cqes);
+
+    /* Provided buffer ring, must be page aligned */
+    ur->br_size = TBI_URING_BUFS * sizeof(struct io_uring_buf);
+    ur->br = (struct io_uring_buf_ring*)mmap(NULL, ur->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ur->br == MAP_FAILED) {
+        perror("Error allocating io_uring buffer ring");
+        goto exit_sqes_mapped;
+    }
+
+    ur->bufs = (uint8_t*)malloc((size_t)TBI_URING_BUFS * TBI_URING_BUF_SIZE);
+    if(!ur->bufs)
+        goto exit_br_mapped;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ur->br;
+    reg.ring_entries = TBI_URING_BUFS;
+    reg.bgid = TBI_URING_BGID;
+    if(tbi_uring_register(ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        perror("Error registering io_uring buffer ring");
+        goto exit_bufs_allocated;
+    }
+
+    ur->br_tail = 0;
+    for(i = 0; i < TBI_URING_BUFS; i++) {
+        tbi_uring_buf_add(ur, i, i);
+    }
+    tbi_uring_buf_publish(ur, TBI_URING_BUFS);
+
+    tbi->channel->uring = ur;
+    if(tbi_uring_arm_accept(tbi->channel) != 0) {
+        tbi->channel->uring = NULL;
+        goto exit_bufs_allocated;
+    }
+
+    return 0;
+
+exit_bufs_allocated:
+    free(ur->bufs);
+exit_br_mapped:
+    munmap(ur->br, ur->br_size);
+exit_sqes_mapped:
+    munmap(ur->sqes, ur->sqes_size);
+exit_ring_mapped:
+    munmap(ur->ring_ptr, ur->ring_size);
+exit_ring_opened:
+    close(ur->fd);
+exit_allocated:
+    free(ur);
+    return -1;
+}
+
+/** @brief Watch an additional file descriptor that wakes up @ref tbi_uring_recv()
+ *
+ * @param[in]  tbi     TBI context
+ * @param[in]  fd      File descriptor to watch
+ *
+ * @return 0 on success, or a negative error value
+ */
+int tbi_uring_watch(tbi_ctx_t* tbi, int fd)
+{
+    struct tbi_uring *ur = tbi->channel->uring;
+
+    ur->watch_fd = fd;
+    return tbi_uring_arm_watch(ur);
+}
+
+/** @brief Handle a completed recv of a client connection
+ *
+ * @param[in]  tbi      TBI context
+ * @param[in]  conn     Client connection
+ * @param[in]  cqe      Completion
+ * @param[in]  handler  Handler for received frames
+ * @param[out] recvd    Incremented by the number of messages handled
+ * @param[out] returned Incremented by the number of buffers given back to the kernel
+ */
+static void tbi_uring_conn_complete(tbi_ctx_t* tbi, tbi_conn_t* conn, struct io_uring_cqe* cqe,
+    tbi_frame_handler handler, int* recvd, unsigned* returned)
+{
+    struct tbi_uring *ur = tbi->channel->uring;
+    unsigned bid;
+
+    if(cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(cqe->res > 0 && conn->state != TBI_CONN_CLOSING) {
+            if(tbi_server_conn_input(tbi, conn, ur->bufs + (size_t)bid * TBI_URING_BUF_SIZE, cqe->res, handler, recvd) != 0) {
+                /* Cancel only a recv that is still armed, an ended one frees the connection below */
+                if(cqe->flags & IORING_CQE_F_MORE)
+                    tbi_uring_conn_shutdown(ur, conn);
+                else
+                    conn->state = TBI_CONN_CLOSING;
+            }
+        }
+        tbi_uring_buf_add(ur, bid, (*returned)++);
+    }
+
+    if(cqe->flags & IORING_CQE_F_MORE)
+        return;
+
+    /* Multishot recv has ended. Rearm if only out of buffers or stopped by the kernel */
+    conn->uring_reqs--;
+    if(conn->state != TBI_CONN_CLOSING && (cqe->res > 0 || cqe->res == -ENOBUFS)) {
+        if(tbi_uring_arm_recv(ur, conn) == 0)
+            return;
+    }
+
+    if(cqe->res < 0 && cqe->res != -ECANCELED && cqe->res != -ECONNRESET)
+        TBI_LOG_WARN("Error receiving from client: %s\n", strerror(-cqe->res));
+
+    conn->state = TBI_CONN_CLOSING;
+    tbi_uring_conn_release(tbi, conn);
+}
+
+/** @brief Wait for client activity, accepting new clients and handing received
+ * messages to the frame handler
+ *
+ * @param[in]  tbi          TBI context
+ * @param[in]  timeout_ms   Max time to wait, or -1 to block until activity
+ * @param[in]  handler      Handler for received frames
+ *
+ * @return Number of messages handled, or a negative error value
+ */
+int tbi_uring_recv(tbi_ctx_t* tbi, int timeout_ms, tbi_frame_handler handler)
+{
+    struct tbi_uring *ur = tbi->channel->uring;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    tbi_conn_t *conn;
+    unsigned head, tail, returned = 0;
+    int ret, recvd = 0;
+
+    /* Submit queued requests and wait for at least one completion */
+    if(timeout_ms >= 0) {
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        ret = tbi_uring_enter(ur->fd, ur->sq_pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } else {
+        ret = tbi_uring_enter(ur->fd, ur->sq_pending, 1, IORING_ENTER_GETEVENTS, NULL, _NSIG / 8);
+    }
+    TBI_STAT_INC(tbi->channel->stats.syscalls);
+    if(ret < 0) {
+        if(errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+            perror("Error in io_uring_enter");
+            return -1;
+        }
+    } else {
+        ur->sq_pending -= ret;
+    }
+
+    head = *ur->cq_head;
+    tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++) {
+        cqe = &ur->cqes[head & *ur->cq_mask];
+
+        switch(cqe->user_data) {
+            case TBI_URING_TAG_ACCEPT:
+                if(cqe->res >= 0) {
+                    conn = tbi_server_conn_add(tbi->channel, cqe->res);
+                    if(conn && tbi_uring_arm_recv(ur, conn) != 0)
+                        tbi_server_conn_close(tbi->channel, conn);
+                } else if(cqe->res != -EAGAIN && cqe->res != -EINTR) {
+                    TBI_LOG_ERROR("Error in server accept: %s\n", strerror(-cqe->res));
+                }
+                if(!(cqe->flags & IORING_CQE_F_MORE))
+                    tbi_uring_arm_accept(tbi->channel);
+                break;
+            case TBI_URING_TAG_WATCH:
+                if(!(cqe->flags & IORING_CQE_F_MORE))
+                    tbi_uring_arm_watch(ur);
+                break;
+            case TBI_URING_TAG_CANCEL:
+                break;
+            default:
+                if(cqe->user_data & TBI_URING_TAG_CONN_CANCEL) {
+                    conn = (tbi_conn_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)TBI_URING_TAG_CONN_CANCEL);
+                    conn->uring_reqs--;
+                    tbi_uring_conn_release(tbi, conn);
+                    break;
+                }
+                conn = (tbi_conn_t*)(uintptr_t)cqe->user_data;
+                tbi_uring_conn_complete(tbi, conn, cqe, handler, &recvd, &returned);
+                break;
+        }
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+    if(returned > 0)
+        tbi_uring_buf_publish(ur, returned);
+
+    return recvd;
+}
+
+/** @brief Tear down the io_uring backend. Client connections are left for the channel to close */
+void tbi_uring_close(tbi_ctx_t* tbi)
+{
+    struct tbi_uring *ur = tbi->channel->uring;
+    struct io_uring_buf_reg reg;
+    struct io_uring_sqe *sqe;
+
+    if(!ur) return;
+
+    /* Cancel all outstanding requests synchronously, so that they release their sockets
+     * before the ring is closed */
+    sqe = tbi_uring_get_sqe(ur);
+    if(sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = TBI_URING_TAG_CANCEL;
+        tbi_uring_enter(ur->fd, ur->sq_pending, 1, IORING_ENTER_GETEVENTS, NULL, _NSIG / 8);
+    }
+
+    /* Stop the kernel from picking buffers before releasing them */
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = TBI_URING_BGID;
+    tbi_uring_register(ur->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+    munmap(ur->sqes, ur->sqes_size);
+    munmap(ur->ring_ptr, ur->ring_size);
+    close(ur->fd);
+    munmap(ur->br, ur->br_size);
+    free(ur->bufs);
+    free(ur);
+    tbi->channel->uring = NULL;
+}
+
+#endif /* TBI_WITH_IO_URING */
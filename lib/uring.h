@@ -0,0 +1,19 @@
+/**
+* @file     uring.h
+* @brief    Header file for the io_uring server channel backend
+*/
+
+#ifndef __TBI_URING_H
+#define __TBI_URING_H
+
+#include <stdbool.h>
+#include "tbi_types.h"
+#include "channel.h"
+
+bool tbi_uring_supported(void);
+int tbi_uring_open(tbi_ctx_t* tbi);
+int tbi_uring_watch(tbi_ctx_t* tbi, int fd);
+int tbi_uring_recv(tbi_ctx_t* tbi, int timeout_ms, tbi_frame_handler handler);
+void tbi_uring_close(tbi_ctx_t* tbi);
+
+#endif /* __TBI_URING_H */
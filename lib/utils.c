@@ -3,10 +3,14 @@
 * @brief    Commonly used utility functions implementation
 */
 
+#define _GNU_SOURCE
+
 #include <sys/time.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "utils.h"
+#include "schema.h"
 #include "crc16.h"
 
 /** @brief Get message field type length in bytes
@@ -35,6 +39,72 @@ int msg_field_type_len(tbi_msg_field_types_t field_type)
     }
 }
 
+/** @brief Get the size of a value in a column of decoded messages, see @ref tbi_columns_t
+ * 
+ * @param[in] field_type    Field type
+ * 
+ * @return length in bytes, timestamps take 8 bytes as milliseconds since the epoch
+ */
+int msg_field_column_len(tbi_msg_field_types_t field_type)
+{
+    if(field_type == TBI_TIMEDIFF_S || field_type == TBI_TIMEDIFF_MS)
+        return sizeof(uint64_t);
+    return msg_field_type_len(field_type);
+}
+
+/** @brief Get length of an RTM frame in bytes, including flags and message type
+ * 
+ * @param[in] format        Binary message format
+ * @param[in] format_len    Binary message format length
+ * 
+ * @return length in bytes
+ */
+int msg_wire_len(const uint8_t *format, int format_len)
+{
+    int len = 1;
+    int i;
+
+    for(i = 0; i < format_len; i++) {
+        len += msg_field_type_len(format[i]);
+    }
+    return len;
+}
+
+/** @brief Get the offset of a struct member in a native message, aligned naturally
+ * like the compiler lays out the generated message structs
+ * 
+ * @param[in] field_type    Field type of the member
+ * @param[in] offset        Offset right after the previous member
+ * 
+ * @return offset of the member in bytes
+ */
+int msg_field_native_offset(tbi_msg_field_types_t field_type, int offset)
+{
+    int size = msg_field_type_len(field_type);
+
+    if(size == 0)
+        return offset;
+    return (offset + size - 1) & ~(size - 1);
+}
+
+/** @brief Get the length of a native message up to the end of its last member
+ * 
+ * @param[in] format        Binary message format
+ * @param[in] format_len    Binary message format length
+ * 
+ * @return length in bytes, excluding any padding after the last member
+ */
+int msg_native_len(const uint8_t *format, int format_len)
+{
+    int len = 0;
+    int i;
+
+    for(i = 0; i < format_len; i++) {
+        len = msg_field_native_offset(format[i], len) + msg_field_type_len(format[i]);
+    }
+    return len;
+}
+
 /** @brief Compute a checksum for the message spec
  * 
  * @param[in] tbi    tbi context
@@ -49,10 +119,11 @@ uint16_t msgspec_checksum(tbi_ctx_t* tbi)
 
     crc = crc16_begin();
 
-    /* Compute checksum of message type IDs, and the format arrays */
+    /* Compute checksum of message type IDs, their flags and the format arrays */
     for(i = 0; i < tbi->msg_ctxs_len; i++) {
         msg_ctx = &(tbi->msg_ctxs[i]);
         crc = crc16(crc, msg_ctx->msgtype);
+        crc = crc16(crc, msg_ctx->dcb ? TBI_SCHEMA_FLAG_DCB : 0);
         for(j = 0; j < msg_ctx->format_len; j++) {
             crc = crc16(crc, msg_ctx->format[j]);
         }
@@ -74,4 +145,21 @@ uint64_t get_current_time_ms(void)
 
     return ms;
 
-}
\ No newline at end of file
+}
+
+/** @brief Get monotonic time in nanoseconds, for measuring durations */
+uint64_t get_monotonic_time_ns(void)
+{
+    struct timespec now;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+        return 0U;
+
+    return (uint64_t)now.tv_sec * 1000000000U + (uint64_t)now.tv_nsec;
+}
+
+/** @brief Get monotonic time in milliseconds, for deadlines */
+uint64_t get_monotonic_time_ms(void)
+{
+    return get_monotonic_time_ns() / 1000000U;
+}
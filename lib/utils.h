@@ -10,7 +10,38 @@
 #include "tbi_types.h"
 
 int msg_field_type_len(tbi_msg_field_types_t field_type);
+int msg_wire_len(const uint8_t *format, int format_len);
+int msg_field_native_offset(tbi_msg_field_types_t field_type, int offset);
+int msg_native_len(const uint8_t *format, int format_len);
+int msg_field_column_len(tbi_msg_field_types_t field_type);
 uint16_t msgspec_checksum(tbi_ctx_t* tbi);
 uint64_t get_current_time_ms(void);
+uint64_t get_monotonic_time_ns(void);
+uint64_t get_monotonic_time_ms(void);
+
+/**
+ * @brief Find the context of a message type, with a single table lookup if the
+ * message spec has an index, else by searching the contexts
+ * 
+ * @param[in] tbi       TBI context
+ * @param[in] msgtype   Message type
+ * 
+ * @return context of the message type, or NULL if not in the message spec
+*/
+static inline tbi_msg_ctx_t* tbi_msg_ctx(tbi_ctx_t* tbi, uint8_t msgtype)
+{
+    int i;
+
+    if(tbi->msg_index) {
+        if(msgtype >= TBI_MAX_MSG_TYPES || (i = tbi->msg_index[msgtype]) < 0 || i >= tbi->msg_ctxs_len)
+            return NULL;
+        return &tbi->msg_ctxs[i];
+    }
+    for(i = 0; i < tbi->msg_ctxs_len; i++) {
+        if(tbi->msg_ctxs[i].msgtype == msgtype)
+            return &tbi->msg_ctxs[i];
+    }
+    return NULL;
+}
 
 #endif /* __TBI_UTILS_H */
\ No newline at end of file
@@ -0,0 +1,218 @@
+/**
+* @file     worker.c
+* @brief    Multi-threaded server workers. Each worker owns a private copy of the
+*           TBI context, with its own SO_REUSEPORT listening socket, connections and
+*           message buffers, so that workers share no state and take no locks
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "tbi_types.h"
+#include "tbi.h"
+#include "buf.h"
+#include "dcb.h"
+#include "batch.h"
+#include "schema.h"
+#include "channel.h"
+#include "worker.h"
+#include "log.h"
+
+/** @brief Create a worker-private copy of the TBI context. Callbacks are copied
+ * as is, message buffers start out empty
+ * 
+ * @param[in] parent    Context to copy
+ * 
+ * @return new context, or NULL on failure
+ */
+static tbi_ctx_t *tbi_worker_ctx_create(tbi_ctx_t* parent)
+{
+    tbi_ctx_t *tbi;
+    int i;
+
+    tbi = (tbi_ctx_t*)malloc(sizeof(tbi_ctx_t));
+    if(!tbi)
+        return NULL;
+
+    memcpy(tbi, parent, sizeof(tbi_ctx_t));
+    tbi->channel = NULL;
+    tbi->workers = NULL;
+    tbi->workers_len = 0;
+    tbi->workers_stop_fd = -1;
+    tbi->dcb_enc = NULL;
+    tbi->dcb_dec = NULL;
+    tbi->batch = NULL;
+    tbi->binds = NULL;
+
+    tbi->msg_ctxs = (tbi_msg_ctx_t*)malloc(parent->msg_ctxs_len * sizeof(tbi_msg_ctx_t));
+    if(!tbi->msg_ctxs) {
+        free(tbi);
+        return NULL;
+    }
+
+    memcpy(tbi->msg_ctxs, parent->msg_ctxs, parent->msg_ctxs_len * sizeof(tbi_msg_ctx_t));
+    for(i = 0; i < tbi->msg_ctxs_len; i++) {
+        tbi->msg_ctxs[i].ring = NULL;
+        tbi->msg_ctxs[i].ring_owned = false;
+        memset(&tbi->msg_ctxs[i].stats, 0, sizeof(tbi_msg_stats_t));
+    }
+
+    return tbi;
+}
+
+/** @brief Free a worker-private context */
+static void tbi_worker_ctx_free(tbi_ctx_t* tbi)
+{
+    int i;
+
+    if(!tbi) return;
+
+    if(tbi->channel)
+        tbi_server_channel_close(tbi);
+
+    for(i = 0; i < tbi->msg_ctxs_len; i++) {
+        tbi_buf_free(&(tbi->msg_ctxs[i]));
+    }
+    tbi_dcb_dec_free(tbi->dcb_dec);
+    tbi_batch_free(tbi->batch);
+
+    /* Registry is shared, the parent frees it */
+    tbi_schema_binds_free(tbi);
+
+    free(tbi->msg_ctxs);
+    free(tbi);
+}
+
+/** @brief Worker thread main loop, receives and processes until stopped */
+static void *tbi_worker_main(void *arg)
+{
+    tbi_worker_t *worker = (tbi_worker_t*)arg;
+    int ret;
+
+    while(!__atomic_load_n(&worker->parent->workers_stopping, __ATOMIC_ACQUIRE)) {
+        ret = tbi_server_dispatch(worker->tbi, -1);
+        if(ret < 0) {
+            TBI_LOG_ERROR("Worker %d: error in recv: %d\n", worker->id, ret);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start server worker threads. Every worker listens on the same port
+ * (SO_REUSEPORT) and the kernel spreads the clients between them
+ * 
+ * @param[in] tbi           TBI context, with message spec and callbacks registered
+ * @param[in] workers_len   Number of worker threads
+ * 
+ * @return 0 on success, negative error code on failure
+*/
+int tbi_workers_start(tbi_ctx_t* tbi, int workers_len)
+{
+    tbi_worker_t *worker;
+    sigset_t all, old;
+    int i;
+
+    /* Workers share the registry of message specs, and bind specs on their own */
+    if(tbi_schemas_init(tbi) != 0)
+        return -1;
+
+    tbi->workers = (tbi_worker_t*)malloc(workers_len * sizeof(tbi_worker_t));
+    if(!tbi->workers)
+        return -1;
+    memset(tbi->workers, 0, workers_len * sizeof(tbi_worker_t));
+
+    tbi->workers_stopping = false;
+    tbi->workers_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(tbi->workers_stop_fd < 0)
+        goto exit_workers_allocated;
+
+    /* Set up every worker before starting any, so that a failure leaves no threads behind */
+    for(i = 0; i < workers_len; i++) {
+        worker = &tbi->workers[i];
+        worker->id = i;
+        worker->parent = tbi;
+        worker->tbi = tbi_worker_ctx_create(tbi);
+        if(!worker->tbi)
+            goto exit_workers_created;
+
+        if(tbi_server_channel_open(worker->tbi, true) != 0)
+            goto exit_workers_created;
+
+        if(tbi_server_channel_watch(worker->tbi, tbi->workers_stop_fd) != 0)
+            goto exit_workers_created;
+    }
+
+    /* Signals are left for the application threads to handle */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for(i = 0; i < workers_len; i++) {
+        worker = &tbi->workers[i];
+        if(pthread_create(&worker->thread, NULL, &tbi_worker_main, worker) != 0) {
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            while(--workers_len >= i) {
+                tbi_worker_ctx_free(tbi->workers[workers_len].tbi);
+            }
+            tbi->workers_len = i;
+            tbi_workers_stop(tbi);
+            return -1;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    tbi->workers_len = workers_len;
+    return 0;
+
+exit_workers_created:
+    for(i = 0; i < workers_len; i++) {
+        tbi_worker_ctx_free(tbi->workers[i].tbi);
+    }
+    close(tbi->workers_stop_fd);
+exit_workers_allocated:
+    free(tbi->workers);
+    tbi->workers = NULL;
+    tbi->workers_stop_fd = -1;
+    return -1;
+}
+
+/**
+ * @brief Stop and join server worker threads, and free their resources
+ * 
+ * @param[in] tbi   TBI context the workers were started from
+*/
+void tbi_workers_stop(tbi_ctx_t* tbi)
+{
+    uint64_t one = 1;
+    int i;
+
+    if(!tbi->workers)
+        return;
+
+    /* Wake up every worker, the eventfd stays readable until closed */
+    __atomic_store_n(&tbi->workers_stopping, true, __ATOMIC_RELEASE);
+    if(write(tbi->workers_stop_fd, &one, sizeof(one)) != sizeof(one))
+        perror("Error waking up workers");
+
+    for(i = 0; i < tbi->workers_len; i++) {
+        pthread_join(tbi->workers[i].thread, NULL);
+    }
+
+    for(i = 0; i < tbi->workers_len; i++) {
+        tbi_worker_ctx_free(tbi->workers[i].tbi);
+    }
+
+    close(tbi->workers_stop_fd);
+    free(tbi->workers);
+    tbi->workers = NULL;
+    tbi->workers_len = 0;
+    tbi->workers_stop_fd = -1;
+}
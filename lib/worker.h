@@ -0,0 +1,14 @@
+/**
+* @file     worker.h
+* @brief    Header file for multi-threaded server workers
+*/
+
+#ifndef __TBI_WORKER_H
+#define __TBI_WORKER_H
+
+#include "tbi_types.h"
+
+int tbi_workers_start(tbi_ctx_t* tbi, int workers_len);
+void tbi_workers_stop(tbi_ctx_t* tbi);
+
+#endif /* __TBI_WORKER_H */
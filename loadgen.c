@@ -0,0 +1,867 @@
+/**
+* @file     loadgen.c
+* @brief    TBI load generator. Simulates a fleet of devices, each with its own client
+*           connection and handshake, streaming RTM and DCB telemetry to a local server
+*           at configurable rates, and reports the achieved throughput, server-side lag
+*           and errors. Run utils/compose.py on utils/example.json before compiling
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "tbi.h"
+#include "messagespec.h"
+#include "channel.h"
+#include "store.h"
+#include "utils.h"
+
+/** @brief Devices are serviced once per tick */
+#define LOADGEN_TICK_US 1000
+
+/** @brief Lag histogram resolution: every power of two is split into 2^bits buckets */
+#define LOADGEN_LAG_SUB_BITS 4
+#define LOADGEN_LAG_BUCKETS ((64 - LOADGEN_LAG_SUB_BITS + 1) << LOADGEN_LAG_SUB_BITS)
+
+/** @brief Max time to send the remaining telemetry after the run, and for the server to receive it */
+#define LOADGEN_DRAIN_MS 10000
+
+/** @brief The server has received everything once nothing arrives for this long */
+#define LOADGEN_SETTLE_MS 500
+
+/** @brief Default message buffer capacity of the simulated devices */
+#define LOADGEN_CAPACITY 256
+
+/** @brief Traffic classes, one message type each */
+typedef enum {
+    LOADGEN_RTM = 0,    /** @brief temp_and_hum, sent as soon as scheduled */
+    LOADGEN_DCB = 1,    /** @brief acceleration, bundled for its send interval */
+    LOADGEN_CLASSES,
+} loadgen_class_t;
+
+static const char *loadgen_class_names[LOADGEN_CLASSES] = { "rtm", "dcb" };
+
+/** @brief Load settings, from the command line */
+typedef struct {
+    int devices;
+    int threads;
+    int workers;                /** @brief In-process server workers, 0 for an external server */
+    int duration_s;
+    double rate[LOADGEN_CLASSES]; /** @brief Messages per second per device */
+    int burst;                  /** @brief Messages scheduled at once */
+    bool aligned;               /** @brief All devices burst at the same moment */
+    int send_interval;          /** @brief DCB send interval in ms, -1 for the message spec */
+    int capacity;               /** @brief Message buffer capacity per type, 0 to fit the rate */
+    int storm_period_s;         /** @brief Time between reconnect storms, 0 for none */
+    int storm_pct;              /** @brief Percentage of devices disconnected in a storm */
+    bool storm_backoff;         /** @brief Reconnect after the library backoff, instead of at once */
+    bool batch;                 /** @brief The in-process server receives with batch callbacks */
+    const char *store_dir;      /** @brief The in-process server stores telemetry in this directory, NULL for none */
+    bool verbose;
+} loadgen_opts_t;
+
+/** @brief Log-linear histogram of lag in microseconds */
+typedef struct {
+    uint64_t buckets[LOADGEN_LAG_BUCKETS];
+} loadgen_hist_t;
+
+/** @brief A simulated device */
+typedef struct {
+    int id;
+    tbi_ctx_t *tbi;
+    uint64_t phase_us;          /** @brief Time of the first burst */
+    uint64_t scheduled[LOADGEN_CLASSES];
+    int32_t acc[3];             /** @brief Random walk of the acceleration signal */
+    uint32_t rand_state;
+} loadgen_device_t;
+
+/** @brief Device thread, servicing a slice of the devices */
+typedef struct {
+    int id;
+    pthread_t thread;
+    loadgen_device_t *devices;
+    int devices_len;
+    uint32_t rand_state;
+    uint64_t storms;            /** @brief Storms started by this thread */
+    /* Read by the main thread while running */
+    int connected;
+    uint64_t scheduled[LOADGEN_CLASSES];
+    uint64_t sent;
+    uint64_t storm_disconnects;
+    uint64_t errors;            /** @brief Failed schedules and flushes */
+    uint64_t late_ticks;        /** @brief Ticks that could not service all devices in time */
+} loadgen_thread_t;
+
+/** @brief Telemetry received by the in-process server, updated from its workers */
+typedef struct {
+    uint64_t received[LOADGEN_CLASSES];
+    uint64_t last_rx_us;
+    loadgen_hist_t lag[LOADGEN_CLASSES];
+    tbi_store_t *store;         /** @brief Store of the received telemetry, NULL for none */
+} loadgen_server_t;
+
+static loadgen_opts_t opts = {
+    .devices = 1000,
+    .threads = 2,
+    .workers = 2,
+    .duration_s = 10,
+    .rate = { 10, 100 },
+    .burst = 1,
+    .send_interval = 1000,
+    .storm_pct = 100,
+};
+
+static uint64_t loadgen_start_ns;
+static bool loadgen_stopping;
+static FILE *report;
+static int report_results;
+
+/** @brief Time since the load generator started, shared with the in-process server */
+static inline uint64_t loadgen_now_us(void)
+{
+    return (get_monotonic_time_ns() - loadgen_start_ns) / 1000;
+}
+
+static inline uint32_t loadgen_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    /* xorshift32 */
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* ---------------------------------------------------------------------------
+ * Lag histogram
+ * ------------------------------------------------------------------------- */
+
+static int loadgen_hist_bucket(uint64_t us)
+{
+    int exp;
+
+    if(us < (1U << LOADGEN_LAG_SUB_BITS))
+        return (int)us;
+    exp = 63 - __builtin_clzll(us);
+    return ((exp - LOADGEN_LAG_SUB_BITS + 1) << LOADGEN_LAG_SUB_BITS) +
+        (int)((us >> (exp - LOADGEN_LAG_SUB_BITS)) & ((1U << LOADGEN_LAG_SUB_BITS) - 1));
+}
+
+/** @brief Smallest value that falls into a bucket */
+static uint64_t loadgen_hist_value(int bucket)
+{
+    int exp, sub = (1 << LOADGEN_LAG_SUB_BITS);
+
+    if(bucket < sub)
+        return bucket;
+    exp = (bucket >> LOADGEN_LAG_SUB_BITS) + LOADGEN_LAG_SUB_BITS - 1;
+    return (uint64_t)(sub + (bucket & (sub - 1))) << (exp - LOADGEN_LAG_SUB_BITS);
+}
+
+static void loadgen_hist_add(loadgen_hist_t *hist, uint64_t us)
+{
+    __atomic_add_fetch(&hist->buckets[loadgen_hist_bucket(us)], 1, __ATOMIC_RELAXED);
+}
+
+/** @brief Copy a histogram, optionally subtracting an earlier copy of it */
+static uint64_t loadgen_hist_snapshot(const loadgen_hist_t *hist, const loadgen_hist_t *since, loadgen_hist_t *out)
+{
+    uint64_t count = 0;
+    int i;
+
+    for(i = 0; i < LOADGEN_LAG_BUCKETS; i++) {
+        out->buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        if(since)
+            out->buckets[i] -= since->buckets[i];
+        count += out->buckets[i];
+    }
+    return count;
+}
+
+/**
+ * @brief Get a percentile of a histogram, rounded up to the end of its bucket
+ *
+ * @param[in] hist      Histogram
+ * @param[in] count     Number of values in the histogram
+ * @param[in] q         Percentile in [0, 1]
+ *
+ * @return lag in microseconds, 0 if the histogram is empty
+*/
+static uint64_t loadgen_hist_percentile(const loadgen_hist_t *hist, uint64_t count, double q)
+{
+    uint64_t seen = 0, rank;
+    int i;
+
+    if(count == 0)
+        return 0;
+    rank = (uint64_t)(q * count);
+    if(rank >= count)
+        rank = count - 1;
+
+    for(i = 0; i < LOADGEN_LAG_BUCKETS - 1; i++) {
+        seen += hist->buckets[i];
+        if(seen > rank)
+            break;
+    }
+    return loadgen_hist_value(i + 1) - 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * In-process server
+ * ------------------------------------------------------------------------- */
+
+/** @brief Count a received message, and the time since its device scheduled it */
+static void loadgen_receive(const int msgtype, const void *msg, void *userdata)
+{
+    const msgspec_temp_and_hum_t *th;
+    const msgspec_acceleration_t *acc;
+    loadgen_server_t *server = (loadgen_server_t*)userdata;
+    uint64_t now_us = loadgen_now_us(), sent_ms;
+    loadgen_class_t cls;
+    uint64_t lag_us = 0;
+
+    if(msgtype == TEMP_AND_HUM) {
+        /* Scheduling time is carried in temp, wrapping after 71 minutes */
+        th = (const msgspec_temp_and_hum_t*)msg;
+        cls = LOADGEN_RTM;
+        lag_us = (uint32_t)now_us - (uint32_t)th->temp;
+    } else if(msgtype == ACCELERATION) {
+        /* Samples are timestamped in ms, the lag includes the send interval */
+        acc = (const msgspec_acceleration_t*)msg;
+        cls = LOADGEN_DCB;
+        sent_ms = (uint64_t)acc->time.seconds * 1000 + acc->time.ms;
+        if(now_us / 1000 > sent_ms)
+            lag_us = (now_us / 1000 - sent_ms) * 1000;
+    } else {
+        return;
+    }
+
+    loadgen_hist_add(&server->lag[cls], lag_us);
+    __atomic_add_fetch(&server->received[cls], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&server->last_rx_us, now_us, __ATOMIC_RELAXED);
+}
+
+/** @brief Count a batch of received messages, see @ref loadgen_receive() */
+static void loadgen_receive_batch(const int msgtype, const void *msgs, int count, const tbi_batch_info_t *info,
+    void *userdata)
+{
+    size_t size = (msgtype == TEMP_AND_HUM) ? sizeof(msgspec_temp_and_hum_t) : sizeof(msgspec_acceleration_t);
+    int i;
+
+    for(i = 0; i < count; i++)
+        loadgen_receive(msgtype, (const uint8_t*)msgs + i * size, userdata);
+}
+
+/** @brief Store a batch of received messages, and count them, see @ref loadgen_receive() */
+static void loadgen_receive_columns(const int msgtype, const tbi_columns_t *cols, const tbi_batch_info_t *info,
+    void *userdata)
+{
+    loadgen_server_t *server = (loadgen_server_t*)userdata;
+    uint64_t now_us, sent_us, lag_us;
+    loadgen_class_t cls;
+    int i;
+
+    tbi_store_append(server->store, msgtype, cols, info);
+
+    /* Timestamps are back to ms since the start of the run relative to the client start */
+    now_us = loadgen_now_us();
+    cls = (msgtype == TEMP_AND_HUM) ? LOADGEN_RTM : LOADGEN_DCB;
+    for(i = 0; i < cols->count; i++) {
+        if(cls == LOADGEN_RTM) {
+            lag_us = (uint32_t)now_us - ((const uint32_t*)cols->cols[1])[i];
+        } else {
+            sent_us = (((const uint64_t*)cols->cols[0])[i] - info->start_ts) * 1000;
+            lag_us = now_us > sent_us ? now_us - sent_us : 0;
+        }
+        loadgen_hist_add(&server->lag[cls], lag_us);
+    }
+    __atomic_add_fetch(&server->received[cls], cols->count, __ATOMIC_RELAXED);
+    __atomic_store_n(&server->last_rx_us, now_us, __ATOMIC_RELAXED);
+}
+
+/* ---------------------------------------------------------------------------
+ * Devices
+ * ------------------------------------------------------------------------- */
+
+/**
+ * @brief Register the message spec into a context with a private copy of the
+ * message type contexts, so that every device has its own message buffers
+ *
+ * @return TBI context, or NULL on failure
+*/
+static tbi_ctx_t *loadgen_tbi_init(void)
+{
+    tbi_msg_ctx_t *ctxs;
+    tbi_ctx_t *tbi;
+
+    if(!(tbi = tbi_init()))
+        return NULL;
+    if(tbi_register_msgspec(tbi) != 0 || !(ctxs = malloc(tbi->msg_ctxs_len * sizeof(tbi_msg_ctx_t)))) {
+        tbi_close(tbi);
+        return NULL;
+    }
+    memcpy(ctxs, tbi->msg_ctxs, tbi->msg_ctxs_len * sizeof(tbi_msg_ctx_t));
+    tbi->msg_ctxs = ctxs;
+    return tbi;
+}
+
+/** @brief Close a context from @ref loadgen_tbi_init() */
+static void loadgen_tbi_close(tbi_ctx_t *tbi)
+{
+    tbi_msg_ctx_t *ctxs = tbi->msg_ctxs;
+
+    tbi_close(tbi);
+    free(ctxs);
+}
+
+/**
+ * @brief Get the message buffer capacity of a traffic class. Bundled messages 
+ * are buffered for their send interval, twice that fits without dropping any
+ *
+ * @param[in] ctx       Message type context
+ * @param[in] cls       Traffic class of the message type
+ *
+ * @return capacity in messages
+*/
+static int loadgen_capacity(const tbi_msg_ctx_t *ctx, loadgen_class_t cls)
+{
+    double bundle;
+
+    if(opts.capacity > 0)
+        return opts.capacity;
+    if(!ctx->dcb || ctx->send_interval <= 0)
+        return LOADGEN_CAPACITY + opts.burst;
+
+    bundle = opts.rate[cls] * ctx->send_interval / 1000.0;
+    if(ctx->max_bundle > 0 && bundle > ctx->max_bundle)
+        bundle = ctx->max_bundle;
+    return (int)(2 * bundle) + LOADGEN_CAPACITY + opts.burst;
+}
+
+/**
+ * @brief Set up a device, and start connecting it to the server
+ *
+ * @param[out] dev      Device
+ * @param[in]  id       Device number
+ *
+ * @return 0 on success, -1 on failure
+*/
+static int loadgen_device_init(loadgen_device_t *dev, int id)
+{
+    tbi_msg_ctx_t *rtm, *dcb;
+    double period_us;
+
+    memset(dev, 0, sizeof(*dev));
+    dev->id = id;
+    dev->rand_state = 0x9e3779b9U * (uint32_t)(id + 1);
+    dev->acc[2] = 9810;
+
+    /* Devices burst at the same moment, or spread evenly over the burst period */
+    period_us = 1e6 * opts.burst / (opts.rate[LOADGEN_RTM] > 0 ? opts.rate[LOADGEN_RTM] : opts.rate[LOADGEN_DCB]);
+    if(!opts.aligned && period_us >= 1)
+        dev->phase_us = loadgen_rand(&dev->rand_state) % (uint64_t)period_us;
+
+    if(!(dev->tbi = loadgen_tbi_init()))
+        return -1;
+
+    rtm = tbi_msg_ctx(dev->tbi, TEMP_AND_HUM);
+    dcb = tbi_msg_ctx(dev->tbi, ACCELERATION);
+    if(opts.send_interval >= 0)
+        dcb->send_interval = opts.send_interval;
+
+    if(tbi_set_buffer(dev->tbi, TEMP_AND_HUM, loadgen_capacity(rtm, LOADGEN_RTM), NULL, 0) != 0 ||
+        tbi_set_buffer(dev->tbi, ACCELERATION, loadgen_capacity(dcb, LOADGEN_DCB), NULL, 0) != 0 ||
+        tbi_set_features(dev->tbi, TBI_FEATURE_CRC32C) != 0 ||
+        tbi_set_device_id(dev->tbi, (uint64_t)id + 1) != 0 ||
+        tbi_client_init(dev->tbi) != 0) {
+        loadgen_tbi_close(dev->tbi);
+        dev->tbi = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/** @brief Number of messages a device has due by now, in whole bursts */
+static uint64_t loadgen_due(uint64_t now_us, uint64_t phase_us, double rate)
+{
+    if(rate <= 0 || now_us < phase_us)
+        return 0;
+    return ((uint64_t)((now_us - phase_us) * rate / (1e6 * opts.burst)) + 1) * opts.burst;
+}
+
+/**
+ * @brief Schedule the messages of a device that are due by now
+ *
+ * @param[in] dev       Device
+ * @param[in] now_us    Current time
+ * @param[in] scheduled Incremented by the number of messages scheduled, per class
+ *
+ * @return number of messages that could not be scheduled
+*/
+static int loadgen_device_schedule(loadgen_device_t *dev, uint64_t now_us, uint64_t *scheduled)
+{
+    msgspec_temp_and_hum_t th;
+    msgspec_acceleration_t acc;
+    uint64_t due, now_ms = now_us / 1000;
+    int i, errors = 0;
+
+    due = loadgen_due(now_us, dev->phase_us, opts.rate[LOADGEN_RTM]);
+    for(; dev->scheduled[LOADGEN_RTM] < due; dev->scheduled[LOADGEN_RTM]++) {
+        th.time = (timediff_s)dev->id;
+        th.temp = (int32_t)(uint32_t)now_us;
+        th.hum = (uint8_t)dev->scheduled[LOADGEN_RTM];
+        if(tbi_send_temp_and_hum(dev->tbi, &th) < 0)
+            errors++;
+        scheduled[LOADGEN_RTM]++;
+    }
+
+    due = loadgen_due(now_us, dev->phase_us, opts.rate[LOADGEN_DCB]);
+    for(; dev->scheduled[LOADGEN_DCB] < due; dev->scheduled[LOADGEN_DCB]++) {
+        /* Slowly wandering signal, compressing like real sensor data */
+        for(i = 0; i < 3; i++)
+            dev->acc[i] += (int32_t)(loadgen_rand(&dev->rand_state) % 9) - 4;
+        acc.time.seconds = (uint32_t)(now_ms / 1000);
+        acc.time.ms = (uint32_t)(now_ms % 1000);
+        acc.acc_x = dev->acc[0];
+        acc.acc_y = dev->acc[1];
+        acc.acc_z = dev->acc[2];
+        if(tbi_send_acceleration(dev->tbi, &acc) < 0)
+            errors++;
+        scheduled[LOADGEN_DCB]++;
+    }
+    return errors;
+}
+
+/** @brief Drop the connections of a share of the devices at once */
+static void loadgen_storm(loadgen_thread_t *t)
+{
+    tbi_channel_t *channel;
+    uint64_t disconnects = 0;
+    int i;
+
+    for(i = 0; i < t->devices_len; i++) {
+        channel = t->devices[i].tbi->channel;
+        if(channel->state == TBI_CLIENT_DISCONNECTED || (int)(loadgen_rand(&t->rand_state) % 100) >= opts.storm_pct)
+            continue;
+
+        tbi_client_channel_disconnect(t->devices[i].tbi);
+        if(!opts.storm_backoff)
+            channel->retry_ts = 0;
+        disconnects++;
+    }
+    __atomic_add_fetch(&t->storm_disconnects, disconnects, __ATOMIC_RELAXED);
+}
+
+/** @brief Send everything the devices still have buffered, until sent or timed out */
+static void loadgen_drain(loadgen_thread_t *t)
+{
+    tbi_flush_result_t res;
+    uint64_t deadline_ms = get_monotonic_time_ms() + LOADGEN_DRAIN_MS;
+    int i, pending, bytes;
+
+    do {
+        pending = 0;
+        for(i = 0; i < t->devices_len; i++) {
+            if(tbi_client_flush(t->devices[i].tbi, TBI_FLUSH_ALL, &res) >= 0)
+                __atomic_add_fetch(&t->sent, res.msgs, __ATOMIC_RELAXED);
+            if(tbi_client_pending(t->devices[i].tbi, &bytes) > 0 || bytes > 0)
+                pending++;
+        }
+        if(pending)
+            usleep(LOADGEN_TICK_US);
+    } while(pending && get_monotonic_time_ms() < deadline_ms);
+}
+
+/** @brief Device thread: schedule due messages and flush every device once per tick */
+static void *loadgen_thread_main(void *arg)
+{
+    loadgen_thread_t *t = (loadgen_thread_t*)arg;
+    tbi_flush_result_t res;
+    uint64_t now_us, next_us, storm, scheduled[LOADGEN_CLASSES];
+    int i, c, connected, errors;
+
+    next_us = loadgen_now_us();
+    while(!__atomic_load_n(&loadgen_stopping, __ATOMIC_ACQUIRE)) {
+        now_us = loadgen_now_us();
+
+        if(opts.storm_period_s > 0) {
+            storm = now_us / (opts.storm_period_s * 1000000ULL);
+            if(storm > t->storms) {
+                t->storms = storm;
+                loadgen_storm(t);
+            }
+        }
+
+        memset(scheduled, 0, sizeof(scheduled));
+        connected = errors = 0;
+        for(i = 0; i < t->devices_len; i++) {
+            errors += loadgen_device_schedule(&t->devices[i], now_us, scheduled);
+
+            /* Sends, and completes connecting and reconnecting */
+            if(tbi_client_flush(t->devices[i].tbi, TBI_FLUSH_NONE, &res) < 0)
+                errors++;
+            else if(res.msgs > 0)
+                __atomic_add_fetch(&t->sent, res.msgs, __ATOMIC_RELAXED);
+            connected += t->devices[i].tbi->channel->connected;
+        }
+
+        for(c = 0; c < LOADGEN_CLASSES; c++)
+            __atomic_add_fetch(&t->scheduled[c], scheduled[c], __ATOMIC_RELAXED);
+        __atomic_add_fetch(&t->errors, errors, __ATOMIC_RELAXED);
+        __atomic_store_n(&t->connected, connected, __ATOMIC_RELAXED);
+
+        /* Catch up without sleeping if servicing the devices took longer than a tick */
+        next_us += LOADGEN_TICK_US;
+        now_us = loadgen_now_us();
+        if(now_us < next_us) {
+            usleep(next_us - now_us);
+        } else {
+            __atomic_add_fetch(&t->late_ticks, 1, __ATOMIC_RELAXED);
+            next_us = now_us;
+        }
+    }
+
+    loadgen_drain(t);
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Reporting
+ * ------------------------------------------------------------------------- */
+
+/**
+ * @brief Write a single result as a JSON object, in the format of tbi_bench so
+ * that runs can be compared with utils/bench_compare.py. Metrics ending with
+ * "_per_s" are better when higher, all others when lower
+*/
+static void loadgen_report(const char *group, const char *name, const char *metric, double value)
+{
+    fprintf(report, "%s\n    {\"group\": \"%s\", \"name\": \"%s\", \"metric\": \"%s\", \"value\": %.6g}",
+        report_results++ ? "," : "", group, name, metric, value);
+    fprintf(stderr, "%-8s %-6s %-20s %14.1f\n", group, name, metric, value);
+}
+
+/** @brief Sum a counter of the device threads */
+#define LOADGEN_THREADS_SUM(threads, field, out) do { \
+        int _i; \
+        (out) = 0; \
+        for(_i = 0; _i < opts.threads; _i++) \
+            (out) += __atomic_load_n(&(threads)[_i].field, __ATOMIC_RELAXED); \
+    } while(0)
+
+/** @brief Print throughput and lag of the last second */
+static void loadgen_progress(loadgen_thread_t *threads, loadgen_server_t *server, uint64_t elapsed_s,
+    uint64_t *last_sent, uint64_t *last_received, loadgen_hist_t *last_lag)
+{
+    loadgen_hist_t interval;
+    uint64_t sent, received = 0, count;
+    int c, connected;
+    char rx[32] = "-", lag[LOADGEN_CLASSES][32];
+
+    LOADGEN_THREADS_SUM(threads, connected, connected);
+    LOADGEN_THREADS_SUM(threads, sent, sent);
+
+    for(c = 0; c < LOADGEN_CLASSES; c++) {
+        strcpy(lag[c], "-");
+        if(!server)
+            continue;
+        received += __atomic_load_n(&server->received[c], __ATOMIC_RELAXED);
+        count = loadgen_hist_snapshot(&server->lag[c], &last_lag[c], &interval);
+        loadgen_hist_snapshot(&server->lag[c], NULL, &last_lag[c]);
+        if(count > 0)
+            snprintf(lag[c], sizeof(lag[c]), "%llu us",
+                (unsigned long long)loadgen_hist_percentile(&interval, count, 0.99));
+    }
+    if(server)
+        snprintf(rx, sizeof(rx), "%llu", (unsigned long long)(received - *last_received));
+
+    fprintf(stderr, "%4llus  connected %6d/%d  sent %9llu/s  received %9s/s  lag p99 rtm %12s  dcb %12s\n",
+        (unsigned long long)elapsed_s, connected, opts.devices, (unsigned long long)(sent - *last_sent),
+        rx, lag[LOADGEN_RTM], lag[LOADGEN_DCB]);
+
+    *last_sent = sent;
+    *last_received = received;
+}
+
+/** @brief Report the totals of the run */
+static void loadgen_summary(loadgen_thread_t *threads, loadgen_device_t *devices, tbi_ctx_t *server_tbi,
+    loadgen_server_t *server, double elapsed_s)
+{
+    tbi_stats_t stats, dev_stats;
+    tbi_store_stats_t store_stats;
+    loadgen_hist_t lag;
+    uint64_t scheduled[LOADGEN_CLASSES] = {0}, dropped[LOADGEN_CLASSES] = {0};
+    uint64_t connects = 0, connect_failures = 0, count, received, errors, late_ticks, storm_disconnects;
+    const char *name;
+    int i, c;
+
+    for(i = 0; i < opts.threads; i++) {
+        for(c = 0; c < LOADGEN_CLASSES; c++)
+            scheduled[c] += threads[i].scheduled[c];
+    }
+    LOADGEN_THREADS_SUM(threads, errors, errors);
+    LOADGEN_THREADS_SUM(threads, late_ticks, late_ticks);
+    LOADGEN_THREADS_SUM(threads, storm_disconnects, storm_disconnects);
+
+    /* Messages the overflow policies dropped never left the devices */
+    for(i = 0; i < opts.devices; i++) {
+        if(tbi_get_stats(devices[i].tbi, &dev_stats) != 0)
+            continue;
+        connects += dev_stats.channel.connects;
+        connect_failures += dev_stats.channel.connect_failures;
+        for(c = 0; c < dev_stats.msgs_len; c++) {
+            if(dev_stats.msgs[c].msgtype == TEMP_AND_HUM)
+                dropped[LOADGEN_RTM] += dev_stats.msgs[c].dropped;
+            else if(dev_stats.msgs[c].msgtype == ACCELERATION)
+                dropped[LOADGEN_DCB] += dev_stats.msgs[c].dropped;
+        }
+    }
+
+    for(c = 0; c < LOADGEN_CLASSES; c++) {
+        if(opts.rate[c] <= 0)
+            continue;
+        name = loadgen_class_names[c];
+        loadgen_report("client", name, "msgs_per_s", (scheduled[c] - dropped[c]) / elapsed_s);
+        loadgen_report("client", name, "dropped", dropped[c]);
+        if(!server)
+            continue;
+
+        received = __atomic_load_n(&server->received[c], __ATOMIC_RELAXED);
+        count = loadgen_hist_snapshot(&server->lag[c], NULL, &lag);
+        loadgen_report("server", name, "msgs_per_s", received / elapsed_s);
+        loadgen_report("server", name, "lag_p50_us", loadgen_hist_percentile(&lag, count, 0.5));
+        loadgen_report("server", name, "lag_p99_us", loadgen_hist_percentile(&lag, count, 0.99));
+        loadgen_report("server", name, "lag_max_us", loadgen_hist_percentile(&lag, count, 1.0));
+        loadgen_report("server", name, "lost",
+            (scheduled[c] - dropped[c] > received) ? scheduled[c] - dropped[c] - received : 0);
+    }
+
+    loadgen_report("client", "conns", "reconnects", connects > (uint64_t)opts.devices ? connects - opts.devices : 0);
+    loadgen_report("client", "conns", "connect_failures", connect_failures - storm_disconnects);
+    loadgen_report("client", "conns", "storm_disconnects", storm_disconnects);
+    loadgen_report("client", "all", "errors", errors);
+    loadgen_report("client", "all", "late_ticks", late_ticks);
+
+    if(server_tbi && tbi_get_stats(server_tbi, &stats) == 0) {
+        errors = 0;
+        for(c = 0; c < stats.msgs_len; c++)
+            errors += stats.msgs[c].decode_errors;
+        loadgen_report("server", "all", "bytes_per_s", stats.channel.bytes_recvd / elapsed_s);
+        loadgen_report("server", "all", "handshake_rejects", stats.channel.handshake_rejects);
+        loadgen_report("server", "all", "frame_errors", stats.channel.frame_errors);
+        loadgen_report("server", "all", "checksum_errors", stats.channel.checksum_errors);
+        loadgen_report("server", "all", "decode_errors", errors);
+    }
+
+    if(server && server->store && tbi_store_get_stats(server->store, &store_stats) == 0) {
+        loadgen_report("store", "all", "rows_per_s", store_stats.rows / elapsed_s);
+        loadgen_report("store", "all", "bytes_per_row", store_stats.rows ? (double)store_stats.bytes / store_stats.rows : 0);
+        loadgen_report("store", "all", "streams", store_stats.streams);
+        loadgen_report("store", "all", "segments", store_stats.segments);
+        loadgen_report("store", "all", "errors", store_stats.rejected + store_stats.errors);
+    }
+}
+
+/** @brief Allow a file descriptor for every device, and every server connection */
+static void loadgen_raise_fd_limit(void)
+{
+    struct rlimit rl;
+    rlim_t needed = (rlim_t)opts.devices * (opts.workers > 0 ? 2 : 1) + 64;
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= needed)
+        return;
+    rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > needed) ? needed : rl.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur < needed)
+        fprintf(stderr, "Open file limit is too low for %d devices, raise it with ulimit -n\n", opts.devices);
+}
+
+static void loadgen_usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Simulates a fleet of devices streaming telemetry to a server on port 8000. Results\n"
+        "are written to stdout as JSON, see utils/bench_compare.py, and progress to stderr\n"
+        "  -n devices     Number of simulated devices (default %d)\n"
+        "  -t threads     Threads servicing the devices (default %d)\n"
+        "  -w workers     In-process server worker threads, 0 to load an external server (default %d)\n"
+        "  -d seconds     Duration of the run (default %d)\n"
+        "  -r rate        RTM (temp_and_hum) messages per second per device (default %g)\n"
+        "  -b rate        DCB (acceleration) samples per second per device (default %g)\n"
+        "  -i ms          DCB send interval, -1 for the message spec (default %d)\n"
+        "  -B messages    Schedule messages in bursts of this many, at the same average rate (default %d)\n"
+        "  -a             Align the bursts of all devices, instead of spreading them\n"
+        "  -s seconds     Disconnect devices at once at this period, a reconnect storm (default off)\n"
+        "  -p percent     Percentage of devices disconnected in a storm (default %d)\n"
+        "  -j             Reconnect after the jittered library backoff, instead of at once\n"
+        "  -c messages    Message buffer capacity per type (default fits the rate)\n"
+        "  -k             Receive with batch callbacks on the in-process server\n"
+        "  -S dir         Store the telemetry the in-process server receives in this directory\n"
+        "  -v             Print library logs to stderr\n",
+        prog, opts.devices, opts.threads, opts.workers, opts.duration_s, opts.rate[LOADGEN_RTM],
+        opts.rate[LOADGEN_DCB], opts.send_interval, opts.burst, opts.storm_pct);
+}
+
+int main(int argc, char* argv[])
+{
+    loadgen_server_t *server = NULL;
+    loadgen_device_t *devices = NULL;
+    loadgen_thread_t *threads = NULL;
+    loadgen_hist_t *last_lag = NULL;
+    tbi_ctx_t *server_tbi = NULL;
+    uint64_t last_sent = 0, last_received = 0, rx_us, settle_ms, end_ms;
+    double elapsed_s = 0;
+    int i, opt, started = 0, per_thread, ret = 1;
+
+    while((opt = getopt(argc, argv, "n:t:w:d:r:b:i:B:as:p:jc:kS:vh")) != -1) {
+        switch(opt) {
+            case 'n': opts.devices = atoi(optarg); break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 'w': opts.workers = atoi(optarg); break;
+            case 'd': opts.duration_s = atoi(optarg); break;
+            case 'r': opts.rate[LOADGEN_RTM] = atof(optarg); break;
+            case 'b': opts.rate[LOADGEN_DCB] = atof(optarg); break;
+            case 'i': opts.send_interval = atoi(optarg); break;
+            case 'B': opts.burst = atoi(optarg); break;
+            case 'a': opts.aligned = true; break;
+            case 's': opts.storm_period_s = atoi(optarg); break;
+            case 'p': opts.storm_pct = atoi(optarg); break;
+            case 'j': opts.storm_backoff = true; break;
+            case 'c': opts.capacity = atoi(optarg); break;
+            case 'k': opts.batch = true; break;
+            case 'S': opts.store_dir = optarg; break;
+            case 'v': opts.verbose = true; break;
+            default:
+                loadgen_usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if(opts.devices <= 0 || opts.threads <= 0 || opts.workers < 0 || opts.duration_s <= 0 || opts.burst <= 0 ||
+        opts.rate[LOADGEN_RTM] < 0 || opts.rate[LOADGEN_DCB] < 0 ||
+        opts.rate[LOADGEN_RTM] + opts.rate[LOADGEN_DCB] <= 0 || opts.storm_pct < 0 || opts.storm_pct > 100) {
+        loadgen_usage(argv[0]);
+        return 2;
+    }
+    if(opts.threads > opts.devices)
+        opts.threads = opts.devices;
+
+    /* The library logs to stdout, which is reserved for the results */
+    if(!(report = fdopen(dup(STDOUT_FILENO), "w")))
+        return 1;
+    if(opts.verbose)
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    else if((i = open("/dev/null", O_WRONLY)) >= 0)
+        dup2(i, STDOUT_FILENO);
+
+    loadgen_raise_fd_limit();
+    loadgen_start_ns = get_monotonic_time_ns();
+
+    if(opts.workers > 0) {
+        if(!(server = calloc(1, sizeof(loadgen_server_t))) || !(last_lag = calloc(LOADGEN_CLASSES, sizeof(loadgen_hist_t))))
+            goto exit;
+        if(!(server_tbi = loadgen_tbi_init()) || tbi_set_features(server_tbi, TBI_FEATURE_CRC32C | TBI_FEATURE_ACK) != 0)
+            goto exit;
+        if(opts.store_dir) {
+            if(!(server->store = tbi_store_open(opts.store_dir, NULL))) {
+                fprintf(stderr, "Unable to open store %s\n", opts.store_dir);
+                goto exit;
+            }
+            tbi_server_register_column_callback(server_tbi, TEMP_AND_HUM, loadgen_receive_columns, server);
+            tbi_server_register_column_callback(server_tbi, ACCELERATION, loadgen_receive_columns, server);
+        } else if(opts.batch) {
+            tbi_server_register_batch_callback(server_tbi, TEMP_AND_HUM, loadgen_receive_batch, server);
+            tbi_server_register_batch_callback(server_tbi, ACCELERATION, loadgen_receive_batch, server);
+        } else {
+            tbi_server_register_msg_callback(server_tbi, TEMP_AND_HUM, loadgen_receive, server);
+            tbi_server_register_msg_callback(server_tbi, ACCELERATION, loadgen_receive, server);
+        }
+        if(tbi_server_start_workers(server_tbi, opts.workers) != 0) {
+            fprintf(stderr, "Unable to start the server, is the port in use?\n");
+            goto exit;
+        }
+    }
+
+    /* Every device connects and handshakes on its own */
+    fprintf(stderr, "Connecting %d devices...\n", opts.devices);
+    if(!(devices = calloc(opts.devices, sizeof(loadgen_device_t))) ||
+        !(threads = calloc(opts.threads, sizeof(loadgen_thread_t))))
+        goto exit;
+    for(i = 0; i < opts.devices; i++) {
+        if(loadgen_device_init(&devices[i], i) != 0) {
+            fprintf(stderr, "Unable to set up device %d\n", i);
+            goto exit;
+        }
+    }
+
+    per_thread = (opts.devices + opts.threads - 1) / opts.threads;
+    for(i = 0; i < opts.threads; i++) {
+        threads[i].id = i;
+        threads[i].devices = &devices[i * per_thread];
+        threads[i].devices_len = (opts.devices - i * per_thread < per_thread) ? opts.devices - i * per_thread : per_thread;
+        threads[i].rand_state = 0x2545f491U * (uint32_t)(i + 1);
+    }
+    for(started = 0; started < opts.threads; started++) {
+        if(pthread_create(&threads[started].thread, NULL, loadgen_thread_main, &threads[started]) != 0)
+            goto exit;
+    }
+
+    for(i = 1; i <= opts.duration_s; i++) {
+        sleep(1);
+        if(server)
+            tbi_store_flush(server->store, 1000);
+        loadgen_progress(threads, server, i, &last_sent, &last_received, last_lag);
+    }
+    elapsed_s = loadgen_now_us() / 1e6;
+    ret = 0;
+
+exit:
+    /* Device threads send what is still buffered before exiting */
+    __atomic_store_n(&loadgen_stopping, true, __ATOMIC_RELEASE);
+    for(i = 0; i < started; i++)
+        pthread_join(threads[i].thread, NULL);
+
+    /* Wait for the server to receive the rest */
+    if(ret == 0 && server) {
+        end_ms = get_monotonic_time_ms() + LOADGEN_DRAIN_MS;
+        do {
+            rx_us = __atomic_load_n(&server->last_rx_us, __ATOMIC_RELAXED);
+            settle_ms = get_monotonic_time_ms() + LOADGEN_SETTLE_MS;
+            while(get_monotonic_time_ms() < settle_ms)
+                usleep(10000);
+            tbi_store_flush(server->store, 0);
+        } while(rx_us != __atomic_load_n(&server->last_rx_us, __ATOMIC_RELAXED) && get_monotonic_time_ms() < end_ms);
+    }
+
+    if(ret == 0) {
+        fprintf(report, "{\n  \"msgspec_version\": %d,\n  \"devices\": %d,\n  \"threads\": %d,\n  \"workers\": %d,\n"
+            "  \"duration_s\": %.3f,\n  \"rtm_rate\": %g,\n  \"dcb_rate\": %g,\n  \"send_interval\": %d,\n"
+            "  \"burst\": %d,\n  \"aligned\": %s,\n  \"batch\": %s,\n  \"storm_period_s\": %d,\n  \"storm_pct\": %d,\n  \"results\": [",
+            MSGSPEC_VERSION, opts.devices, opts.threads, opts.workers, elapsed_s, opts.rate[LOADGEN_RTM],
+            opts.rate[LOADGEN_DCB], opts.send_interval, opts.burst, opts.aligned ? "true" : "false", opts.batch ? "true" : "false",
+            opts.storm_period_s, opts.storm_pct);
+        loadgen_summary(threads, devices, server_tbi, server, elapsed_s);
+        fprintf(report, "\n  ]\n}\n");
+    }
+
+    for(i = 0; devices && i < opts.devices; i++) {
+        if(devices[i].tbi)
+            loadgen_tbi_close(devices[i].tbi);
+    }
+    if(server_tbi)
+        loadgen_tbi_close(server_tbi);
+    if(server)
+        tbi_store_close(server->store);
+    free(threads);
+    free(devices);
+    free(last_lag);
+    free(server);
+    fclose(report);
+    return ret;
+}
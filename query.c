@@ -0,0 +1,256 @@
+/**
+* @file     query.c
+* @brief    TBI store query tool. Lists the devices and message types in a store
+*           directory written by the server, prints the rows of a device and message
+*           type within a time range and matching field predicates as CSV, or
+*           downsamples a column into min, max, average and count per time bucket
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "query.h"
+
+/** @brief Default number of buckets the time range is split into when aggregating */
+#define QUERY_BUCKETS 100
+
+/** @brief Max number of buckets */
+#define QUERY_MAX_BUCKETS 1000000
+
+/** @brief Results are written here, library logs go to stderr */
+static FILE *out;
+
+/** @brief Print rows as CSV, or only count them */
+static void query_print_columns(const int msgtype, const tbi_columns_t *cols, const tbi_batch_info_t *info, void *userdata)
+{
+    bool count_only = *(bool*)userdata;
+    int i, f;
+
+    if(count_only)
+        return;
+    for(i = 0; i < cols->count; i++) {
+        for(f = 0; f < cols->fields; f++) {
+            fputs(f ? "," : "", out);
+            switch(cols->format[f]) {
+                case TBI_TIMEDIFF_S:
+                case TBI_TIMEDIFF_MS: fprintf(out, "%" PRIu64, ((const uint64_t*)cols->cols[f])[i]); break;
+                case TBI_UINT8: fprintf(out, "%u", ((const uint8_t*)cols->cols[f])[i]); break;
+                case TBI_INT8: fprintf(out, "%d", ((const int8_t*)cols->cols[f])[i]); break;
+                case TBI_UINT16: fprintf(out, "%u", ((const uint16_t*)cols->cols[f])[i]); break;
+                case TBI_INT16: fprintf(out, "%d", ((const int16_t*)cols->cols[f])[i]); break;
+                case TBI_UINT32: fprintf(out, "%" PRIu32, ((const uint32_t*)cols->cols[f])[i]); break;
+                default: fprintf(out, "%" PRId32, ((const int32_t*)cols->cols[f])[i]); break;
+            }
+        }
+        fputc('\n', out);
+    }
+}
+
+/** @brief List the devices and message types in a store, with their time ranges */
+static int query_list(const char *dir)
+{
+    char path[4096];
+    struct dirent *dev, *seg;
+    unsigned long long device_id;
+    unsigned int type, seq;
+    uint64_t min_ts, max_ts, rows;
+    uint8_t seen[256];
+    DIR *d, *s;
+    char end;
+
+    if(!(d = opendir(dir))) {
+        fprintf(stderr, "Unable to open %s\n", dir);
+        return 1;
+    }
+    fprintf(out, "device,msgtype,from_ms,to_ms,rows\n");
+    while((dev = readdir(d))) {
+        if(strlen(dev->d_name) != 16 || sscanf(dev->d_name, "%16llx%c", &device_id, &end) != 1)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, dev->d_name);
+        if(!(s = opendir(path)))
+            continue;
+        memset(seen, 0, sizeof(seen));
+        while((seg = readdir(s))) {
+            if(sscanf(seg->d_name, "%2u-%8u.seg", &type, &seq) == 2 && type < sizeof(seen))
+                seen[type] = 1;
+        }
+        closedir(s);
+        for(type = 0; type < sizeof(seen); type++) {
+            if(seen[type] && tbi_query_range(dir, device_id, type, &min_ts, &max_ts, &rows) == 0)
+                fprintf(out, "%llu,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", device_id, type, min_ts, max_ts + 1, rows);
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+/** @brief Parse a predicate such as 1>=100: column, comparison and value */
+static int query_parse_pred(const char *arg, tbi_query_pred_t *pred)
+{
+    /* Two-character comparisons first, < is a prefix of <= */
+    static const struct { const char *str; tbi_query_op_t op; } ops[] = {
+        { "==", TBI_QUERY_EQ }, { "!=", TBI_QUERY_NE }, { "<=", TBI_QUERY_LE }, { ">=", TBI_QUERY_GE },
+        { "<", TBI_QUERY_LT }, { ">", TBI_QUERY_GT },
+    };
+    char *p, *end;
+    size_t i;
+
+    pred->field = (int)strtol(arg, &p, 10);
+    if(p == arg)
+        return -1;
+    for(i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if(strncmp(p, ops[i].str, strlen(ops[i].str)) == 0)
+            break;
+    }
+    if(i == sizeof(ops) / sizeof(ops[0]))
+        return -1;
+    pred->op = ops[i].op;
+    p += strlen(ops[i].str);
+    pred->value = strtoll(p, &end, 0);
+    return (end == p || *end) ? -1 : 0;
+}
+
+static double query_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void query_usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options] <store dir> [<device ID> <message type>]\n"
+        "Prints the rows of a device and message type stored by the server as CSV, with\n"
+        "timestamps in ms since the epoch. Lists the devices and message types without them\n"
+        "  -f ms          Start of the time range (default the earliest row)\n"
+        "  -t ms          End of the time range, exclusive (default past the latest row)\n"
+        "  -w predicate   Only rows where a column compares to a value, such as 1>100.\n"
+        "                 Comparisons are == != < <= > >=, repeat for up to %d\n"
+        "  -a column      Print min, max, average and count of a column per time bucket instead\n"
+        "  -b ms          Length of the time buckets (default the time range in %d buckets)\n"
+        "  -c             Only count the matching rows\n"
+        "  -s             Print query statistics to stderr\n",
+        prog, TBI_QUERY_MAX_PREDS, QUERY_BUCKETS);
+}
+
+int main(int argc, char* argv[])
+{
+    tbi_query_t query = {0};
+    tbi_query_stats_t stats;
+    tbi_query_bucket_t *buckets = NULL;
+    uint64_t min_ts, max_ts, rows, matched;
+    uint64_t bucket_ms = 0;
+    bool count_only = false, print_stats = false, has_from = false, has_to = false;
+    int opt, field = -1, i, n, ret = 1;
+    const char *dir;
+    double start_ms;
+
+    while((opt = getopt(argc, argv, "f:t:w:a:b:csh")) != -1) {
+        switch(opt) {
+            case 'f': query.from_ts = strtoull(optarg, NULL, 0); has_from = true; break;
+            case 't': query.to_ts = strtoull(optarg, NULL, 0); has_to = true; break;
+            case 'w':
+                if(query.preds_len == TBI_QUERY_MAX_PREDS || query_parse_pred(optarg, &query.preds[query.preds_len]) != 0) {
+                    fprintf(stderr, "Invalid predicate %s\n", optarg);
+                    return 2;
+                }
+                query.preds_len++;
+                break;
+            case 'a': field = atoi(optarg); break;
+            case 'b': bucket_ms = strtoull(optarg, NULL, 0); break;
+            case 'c': count_only = true; break;
+            case 's': print_stats = true; break;
+            default:
+                query_usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if(argc - optind != 1 && argc - optind != 3) {
+        query_usage(argv[0]);
+        return 2;
+    }
+    dir = argv[optind];
+
+    /* The library logs to stdout, which is reserved for the results */
+    if(!(out = fdopen(dup(STDOUT_FILENO), "w")))
+        return 1;
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    if(argc - optind == 1) {
+        ret = query_list(dir);
+        fclose(out);
+        return ret;
+    }
+    query.device_id = strtoull(argv[optind + 1], NULL, 0);
+    query.msgtype = atoi(argv[optind + 2]);
+
+    /* Default time range is everything stored */
+    if(tbi_query_range(dir, query.device_id, query.msgtype, &min_ts, &max_ts, &rows) != 0) {
+        fprintf(stderr, "Nothing stored for device %llu, message type %d\n", (unsigned long long)query.device_id,
+            query.msgtype);
+        goto cleanup;
+    }
+    if(!has_from)
+        query.from_ts = min_ts;
+    if(!has_to)
+        query.to_ts = max_ts + 1;
+    if(query.to_ts <= query.from_ts) {
+        fprintf(stderr, "Empty time range\n");
+        goto cleanup;
+    }
+
+    start_ms = query_now_ms();
+    if(field >= 0) {
+        if(bucket_ms == 0)
+            bucket_ms = (query.to_ts - query.from_ts + QUERY_BUCKETS - 1) / QUERY_BUCKETS;
+        if(bucket_ms > UINT32_MAX || (query.to_ts - query.from_ts + bucket_ms - 1) / bucket_ms > QUERY_MAX_BUCKETS) {
+            fprintf(stderr, "Invalid bucket length %llu ms\n", (unsigned long long)bucket_ms);
+            goto cleanup;
+        }
+        n = (int)((query.to_ts - query.from_ts + bucket_ms - 1) / bucket_ms);
+        if(!(buckets = malloc(n * sizeof(tbi_query_bucket_t))))
+            goto cleanup;
+        if((n = tbi_query_aggregate(dir, &query, field, (uint32_t)bucket_ms, buckets, n, &stats)) < 0) {
+            fprintf(stderr, "Query failed\n");
+            goto cleanup;
+        }
+        fprintf(out, "from_ms,min,max,avg,count\n");
+        for(i = 0; i < n; i++) {
+            if(buckets[i].count == 0)
+                continue;
+            fprintf(out, "%" PRIu64 ",%" PRId64 ",%" PRId64 ",%.3f,%" PRIu64 "\n", buckets[i].start_ts, buckets[i].min,
+                buckets[i].max, (double)buckets[i].sum / buckets[i].count, buckets[i].count);
+        }
+        matched = stats.rows_matched;
+    } else {
+        if(tbi_query_scan(dir, &query, query_print_columns, &count_only, &stats) != 0) {
+            fprintf(stderr, "Query failed\n");
+            goto cleanup;
+        }
+        matched = stats.rows_matched;
+        if(count_only)
+            fprintf(out, "%" PRIu64 "\n", matched);
+    }
+
+    if(print_stats) {
+        fprintf(stderr, "%" PRIu64 " of %" PRIu64 " rows matched in %.3f ms, scanned %" PRIu64 " rows, "
+            "skipped %" PRIu64 "/%" PRIu64 " segments and %" PRIu64 "/%" PRIu64 " blocks\n",
+            matched, rows, query_now_ms() - start_ms, stats.rows_scanned, stats.segments_skipped, stats.segments,
+            stats.blocks_skipped, stats.blocks);
+    }
+    ret = 0;
+
+cleanup:
+    free(buckets);
+    fclose(out);
+    return ret;
+}
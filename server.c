@@ -7,8 +7,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h> 
+#include <unistd.h>
 
 #include "tbi.h"
+#include "store.h"
 #include "messagespec.h"
 
 /** @brief Flag to stop looping and its sig handler */
@@ -17,6 +19,28 @@ void sig_handler(int signum) {
     stopping = 1;
 }
 
+/** @brief Flag to reload message specs and its sig handler */
+static sig_atomic_t reloading = 0;
+void sighup_handler(int signum) {
+    reloading = 1;
+    /* Handler is reset on delivery with -std=c99 */
+    signal(SIGHUP, sighup_handler);
+}
+
+/** @brief Accept clients of the message specs in a directory, e.g. older firmware. Picks up new ones on SIGHUP */
+void reload_schemas(tbi_ctx_t* tbi, const char* dir)
+{
+    int ret;
+
+    reloading = 0;
+    if(!dir)
+        return;
+    if((ret = tbi_server_load_schemas(tbi, dir)) < 0)
+        printf("Unable to load message specs from %s!\n", dir);
+    else
+        printf("Loaded %d new message spec(s) from %s\n", ret, dir);
+}
+
 /** @brief Example context to be passed back to us in callbacks */
 typedef struct {
     uint32_t magic;
@@ -39,14 +63,81 @@ void receive_temp_and_hum(const int msgtype, const void* buf, void* userdata)
     printf("            Server magic: 0x%X\n\n", ctx->magic);
 }
 
+/** @brief Example batch callback for ACCELERATION messagetype, all samples of a bundle at once */
+void receive_acceleration(const int msgtype, const void* msgs, int count, const tbi_batch_info_t* info, void* userdata)
+{
+    const msgspec_acceleration_t* acc = (const msgspec_acceleration_t*)msgs;
+
+    if(msgtype != ACCELERATION || count <= 0)
+        return;
+
+    printf("Received %d acceleration samples from client %llu!:\n", count, (unsigned long long)info->conn_id);
+    printf("    time: %u.%03u - %u.%03u s\n", acc[0].time.seconds, acc[0].time.ms,
+        acc[count - 1].time.seconds, acc[count - 1].time.ms);
+    printf("    last: x %d, y %d, z %d\n\n", acc[count - 1].acc_x, acc[count - 1].acc_y, acc[count - 1].acc_z);
+}
+
+/** @brief Example column callback, storing all received telemetry and printing a summary */
+void store_columns(const int msgtype, const tbi_columns_t* cols, const tbi_batch_info_t* info, void* userdata)
+{
+    tbi_store_t* store = (tbi_store_t*)userdata;
+
+    if(tbi_store_append(store, msgtype, cols, info) < 0)
+        printf("Unable to store %d messages of type %d from device %llu!\n", cols->count, msgtype,
+            (unsigned long long)info->device_id);
+    else
+        printf("Stored %d messages of type %d from device %llu\n", cols->count, msgtype,
+            (unsigned long long)info->device_id);
+}
+
+/** @brief Print a summary of library statistics */
+void print_stats(tbi_ctx_t* tbi)
+{
+    tbi_stats_t stats;
+    tbi_msg_stats_t *msg;
+    int i;
+
+    if(tbi_get_stats(tbi, &stats) != 0)
+        return;
+
+    printf("Clients accepted: %llu, handshakes rejected: %llu, bytes received: %llu\n",
+        (unsigned long long)stats.channel.conns_accepted, 
+        (unsigned long long)stats.channel.handshake_rejects,
+        (unsigned long long)stats.channel.bytes_recvd);
+
+    for(i = 0; i < stats.msgs_len; i++) {
+        msg = &stats.msgs[i];
+        printf("Message type %u: %llu frames, %llu messages, %llu decode errors, avg decode %llu ns, avg callback %llu ns\n",
+            msg->msgtype, (unsigned long long)msg->frames_recvd, (unsigned long long)msg->callback.count, 
+            (unsigned long long)msg->decode_errors,
+            (unsigned long long)(msg->deserialize.count ? msg->deserialize.sum_ns / msg->deserialize.count : 0),
+            (unsigned long long)(msg->callback.count ? msg->callback.sum_ns / msg->callback.count : 0));
+    }
+}
 
 int main(int argc, char* arv[])
 {
     example_server_ctx ctx = {.magic = 0xDEADBEEF};
+    tbi_store_t* store = NULL;
+    const char* schema_dir = NULL;
     tbi_ctx_t* tbi;
+    int workers = 0;
     int ret;
+
+    /* Optional number of worker threads, single-threaded by default */
+    if(argc > 1)
+        workers = atoi(arv[1]);
+
+    /* Optional directory to store all received telemetry in, none if empty */
+    if(argc > 2 && arv[2][0] && !(store = tbi_store_open(arv[2], NULL)))
+        return 1;
+
+    /* Optional directory of message spec descriptors (*.tbis) of other firmware versions */
+    if(argc > 3)
+        schema_dir = arv[3];
     
     signal(SIGINT, sig_handler); 
+    signal(SIGHUP, sighup_handler);
 
     tbi = tbi_init();
     if(!tbi)
@@ -56,31 +147,64 @@ int main(int argc, char* arv[])
     if((ret = tbi_register_msgspec(tbi)) != 0)
         return 1;
 
+    /* Accept clients asking for checksummed frames, and acknowledge frames to spooling clients */
+    if((ret = tbi_set_features(tbi, TBI_FEATURE_CRC32C | TBI_FEATURE_ACK)) != 0)
+        return 1;
+
+    printf("Registering callback(s)...\n");
+    if(store) {
+        tbi_server_register_column_callback(tbi, TEMP_AND_HUM, &store_columns, store);
+        tbi_server_register_column_callback(tbi, ACCELERATION, &store_columns, store);
+    } else {
+        tbi_server_register_msg_callback(tbi, TEMP_AND_HUM, &receive_temp_and_hum, &ctx);
+        tbi_server_register_batch_callback(tbi, ACCELERATION, &receive_acceleration, NULL);
+    }
+    reload_schemas(tbi, schema_dir);
+
+    if(workers > 0) {
+        printf("Starting %d server workers...\n", workers);
+        if((ret = tbi_server_start_workers(tbi, workers)) != 0) {
+            tbi_close(tbi);
+            return 1;
+        }
+
+        /* Workers receive and process on their own, wait for SIGINT */
+        while(!stopping) {
+            sleep(1);
+            tbi_store_flush(store, 1000);
+            if(reloading)
+                reload_schemas(tbi, schema_dir);
+        }
+
+        print_stats(tbi);
+        tbi_close(tbi);
+        tbi_store_close(store);
+        return 0;
+    }
+
     printf("Server init...\n");
     if((ret = tbi_server_init(tbi)) != 0) {
         tbi_close(tbi);
         return 1;
     }
 
-    printf("Registering callback(s)...\n");
-    tbi_server_register_msg_callback(tbi, TEMP_AND_HUM, &receive_temp_and_hum, &ctx);
-
     printf("Entering main loop...\n");
     while(!stopping) {
-        /* Blocking receive, returns when telemetry received */
-        ret = tbi_server_receive_blocking(tbi);
-        if(ret > 0) {
-            /* Process received messages (invokes callbacks) */
-            ret = tbi_server_process(tbi);
-            if(ret < 0) {
-                printf("Error in process: %d\n", ret);
-            }
-        } else if (ret < 0) {
+        /* Blocking receive, invokes callbacks as telemetry is received */
+        ret = tbi_server_dispatch(tbi, store ? 1000 : -1);
+        if (ret < 0) {
             printf("Error in recv: %d\n", ret);
             break;
         }
+
+        /* Rows of idle devices are written out too */
+        tbi_store_flush(store, 1000);
+        if(reloading)
+            reload_schemas(tbi, schema_dir);
     }
 
+    print_stats(tbi);
     tbi_close(tbi);
+    tbi_store_close(store);
     return 0;
 }
\ No newline at end of file
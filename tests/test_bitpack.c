@@ -0,0 +1,165 @@
+/**
+* @file     test_bitpack.c
+* @brief    Round-trip test of the bit packing kernels of every instruction set
+*           the CPU supports, against the scalar kernels and a bit-by-bit
+*           reference: every width 0-32, contiguous and random strides, random
+*           bit offsets, and values ending exactly at the end of the stream
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitpack.h"
+
+/** @brief Value counts, below and past the vector loop bounds */
+static const int test_counts[] = {0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 33, 100, 1000};
+
+#define TEST_MAX_COUNT 1000
+#define TEST_ROUNDS 8
+
+static uint64_t test_rng = 0x243F6A8885A308D3ull;
+
+static uint32_t test_rand(void)
+{
+    test_rng ^= test_rng << 13;
+    test_rng ^= test_rng >> 7;
+    test_rng ^= test_rng << 17;
+    return (uint32_t)(test_rng >> 16);
+}
+
+static uint32_t test_mask(int width)
+{
+    return width == 32 ? 0xFFFFFFFFu : (1u << width) - 1;
+}
+
+/** @brief Write a value MSB first, a bit at a time */
+static void test_put_bits(uint8_t *buf, uint32_t bit, int width, uint32_t value)
+{
+    int j;
+
+    for(j = 0; j < width; j++, bit++) {
+        if((value >> (width - 1 - j)) & 1)
+            buf[bit / 8] |= (uint8_t)(0x80 >> (bit % 8));
+    }
+}
+
+/**
+ * @brief Pack and unpack values with the selected kernels, and compare with the
+ * reference stream and the scalar unpacked values
+ *
+ * @return 0 if all match, -1 otherwise
+ */
+static int test_pack_unpack(tbi_bitpack_isa_t isa, int width, uint32_t bit, uint32_t stride, int count)
+{
+    uint32_t values[TEST_MAX_COUNT], out[TEST_MAX_COUNT], scalar[TEST_MAX_COUNT];
+    uint8_t *ref, *packed;
+    int i, len, ret = 0;
+
+    /* Stream ends with the last value */
+    len = count > 0 ? (int)((bit + (uint32_t)(count - 1) * stride + width + 7) / 8) : 0;
+    ref = calloc(len + 1, 1);
+    packed = calloc(len + 1, 1);
+    if(!ref || !packed) {
+        free(ref);
+        free(packed);
+        return -1;
+    }
+
+    for(i = 0; i < count; i++) {
+        values[i] = test_rand() & test_mask(width);
+        test_put_bits(ref, bit + i * stride, width, values[i]);
+    }
+
+    tbi_bitpack_set_isa(isa);
+    tbi_bitpack_pack(packed, len, bit, stride, width, count, values);
+    if(memcmp(packed, ref, len + 1) != 0)
+        ret = -1;
+
+    memset(out, 0xA5, sizeof(out));
+    tbi_bitpack_unpack(ref, len, bit, stride, width, count, out);
+    tbi_bitpack_set_isa(TBI_BITPACK_SCALAR);
+    memset(scalar, 0x5A, sizeof(scalar));
+    tbi_bitpack_unpack(ref, len, bit, stride, width, count, scalar);
+    for(i = 0; i < count; i++) {
+        if(out[i] != values[i] || scalar[i] != values[i])
+            ret = -1;
+    }
+
+    if(ret != 0)
+        printf("%s: width %d bit %u stride %u count %d failed\n", tbi_bitpack_isa_name(isa), width, bit, stride, count);
+    free(ref);
+    free(packed);
+    return ret;
+}
+
+/** @brief Encode and decode zigzag deltas with the selected kernels, against the scalar formula */
+static int test_zigzag(tbi_bitpack_isa_t isa, int count)
+{
+    uint32_t values[TEST_MAX_COUNT], deltas[TEST_MAX_COUNT];
+    uint32_t prev = test_rand(), p, last;
+    int i, ret = 0;
+
+    for(i = 0; i < count; i++) {
+        /* Small steps, and now and then a jump across the whole range */
+        values[i] = (i % 5 == 4) ? test_rand() * 2654435761u : (i ? values[i - 1] : prev) + (test_rand() % 64) - 32;
+    }
+
+    tbi_bitpack_set_isa(isa);
+    tbi_zigzag_delta_encode(values, count, prev, deltas);
+    for(i = 0, p = prev; i < count; i++) {
+        if(deltas[i] != tbi_zigzag32((int32_t)(values[i] - p)))
+            ret = -1;
+        p = values[i];
+    }
+
+    last = tbi_zigzag_delta_decode(deltas, count, prev);
+    for(i = 0; i < count; i++) {
+        if(deltas[i] != values[i])
+            ret = -1;
+    }
+    if(last != (count ? values[count - 1] : prev))
+        ret = -1;
+
+    if(ret != 0)
+        printf("%s: zigzag delta count %d failed\n", tbi_bitpack_isa_name(isa), count);
+    return ret;
+}
+
+int main(void)
+{
+    const tbi_bitpack_isa_t isas[] = {TBI_BITPACK_SCALAR, TBI_BITPACK_SSE41, TBI_BITPACK_AVX2};
+    int a, w, c, r, count, isa_failed, failed = 0;
+    uint32_t bit;
+
+    for(a = 0; a < (int)(sizeof(isas) / sizeof(isas[0])); a++) {
+        if(tbi_bitpack_set_isa(isas[a]) != 0) {
+            printf("%s: not supported, skipped\n", tbi_bitpack_isa_name(isas[a]));
+            continue;
+        }
+        isa_failed = 0;
+
+        /* Every width, including 25 and 26 where SSE4.1 falls back to scalar */
+        for(w = 0; w <= 32; w++) {
+            for(c = 0; c < (int)(sizeof(test_counts) / sizeof(test_counts[0])); c++) {
+                count = test_counts[c];
+                for(r = 0; r < TEST_ROUNDS; r++) {
+                    bit = r == 0 ? 0 : test_rand() % 64;
+                    isa_failed |= test_pack_unpack(isas[a], w, bit, w, count);
+                    isa_failed |= test_pack_unpack(isas[a], w, bit, w + test_rand() % 41, count);
+                }
+            }
+        }
+
+        /* Across the vector loop bound and the scalar tail */
+        for(count = 0; count <= 17; count++) {
+            for(r = 0; r < TEST_ROUNDS; r++)
+                isa_failed |= test_zigzag(isas[a], count);
+        }
+        isa_failed |= test_zigzag(isas[a], TEST_MAX_COUNT);
+
+        printf("%s: %s\n", tbi_bitpack_isa_name(isas[a]), isa_failed ? "FAIL" : "ok");
+        failed |= isa_failed;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,155 @@
+/**
+* @file     test_buf.c
+* @brief    Stress test of the message buffer ring: producer threads push
+*           concurrently with a consumer, under each overflow policy. Every
+*           producer's messages must be taken in the order it pushed them, and
+*           every message must be either taken or counted as dropped
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "tbi_types.h"
+#include "buf.h"
+
+#define TEST_PRODUCERS 8
+#define TEST_MSGS 100000
+#define TEST_CAPACITY 16
+#define TEST_YIELD_EVERY 32
+
+/** @brief Test message, the check word catches torn copies, and is stored as the start timestamp of the slot too */
+typedef struct {
+    uint32_t producer;
+    uint32_t seq;
+    uint64_t check;
+} test_msg_t;
+
+typedef struct {
+    tbi_msg_ctx_t *ctx;
+    int id;
+    bool retry;                 /** @brief Push again until stored, so that nothing is dropped */
+} test_producer_t;
+
+static volatile int producers_done;
+
+static uint64_t test_check(uint32_t producer, uint32_t seq)
+{
+    return ((uint64_t)producer << 32 | seq) * 0x9E3779B97F4A7C15ull;
+}
+
+static void *test_produce(void *arg)
+{
+    test_producer_t *p = (test_producer_t*)arg;
+    test_msg_t msg;
+    uint32_t i;
+    int ret;
+
+    for(i = 0; i < TEST_MSGS; i++) {
+        msg.producer = p->id;
+        msg.seq = i;
+        msg.check = test_check(p->id, i);
+        while((ret = tbi_buf_push_back_ts(p->ctx, &msg, sizeof(msg), msg.check + 1)) != 0 && p->retry) {
+            if(ret < 0)
+                return NULL;
+            sched_yield();
+        }
+
+        /* Interleave with the consumer and the other producers also on a single CPU */
+        if(i % TEST_YIELD_EVERY == 0)
+            sched_yield();
+    }
+    __atomic_add_fetch(&producers_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/** @brief Take a message, checking it follows the last one of its producer */
+static int test_take(tbi_msg_ctx_t *ctx, int64_t *last, bool gaps, uint64_t *taken)
+{
+    test_msg_t *msg;
+    uint64_t pos;
+
+    if(!(msg = tbi_buf_pop_front(ctx, &pos)))
+        return 0;
+
+    if(msg->producer >= TEST_PRODUCERS || msg->check != test_check(msg->producer, msg->seq) ||
+        tbi_buf_start_ts(msg) != msg->check + 1) {
+        printf("Corrupted message %u/%u\n", msg->producer, msg->seq);
+        return -1;
+    }
+    if(gaps ? (int64_t)msg->seq <= last[msg->producer] : (int64_t)msg->seq != last[msg->producer] + 1) {
+        printf("Producer %u out of order: %u after %lld\n", msg->producer, msg->seq, (long long)last[msg->producer]);
+        return -1;
+    }
+    last[msg->producer] = msg->seq;
+    tbi_buf_release(ctx, pos);
+    (*taken)++;
+    return 1;
+}
+
+static int test_policy(const char *name, tbi_overflow_policy_t policy, int decimate, bool retry)
+{
+    pthread_t threads[TEST_PRODUCERS];
+    test_producer_t producers[TEST_PRODUCERS];
+    tbi_msg_ctx_t ctx;
+    int64_t last[TEST_PRODUCERS];
+    uint64_t taken = 0, dropped, total = (uint64_t)TEST_PRODUCERS * TEST_MSGS;
+    int i, ret = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.raw_size = sizeof(test_msg_t);
+    ctx.capacity = TEST_CAPACITY;
+    ctx.overflow = policy;
+    ctx.decimate = decimate;
+    if(tbi_buf_init(&ctx, NULL, 0) != 0) {
+        printf("%s: init failed\n", name);
+        return -1;
+    }
+
+    for(i = 0; i < TEST_PRODUCERS; i++) {
+        last[i] = -1;
+        producers[i].ctx = &ctx;
+        producers[i].id = i;
+        producers[i].retry = retry;
+    }
+    producers_done = 0;
+    for(i = 0; i < TEST_PRODUCERS; i++)
+        pthread_create(&threads[i], NULL, test_produce, &producers[i]);
+
+    /* Consume while producing, then drain */
+    while(ret >= 0 && __atomic_load_n(&producers_done, __ATOMIC_ACQUIRE) < TEST_PRODUCERS) {
+        if((ret = test_take(&ctx, last, !retry, &taken)) == 0)
+            sched_yield();
+    }
+    for(i = 0; i < TEST_PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+    while(ret >= 0 && (ret = test_take(&ctx, last, !retry, &taken)) > 0);
+
+    /* Retried pushes count as dropped too, but every message must get through */
+    dropped = retry ? 0 : ctx.stats.dropped;
+    if(ret >= 0 && taken + dropped != total) {
+        printf("%s: %llu taken + %llu dropped of %llu\n", name, (unsigned long long)taken,
+            (unsigned long long)dropped, (unsigned long long)total);
+        ret = -1;
+    }
+    printf("%s: %s, %llu taken, %llu dropped\n", name, ret < 0 ? "FAIL" : "ok",
+        (unsigned long long)taken, (unsigned long long)dropped);
+
+    tbi_buf_free(&ctx);
+    return ret < 0 ? -1 : 0;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    failed |= test_policy("drop newest, retried", TBI_OVERFLOW_DROP_NEWEST, 0, true);
+    failed |= test_policy("drop newest", TBI_OVERFLOW_DROP_NEWEST, 0, false);
+    failed |= test_policy("drop oldest", TBI_OVERFLOW_DROP_OLDEST, 0, false);
+    failed |= test_policy("decimate", TBI_OVERFLOW_DECIMATE, 4, false);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,66 @@
+#!/usr/bin/python3
+"""
+    Compare two tbi_bench results, and report the metrics that regressed by more
+    than the threshold. Metrics ending with "_per_s" are better when higher, all
+    others when lower. Exits with 1 if anything regressed
+"""
+import argparse
+import json
+import sys
+
+def load(path: str) -> dict:
+    """
+        Load results of a benchmark run, keyed by group, name and metric
+    """
+    with open(path, "r") as f:
+        contents: dict = json.load(f)
+    results: dict = {}
+    for r in contents.get("results", []):
+        results[(r["group"], r["name"], r["metric"])] = float(r["value"])
+    return results
+
+def compare(baseline: dict, current: dict, threshold: float) -> int:
+    """
+        Print the change of every metric in both runs, and count regressions
+    """
+    regressions = 0
+    for key in sorted(baseline.keys() & current.keys()):
+        old, new = baseline[key], current[key]
+        if old == 0:
+            continue
+        change = (new - old) / old * 100.0
+        worse = -change if key[2].endswith("_per_s") else change
+        mark = ""
+        if worse > threshold:
+            mark = "  REGRESSION"
+            regressions += 1
+        print(f"{key[0]:<12} {key[1]:<28} {key[2]:<22} {old:>14.3f} {new:>14.3f} {change:>+8.1f}%{mark}")
+
+    for key in sorted(baseline.keys() - current.keys()):
+        print(f"{key[0]:<12} {key[1]:<28} {key[2]:<22} missing from current run")
+    return regressions
+
+if __name__ == "__main__":
+
+    p = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+
+    p.add_argument("baseline",
+                   help="Results of the earlier release")
+    p.add_argument("current",
+                   help="Results to compare against the baseline")
+    p.add_argument("-t", "--threshold", type=float, default=10.0,
+                   help="Allowed regression in percent (default 10)")
+
+    cmdline_args = p.parse_args()
+
+    try:
+        regressions = compare(load(cmdline_args.baseline), load(cmdline_args.current), cmdline_args.threshold)
+    except Exception as e:
+        print(f"Error comparing results: {repr(e)}")
+        sys.exit(2)
+
+    if regressions:
+        print(f"{regressions} metric(s) regressed by more than {cmdline_args.threshold}%")
+        sys.exit(1)
+    print("No regressions")
@@ -5,8 +5,18 @@ import os
 
 VERBOSE = False
 OUT_PATH = "./generated/messagespec.h"
+DESC_PATH = "./generated/messagespec.tbis"
+# Binary descriptor of the spec, loaded by servers that accept clients of several specs (lib/schema.h)
+DESC_MAGIC = b"TBIS"
+DESC_VERSION = 1
+DESC_FLAG_DCB = 1
 VERSION = None
 MAX_ID_NUM = 15
+OVERFLOW_POLICIES = {
+    "drop_newest": "TBI_OVERFLOW_DROP_NEWEST",
+    "drop_oldest": "TBI_OVERFLOW_DROP_OLDEST",
+    "decimate": "TBI_OVERFLOW_DECIMATE",
+}
 TYPES = {
     0: "timediff_s  ",
     1: "timediff_ms ",
@@ -17,6 +27,17 @@ TYPES = {
     6: "uint32_t    ",
     7: "int32_t     ",
 }
+# Wire size, and C type of struct members with an integer wire representation
+WIRE_TYPES = {
+    0: (4, None),
+    1: (4, None),
+    2: (1, "uint8_t"),
+    3: (1, "int8_t"),
+    4: (2, "uint16_t"),
+    5: (2, "int16_t"),
+    6: (4, "uint32_t"),
+    7: (4, "int32_t"),
+}
 
 def debug(line: str):
     if VERBOSE:
@@ -30,6 +51,7 @@ def generate_begin(path: str = OUT_PATH) -> bool:
         debug("Removing existing files...")
         if os.path.exists(path) and os.path.isfile(path):
             os.unlink(path)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
 
         debug("Adding include guards...")
         with open(path, "w") as f:
@@ -39,6 +61,8 @@ def generate_begin(path: str = OUT_PATH) -> bool:
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
 #include "tbi_types.h"
 #include "tbi.h"\n\n""")
             f.write(f"#define MSGSPEC_VERSION {VERSION}\n\n")
@@ -58,6 +82,7 @@ def generate_enum(spec: dict, path: str = OUT_PATH) -> bool:
             f.write("/** @brief Message name enumeration, values are IDs */\n")
             f.write("typedef enum {\n")
             bundles: list = []
+            ids: set = set()
             k: str
             v: dict
             for k, v in spec.items():
@@ -68,6 +93,10 @@ def generate_enum(spec: dict, path: str = OUT_PATH) -> bool:
                 elif id_num > MAX_ID_NUM:
                     print(f"Error: ID value for {k} too large! Max: {MAX_ID_NUM}")
                     return False
+                elif id_num in ids:
+                    print(f"Error: ID value {id_num} of {k} already in use")
+                    return False
+                ids.add(id_num)
                 f.write(f"  {k.upper()} = {id_num},\n")
                 if v.get("bundle", False):
                     bundles.append(k.upper())
@@ -119,7 +148,7 @@ def generate_functions(spec: dict, path: str = OUT_PATH) -> bool:
                 f.write(" *  @param[in] tbi     Initialized TBI context\n")
                 f.write(" *  @param[in] value   Pointer to new telemetry message. Copied to internal buffer\n")
                 f.write(" *\n")
-                f.write(" *  @return 0 on success, or negative error code\n")
+                f.write(" *  @return 0 on success, 1 if dropped because the message buffer is full, or negative error code\n")
                 f.write("*/\n")
                 f.write(f"int tbi_send_{k}(tbi_ctx_t* tbi, const msgspec_{k}_t *value)\n")
                 f.write("{\n")
@@ -131,6 +160,91 @@ def generate_functions(spec: dict, path: str = OUT_PATH) -> bool:
         return False
     return True
 
+def generate_codecs(spec: dict, path: str = OUT_PATH) -> bool:
+    """
+        Generate straight-line RTM serializers and deserializers for each 
+        message type, with fixed sizes and offsets
+    """
+    debug("Generating message type serializers...")
+    try:
+        with open(path, "a") as f:
+            k: str
+            v: dict
+            for k, v in spec.items():
+                fields = list(v.get("data_types", {}).items())
+                for _, datatype in fields:
+                    if datatype not in WIRE_TYPES:
+                        print(f"Error in serializer generation for {k}: unknown type {datatype}")
+                        return False
+                wire_len = 1 + sum(WIRE_TYPES[datatype][0] for _, datatype in fields)
+                sizes = set(WIRE_TYPES[datatype][0] for _, datatype in fields)
+
+                f.write(f"\n/** @brief Serialize {k} into an RTM frame, see @ref tbi_serialize_rtm_into() */\n")
+                f.write(f"static int msgspec_encode_{k}(const void *msg, uint8_t *out, int out_size)\n")
+                f.write("{\n")
+                f.write(f"\tconst msgspec_{k}_t *m = (const msgspec_{k}_t*)msg;\n")
+                if 4 in sizes:
+                    f.write("\tuint32_t v32;\n")
+                if 2 in sizes:
+                    f.write("\tuint16_t v16;\n")
+                f.write("\n")
+                f.write(f"\tif(out_size < {wire_len})\n")
+                f.write("\t\treturn -1;\n")
+                f.write(f"\tout[0] = {k.upper()};\n")
+                off = 1
+                for name, datatype in fields:
+                    size, ctype = WIRE_TYPES[datatype]
+                    if size == 1:
+                        f.write(f"\tout[{off}] = (uint8_t)m->{name};\n")
+                    elif size == 2:
+                        f.write(f"\tv16 = htons((uint16_t)m->{name});\n")
+                        f.write(f"\tmemcpy(out + {off}, &v16, 2);\n")
+                    elif ctype is None:
+                        f.write(f"\tmemcpy(&v32, &m->{name}, 4);\n")
+                        f.write("\tv32 = htonl(v32);\n")
+                        f.write(f"\tmemcpy(out + {off}, &v32, 4);\n")
+                    else:
+                        f.write(f"\tv32 = htonl((uint32_t)m->{name});\n")
+                        f.write(f"\tmemcpy(out + {off}, &v32, 4);\n")
+                    off += size
+                f.write(f"\treturn {wire_len};\n")
+                f.write("}\n")
+
+                f.write(f"\n/** @brief Deserialize {k} from an RTM frame, see @ref tbi_deserialize_rtm_into() */\n")
+                f.write(f"static int msgspec_decode_{k}(const uint8_t *in, int in_len, void *msg)\n")
+                f.write("{\n")
+                f.write(f"\tmsgspec_{k}_t *m = (msgspec_{k}_t*)msg;\n")
+                if 4 in sizes:
+                    f.write("\tuint32_t v32;\n")
+                if 2 in sizes:
+                    f.write("\tuint16_t v16;\n")
+                f.write("\n")
+                f.write(f"\tif(in_len != {wire_len})\n")
+                f.write("\t\treturn -1;\n")
+                off = 1
+                for name, datatype in fields:
+                    size, ctype = WIRE_TYPES[datatype]
+                    if size == 1:
+                        f.write(f"\tm->{name} = ({ctype})in[{off}];\n")
+                    elif size == 2:
+                        f.write(f"\tmemcpy(&v16, in + {off}, 2);\n")
+                        f.write(f"\tm->{name} = ({ctype})ntohs(v16);\n")
+                    elif ctype is None:
+                        f.write(f"\tmemcpy(&v32, in + {off}, 4);\n")
+                        f.write("\tv32 = ntohl(v32);\n")
+                        f.write(f"\tmemcpy(&m->{name}, &v32, 4);\n")
+                    else:
+                        f.write(f"\tmemcpy(&v32, in + {off}, 4);\n")
+                        f.write(f"\tm->{name} = ({ctype})ntohl(v32);\n")
+                    off += size
+                f.write(f"\treturn {wire_len};\n")
+                f.write("}\n")
+
+    except Exception as e:
+        print(f"Error in generate_codecs: {repr(e)}")
+        return False
+    return True
+
 def generate_machine_format_arrays(spec: dict, path: str = OUT_PATH) -> bool:
     """
         Generate machine readable format arrays
@@ -173,8 +287,31 @@ def generate_message_type_contexts(spec: dict, path: str = OUT_PATH) -> bool:
                 f.write(f"\t\t.raw_size     = sizeof(msgspec_{k}_t),\n")
                 f.write(f"\t\t.format_len   = sizeof(msgspec_binary_{k}) / sizeof(uint8_t),\n")
                 f.write(f"\t\t.format       = &msgspec_binary_{k}[0],\n")
-                f.write(f"\t\t.buflen       = 0,\n")
-                f.write(f"\t\t.head         = NULL,\n")
+                f.write(f"\t\t.encode       = msgspec_encode_{k},\n")
+                f.write(f"\t\t.decode       = msgspec_decode_{k},\n")
+                overflow = v.get("overflow", "drop_newest")
+                if overflow not in OVERFLOW_POLICIES:
+                    print(f"Error in context generation for {k}: unknown overflow policy {overflow}")
+                    return False
+                decimate = int(v.get("decimate", 2 if overflow == "decimate" else 0))
+                if overflow == "decimate" and decimate < 2:
+                    print(f"Error in context generation for {k}: decimate must be at least 2")
+                    return False
+                send_interval = int(v.get("send_interval", 0))
+                max_bundle = int(v.get("max_bundle", 0))
+                if (send_interval or max_bundle) and not v.get("bundle", False):
+                    print(f"Error in context generation for {k}: send_interval and max_bundle require bundle")
+                    return False
+                if send_interval < 0 or max_bundle < 0:
+                    print(f"Error in context generation for {k}: send_interval and max_bundle must not be negative")
+                    return False
+                f.write(f"\t\t.capacity     = {int(v.get('capacity', 0))},\n")
+                f.write(f"\t\t.quota_bytes  = {int(v.get('quota_bytes', 0))},\n")
+                f.write(f"\t\t.overflow     = {OVERFLOW_POLICIES[overflow]},\n")
+                f.write(f"\t\t.decimate     = {decimate},\n")
+                f.write(f"\t\t.send_interval = {send_interval},\n")
+                f.write(f"\t\t.max_bundle   = {max_bundle},\n")
+                f.write(f"\t\t.ring         = NULL,\n")
                 f.write(f"\t\t.cb           = NULL,\n")
                 f.write(f"\t\t.cb_userdata  = NULL,\n")
                 f.write("\t},\n")
@@ -182,6 +319,13 @@ def generate_message_type_contexts(spec: dict, path: str = OUT_PATH) -> bool:
             f.write("};\n")
             f.write(f"const int msgspec_ctxs_len = {len(spec.keys())};\n")
 
+            # Position of each message type in msgspec_ctxs, for O(1) lookup by msgtype
+            index = [-1] * (MAX_ID_NUM + 1)
+            for i, v in enumerate(spec.values()):
+                index[v["id"]] = i
+            f.write("\n/** @brief Index of each message type in msgspec_ctxs, -1 for unused types */\n")
+            f.write(f"const int8_t msgspec_index[TBI_MAX_MSG_TYPES] = {{ {', '.join(str(i) for i in index)} }};\n")
+
     except Exception as e:
         print(f"Error in generate_message_type_contexts: {repr(e)}")
         return False
@@ -201,6 +345,7 @@ def generate_register_msgspec_fn(spec: dict, path: str = OUT_PATH) -> bool:
             f.write("\ttbi->msgspec_version = MSGSPEC_VERSION;\n")
             f.write("\ttbi->msg_ctxs = &msgspec_ctxs[0];\n")
             f.write("\ttbi->msg_ctxs_len = msgspec_ctxs_len;\n")
+            f.write("\ttbi->msg_index = &msgspec_index[0];\n")
             f.write("\treturn 0;\n")
             f.write("}\n")
 
@@ -209,6 +354,30 @@ def generate_register_msgspec_fn(spec: dict, path: str = OUT_PATH) -> bool:
         return False
     return True
 
+def generate_descriptor(spec: dict, path: str = DESC_PATH) -> bool:
+    """
+        Generate binary descriptor of the message spec, for servers to load at runtime
+    """
+    debug("Generating binary descriptor...")
+    try:
+        desc = bytearray(DESC_MAGIC)
+        desc += bytes([DESC_VERSION, VERSION, len(spec)])
+        k: str
+        v: dict
+        for k, v in spec.items():
+            datatypes = list(v.get("data_types", {}).values())
+            if len(datatypes) > 255:
+                print(f"Error in descriptor generation for {k}: too many members")
+                return False
+            flags = DESC_FLAG_DCB if bool(v.get("bundle", False)) else 0
+            desc += bytes([v["id"], flags, len(datatypes)] + datatypes)
+        with open(path, "wb") as f:
+            f.write(desc)
+    except Exception as e:
+        print(f"Error in generate_descriptor: {repr(e)}")
+        return False
+    return True
+
 def generate_finalize(path: str = OUT_PATH) -> bool:
     try:
         debug("Closing include guards...")
@@ -253,6 +422,10 @@ def compose(path: str) -> bool:
         debug("Message type send function generation failed")
         return False
 
+    if not generate_codecs(contents_json):
+        debug("Message type serializer generation failed")
+        return False
+
     if not generate_machine_format_arrays(contents_json):
         debug("Machine readable format spec generation failed")
         return False
@@ -269,6 +442,10 @@ def compose(path: str) -> bool:
         debug("File wrap-up failed")
         return False
 
+    if not generate_descriptor(contents_json):
+        debug("Binary descriptor generation failed")
+        return False
+
     return True
 
 